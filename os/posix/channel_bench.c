@@ -0,0 +1,277 @@
+// Benchmark the channel database with a regional repeater directory: the time
+// to load it, and the time of frequency-range, name-prefix, and tag queries.
+// Then build a repeater index of it, and time nearest-repeater queries, checking
+// their results against a search of every entry.
+//
+//   make -f platform/Makefile.native channel_bench
+//
+// Set GM_PROFILE to a file to profile it, as gm_profile.h says.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "channel_db.h"
+#include "gm_profile.h"
+#include "maidenhead.h"
+#include "repeater_index.h"
+
+#define NUMBER_OF_ENTRIES	5000
+#define NUMBER_OF_QUERIES	1000
+#define UPDATES			2000
+#define NEAREST			5
+
+static double
+now(void)
+{
+  struct timespec t;
+
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + (t.tv_nsec / 1e9);
+}
+
+static bool
+count(const channel_db_entry * entry, void * context)
+{
+  (*(size_t *)context)++;
+  return true;
+}
+
+typedef struct brute_force {
+  float		latitude;
+  float		longitude;
+  float		distance;
+  uint32_t	id;
+} brute_force;
+
+static bool
+nearest(const channel_db_entry * entry, void * context)
+{
+  brute_force * const b = context;
+  const float d = maidenhead_distance(b->latitude, b->longitude, entry->latitude, entry->longitude);
+
+  if ( d < b->distance ) {
+    b->distance = d;
+    b->id = entry->id;
+  }
+  return true;
+}
+
+static void
+report(const char * name, double seconds, size_t operations, size_t results)
+{
+  printf(
+   "%-28s %10.2f us/op %10zu results\n",
+   name,
+   (seconds * 1e6) / operations,
+   results);
+}
+
+int
+main(void)
+{
+  const char * const	path = "/tmp/channel_bench.db";
+  channel_db_entry	e;
+  channel_db_stats	s;
+  size_t		results = 0;
+  double		start;
+
+  gm_profile_from_environment();
+  unlink(path);
+  srand(1);
+
+  channel_db * db = channel_db_open(path);
+  if ( db == NULL ) {
+    perror(path);
+    return 1;
+  }
+
+  const int repeater = channel_db_tag(db, "repeater");
+  const int dstar = channel_db_tag(db, "dstar");
+
+  start = now();
+  for ( int i = 0; i < NUMBER_OF_ENTRIES; i++ ) {
+    memset(&e, 0, sizeof(e));
+    // Two-meter and 70-centimeter repeaters, with the usual offsets.
+    if ( i % 2 ) {
+      e.channel.receive_frequency = 144.0f + (rand() % 800) * 0.005f;
+      e.channel.transmit_frequency = e.channel.receive_frequency - 0.6f;
+    }
+    else {
+      e.channel.receive_frequency = 420.0f + (rand() % 6000) * 0.005f;
+      e.channel.transmit_frequency = e.channel.receive_frequency + 5.0f;
+    }
+    e.channel.bandwidth = 12.5f;
+    e.channel.transmit_subaudible_tone = 100.0f;
+    snprintf(
+     e.name,
+     sizeof(e.name),
+     "%c%d%c%c%c",
+     "KNW"[rand() % 3],
+     rand() % 10,
+     'A' + rand() % 26,
+     'A' + rand() % 26,
+     'A' + rand() % 26);
+    e.tags = (1UL << repeater) | ((i % 10) < 2 ? (1UL << dstar) : 0);
+    e.latitude = 32.0f + (rand() % 1000) / 100.0f;
+    e.longitude = -124.0f + (rand() % 1000) / 100.0f;
+    if ( !channel_db_put(db, &e) ) {
+      fprintf(stderr, "put: %s\n", channel_db_error(db));
+      return 1;
+    }
+  }
+  report("put", now() - start, NUMBER_OF_ENTRIES, 0);
+
+  // Rewrite some entries, so that the file has dead records to compact.
+  start = now();
+  for ( int i = 0; i < UPDATES; i++ ) {
+    e = *channel_db_get(db, 1 + (rand() % NUMBER_OF_ENTRIES));
+    e.channel.squelch_level = 0.5f;
+    channel_db_put(db, &e);
+  }
+  report("update", now() - start, UPDATES, 0);
+  channel_db_close(db);
+
+  start = now();
+  db = channel_db_open(path);
+  report("open and load", now() - start, 1, 0);
+  channel_db_stats_get(db, &s);
+  printf(
+   "entries %zu, dead records %zu, file size %ld, compactions %u\n",
+   s.entries,
+   s.dead_records,
+   s.file_size,
+   s.compactions);
+
+  // The first query builds the indexes.
+  start = now();
+  results = 0;
+  channel_db_frequency_range(db, 144.0f, 148.0f, 0, count, &results);
+  report("build indexes and query", now() - start, 1, results);
+
+  start = now();
+  results = 0;
+  for ( int i = 0; i < NUMBER_OF_QUERIES; i++ ) {
+    const float low = 144.0f + (rand() % 300) * 0.01f;
+    channel_db_frequency_range(db, low, low + 1.0f, 0, count, &results);
+  }
+  report("frequency range, 1 MHz", now() - start, NUMBER_OF_QUERIES, results / NUMBER_OF_QUERIES);
+
+  start = now();
+  results = 0;
+  for ( int i = 0; i < NUMBER_OF_QUERIES; i++ )
+    channel_db_frequency_range(db, 144.0f, 148.0f, 1UL << dstar, count, &results);
+  report("144-148 MHz, tagged dstar", now() - start, NUMBER_OF_QUERIES, results / NUMBER_OF_QUERIES);
+
+  start = now();
+  results = 0;
+  for ( int i = 0; i < NUMBER_OF_QUERIES; i++ ) {
+    char prefix[3] = { "KNW"[rand() % 3], '0' + rand() % 10, '\0' };
+    channel_db_name_prefix(db, prefix, count, &results);
+  }
+  report("name prefix, 2 characters", now() - start, NUMBER_OF_QUERIES, results / NUMBER_OF_QUERIES);
+
+  start = now();
+  results = 0;
+  for ( int i = 0; i < NUMBER_OF_QUERIES; i++ )
+    channel_db_tagged(db, dstar, count, &results);
+  report("tag", now() - start, NUMBER_OF_QUERIES, results / NUMBER_OF_QUERIES);
+
+  start = now();
+  for ( int i = 0; i < NUMBER_OF_QUERIES; i++ )
+    results += channel_db_get(db, 1 + (rand() % NUMBER_OF_ENTRIES)) != NULL;
+  report("get by identifier", now() - start, NUMBER_OF_QUERIES, 1);
+
+  const char * const	index_path = "/tmp/channel_bench.idx";
+  repeater_result	r[64];
+  repeater_query	q = {};
+  char			locator[7];
+
+  start = now();
+  if ( !repeater_index_build(db, index_path, 1UL << repeater) ) {
+    perror(index_path);
+    return 1;
+  }
+  report("build repeater index", now() - start, 1, 0);
+
+  start = now();
+  repeater_index * const index = repeater_index_open(index_path);
+  if ( index == NULL ) {
+    perror(index_path);
+    return 1;
+  }
+  report("open repeater index", now() - start, 1, 0);
+  if ( !repeater_index_current(index, db, 1UL << repeater) ) {
+    fprintf(stderr, "The index should be current.\n");
+    return 1;
+  }
+
+  start = now();
+  for ( int i = 0; i < NUMBER_OF_QUERIES; i++ ) {
+    q.latitude = 32.0f + (rand() % 1000) / 100.0f;
+    q.longitude = -124.0f + (rand() % 1000) / 100.0f;
+    maidenhead_from_location(q.latitude, q.longitude, locator, 6);
+    maidenhead_to_location(locator, &q.latitude, &q.longitude);
+  }
+  const double locator_time = now() - start;
+  report("locator round trip", locator_time, NUMBER_OF_QUERIES, 1);
+
+  q.radius = 500.0f;
+  q.limit = NEAREST;
+  q.number_of_privileges = repeater_privileges("US", "technician", &q.privileges);
+  start = now();
+  results = 0;
+  for ( int i = 0; i < NUMBER_OF_QUERIES; i++ ) {
+    q.latitude = 32.0f + (rand() % 1000) / 100.0f;
+    q.longitude = -124.0f + (rand() % 1000) / 100.0f;
+    results += repeater_index_nearest(index, &q, r);
+  }
+  report("5 nearest, technician", now() - start, NUMBER_OF_QUERIES, results / NUMBER_OF_QUERIES);
+
+  // Novices can only use 222 MHz, which this directory doesn't have, so every
+  // query reads all of the squares within the radius.
+  q.radius = 100.0f;
+  q.number_of_privileges = repeater_privileges("US", "novice", &q.privileges);
+  start = now();
+  results = 0;
+  for ( int i = 0; i < NUMBER_OF_QUERIES; i++ ) {
+    q.latitude = 32.0f + (rand() % 1000) / 100.0f;
+    q.longitude = -124.0f + (rand() % 1000) / 100.0f;
+    results += repeater_index_nearest(index, &q, r);
+  }
+  report("5 nearest, 100 km, novice", now() - start, NUMBER_OF_QUERIES, results / NUMBER_OF_QUERIES);
+
+  q.radius = 25.0f;
+  q.limit = sizeof(r) / sizeof(*r);
+  q.privileges = NULL;
+  start = now();
+  results = 0;
+  for ( int i = 0; i < NUMBER_OF_QUERIES; i++ ) {
+    q.latitude = 32.0f + (rand() % 1000) / 100.0f;
+    q.longitude = -124.0f + (rand() % 1000) / 100.0f;
+    results += repeater_index_nearest(index, &q, r);
+  }
+  report("within 25 km", now() - start, NUMBER_OF_QUERIES, results / NUMBER_OF_QUERIES);
+
+  // Check the nearest result against every entry.
+  q.radius = 20000.0f;
+  q.limit = 1;
+  for ( int i = 0; i < 100; i++ ) {
+    brute_force b = { .distance = 1e9f };
+
+    b.latitude = q.latitude = 30.0f + (rand() % 1400) / 100.0f;
+    b.longitude = q.longitude = -126.0f + (rand() % 1400) / 100.0f;
+    channel_db_frequency_range(db, 0.0f, 1e6f, 0, nearest, &b);
+    if ( repeater_index_nearest(index, &q, r) != 1 || r[0].distance != b.distance ) {
+      fprintf(stderr, "Nearest to %f, %f is %u, not %u.\n", q.latitude, q.longitude, b.id, r[0].id);
+      return 1;
+    }
+  }
+
+  repeater_index_close(index);
+  unlink(index_path);
+  channel_db_close(db);
+  unlink(path);
+  return 0;
+}
@@ -3,10 +3,13 @@
 #include <stddef.h>
 #include "radio_driver.h"
 #include "os_driver.h"
+#include "gm_profile.h"
 
 int
 main(int, char * *) /*@globals errno;@*/
 {
+  gm_profile_from_environment();
+
   platform_context /*@null@*/ /*@owned@*/ * platform = platform_init("/dev/tty");
 
   if ( platform == 0 )
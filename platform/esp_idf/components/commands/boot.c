@@ -0,0 +1,34 @@
+#include <stdio.h>
+#include <esp_console.h>
+#include <argtable3/argtable3.h>
+#include "generic_main.h"
+
+static struct {
+    struct arg_end * end;
+} args;
+
+static int run(int argc, char * * argv)
+{
+  int nerrors = arg_parse(argc, argv, (void **) &args);
+  if (nerrors) {
+    arg_print_errors(stderr, args.end, argv[0]);
+      return 1;
+  }
+
+  gm_boot_report();
+  return 0;
+}
+
+CONSTRUCTOR install(void)
+{
+  args.end = arg_end(10);
+  static const esp_console_cmd_t command = {
+    .command = "boot",
+    .help = "Display the timeline of initialization, and the time to the first HTTPS response.",
+    .hint = NULL,
+    .func = &run,
+    .argtable = &args
+  };
+
+  gm_command_register(&command);
+}
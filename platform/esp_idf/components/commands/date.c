@@ -20,18 +20,12 @@ static struct {
 // this has to be done every time.
 static void timezone_set(void)
 {
-  char buffer[128];
-  size_t buffer_size = sizeof(buffer);
-  esp_err_t err = nvs_get_str(GM.nvs, "timezone", buffer, &buffer_size);
+  const char * const tz = gm_nonvolatile_string("timezone");
 
-  if (err) {
+  if (tz)
+    setenv("TZ", tz, 1);
+  else
     unsetenv("TZ");
-    if (err != ESP_ERR_NVS_NOT_FOUND)
-      GM_FAIL("Error getting timezone: %s\n", esp_err_to_name(err));
-  }
-  else {
-    setenv("TZ", buffer, 1);
-  }
 
   tzset();
 }
@@ -0,0 +1,118 @@
+#include <stdio.h>
+#include <string.h>
+#include <esp_console.h>
+#include <esp_timer.h>
+#include <argtable3/argtable3.h>
+#include "generic_main.h"
+
+static struct {
+    struct arg_lit * mark;
+    struct arg_lit * since;
+    struct arg_end * end;
+} args;
+
+// For the allocation rate since the last report.
+static uint32_t	previous_allocations[GM_MEMORY_TAGS];
+static int64_t	previous_time = 0;
+static uint32_t	mark = 0;
+
+static void
+print_site(gm_memory_tag_t tag, const char * file, int line, uint32_t allocations, size_t bytes, void * context)
+{
+  const char * const slash = strrchr(file, '/');
+
+  gm_printf(
+   "  %-10s %s:%d, %lu allocations, %lu bytes\n",
+   gm_memory_tag_name(tag),
+   slash ? slash + 1 : file,
+   line,
+   (unsigned long)allocations,
+   (unsigned long)bytes);
+}
+
+static void
+report(void)
+{
+  const int64_t		now = esp_timer_get_time();
+  const double		seconds = (now - previous_time) / 1e6;
+  gm_memory_heap_t	heap;
+
+  gm_memory_heap(&heap);
+  gm_printf(
+   "Heap: %lu bytes free, %lu at the least, largest free block %lu, %.0f%% fragmented.\n",
+   (unsigned long)heap.free_bytes,
+   (unsigned long)heap.minimum_free_bytes,
+   (unsigned long)heap.largest_free_block,
+   heap.free_bytes ? 100.0 * (1.0 - (double)heap.largest_free_block / heap.free_bytes) : 0.0);
+  gm_printf(
+   "%-10s %8s %8s %6s %8s %8s %5s %10s\n",
+   "tag",
+   "live",
+   "peak",
+   "count",
+   "allocs",
+   "per s",
+   "fails",
+   "free@peak");
+
+  for ( int tag = 0; tag < GM_MEMORY_TAGS; tag++ ) {
+    gm_memory_stats_t s;
+
+    gm_memory_stats(tag, &s);
+    if ( s.allocations > 0 || s.failures > 0 ) {
+      gm_printf(
+       "%-10s %8lu %8lu %6lu %8lu %8.1f %5lu %10lu\n",
+       gm_memory_tag_name(tag),
+       (unsigned long)s.live_bytes,
+       (unsigned long)s.peak_bytes,
+       (unsigned long)s.live_allocations,
+       (unsigned long)s.allocations,
+       seconds > 0 ? (s.allocations - previous_allocations[tag]) / seconds : 0.0,
+       (unsigned long)s.failures,
+       (unsigned long)s.largest_free_at_peak);
+    }
+    previous_allocations[tag] = s.allocations;
+  }
+  previous_time = now;
+}
+
+static int run(int argc, char * * argv)
+{
+  int nerrors = arg_parse(argc, argv, (void **) &args);
+  if (nerrors) {
+    arg_print_errors(stderr, args.end, argv[0]);
+      return 1;
+  }
+
+  if ( args.mark->count > 0 ) {
+    mark = gm_memory_mark();
+    gm_printf("Marked. \"mem -s\" lists what is allocated after this and still live.\n");
+  }
+  else if ( args.since->count > 0 ) {
+    if ( mark == 0 ) {
+      gm_printf("Mark first, with \"mem -m\".\n");
+      return 1;
+    }
+    gm_printf("Live allocations made since the mark:\n");
+    gm_memory_since(mark, print_site, NULL);
+  }
+  else
+    report();
+  return 0;
+}
+
+CONSTRUCTOR install(void)
+{
+  args.mark = arg_lit0("m", "mark", "Mark this point, to list the allocations made after it.");
+  args.since = arg_lit0("s", "since", "List the live allocations made since the mark, by where they were made.");
+  args.end = arg_end(10);
+  static const esp_console_cmd_t command = {
+    .command = "mem",
+    .help = "Report heap use by subsystem, and find leaks.",
+    .hint = NULL,
+    .func = &run,
+    .argtable = &args
+  };
+
+  gm_command_register(&command);
+}
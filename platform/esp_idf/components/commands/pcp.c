@@ -4,10 +4,15 @@
 #include <cJSON.h>
 #include <esp_console.h>
 #include <argtable3/argtable3.h>
+#include <arpa/inet.h>
 #include "generic_main.h"
 
 static struct {
     struct arg_lit * ipv6;
+    struct arg_lit * udp;
+    struct arg_lit * release;
+    struct arg_int * port;
+    struct arg_int * external;
     struct arg_end * end;
 } args;
 
@@ -19,10 +24,29 @@ static int run(int argc, char * * argv)
       return 1;
   }
   printf("\n"); 
-  if ( args.ipv6->count > 0 )
-    gm_pcp_request_mapping_ipv6(&GM.net_interfaces[GM_STA]);
+
+  const bool			ipv6 = args.ipv6->count > 0;
+  const gm_pcp_protocol_t	protocol = args.udp->count > 0 ? GM_PCP_UDP : GM_PCP_TCP;
+  const uint16_t		port = args.port->count > 0 ? args.port->ival[0] : 443;
+  const uint16_t		external = args.external->count > 0 ? args.external->ival[0] : port;
+  struct sockaddr_storage	address;
+  char				buffer[INET6_ADDRSTRLEN + 1];
+
+  if ( args.release->count > 0 ) {
+    gm_pcp_release_mapping(ipv6, protocol, port);
+    return 0;
+  }
+
+  if ( gm_pcp_external_address(ipv6, protocol, port, &address) ) {
+    gm_ntop(&address, buffer, sizeof(buffer));
+    gm_printf("Port %d is mapped to %s port %d.\n", port, buffer, ntohs(((struct sockaddr_in *)&address)->sin_port));
+    return 0;
+  }
+
+  if ( ipv6 )
+    gm_pcp_request_mapping_ipv6(&GM.net_interfaces[GM_STA], protocol, port, external);
   else
-    gm_pcp_request_mapping_ipv4(&GM.net_interfaces[GM_STA]);
+    gm_pcp_request_mapping_ipv4(&GM.net_interfaces[GM_STA], protocol, port, external);
 
   return 0;
 }
@@ -30,10 +54,14 @@ static int run(int argc, char * * argv)
 CONSTRUCTOR install(void)
 {
   args.ipv6 =  arg_lit0("6", NULL, "Use IPv6 (default IPv4)");
+  args.udp = arg_lit0("u", "udp", "Map a UDP port (default TCP)");
+  args.release = arg_lit0("r", "release", "Delete the mapping");
+  args.port = arg_int0("p", "port", "port", "The port on this device (default 443)");
+  args.external = arg_int0("e", "external", "port", "The external port to ask for (default the same)");
   args.end = arg_end(10);
   static const esp_console_cmd_t command = {
     .command = "pcp",
-    .help = "Run the port control protocol to get a firewall pinhole.",
+    .help = "Run the port control protocol to get a firewall pinhole, or show the one there is.",
     .hint = NULL,
     .func = &run,
     .argtable = &args
@@ -0,0 +1,67 @@
+#include <stdio.h>
+#include <esp_console.h>
+#include <argtable3/argtable3.h>
+#include "generic_main.h"
+#include "gm_profile.h"
+
+static struct {
+    struct arg_lit * start;
+    struct arg_lit * stop;
+    struct arg_lit * clear;
+    struct arg_int * rate;
+    struct arg_end * end;
+} args;
+
+// The dump goes to the log sinks, so it can be captured from the telnet log
+// server as well as the console.
+static void
+writer(const char * text, size_t size, void * context)
+{
+  gm_log_text(text, size);
+}
+
+static int run(int argc, char * * argv)
+{
+  int nerrors = arg_parse(argc, argv, (void **) &args);
+  if (nerrors) {
+    arg_print_errors(stderr, args.end, argv[0]);
+      return 1;
+  }
+
+  if ( args.clear->count > 0 )
+    gm_profile_clear();
+
+  if ( args.stop->count > 0 )
+    gm_profile_stop();
+  else if ( args.start->count > 0 ) {
+    const unsigned int rate = args.rate->count > 0 ? args.rate->ival[0] : GM_PROFILE_DEFAULT_RATE;
+    const char * const error = gm_profile_start(rate);
+
+    if ( error ) {
+      gm_printf("%s\n", error);
+      return 1;
+    }
+    gm_printf("Profiling at %u samples per second on each core.\n", rate);
+  }
+  else if ( args.clear->count == 0 )
+    gm_profile_dump(writer, NULL);
+  return 0;
+}
+
+CONSTRUCTOR install(void)
+{
+  args.start = arg_lit0("s", "start", "Start sampling.");
+  args.stop = arg_lit0(NULL, "stop", "Stop sampling, keeping the samples.");
+  args.clear = arg_lit0("c", "clear", "Discard the samples so far.");
+  args.rate = arg_int0("r", "rate", "<hz>", "Samples per second on each core, with --start.");
+  args.end = arg_end(10);
+  static const esp_console_cmd_t command = {
+    .command = "profile",
+    .help = "Sample where the CPU is, and dump the samples for profile_fold.",
+    .hint = NULL,
+    .func = &run,
+    .argtable = &args
+  };
+
+  gm_command_register(&command);
+}
@@ -0,0 +1,60 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <esp_console.h>
+#include <esp_system.h>
+#include <argtable3/argtable3.h>
+#include "generic_main.h"
+
+static struct {
+    struct arg_lit * clear;
+    struct arg_end * end;
+} args;
+
+static int run(int argc, char * * argv)
+{
+  gm_session_cache_stats_t s;
+
+  int nerrors = arg_parse(argc, argv, (void **) &args);
+  if (nerrors) {
+    arg_print_errors(stderr, args.end, argv[0]);
+      return 1;
+  }
+
+  if ( args.clear->count > 0 ) {
+    gm_session_cache_invalidate(NULL);
+    return 0;
+  }
+
+  gm_session_cache_stats(&s);
+
+  const uint32_t lookups = s.hits + s.misses;
+
+  gm_printf("Session cache: %" PRIu32 " of %" PRIu32 " entries used.\n", s.entries, s.size);
+  gm_printf("Hits: %" PRIu32 ", misses: %" PRIu32 ", hit rate: %" PRIu32 "%%.\n",
+   s.hits,
+   s.misses,
+   lookups ? (uint32_t)((s.hits * 100ULL) / lookups) : 0);
+  gm_printf("Expired: %" PRIu32 ", evicted: %" PRIu32 ", invalidated: %" PRIu32 ".\n",
+   s.expirations,
+   s.evictions,
+   s.invalidations);
+
+  return 0;
+}
+
+CONSTRUCTOR install(void)
+{
+  args.clear = arg_lit0("c", "clear", "Drop all cached sessions.");
+  args.end = arg_end(10);
+  static const esp_console_cmd_t command = {
+    .command = "sessions",
+    .help = "Display the statistics of the decoded-session cache.",
+    .hint = NULL,
+    .func = &run,
+    .argtable = &args
+  };
+
+  gm_command_register(&command);
+}
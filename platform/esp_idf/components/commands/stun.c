@@ -13,7 +13,19 @@ static struct {
     struct arg_end * end;
 } args;
 
-static struct sockaddr_storage sock;
+// Called in the select task when the race is over.
+static void
+after(bool success, bool ipv6, struct sockaddr * address)
+{
+  char buffer[INET6_ADDRSTRLEN + 1];
+
+  if ( !success ) {
+    gm_printf("No STUN server answered for %s.\n", ipv6 ? "IPv6" : "IPv4");
+    return;
+  }
+  gm_ntop((struct sockaddr_storage *)address, buffer, sizeof(buffer));
+  gm_printf("Public %s address %s\n", ipv6 ? "IPv6" : "IPv4", buffer);
+}
 
 static int run(int argc, char * * argv)
 {
@@ -26,7 +38,7 @@ static int run(int argc, char * * argv)
       return 1;
   }
 
-  result = gm_stun(args.ipv6->count > 0, (struct sockaddr *)&sock, 0);
+  result = gm_stun(args.ipv6->count > 0, after);
   if ( result != 0 )
     return 1;
 
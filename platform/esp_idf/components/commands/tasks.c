@@ -4,16 +4,80 @@
 #include <freertos/task.h>
 #include <esp_console.h>
 #include <esp_system.h>
+#include <esp_timer.h>
 #include <argtable3/argtable3.h>
 #include "generic_main.h"
 
-extern esp_err_t print_real_time_stats(TickType_t xTicksToWait);
-
 static struct {
     struct arg_lit * cpu;
+    struct arg_int * history;
     struct arg_end * end;
 } tasks_args;
 
+static void
+keep_last(const gm_cpu_sample_t * sample, void * context)
+{
+  *(gm_cpu_sample_t *)context = *sample;
+}
+
+static void
+print_cores(const gm_cpu_sample_t * s)
+{
+  for ( int core = 0; core < portNUM_PROCESSORS; core++ )
+    gm_printf(" %5.1f", s->busy[core] / 10.0);
+}
+
+static void
+print_sample(const gm_cpu_sample_t * s, void * context)
+{
+  gm_printf("%9.1f", s->time_ms / 1000.0);
+  print_cores(s);
+  for ( int i = 0; i < GM_CPU_TOP && s->top[i].task != GM_CPU_NO_TASK; i++ )
+    gm_printf("  %s %.1f", gm_cpu_task_name(s->top[i].task), s->top[i].share / 10.0);
+  gm_printf("\n");
+}
+
+// Like top: the busy share of each core in the last second, and of the tasks
+// in the last second and on average, from the CPU sampler.
+static void
+print_cpu(void)
+{
+  gm_cpu_task_t * const	tasks = gm_malloc(GM_MEMORY_COMMANDS, GM_CPU_MAXIMUM_TASKS * sizeof(*tasks));
+  gm_cpu_sample_t	last = { .time_ms = 0 };
+  size_t		n;
+
+  if ( tasks == NULL ) {
+    gm_printf("Out of memory.\n");
+    return;
+  }
+  gm_cpu_history(esp_timer_get_time() / 1000 - 5000, keep_last, &last);
+  if ( last.time_ms == 0 ) {
+    gm_printf("The CPU sampler has no samples yet.\n");
+    gm_free(tasks);
+    return;
+  }
+  gm_printf("Busy %%, by core:");
+  print_cores(&last);
+  gm_printf("\n\n%-16s %4s %6s %6s %6s %10s\n", "Task", "Core", "Now %", "Avg %", "Peak %", "Total s");
+
+  n = gm_cpu_tasks(tasks, GM_CPU_MAXIMUM_TASKS);
+  for ( size_t i = 0; i < n; i++ ) {
+    const gm_cpu_task_t * const t = &tasks[i];
+
+    if ( !t->live )
+      continue;
+    gm_printf(
+     "%-16s %4s %6.1f %6.1f %6.1f %10.1f\n",
+     t->name,
+     t->core < 0 ? "any" : t->core == 0 ? "0" : "1",
+     t->share / 10.0,
+     t->average / 10.0,
+     t->peak / 10.0,
+     t->run_time_us / 1e6);
+  }
+  gm_free(tasks);
+}
+
 static int tasks(int argc, char * * argv)
 {
   char stats_buffer[1024];
@@ -24,12 +88,14 @@ static int tasks(int argc, char * * argv)
       return 1;
   }
 
-  if (tasks_args.cpu->count > 0) {
-    // The task statistics functions block interrupts while they are running,
-    // and that does something odd to command-line processing, so that the
-    // carriage return isn't printed. So, add one here.
-    gm_printf("\n");
-    print_real_time_stats(100);
+  if (tasks_args.cpu->count > 0)
+    print_cpu();
+  else if (tasks_args.history->count > 0) {
+    gm_printf("%9s %5s %5s  %s\n", "seconds", "core0", "core1", "busiest tasks, %");
+    gm_cpu_history(
+     esp_timer_get_time() / 1000 - tasks_args.history->ival[0] * 1000LL,
+     print_sample,
+     NULL);
   }
   else {
     gm_printf("Task Name\tStatus\tPrio\tHWM\tTask\tAffinity\n");
@@ -42,7 +108,8 @@ static int tasks(int argc, char * * argv)
 
 CONSTRUCTOR install(void)
 {
-  tasks_args.cpu  = arg_lit0(NULL, "cpu", "Collect CPU time usage for one second, and display.");
+  tasks_args.cpu  = arg_lit0(NULL, "cpu", "Display the CPU use of each task, from the CPU sampler.");
+  tasks_args.history  = arg_int0(NULL, "history", "<seconds>", "Display the CPU use of each core, and the busiest tasks, for each second of the last <seconds>.");
   tasks_args.end = arg_end(10);
   static const esp_console_cmd_t command = {
     .command = "tasks",
@@ -0,0 +1,48 @@
+#include <stdio.h>
+#include <esp_console.h>
+#include <argtable3/argtable3.h>
+#include "generic_main.h"
+#include "gm_trace.h"
+
+static struct {
+    struct arg_lit * clear;
+    struct arg_end * end;
+} args;
+
+// The dump goes to the log sinks, so it can be captured from the telnet log
+// server as well as the console.
+static void
+writer(const char * text, size_t size, void * context)
+{
+  gm_log_text(text, size);
+}
+
+static int run(int argc, char * * argv)
+{
+  int nerrors = arg_parse(argc, argv, (void **) &args);
+  if (nerrors) {
+    arg_print_errors(stderr, args.end, argv[0]);
+      return 1;
+  }
+
+  if ( args.clear->count > 0 )
+    gm_trace_clear();
+  else
+    gm_trace_dump(writer, NULL);
+  return 0;
+}
+
+CONSTRUCTOR install(void)
+{
+  args.clear = arg_lit0("c", "clear", "Discard the events recorded so far.");
+  args.end = arg_end(10);
+  static const esp_console_cmd_t command = {
+    .command = "trace",
+    .help = "Dump the trace events, for conversion with trace_to_json.",
+    .hint = NULL,
+    .func = &run,
+    .argtable = &args
+  };
+
+  gm_command_register(&command);
+}
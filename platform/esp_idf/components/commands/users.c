@@ -0,0 +1,89 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <esp_console.h>
+#include <esp_system.h>
+#include <argtable3/argtable3.h>
+#include "generic_main.h"
+
+static struct {
+    struct arg_str * delete;
+    struct arg_lit * export;
+    struct arg_str * import;
+    struct arg_end * end;
+} args;
+
+static void
+print_user(const char * name, const gm_user_data_t * d, void * context)
+{
+  gm_printf(
+   "%-15s\t%-.*s\t%-.*s\t%-.*s\t%s%s%s\n",
+   name,
+   (int)sizeof(d->callsign), d->callsign,
+   (int)sizeof(d->country), d->country,
+   (int)sizeof(d->license_class), d->license_class,
+   d->admin ? "admin " : "",
+   d->transmit ? "transmit " : "",
+   d->banned ? "banned" : "");
+}
+
+static int run(int argc, char * * argv)
+{
+  int nerrors = arg_parse(argc, argv, (void **) &args);
+  if (nerrors) {
+    arg_print_errors(stderr, args.end, argv[0]);
+      return 1;
+  }
+
+  if ( args.delete->count > 0 ) {
+    if ( gm_delete_user(args.delete->sval[0]) != ESP_OK ) {
+      gm_printf("No such user: %s\n", args.delete->sval[0]);
+      return 1;
+    }
+    return 0;
+  }
+
+  if ( args.import->count > 0 ) {
+    cJSON * const json = cJSON_Parse(args.import->sval[0]);
+    const int count = gm_user_import(json);
+    cJSON_Delete(json);
+    if ( count < 0 ) {
+      gm_printf("Import requires a JSON array of users.\n");
+      return 1;
+    }
+    gm_printf("Imported %d users.\n", count);
+    return 0;
+  }
+
+  if ( args.export->count > 0 ) {
+    cJSON * const json = gm_user_export();
+    char * const s = cJSON_Print(json);
+    cJSON_Delete(json);
+    if ( s ) {
+      gm_printf("%s\n", s);
+      free(s);
+    }
+    return 0;
+  }
+
+  const size_t count = gm_user_list(print_user, NULL);
+  gm_printf("%d users.\n", (int)count);
+  return 0;
+}
+
+CONSTRUCTOR install(void)
+{
+  args.delete = arg_str0("d", "delete", "name", "Delete a user.");
+  args.export = arg_lit0("e", "export", "Print all users as JSON, without passwords.");
+  args.import = arg_str0("i", "import", "json", "Add or change users from a JSON array.");
+  args.end = arg_end(10);
+  static const esp_console_cmd_t command = {
+    .command = "users",
+    .help = "List, import, export, or delete users of the web interface.",
+    .hint = NULL,
+    .func = &run,
+    .argtable = &args
+  };
+
+  gm_command_register(&command);
+}
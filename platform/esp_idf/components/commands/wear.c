@@ -0,0 +1,85 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <esp_console.h>
+#include <esp_system.h>
+#include <esp_partition.h>
+#include <esp_timer.h>
+#include <argtable3/argtable3.h>
+#include "generic_main.h"
+
+static struct {
+    struct arg_end * end;
+} args;
+
+static void
+print_counter(const char * key, uint32_t writes, void * context)
+{
+  gm_printf("  %-15s %" PRIu32 "\n", key, writes);
+}
+
+static int run(int argc, char * * argv)
+{
+  gm_config_wear_t	w;
+  gm_config_life_t	life;
+  nvs_stats_t		stats = {};
+
+  int nerrors = arg_parse(argc, argv, (void **) &args);
+  if (nerrors) {
+    arg_print_errors(stderr, args.end, argv[0]);
+      return 1;
+  }
+
+  const esp_partition_t * const partition = esp_partition_find_first(
+   ESP_PARTITION_TYPE_DATA,
+   ESP_PARTITION_SUBTYPE_DATA_NVS,
+   NULL);
+
+  if ( partition == NULL ) {
+    gm_printf("No NVS partition.\n");
+    return 1;
+  }
+
+  gm_config_wear(&w);
+  gm_config_estimate_life(&w, partition->size, esp_timer_get_time() / 1e6, &life);
+  (void) nvs_get_stats(partition->label, &stats);
+
+  gm_printf("NVS partition \"%s\": %" PRIu32 " KB, %d of %d entries used.\n",
+   partition->label,
+   partition->size / 1024,
+   (int)stats.used_entries,
+   (int)stats.total_entries);
+  gm_printf("Commits: %" PRIu32 ", keys written: %" PRIu32 ", unchanged and skipped: %" PRIu32 ".\n",
+   w.commits,
+   w.writes,
+   w.skipped);
+  gm_printf("Entries written: about %llu, %llu since boot.\n",
+   (unsigned long long)w.entries,
+   (unsigned long long)w.entries_since_start);
+  gm_printf("Erase cycles per page: about %.1f, %.3f%% of rated life used.\n",
+   life.erase_cycles,
+   (1.0 - life.remaining_fraction) * 100.0);
+  if ( life.days_remaining >= 0 )
+    gm_printf("At the rate since boot, the partition will last about %.0f more days.\n", life.days_remaining);
+  else
+    gm_printf("Nothing written since boot, no rate to project life from.\n");
+
+  gm_printf("Writes per key:\n");
+  gm_config_counters(print_counter, NULL);
+  return 0;
+}
+
+CONSTRUCTOR install(void)
+{
+  args.end = arg_end(10);
+  static const esp_console_cmd_t command = {
+    .command = "wear",
+    .help = "Report writes to the non-volatile configuration and estimate FLASH life.",
+    .hint = NULL,
+    .func = &run,
+    .argtable = &args
+  };
+
+  gm_command_register(&command);
+}
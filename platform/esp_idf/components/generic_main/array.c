@@ -15,8 +15,8 @@ typedef struct _GM_Array GM_Array;
 GM_Array *
 gm_array_create()
 {
-  GM_Array * array = (GM_Array *)malloc(sizeof(GM_Array));
-  array->data = (const void * *)malloc(sizeof(*(array->data)) * increment_size);
+  GM_Array * array = (GM_Array *)gm_malloc(GM_MEMORY_COMMANDS, sizeof(GM_Array));
+  array->data = (const void * *)gm_malloc(GM_MEMORY_COMMANDS, sizeof(*(array->data)) * increment_size);
   array->size = increment_size;
   array->used = 0;
   return array;
@@ -25,8 +25,8 @@ gm_array_create()
 void
 gm_array_destroy(GM_Array * array)
 {
-  free(array->data);
-  free(array);
+  gm_free(array->data);
+  gm_free(array);
 }
 
 const void *
@@ -34,7 +34,7 @@ gm_array_add(GM_Array * array, const void * data)
 {
   if ( array->used == array->size ) {
     array->size += increment_size;
-    array->data = (const void * *)realloc(array->data, sizeof(*(array->data)) * array->size);
+    array->data = (const void * *)gm_realloc(GM_MEMORY_COMMANDS, array->data, sizeof(*(array->data)) * array->size);
   }
   array->data[array->used++] = data;
   return data;
@@ -0,0 +1,361 @@
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <esp_partition.h>
+#include <esp_http_server.h>
+#include <miniz.h>
+#include "generic_main.h"
+#include "compressed_fs.h"
+
+// Web assets in a compressed_fs image in the "assets" FLASH partition. Unlike
+// frogfs, which is linked into the firmware, this can be updated in the field
+// without changing the firmware, with parttool.py, or by uploading the image
+// to POST /assets, which writes it with gm_assets_write().
+//
+// The partition is memory-mapped, so file data is sent to the network straight
+// from FLASH. Compressed files are sent as they are to clients that accept
+// "deflate", and decompressed in pieces for those that don't, using the ROM
+// copy of the miniz decompressor.
+
+#define ASSETS_PARTITION	"assets"
+#define CHUNK_SIZE		1024
+
+struct compressed_fs_reader {
+  tinfl_decompressor	inflator;
+  const uint8_t *	in;
+  size_t		in_remaining;
+  uint32_t		method;
+  bool			done;
+  // Decompressed data not yet returned to the caller.
+  size_t		pending_start;
+  size_t		pending_size;
+  size_t		window_position;
+  // The decompressor uses this as a circular buffer holding the last window of
+  // output, which is all that later data can refer to.
+  uint8_t		window[COMPRESSED_FS_WINDOW_SIZE];
+};
+
+static const struct {
+  const char *	extension;
+  const char *	type;
+} content_types[] = {
+  { ".html", "text/html" },
+  { ".css", "text/css" },
+  { ".js", "text/javascript" },
+  { ".mjs", "text/javascript" },
+  { ".json", "application/json" },
+  { ".svg", "image/svg+xml" },
+  { ".png", "image/png" },
+  { ".jpg", "image/jpeg" },
+  { ".ico", "image/x-icon" },
+  { ".txt", "text/plain" },
+  { }
+};
+
+// An image being written. Its first sector, with the header, is kept here
+// and written last, so that an upload that is cut off never leaves a valid
+// header in front of incomplete data.
+struct _gm_assets_writer {
+  size_t	offset;		// Of the next byte.
+  esp_err_t	err;
+  uint8_t	first[];	// The partition's erase size.
+};
+
+static pthread_mutex_t		lock = PTHREAD_MUTEX_INITIALIZER;
+static compressed_fs_t		assets;
+static const esp_partition_t *	partition = NULL;
+static const void *		image = NULL;
+static bool			assets_tried = false;
+static bool			assets_valid = false;
+static bool			writing = false;
+
+// Call with the lock held. The partition stays mapped, whether or not it holds
+// an image, so that one can be written and used without mapping it again.
+static bool
+map_partition(void)
+{
+  esp_partition_mmap_handle_t	handle;
+
+  if ( !assets_tried ) {
+    assets_tried = true;
+
+    const esp_partition_t * const p = esp_partition_find_first(
+     ESP_PARTITION_TYPE_DATA,
+     ESP_PARTITION_SUBTYPE_ANY,
+     ASSETS_PARTITION);
+
+    if ( p == NULL )
+      gm_printf("There is no %s partition.\n", ASSETS_PARTITION);
+    else if ( esp_partition_mmap(p, 0, p->size, ESP_PARTITION_MMAP_DATA, &image, &handle) != ESP_OK )
+      gm_printf("Can't map the %s partition.\n", ASSETS_PARTITION);
+    else {
+      partition = p;
+      // An erased partition is normal until assets are written to it.
+      assets_valid = compressed_fs_open(&assets, image, p->size);
+    }
+  }
+  return partition != NULL;
+}
+
+static bool
+map_assets(void)
+{
+  bool valid;
+
+  pthread_mutex_lock(&lock);
+  (void) map_partition();
+  valid = assets_valid;
+  pthread_mutex_unlock(&lock);
+  return valid;
+}
+
+// Start writing a new image. The old one is erased, and until the new one is
+// complete, requests fall through to frogfs. Only one image is written at a
+// time. Returns NULL if another is being written, or there is no partition.
+gm_assets_writer_t *
+gm_assets_write_begin(void)
+{
+  gm_assets_writer_t *	w = NULL;
+
+  pthread_mutex_lock(&lock);
+  if ( !writing && map_partition() ) {
+    w = gm_malloc(GM_MEMORY_ASSETS, sizeof(*w) + partition->erase_size);
+    if ( w ) {
+      writing = true;
+      assets_valid = false;
+    }
+  }
+  pthread_mutex_unlock(&lock);
+
+  if ( w == NULL )
+    return NULL;
+
+  w->offset = 0;
+  memset(w->first, 0xff, partition->erase_size);
+  w->err = esp_partition_erase_range(partition, 0, partition->erase_size);
+  return w;
+}
+
+// Write the next part of the image. Each sector is erased as the image
+// reaches it.
+esp_err_t
+gm_assets_write(gm_assets_writer_t * w, const void * data, size_t size)
+{
+  const uint8_t *	d = data;
+  const size_t		sector = partition->erase_size;
+
+  while ( size > 0 && w->err == ESP_OK ) {
+    size_t n = sector - w->offset % sector;
+
+    if ( w->offset >= partition->size ) {
+      gm_printf("The assets image is larger than the %s partition.\n", ASSETS_PARTITION);
+      w->err = ESP_ERR_INVALID_SIZE;
+      break;
+    }
+    if ( n > size )
+      n = size;
+
+    if ( w->offset < sector )
+      memcpy(&w->first[w->offset], d, n);
+    else {
+      if ( w->offset % sector == 0 )
+        w->err = esp_partition_erase_range(partition, w->offset, sector);
+      if ( w->err == ESP_OK )
+        w->err = esp_partition_write(partition, w->offset, d, n);
+    }
+
+    w->offset += n;
+    d += n;
+    size -= n;
+  }
+  return w->err;
+}
+
+// Finish writing the image. If it's complete, its first sector is written, and
+// if it's a valid image it's served from then on. Returns ESP_OK if it is.
+esp_err_t
+gm_assets_write_end(gm_assets_writer_t * w, bool complete)
+{
+  esp_err_t	err = w->err;
+
+  if ( err == ESP_OK && !complete )
+    err = ESP_ERR_INVALID_STATE;
+  if ( err == ESP_OK ) {
+    const size_t size = w->offset < partition->erase_size ? w->offset : partition->erase_size;
+
+    err = esp_partition_write(partition, 0, w->first, size);
+  }
+
+  pthread_mutex_lock(&lock);
+  if ( err == ESP_OK && !compressed_fs_open(&assets, image, partition->size) )
+    err = ESP_ERR_INVALID_ARG;
+  assets_valid = err == ESP_OK;
+  pthread_mutex_unlock(&lock);
+
+  // Leave the partition erased rather than holding an image that isn't valid.
+  if ( err == ESP_ERR_INVALID_ARG )
+    (void) esp_partition_erase_range(partition, 0, partition->erase_size);
+
+  pthread_mutex_lock(&lock);
+  writing = false;
+  pthread_mutex_unlock(&lock);
+
+  if ( err != ESP_OK )
+    gm_printf("The assets image wasn't written: %s.\n", esp_err_to_name(err));
+  gm_free(w);
+  return err;
+}
+
+compressed_fs_reader_t *
+compressed_fs_reader_create(const compressed_fs_t * fs, const struct compressed_fs_entry * e)
+{
+  compressed_fs_reader_t * const r = gm_malloc(GM_MEMORY_ASSETS, sizeof(*r));
+
+  if ( r == NULL )
+    return NULL;
+
+  tinfl_init(&r->inflator);
+  r->in = compressed_fs_data(fs, e);
+  r->in_remaining = e->compressed_size;
+  r->method = e->method;
+  r->done = false;
+  r->pending_start = 0;
+  r->pending_size = 0;
+  r->window_position = 0;
+  return r;
+}
+
+void
+compressed_fs_reader_destroy(compressed_fs_reader_t * r)
+{
+  gm_free(r);
+}
+
+// Read the next part of a file, decompressing it if necessary.
+// Returns the number of bytes read, 0 at the end of the file, or -1 if the
+// compressed data is damaged.
+int
+compressed_fs_read(compressed_fs_reader_t * r, void * buffer, size_t size)
+{
+  uint8_t *	out = buffer;
+  size_t	total = 0;
+
+  if ( r->method != ZLIB ) {
+    if ( size > r->in_remaining )
+      size = r->in_remaining;
+    memcpy(buffer, r->in, size);
+    r->in += size;
+    r->in_remaining -= size;
+    return size;
+  }
+
+  while ( total < size ) {
+    if ( r->pending_size > 0 ) {
+      size_t n = size - total;
+
+      if ( n > r->pending_size )
+        n = r->pending_size;
+      memcpy(&out[total], &r->window[r->pending_start], n);
+      r->pending_start += n;
+      r->pending_size -= n;
+      total += n;
+      continue;
+    }
+    if ( r->done )
+      break;
+
+    size_t in_size = r->in_remaining;
+    size_t out_size = sizeof(r->window) - r->window_position;
+
+    const tinfl_status status = tinfl_decompress(
+     &r->inflator,
+     r->in,
+     &in_size,
+     r->window,
+     &r->window[r->window_position],
+     &out_size,
+     TINFL_FLAG_PARSE_ZLIB_HEADER);
+
+    r->in += in_size;
+    r->in_remaining -= in_size;
+    r->pending_start = r->window_position;
+    r->pending_size = out_size;
+    r->window_position = (r->window_position + out_size) & (sizeof(r->window) - 1);
+
+    if ( status == TINFL_STATUS_DONE )
+      r->done = true;
+    else if ( status != TINFL_STATUS_HAS_MORE_OUTPUT )
+      return -1;
+  }
+  return total;
+}
+
+static void
+set_content_type(httpd_req_t * req, const char * name)
+{
+  const char * const dot = strrchr(name, '.');
+
+  if ( dot == NULL )
+    return;
+
+  for ( int i = 0; content_types[i].extension; i++ ) {
+    if ( strcasecmp(dot, content_types[i].extension) == 0 ) {
+      httpd_resp_set_type(req, content_types[i].type);
+      return;
+    }
+  }
+}
+
+static esp_err_t
+send_decompressed(httpd_req_t * req, const struct compressed_fs_entry * e)
+{
+  compressed_fs_reader_t * const r = compressed_fs_reader_create(&assets, e);
+  char buffer[CHUNK_SIZE];
+  int size;
+
+  if ( r == NULL )
+    return ESP_ERR_NO_MEM;
+
+  while ( (size = compressed_fs_read(r, buffer, sizeof(buffer))) > 0 ) {
+    if ( httpd_resp_send_chunk(req, buffer, size) != ESP_OK )
+      break; // Client hung up.
+  }
+  if ( size < 0 )
+    gm_printf("Assets: %s is damaged.\n", compressed_fs_name(&assets, e));
+  httpd_resp_send_chunk(req, NULL, 0);
+  compressed_fs_reader_destroy(r);
+  return ESP_OK;
+}
+
+// Serve a file from the assets partition.
+// Returns ESP_FAIL if there is no such file.
+esp_err_t
+gm_assets_file_handler(httpd_req_t * req, const gm_uri * uri)
+{
+  if ( !map_assets() )
+    return ESP_FAIL;
+
+  const struct compressed_fs_entry * const e = compressed_fs_find(&assets, uri->path);
+
+  if ( e == NULL )
+    return ESP_FAIL;
+
+  set_content_type(req, uri->path);
+
+  switch ( e->method ) {
+  case ZERO_LENGTH:
+    return httpd_resp_send(req, NULL, 0);
+  case NONE:
+    // compressed_fs_open() checked that this is within the image, and that
+    // it's the same as the size.
+    return httpd_resp_send(req, compressed_fs_data(&assets, e), e->compressed_size);
+  case ZLIB:
+    if ( gm_client_accepts_compression(req, "deflate") ) {
+      httpd_resp_set_hdr(req, "Content-Encoding", "deflate");
+      return httpd_resp_send(req, compressed_fs_data(&assets, e), e->compressed_size);
+    }
+    return send_decompressed(req, e);
+  default:
+    return ESP_FAIL;
+  }
+}
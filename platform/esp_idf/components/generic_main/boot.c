@@ -0,0 +1,228 @@
+// Boot profiling and initialization.
+//
+// gm_boot_run() runs the initialization steps in the order of their
+// dependencies, each one as soon as the steps it needs are done, on the
+// calling task and a helper task on the other core. So the steps that wait on
+// the FLASH or the radio overlap with the ones that don't, rather than all of
+// them waiting in a line.
+//
+// The start and end of every step, and the milestones after it, like getting
+// an address and sending the first HTTPS response, are kept with the time
+// since the program started. The timeline is printed after the first HTTPS
+// response, and with the "boot" console command.
+//
+// A step that needs one that can never be done, because the steps need each
+// other or one that doesn't exist, isn't run. It's shown as failed in the
+// timeline, and the rest of the boot goes on without it.
+#include <string.h>
+#include <pthread.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <esp_timer.h>
+#include "generic_main.h"
+
+#define MAXIMUM_RECORDS	32
+// The helper task runs steps that were written for the main task.
+#define HELPER_STACK	CONFIG_ESP_MAIN_TASK_STACK_SIZE
+
+typedef struct _record {
+  const char *	name;
+  int64_t	start;
+  int64_t	end;
+  int		core;
+  bool		step;
+  bool		failed;
+} record_t;
+
+typedef struct _run {
+  const gm_boot_step_t *	steps;
+  size_t			count;
+  uint32_t			started;
+  uint32_t			done;
+  size_t			running;
+  size_t			helpers;
+} run_t;
+
+static pthread_mutex_t	lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	changed = PTHREAD_COND_INITIALIZER;
+static record_t		records[MAXIMUM_RECORDS];
+static size_t		number_of_records = 0;
+
+// Called with the lock held.
+static record_t *
+new_record(const char * name, bool step)
+{
+  record_t * r;
+
+  if ( number_of_records >= MAXIMUM_RECORDS ) {
+    GM_WARN_ONCE("Boot: More than %d records, the rest are not kept.\n", MAXIMUM_RECORDS);
+    return NULL;
+  }
+  r = &records[number_of_records++];
+  r->name = name;
+  r->step = step;
+  r->core = xPortGetCoreID();
+  r->start = r->end = esp_timer_get_time();
+  return r;
+}
+
+// Mark the steps that haven't started as failed and done, so that the boot
+// goes on without them. Called with the lock held.
+static void
+unreachable(run_t * run)
+{
+  for ( size_t index = 0; index < run->count; index++ ) {
+    const uint32_t bit = 1UL << index;
+
+    if ( (run->started & bit) == 0 ) {
+      record_t * const r = new_record(run->steps[index].name, true);
+
+      if ( r )
+        r->failed = true;
+      run->started |= bit;
+      run->done |= bit;
+    }
+  }
+  pthread_cond_broadcast(&changed);
+}
+
+// Run steps as they become ready, until all of them are done. Runs on the
+// calling task and the helper at once.
+static void
+work(run_t * run)
+{
+  const uint32_t all = run->count >= 32 ? UINT32_MAX : (1UL << run->count) - 1;
+
+  pthread_mutex_lock(&lock);
+  while ( run->done != all ) {
+    size_t index;
+
+    for ( index = 0; index < run->count; index++ ) {
+      const uint32_t bit = 1UL << index;
+
+      if ( (run->started & bit) == 0 && (run->steps[index].needs & ~run->done) == 0 )
+        break;
+    }
+
+    if ( index == run->count ) {
+      // A step that needs one that is never done would wait forever.
+      if ( run->running == 0 ) {
+        GM_FAIL("Boot: The steps that are left need each other, or a step that doesn't exist.\n");
+        unreachable(run);
+        break;
+      }
+      pthread_cond_wait(&changed, &lock);
+      continue;
+    }
+
+    record_t * const r = new_record(run->steps[index].name, true);
+
+    run->started |= 1UL << index;
+    run->running++;
+    pthread_mutex_unlock(&lock);
+
+    (run->steps[index].run)();
+
+    pthread_mutex_lock(&lock);
+    if ( r )
+      r->end = esp_timer_get_time();
+    run->running--;
+    run->done |= 1UL << index;
+    pthread_cond_broadcast(&changed);
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+static void
+helper(void * data)
+{
+  run_t * const run = (run_t *)data;
+
+  work(run);
+  // The run is on the stack of gm_boot_run(), which waits for this.
+  pthread_mutex_lock(&lock);
+  run->helpers--;
+  pthread_cond_broadcast(&changed);
+  pthread_mutex_unlock(&lock);
+  vTaskDelete(NULL);
+}
+
+// Run initialization steps, in parallel where their dependencies allow. A
+// step's "needs" has the bit (1 << index) set for each step that must be
+// done before it starts. Returns when all of the steps are done.
+void
+gm_boot_run(const gm_boot_step_t * steps, size_t count)
+{
+  run_t		run = { .steps = steps, .count = count, .helpers = 1 };
+  const int64_t	start = esp_timer_get_time();
+  BaseType_t	core = tskNO_AFFINITY;
+
+  if ( count > 32 )
+    GM_FAIL("Boot: No more than 32 steps.\n");
+
+#if portNUM_PROCESSORS > 1
+  core = !xPortGetCoreID();
+#endif
+
+  if ( xTaskCreatePinnedToCore(helper, "boot", HELPER_STACK, &run, uxTaskPriorityGet(NULL), NULL, core) != pdPASS ) {
+    run.helpers = 0;
+    GM_WARN_ONCE("Boot: Can't start the helper task, initializing in one task.\n");
+  }
+
+  work(&run);
+  pthread_mutex_lock(&lock);
+  while ( run.helpers > 0 )
+    pthread_cond_wait(&changed, &lock);
+  pthread_mutex_unlock(&lock);
+  gm_printf("Initialized in %lld ms.\n", (long long)(esp_timer_get_time() - start) / 1000);
+}
+
+// Record the time of a moment of the boot, once. Returns true the first time
+// it's called with a name.
+bool
+gm_boot_milestone(const char * name)
+{
+  pthread_mutex_lock(&lock);
+  for ( size_t i = 0; i < number_of_records; i++ ) {
+    if ( !records[i].step && strcmp(records[i].name, name) == 0 ) {
+      pthread_mutex_unlock(&lock);
+      return false;
+    }
+  }
+  const bool recorded = new_record(name, false) != NULL;
+  pthread_mutex_unlock(&lock);
+  return recorded;
+}
+
+// Print the boot timeline, in milliseconds since the program started.
+void
+gm_boot_report(void)
+{
+  record_t	copy[MAXIMUM_RECORDS];
+  size_t	n;
+
+  // Copied, so that printing isn't done with the lock held.
+  pthread_mutex_lock(&lock);
+  n = number_of_records;
+  memcpy(copy, records, n * sizeof(*copy));
+  pthread_mutex_unlock(&lock);
+
+  gm_printf("Boot timeline, in ms since start:\n");
+  gm_printf("%8s %8s %4s  %s\n", "start", "ms", "core", "step or milestone");
+  for ( size_t i = 0; i < n; i++ ) {
+    const record_t * const r = &copy[i];
+
+    if ( r->step && r->failed )
+      gm_printf("%8.1f %8s %4s  %s (not run)\n", r->start / 1000.0, "", "", r->name);
+    else if ( r->step ) {
+      gm_printf(
+       "%8.1f %8.1f %4d  %s\n",
+       r->start / 1000.0,
+       (r->end - r->start) / 1000.0,
+       r->core,
+       r->name);
+    }
+    else
+      gm_printf("%8.1f %8s %4d  %s\n", r->start / 1000.0, "", r->core, r->name);
+  }
+}
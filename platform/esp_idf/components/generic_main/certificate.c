@@ -0,0 +1,198 @@
+// The TLS key and certificate of the web server.
+//
+// Each device has its own P-256 ECDSA key, and a self-signed certificate for
+// it, made at the first boot and kept in the keys partition. An ECDSA
+// signature costs a few milliseconds with the bignum accelerator, where the
+// RSA-2048 private-key operation of a handshake took hundreds, and no two
+// devices share a private key.
+//
+// The partition holds a record: a header, the key, and the certificate, both
+// DER. A record that doesn't check, including an erased partition, is replaced
+// with a new key and certificate.
+#include <stdio.h>
+#include <string.h>
+#include <esp_partition.h>
+#include <esp_random.h>
+#include <esp_https_server.h>
+#include <mbedtls/ctr_drbg.h>
+#include <mbedtls/ecp.h>
+#include <mbedtls/entropy.h>
+#include <mbedtls/pk.h>
+#include <mbedtls/platform_util.h>
+#include <mbedtls/x509_crt.h>
+#include "generic_main.h"
+
+#define MAGIC			"GMKY"
+#define VERSION			1
+#define MAXIMUM_KEY_SIZE	160
+#define MAXIMUM_CERTIFICATE_SIZE	1024
+// The certificate doesn't expire during the life of the device.
+#define NOT_BEFORE		"20250101000000"
+#define NOT_AFTER		"20491231235959"
+
+typedef struct _header {
+  char		magic[4];
+  uint16_t	version;
+  uint16_t	key_size;
+  uint16_t	certificate_size;
+  uint16_t	reserved;
+  uint32_t	checksum;	// Of the key and certificate.
+} header_t;
+
+typedef struct _record {
+  header_t	header;
+  uint8_t	data[MAXIMUM_KEY_SIZE + MAXIMUM_CERTIFICATE_SIZE];
+} record_t;
+
+static record_t	record;
+static bool	loaded = false;
+
+// FNV-1a.
+static uint32_t
+checksum(const uint8_t * data, size_t size)
+{
+  uint32_t h = 2166136261u;
+
+  while ( size-- > 0 ) {
+    h ^= *data++;
+    h *= 16777619u;
+  }
+  return h;
+}
+
+static bool
+valid(const record_t * r)
+{
+  const header_t * const h = &r->header;
+
+  return memcmp(h->magic, MAGIC, sizeof(h->magic)) == 0
+   && h->version == VERSION
+   && h->key_size > 0
+   && h->key_size <= MAXIMUM_KEY_SIZE
+   && h->certificate_size > 0
+   && h->certificate_size <= MAXIMUM_CERTIFICATE_SIZE
+   && h->checksum == checksum(r->data, h->key_size + h->certificate_size);
+}
+
+// Make a P-256 key and a self-signed certificate for it, named for the
+// device, into the record. mbedtls writes DER at the end of the buffer.
+static bool
+generate(void)
+{
+  mbedtls_entropy_context	entropy;
+  mbedtls_ctr_drbg_context	drbg;
+  mbedtls_pk_context		key;
+  mbedtls_x509write_cert	certificate;
+  uint8_t			serial[16];
+  char				subject[80];
+  uint8_t			der[MAXIMUM_CERTIFICATE_SIZE];
+  int				key_size = -1;
+  int				certificate_size = -1;
+  bool				ok = false;
+
+  mbedtls_entropy_init(&entropy);
+  mbedtls_ctr_drbg_init(&drbg);
+  mbedtls_pk_init(&key);
+  mbedtls_x509write_crt_init(&certificate);
+
+  snprintf(subject, sizeof(subject), "CN=%s", GM.unique_name);
+  // The radio is on, so the hardware random generator is too.
+  esp_fill_random(serial, sizeof(serial));
+  serial[0] &= 0x7f;	// Positive.
+
+  if ( mbedtls_ctr_drbg_seed(&drbg, mbedtls_entropy_func, &entropy, (const uint8_t *)subject, strlen(subject)) != 0
+   ||  mbedtls_pk_setup(&key, mbedtls_pk_info_from_type(MBEDTLS_PK_ECKEY)) != 0
+   ||  mbedtls_ecp_gen_key(MBEDTLS_ECP_DP_SECP256R1, mbedtls_pk_ec(key), mbedtls_ctr_drbg_random, &drbg) != 0 ) {
+    gm_printf("Can't make a TLS key.\n");
+    goto done;
+  }
+
+  mbedtls_x509write_crt_set_version(&certificate, MBEDTLS_X509_CRT_VERSION_3);
+  mbedtls_x509write_crt_set_md_alg(&certificate, MBEDTLS_MD_SHA256);
+  mbedtls_x509write_crt_set_subject_key(&certificate, &key);
+  mbedtls_x509write_crt_set_issuer_key(&certificate, &key);
+  if ( mbedtls_x509write_crt_set_subject_name(&certificate, subject) != 0
+   ||  mbedtls_x509write_crt_set_issuer_name(&certificate, subject) != 0
+   ||  mbedtls_x509write_crt_set_serial_raw(&certificate, serial, sizeof(serial)) != 0
+   ||  mbedtls_x509write_crt_set_validity(&certificate, NOT_BEFORE, NOT_AFTER) != 0
+   ||  mbedtls_x509write_crt_set_basic_constraints(&certificate, 0, -1) != 0
+   ||  mbedtls_x509write_crt_set_subject_key_identifier(&certificate) != 0
+   ||  (certificate_size = mbedtls_x509write_crt_der(&certificate, der, sizeof(der), mbedtls_ctr_drbg_random, &drbg)) <= 0
+   ||  (key_size = mbedtls_pk_write_key_der(&key, record.data, MAXIMUM_KEY_SIZE)) <= 0 ) {
+    gm_printf("Can't make a TLS certificate.\n");
+    goto done;
+  }
+
+  memmove(record.data, &record.data[MAXIMUM_KEY_SIZE - key_size], key_size);
+  memcpy(&record.data[key_size], &der[sizeof(der) - certificate_size], certificate_size);
+  // Don't leave a copy of some of the key after the certificate.
+  mbedtls_platform_zeroize(
+   &record.data[key_size + certificate_size],
+   sizeof(record.data) - key_size - certificate_size);
+  memcpy(record.header.magic, MAGIC, sizeof(record.header.magic));
+  record.header.version = VERSION;
+  record.header.key_size = key_size;
+  record.header.certificate_size = certificate_size;
+  record.header.reserved = 0;
+  record.header.checksum = checksum(record.data, key_size + certificate_size);
+  ok = true;
+
+done:
+  mbedtls_x509write_crt_free(&certificate);
+  mbedtls_pk_free(&key);
+  mbedtls_ctr_drbg_free(&drbg);
+  mbedtls_entropy_free(&entropy);
+  return ok;
+}
+
+// Load the key and certificate, making them if there are none. An
+// initialization step, after WiFi is started, for the random generator.
+void
+gm_certificate_load(void)
+{
+  const esp_partition_t * const p = esp_partition_find_first(
+   ESP_PARTITION_TYPE_DATA,
+   ESP_PARTITION_SUBTYPE_ANY,
+   GM_KEYS_PARTITION);
+  esp_err_t err;
+
+  if ( p == NULL ) {
+    gm_printf("There is no %s partition, so there's no TLS certificate.\n", GM_KEYS_PARTITION);
+    return;
+  }
+
+  if ( (err = esp_partition_read(p, 0, &record, sizeof(record))) != ESP_OK ) {
+    gm_flash_failure("keys read", err);
+    return;
+  }
+  if ( valid(&record) ) {
+    loaded = true;
+    return;
+  }
+
+  gm_printf("Making the TLS key and certificate for %s.\n", GM.unique_name);
+  if ( !generate() )
+    return;
+
+  if ( (err = esp_partition_erase_range(p, 0, (sizeof(record) + p->erase_size - 1) / p->erase_size * p->erase_size)) != ESP_OK
+   ||  (err = esp_partition_write(p, 0, &record, sizeof(record.header) + record.header.key_size + record.header.certificate_size)) != ESP_OK ) {
+    // The key works until the next boot, which makes another.
+    gm_flash_failure("keys write", err);
+  }
+  loaded = true;
+}
+
+// Call this on a structure that has already been initialized with
+// HTTPD_SSL_CONFIG_DEFAULT(), after gm_certificate_load().
+void
+gm_self_signed_ssl_certificates(struct httpd_ssl_config * c)
+{
+  if ( !loaded ) {
+    GM_WARN_ONCE("The web server has no TLS certificate.\n");
+    return;
+  }
+  c->prvtkey_pem = record.data;
+  c->prvtkey_len = record.header.key_size;
+  c->servercert = &record.data[record.header.key_size];
+  c->servercert_len = record.header.certificate_size;
+}
@@ -0,0 +1,28 @@
+#include <stdint.h>
+#include <time.h>
+#ifdef ESP_PLATFORM
+#include <esp_timer.h>
+#endif
+#include "gm_clock.h"
+
+// The real clock. The host simulation links its own instead, see
+// host/sim_net.c.
+
+int64_t
+gm_clock_us(void)
+{
+#ifdef ESP_PLATFORM
+  return esp_timer_get_time();
+#else
+  struct timespec t;
+
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000LL + t.tv_nsec / 1000;
+#endif
+}
+
+time_t
+gm_clock_time(void)
+{
+  return time(NULL);
+}
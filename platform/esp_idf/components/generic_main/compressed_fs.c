@@ -0,0 +1,131 @@
+#include <string.h>
+#include "compressed_fs.h"
+
+// The parts of compressed_fs that don't depend on the platform, used by the
+// device and by the host builder. The image is read in place, through the
+// structures, so this assumes a little-endian processor, as are the ESP32
+// family and the usual hosts.
+
+const uint8_t compressed_fs_magic[COMPRESSED_FS_MAGIC_SIZE] =
+ "compressed_fs image, version 2, see compressed_fs.h.\n";
+
+// FNV-1a.
+uint32_t
+compressed_fs_hash(const char * name)
+{
+  uint32_t h = 2166136261;
+
+  while ( *name ) {
+    h ^= (uint8_t)*name++;
+    h *= 16777619;
+  }
+  return h;
+}
+
+static bool
+in_image(const compressed_fs_t * fs, uint32_t offset, uint32_t size)
+{
+  return offset <= fs->size && size <= fs->size - offset;
+}
+
+// Check that an image is complete and consistent, so that later accesses
+// needn't check bounds.
+bool
+compressed_fs_open(compressed_fs_t * fs, const void * image, size_t size)
+{
+  const struct compressed_fs_header * const h = image;
+
+  memset(fs, 0, sizeof(*fs));
+  fs->image = image;
+  fs->size = size;
+
+  if ( size < sizeof(*h)
+   || memcmp(h->magic, compressed_fs_magic, sizeof(h->magic)) != 0
+   || h->image_size > size )
+    return false;
+
+  // Don't look beyond the image, the rest of the partition is erased FLASH.
+  fs->size = h->image_size;
+
+  if ( h->number_of_files > fs->size / sizeof(struct compressed_fs_entry)
+   || (h->table_offset & 3) != 0
+   || (h->hash_offset & 3) != 0
+   || h->hash_size <= h->number_of_files
+   || (h->hash_size & (h->hash_size - 1)) != 0
+   || !in_image(fs, h->table_offset, h->number_of_files * sizeof(struct compressed_fs_entry))
+   || h->hash_size > fs->size / sizeof(uint32_t)
+   || !in_image(fs, h->hash_offset, h->hash_size * sizeof(uint32_t)) )
+    return false;
+
+  fs->header = h;
+  fs->entries = (const struct compressed_fs_entry *)(fs->image + h->table_offset);
+  fs->hash = (const uint32_t *)(fs->image + h->hash_offset);
+
+  for ( uint32_t i = 0; i < h->number_of_files; i++ ) {
+    const struct compressed_fs_entry * const e = &fs->entries[i];
+
+    if ( e->name_offset >= fs->size
+     || memchr(fs->image + e->name_offset, '\0', fs->size - e->name_offset) == NULL
+     || !in_image(fs, e->data_offset, e->compressed_size)
+     || e->method > ZLIB
+     // Stored data is served with its size, so it must be what is in the image.
+     || (e->method != ZLIB && e->size != e->compressed_size) )
+      return false;
+  }
+  for ( uint32_t i = 0; i < h->hash_size; i++ ) {
+    if ( fs->hash[i] > h->number_of_files )
+      return false;
+  }
+  return true;
+}
+
+const char *
+compressed_fs_name(const compressed_fs_t * fs, const struct compressed_fs_entry * e)
+{
+  return (const char *)(fs->image + e->name_offset);
+}
+
+const void *
+compressed_fs_data(const compressed_fs_t * fs, const struct compressed_fs_entry * e)
+{
+  return fs->image + e->data_offset;
+}
+
+const struct compressed_fs_entry *
+compressed_fs_find(const compressed_fs_t * fs, const char * name)
+{
+  if ( fs->header == NULL || fs->header->hash_size == 0 )
+    return NULL;
+
+  const uint32_t mask = fs->header->hash_size - 1;
+
+  // The table is never full, so there is always an empty slot to stop at.
+  for ( uint32_t i = compressed_fs_hash(name) & mask; fs->hash[i] != 0; i = (i + 1) & mask ) {
+    const struct compressed_fs_entry * const e = &fs->entries[fs->hash[i] - 1];
+
+    if ( strcmp(compressed_fs_name(fs, e), name) == 0 )
+      return e;
+  }
+  return NULL;
+}
+
+const struct compressed_fs_entry *
+compressed_fs_bsearch(const compressed_fs_t * fs, const char * name)
+{
+  size_t low = 0;
+  size_t high = fs->header ? fs->header->number_of_files : 0;
+
+  while ( low < high ) {
+    const size_t middle = low + (high - low) / 2;
+    const struct compressed_fs_entry * const e = &fs->entries[middle];
+    const int result = strcmp(compressed_fs_name(fs, e), name);
+
+    if ( result == 0 )
+      return e;
+    else if ( result < 0 )
+      low = middle + 1;
+    else
+      high = middle;
+  }
+  return NULL;
+}
@@ -0,0 +1,476 @@
+// Configuration Store
+//
+// Changes to configuration are held in a small RAM write-back buffer and
+// written to the backend (NVS on the device) together, with one commit:
+//
+//   gm_config_begin();
+//   gm_config_set("ssid", ...);
+//   gm_config_set("wifi_password", ...);
+//   gm_config_commit();
+//
+// Outside of a transaction, changes stay in the buffer until the platform
+// calls gm_config_flush(), which it does after a short delay, so that quick
+// successive changes are coalesced. Reads see the buffer first, so a change is
+// visible as soon as it's made.
+//
+// A value that is set to what's already stored isn't written at all. Every
+// write is counted per key, along with an estimate of the 32-byte FLASH
+// entries it used, to estimate wear of the partition. The counters are
+// persisted only every few commits, as a single value, so that counting wear
+// doesn't cause much of it.
+//
+// If a transaction changes more keys than the buffer holds, it is committed in
+// parts. A change that fails to write stays in the buffer, and is tried again
+// at the next flush.
+//
+// This is portable C, without ESP-IDF dependencies, so that it can be
+// benchmarked on the host against a simulated FLASH.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "gm_config_store.h"
+
+// Persist the write counters every this many commits.
+#define COUNTER_INTERVAL	8
+// NVS stores a string as a header entry and then 32-byte data entries.
+#define ENTRY_SIZE		32
+#define ENTRIES_PER_PAGE	126
+#define PAGE_SIZE		4096
+// Rated erase cycles of the FLASH.
+#define RATED_CYCLES		100000.0
+// Nested transactions.
+#define MAXIMUM_DEPTH		8
+
+typedef struct _pending {
+  char	key[GM_CONFIG_KEY_SIZE];
+  char	value[GM_CONFIG_VALUE_SIZE];
+  bool	erase;
+} pending_t;
+
+typedef struct _counter {
+  char		key[GM_CONFIG_KEY_SIZE];
+  uint32_t	writes;
+} counter_t;
+
+static pthread_mutex_t		lock = PTHREAD_MUTEX_INITIALIZER;
+static const gm_config_backend_t * backend = NULL;
+static gm_config_changed_t	changed = NULL;
+static pending_t		pending[GM_CONFIG_PENDING];
+static size_t			number_pending = 0;
+static int			transaction_depth = 0;
+// The number of pending changes when each open transaction began.
+static size_t			marks[MAXIMUM_DEPTH];
+static counter_t		counters[GM_CONFIG_COUNTERS];
+static gm_config_wear_t		wear;
+static uint64_t			entries_at_start = 0;
+static uint32_t			commits_since_counters_saved = 0;
+
+static uint32_t
+entries_for(const char * value)
+{
+  return 1 + (strlen(value) + 1 + ENTRY_SIZE - 1) / ENTRY_SIZE;
+}
+
+// Call with the lock held.
+static counter_t *
+counter(const char * key)
+{
+  for ( size_t i = 0; i < GM_CONFIG_COUNTERS; i++ ) {
+    if ( counters[i].key[0] == '\0' ) {
+      strcpy(counters[i].key, key);
+      return &counters[i];
+    }
+    if ( strcmp(counters[i].key, key) == 0 )
+      return &counters[i];
+  }
+  return NULL;
+}
+
+// The counters are kept as text, "entries commits writes skipped key=n ...", so
+// that they can be stored with the same string operations as everything else.
+static void
+load_counters(void)
+{
+  char			buffer[GM_CONFIG_VALUE_SIZE * 4];
+  unsigned long long	entries;
+  unsigned long		commits, writes, skipped;
+  int			offset = 0;
+  const char *		s;
+
+  if ( backend->get(backend->context, GM_CONFIG_WEAR_KEY, buffer, sizeof(buffer)) != GM_CONFIG_OK )
+    return;
+
+  if ( sscanf(buffer, "%llu %lu %lu %lu%n", &entries, &commits, &writes, &skipped, &offset) != 4 )
+    return;
+
+  wear.entries = entries;
+  wear.commits = commits;
+  wear.writes = writes;
+  wear.skipped = skipped;
+
+  s = &buffer[offset];
+  while ( *s == ' ' ) {
+    char		key[GM_CONFIG_KEY_SIZE];
+    unsigned long	n;
+
+    if ( sscanf(s, " %15[^=]=%lu%n", key, &n, &offset) != 2 )
+      break;
+    counter_t * const c = counter(key);
+    if ( c )
+      c->writes = n;
+    s += offset;
+  }
+}
+
+// Call with the lock held. Writes the counters, but doesn't commit.
+static gm_config_result_t
+save_counters(void)
+{
+  char	buffer[GM_CONFIG_VALUE_SIZE * 4];
+  size_t length;
+
+  length = snprintf(
+   buffer,
+   sizeof(buffer),
+   "%llu %lu %lu %lu",
+   (unsigned long long)wear.entries,
+   (unsigned long)wear.commits,
+   (unsigned long)wear.writes,
+   (unsigned long)wear.skipped);
+
+  for ( size_t i = 0; i < GM_CONFIG_COUNTERS && counters[i].key[0] != '\0'; i++ ) {
+    if ( length >= sizeof(buffer) )
+      break;
+    length += snprintf(&buffer[length], sizeof(buffer) - length, " %s=%lu", counters[i].key, (unsigned long)counters[i].writes);
+  }
+  if ( length >= sizeof(buffer) )
+    return GM_CONFIG_ERROR;
+
+  wear.entries += entries_for(buffer);
+  commits_since_counters_saved = 0;
+  return backend->set(backend->context, GM_CONFIG_WEAR_KEY, buffer);
+}
+
+// Call with the lock held. Returns the pending change for the key, or NULL.
+static pending_t *
+find_pending(const char * key)
+{
+  for ( size_t i = 0; i < number_pending; i++ ) {
+    if ( strcmp(pending[i].key, key) == 0 )
+      return &pending[i];
+  }
+  return NULL;
+}
+
+// Call with the lock held. Keep only the changes that failed to write, in
+// order, and make the open transactions' marks fit what's left.
+static void
+keep_failed(const bool failed[GM_CONFIG_PENDING])
+{
+  size_t kept = 0;
+
+  for ( size_t i = 0; i < number_pending; i++ ) {
+    if ( failed[i] ) {
+      if ( kept != i )
+        pending[kept] = pending[i];
+      kept++;
+    }
+  }
+  number_pending = kept;
+
+  for ( int i = 0; i < transaction_depth; i++ ) {
+    if ( marks[i] > number_pending )
+      marks[i] = number_pending;
+  }
+}
+
+// Call with the lock held. Write all pending changes, and commit once.
+// The keys that changed are copied to the caller, for notification after the
+// lock is released. Returns the worst result, even if some keys were written.
+static gm_config_result_t
+flush_locked(char changed_keys[GM_CONFIG_PENDING][GM_CONFIG_KEY_SIZE], size_t * number_changed)
+{
+  gm_config_result_t	result = GM_CONFIG_OK;
+  char			current[GM_CONFIG_VALUE_SIZE];
+  bool			failed[GM_CONFIG_PENDING] = {};
+
+  *number_changed = 0;
+
+  if ( number_pending == 0 )
+    return GM_CONFIG_OK;
+
+  for ( size_t i = 0; i < number_pending; i++ ) {
+    pending_t * const p = &pending[i];
+    const gm_config_result_t get_result = backend->get(backend->context, p->key, current, sizeof(current));
+    gm_config_result_t	r;
+
+    if ( p->erase ) {
+      if ( get_result == GM_CONFIG_NOT_FOUND ) {
+        wear.skipped++;
+        continue;
+      }
+      r = backend->erase(backend->context, p->key);
+    }
+    else {
+      if ( get_result == GM_CONFIG_OK && strcmp(current, p->value) == 0 ) {
+        wear.skipped++;
+        continue;
+      }
+      r = backend->set(backend->context, p->key, p->value);
+      wear.entries += entries_for(p->value);
+    }
+
+    if ( r != GM_CONFIG_OK ) {
+      if ( result == GM_CONFIG_OK || r == GM_CONFIG_ERROR )
+        result = r;
+      failed[i] = true;
+      continue;
+    }
+
+    wear.writes++;
+    counter_t * const c = counter(p->key);
+    if ( c )
+      c->writes++;
+    strcpy(changed_keys[(*number_changed)++], p->key);
+  }
+
+  if ( *number_changed == 0 ) {
+    keep_failed(failed);
+    return result;
+  }
+
+  wear.commits++;
+  if ( ++commits_since_counters_saved >= COUNTER_INTERVAL )
+    (void) save_counters();
+
+  if ( backend->commit(backend->context) != GM_CONFIG_OK ) {
+    // Nothing is known to be written, so keep all of it for the next try.
+    *number_changed = 0;
+    return GM_CONFIG_ERROR;
+  }
+
+  keep_failed(failed);
+  return result;
+}
+
+static gm_config_result_t
+flush_and_notify(void)
+{
+  char			changed_keys[GM_CONFIG_PENDING][GM_CONFIG_KEY_SIZE];
+  const char *		keys[GM_CONFIG_PENDING];
+  size_t		number_changed;
+  gm_config_result_t	result;
+
+  pthread_mutex_lock(&lock);
+  result = flush_locked(changed_keys, &number_changed);
+  pthread_mutex_unlock(&lock);
+
+  if ( changed && number_changed > 0 ) {
+    for ( size_t i = 0; i < number_changed; i++ )
+      keys[i] = changed_keys[i];
+    (*changed)(keys, number_changed);
+  }
+  return result;
+}
+
+static gm_config_result_t
+add_pending(const char * key, const char * value, bool erase)
+{
+  pending_t * p;
+
+  if ( strlen(key) >= GM_CONFIG_KEY_SIZE || (value && strlen(value) >= GM_CONFIG_VALUE_SIZE) )
+    return GM_CONFIG_ERROR;
+
+  pthread_mutex_lock(&lock);
+  if ( (p = find_pending(key)) == NULL ) {
+    if ( number_pending == GM_CONFIG_PENDING ) {
+      // The buffer is full, write it now, even during a transaction.
+      pthread_mutex_unlock(&lock);
+      const gm_config_result_t result = flush_and_notify();
+      if ( result != GM_CONFIG_OK )
+        return result;
+      pthread_mutex_lock(&lock);
+      if ( number_pending == GM_CONFIG_PENDING ) {
+        pthread_mutex_unlock(&lock);
+        return GM_CONFIG_ERROR;
+      }
+    }
+    p = &pending[number_pending++];
+    strcpy(p->key, key);
+  }
+  p->erase = erase;
+  if ( value )
+    strcpy(p->value, value);
+  else
+    p->value[0] = '\0';
+  pthread_mutex_unlock(&lock);
+  return GM_CONFIG_OK;
+}
+
+void
+gm_config_init(const gm_config_backend_t * b, gm_config_changed_t c)
+{
+  pthread_mutex_lock(&lock);
+  backend = b;
+  changed = c;
+  number_pending = 0;
+  transaction_depth = 0;
+  commits_since_counters_saved = 0;
+  memset(counters, 0, sizeof(counters));
+  memset(&wear, 0, sizeof(wear));
+  load_counters();
+  entries_at_start = wear.entries;
+  pthread_mutex_unlock(&lock);
+}
+
+gm_config_result_t
+gm_config_begin(void)
+{
+  gm_config_result_t result = GM_CONFIG_OK;
+
+  pthread_mutex_lock(&lock);
+  if ( transaction_depth < MAXIMUM_DEPTH )
+    marks[transaction_depth++] = number_pending;
+  else
+    result = GM_CONFIG_ERROR;
+  pthread_mutex_unlock(&lock);
+  return result;
+}
+
+// Commit the outermost transaction.
+gm_config_result_t
+gm_config_commit(void)
+{
+  pthread_mutex_lock(&lock);
+  if ( transaction_depth > 0 )
+    transaction_depth--;
+  const bool outermost = (transaction_depth == 0);
+  pthread_mutex_unlock(&lock);
+
+  if ( outermost )
+    return flush_and_notify();
+  return GM_CONFIG_OK;
+}
+
+// Discard the changes made since the innermost transaction began, and close
+// it. Outside of a transaction, discard all of the pending changes. Changes
+// already committed because the buffer filled are not undone, nor are
+// changes to keys that were already pending when the transaction began.
+gm_config_result_t
+gm_config_abort(void)
+{
+  pthread_mutex_lock(&lock);
+  if ( transaction_depth > 0 )
+    number_pending = marks[--transaction_depth];
+  else
+    number_pending = 0;
+  pthread_mutex_unlock(&lock);
+  return GM_CONFIG_OK;
+}
+
+// Write the pending changes, unless a transaction is open, in which case they
+// are written when it's committed.
+gm_config_result_t
+gm_config_flush(void)
+{
+  pthread_mutex_lock(&lock);
+  const bool in_transaction = (transaction_depth > 0);
+  pthread_mutex_unlock(&lock);
+
+  if ( in_transaction )
+    return GM_CONFIG_OK;
+  return flush_and_notify();
+}
+
+bool
+gm_config_pending(void)
+{
+  pthread_mutex_lock(&lock);
+  const bool any = (number_pending > 0);
+  pthread_mutex_unlock(&lock);
+  return any;
+}
+
+gm_config_result_t
+gm_config_get(const char * key, char * buffer, size_t size)
+{
+  const pending_t * p;
+
+  pthread_mutex_lock(&lock);
+  if ( (p = find_pending(key)) != NULL ) {
+    gm_config_result_t result = GM_CONFIG_NOT_FOUND;
+    if ( !p->erase ) {
+      if ( strlen(p->value) < size ) {
+        strcpy(buffer, p->value);
+        result = GM_CONFIG_OK;
+      }
+      else
+        result = GM_CONFIG_ERROR;
+    }
+    pthread_mutex_unlock(&lock);
+    return result;
+  }
+  pthread_mutex_unlock(&lock);
+
+  return backend->get(backend->context, key, buffer, size);
+}
+
+gm_config_result_t
+gm_config_set(const char * key, const char * value)
+{
+  return add_pending(key, value, false);
+}
+
+gm_config_result_t
+gm_config_erase(const char * key)
+{
+  return add_pending(key, NULL, true);
+}
+
+void
+gm_config_wear(gm_config_wear_t * w)
+{
+  pthread_mutex_lock(&lock);
+  *w = wear;
+  w->entries_since_start = wear.entries - entries_at_start;
+  pthread_mutex_unlock(&lock);
+}
+
+void
+gm_config_counters(gm_config_counter_coroutine_t coroutine, void * context)
+{
+  counter_t	copy[GM_CONFIG_COUNTERS];
+
+  pthread_mutex_lock(&lock);
+  memcpy(copy, counters, sizeof(copy));
+  pthread_mutex_unlock(&lock);
+
+  for ( size_t i = 0; i < GM_CONFIG_COUNTERS && copy[i].key[0] != '\0'; i++ )
+    (*coroutine)(copy[i].key, copy[i].writes, context);
+}
+
+// Estimate the life of a log-structured key-value partition like NVS. Entries
+// are written sequentially through all of the pages, so each page is erased
+// about once for every partition's worth of entries written. The remaining
+// time is projected from the rate of writing since gm_config_init().
+void
+gm_config_estimate_life(const gm_config_wear_t * w, size_t partition_size, double seconds_since_start, gm_config_life_t * life)
+{
+  const double entries_per_cycle = (double)(partition_size / PAGE_SIZE) * ENTRIES_PER_PAGE;
+
+  life->erase_cycles = entries_per_cycle > 0 ? (double)w->entries / entries_per_cycle : 0;
+  life->remaining_fraction = 1.0 - (life->erase_cycles / RATED_CYCLES);
+  if ( life->remaining_fraction < 0 )
+    life->remaining_fraction = 0;
+
+  if ( w->entries_since_start > 0 && seconds_since_start > 0 && entries_per_cycle > 0 ) {
+    const double cycles_per_day = ((double)w->entries_since_start / entries_per_cycle) / (seconds_since_start / 86400.0);
+    life->days_remaining = (RATED_CYCLES - life->erase_cycles) / cycles_per_day;
+    if ( life->days_remaining < 0 )
+      life->days_remaining = 0;
+  }
+  else
+    life->days_remaining = -1;
+}
@@ -1,230 +1,288 @@
-// unsigned char * base64_decode(const char *src, size_t len, size_t *out_len);
 #include <stdint.h>
 #include <stddef.h>
 #include <string.h>
-#include <cJSON.h>
-#include <sys/param.h>
-#include <aes/esp_aes.h>
+#include <time.h>
+#include <pthread.h>
+#include <mbedtls/gcm.h>
 #include <esp_random.h>
 #include <esp_https_server.h>
-#include <esp_rom_crc.h>
 #include <esp_log.h>
-#include "../src/utils/base64.h"
 #include "generic_main.h"
 
-// We use JSON for session context. It gets sent to the browser as an encrypted 
-// cookie, and the browser sends it back. On a machine with more resources, we
-// would keep the session context on a disk, or at least a larger FLASH with
-// better wear-leveling. ESP-32 has small FLASH with a limited number of write
+// We send session context to the browser as an encrypted cookie, and the
+// browser sends it back. On a machine with more resources, we would keep the
+// session context on a disk, or at least a larger FLASH with better
+// wear-leveling. ESP-32 has small FLASH with a limited number of write
 // cycles, and its wear-leveling depends on the presence of _unused_ space on the
 // partition, which of course is limited by the FLASH size. Once you ruin the
 // FLASH the device is probably bricked. So don't store session context locally.
+//
+// The cookie is sent with every request, so it's kept small. It's binary:
+//
+//   version	1 byte, also authenticated as additional data.
+//   nonce	12 random bytes.
+//   records	Encrypted type-length-value records.
+//   tag	16-byte AES-GCM authentication tag.
+//
+// and then Base64url-encoded without padding. The GCM tag makes the cookie
+// impossible to forge or modify without the key, and the random nonce means
+// that the same session never encrypts the same way twice. The AES block
+// operations of GCM run on the AES hardware.
+//
+// Unknown record types are skipped when reading, so that records can be added
+// without a new version.
+
+#define COOKIE_VERSION	1
+#define NONCE_SIZE	12
+#define TAG_SIZE	16
+#define RECORDS_SIZE	64
+#define BINARY_SIZE	(1 + NONCE_SIZE + RECORDS_SIZE + TAG_SIZE)
+// Cookies older than this are refused, even if the browser keeps them.
+#define MAXIMUM_AGE	(30 * 24 * 60 * 60)
+// An issue time before 2020 was stamped by a clock that hadn't been set.
+#define EARLIEST_ISSUED	1577836800
+
+enum record_type {
+  NAME = 1,
+  ISSUED = 2
+};
 
-#ifndef roundup
-#define roundup(x, y) ((((x) + ((y) - 1)) / (y)) * (y))
-#endif
-
-// C won't let me define array sizes at file scope with a number in a const size_t.
-#define PAYLOAD_SIZE 1024
-
-const char tag[] = "cookie";
+static const char tag[] = "cookie";
 
 // Our cookie is called "c".
-const uint8_t cookie_start[] = "c=";
+static const char cookie_start[] = "c=";
 
 // Send cookie only on SSL, expire it after 30 days, try to avoid cross-site
 // scripting. The device renews the cookie if you keep using it.
-const uint8_t cookie_end[] =
+static const char cookie_end[] =
 "; Secure; SameSite=Strict; Max-Age=2592000; Partitioned;";
 
-// This buffer gets used for two different things in write_cookie(), to save stack
-// on the very memory-constrained ESP-32.
-union CookiePayload {
-  // Struct payload contains compact JSON, with a header.
-  struct Payload {
-    struct Header {
-      // This checksum is used to verify that we have decrypted the payload
-      // data successfully, and to prevent bit-manipulation of the
-      // cookie as a means of breaking our encryption.
-      uint32_t crc32;
-
-      // Cookie encryption always uses the same AES initialization vector,
-      // so that we don't have to send the IV as a separate cookie.
-      // Thus, we _must_ include randomness in the payload so that the
-      // encrypted output is not the same every time for the same JSON input,
-      // which would provide information for breaking our encryption.
-      uint32_t random;
-    } header;
-
-    char data[roundup(PAYLOAD_SIZE + sizeof(struct Header), 16)];
-  } payload;
-
-  // Struct Cookie contains the Set-Cookie datum.
-  struct Cookie {
-    // This contains cookie_start[] without the terminating null.
-    uint8_t start[sizeof(cookie_start) - 1];
-
-    // This contains the base64-encoded encrypted JSON data.
-    uint8_t data[
-     sizeof(struct Payload)
-     + (sizeof(struct Payload) / 3) + 3 // Account for Base64-encoding.
-     + sizeof(cookie_end)];
-  } cookie;
-
-  // Typed access to encrypt struct Payload.
-  uint8_t bytes[sizeof(struct Cookie)];
-
-  // Typed access to send struct Cookie as the Set-Cookie datum.
-  char characters[sizeof(struct Cookie)];
-};
+static const char base64url[] =
+ "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+
+// The GCM context holds state during an operation, so it must not be shared.
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Encode the binary data at the end of the buffer into Base64url at the start
+// of the same buffer, without padding. The binary data must start at
+// (size + 2) / 3 bytes from the start, so that each group of 3 bytes has been
+// read before it's overwritten by its 4 characters.
+static size_t
+base64url_encode_in_place(char * buffer, size_t size)
+{
+  const uint8_t * in = (const uint8_t *)&buffer[(size + 2) / 3];
+  char *	out = buffer;
+
+  while ( size >= 3 ) {
+    const uint32_t v = (in[0] << 16) | (in[1] << 8) | in[2];
+    in += 3;
+    size -= 3;
+    *out++ = base64url[(v >> 18) & 0x3f];
+    *out++ = base64url[(v >> 12) & 0x3f];
+    *out++ = base64url[(v >> 6) & 0x3f];
+    *out++ = base64url[v & 0x3f];
+  }
+  if ( size > 0 ) {
+    const uint32_t v = (in[0] << 16) | (size > 1 ? in[1] << 8 : 0);
+    *out++ = base64url[(v >> 18) & 0x3f];
+    *out++ = base64url[(v >> 12) & 0x3f];
+    if ( size > 1 )
+      *out++ = base64url[(v >> 6) & 0x3f];
+  }
+  return out - buffer;
+}
 
-cJSON *
-gm_read_cookie(httpd_req_t * req)
+// Decode Base64url in place. The output is never longer than the input read
+// so far, so it doesn't overwrite unread input. Returns the decoded size, or
+// -1 if the input isn't Base64url.
+static int
+base64url_decode_in_place(char * buffer, size_t length)
 {
-  union CookiePayload b;
-  char a[sizeof(b.characters)];
-  size_t data_length = sizeof(a);
-  
-  esp_err_t cookie_err = httpd_req_get_cookie_val(req, "c", (char *)a, &data_length);
-
-  // The most likely error here is simply that the current request did not
-  // contain our session data cookie.
-  if ( cookie_err == ESP_ERR_NOT_FOUND )
-    return 0; // Fail quietly.
-  else if ( cookie_err != ESP_OK ) {
-    gm_printf("Cookie error: %s.\n", esp_err_to_name(cookie_err));
-    return 0;
+  uint8_t *	out = (uint8_t *)buffer;
+  uint32_t	v = 0;
+  int		bits = 0;
+
+  for ( size_t i = 0; i < length; i++ ) {
+    const char	c = buffer[i];
+    int		d;
+
+    if ( c >= 'A' && c <= 'Z' )
+      d = c - 'A';
+    else if ( c >= 'a' && c <= 'z' )
+      d = c - 'a' + 26;
+    else if ( c >= '0' && c <= '9' )
+      d = c - '0' + 52;
+    else if ( c == '-' )
+      d = 62;
+    else if ( c == '_' )
+      d = 63;
+    else
+      return -1;
+
+    v = (v << 6) | d;
+    bits += 6;
+    if ( bits >= 8 ) {
+      bits -= 8;
+      *out++ = (v >> bits) & 0xff;
+    }
   }
+  return out - (uint8_t *)buffer;
+}
+
+static size_t
+put_record(uint8_t * r, size_t offset, enum record_type type, const void * value, size_t length)
+{
+  if ( offset + 2 + length > RECORDS_SIZE || length > 255 )
+    return offset;
+
+  r[offset++] = type;
+  r[offset++] = length;
+  memcpy(&r[offset], value, length);
+  return offset + length;
+}
 
-  // Decode from Base-64 and get the encrypted payload.
-  size_t length = 0;
-  uint8_t * const unbased = base64_decode(a, data_length, &length);
-  memcpy(a, unbased, length);
-  a[length] = '\0';
-  free(unbased);
+// Decode the value of our cookie. The value is overwritten, the caller
+// provides it in a buffer that it doesn't need again.
+bool
+gm_decode_cookie(char * value, size_t length, gm_cookie_t * cookie)
+{
+  uint8_t	records[RECORDS_SIZE];
+  const int	size = base64url_decode_in_place(value, length);
+  const uint8_t * const b = (const uint8_t *)value;
+
+  memset(cookie, 0, sizeof(*cookie));
 
-  if ( length % 16 > 0 ) {
-    gm_printf("Cookie payload length %d is not a multiple of 16.\n", length);
-    return 0;
+  if ( size < 1 + NONCE_SIZE + TAG_SIZE || size > BINARY_SIZE ) {
+    gm_printf("Cookie size %d is incorrect.\n", size);
+    return false;
+  }
+  if ( b[0] != COOKIE_VERSION ) {
+    // Old cookies are simply replaced at the next login.
+    return false;
   }
 
-  // AES modifies the IV so that you can use it to stream. So, make a temporary
-  // copy.
-  uint8_t iv[sizeof(GM.aes_cookie_iv)];
-  memcpy(iv, GM.aes_cookie_iv, sizeof(iv));
-  
-  // Decrypt the payload.
-  (void) esp_aes_crypt_cbc(
-   &GM.aes_cookie_context,
-   ESP_AES_DECRYPT,
-   length,
-   iv,
-   (uint8_t *)a,
-   b.bytes);
-
-  // Check that the calculated CRC for the data matches the one in the cookie.
-  const uint32_t crc32 = esp_rom_crc32_le(
-   0,
-   (uint8_t *)&b.payload.header.random, length - sizeof(b.payload.header.crc32));
-
-  if ( b.payload.header.crc32 != crc32 ) {
-    gm_printf("Cookie CRC doesn't match.\n");
-    return 0;
+  const size_t records_size = size - (1 + NONCE_SIZE + TAG_SIZE);
+
+  pthread_mutex_lock(&lock);
+  const int err = mbedtls_gcm_auth_decrypt(
+   &GM.cookie_gcm,
+   records_size,
+   &b[1],
+   NONCE_SIZE,
+   b,
+   1,
+   &b[1 + NONCE_SIZE + records_size],
+   TAG_SIZE,
+   &b[1 + NONCE_SIZE],
+   records);
+  pthread_mutex_unlock(&lock);
+
+  if ( err != 0 ) {
+    gm_printf("Cookie authentication failed.\n");
+    return false;
   }
-  
-  // Parse the payload.
-  cJSON * volatile json = cJSON_ParseWithLength(
-   b.payload.data,
-   length - sizeof(b.payload.header));
-
-  if ( json == NULL ) {
-    gm_printf("Cookie JSON parse failed.\n");
-    return 0;
+
+  for ( size_t i = 0; i + 2 <= records_size; ) {
+    const uint8_t	type = records[i];
+    const uint8_t	l = records[i + 1];
+    const uint8_t *	v = &records[i + 2];
+
+    if ( i + 2 + l > records_size )
+      return false;
+
+    switch ( type ) {
+    case NAME:
+      if ( l >= sizeof(cookie->user_name) )
+        return false;
+      memcpy(cookie->user_name, v, l);
+      cookie->user_name[l] = '\0';
+      break;
+    case ISSUED:
+      if ( l != sizeof(cookie->issued) )
+        return false;
+      cookie->issued = v[0] | (v[1] << 8) | (v[2] << 16) | ((uint32_t)v[3] << 24);
+      break;
+    }
+    i += 2 + l;
   }
 
-  return json;
+  // An issue time from an unset clock is unknown rather than expired.
+  if ( cookie->issued < EARLIEST_ISSUED )
+    cookie->issued = 0;
+
+  // Only trust the clock if it has been set.
+  if ( cookie->issued != 0 && GM.time_last_synchronized != 0 ) {
+    const time_t now = gm_clock_time();
+    if ( now > (time_t)cookie->issued + MAXIMUM_AGE ) {
+      memset(cookie, 0, sizeof(*cookie));
+      return false;
+    }
+  }
+  return true;
 }
 
+// Set the cookie in the response. If the issue time is zero, it's stamped
+// with the current time. Nothing is sent until the clock has been set, as a
+// cookie stamped in 1970 would expire as soon as it was.
 void
-gm_write_cookie(httpd_req_t * const req, cJSON * const json)
+gm_write_cookie(httpd_req_t * const req, const gm_cookie_t * const cookie)
 {
-  // Allow for a 1024 bytes of compact JSON. This effects the necessary httpd
-  // header size, and the httpsd stack size.
-  // The http to https redirector doesn't use cookies, and these cookies are only
-  // sent to https connections.
-  // The + 8 is to account for the size of the header in struct Payload.
-  uint8_t a[PAYLOAD_SIZE + sizeof(struct Header)];
-  union CookiePayload b;
-
-  if ( cJSON_PrintPreallocated(
-   json,
-   b.payload.data,
-   sizeof(b.payload.data),
-   0) == 0 ) {
-    ESP_LOGE(tag, "JSON context too large for buffer.\n");
-    sleep(1);
-    abort();
+  uint8_t	records[RECORDS_SIZE];
+  size_t	records_size = 0;
+  uint8_t	issued[4];
+
+  if ( GM.time_last_synchronized == 0 )
+    return;
+
+  // The Set-Cookie header is sent after this returns, so it's kept in the
+  // session context rather than on the stack.
+  if ( gm_session(req) != ESP_OK )
+    return;
+  gm_session_context_t * const s = req->sess_ctx;
+  char * const set_cookie = s->set_cookie;
+
+  const uint32_t t = cookie->issued ? cookie->issued : (uint32_t)gm_clock_time();
+  issued[0] = t & 0xff;
+  issued[1] = (t >> 8) & 0xff;
+  issued[2] = (t >> 16) & 0xff;
+  issued[3] = (t >> 24) & 0xff;
+
+  records_size = put_record(records, records_size, NAME, cookie->user_name, strnlen(cookie->user_name, sizeof(cookie->user_name) - 1));
+  records_size = put_record(records, records_size, ISSUED, issued, sizeof(issued));
+
+  const size_t size = 1 + NONCE_SIZE + records_size + TAG_SIZE;
+  // Build the binary cookie where the encoder wants to find it: after the
+  // "c=", and far enough in that encoding doesn't overwrite unread data.
+  char * const	encoded = &set_cookie[sizeof(cookie_start) - 1];
+  uint8_t * const b = (uint8_t *)&encoded[(size + 2) / 3];
+
+  b[0] = COOKIE_VERSION;
+  esp_fill_random(&b[1], NONCE_SIZE);
+
+  pthread_mutex_lock(&lock);
+  const int err = mbedtls_gcm_crypt_and_tag(
+   &GM.cookie_gcm,
+   MBEDTLS_GCM_ENCRYPT,
+   records_size,
+   &b[1],
+   NONCE_SIZE,
+   b,
+   1,
+   records,
+   &b[1 + NONCE_SIZE],
+   TAG_SIZE,
+   &b[1 + NONCE_SIZE + records_size]);
+  pthread_mutex_unlock(&lock);
+
+  if ( err != 0 ) {
+    ESP_LOGE(tag, "Cookie encryption failed: %d.", err);
+    return;
   }
 
-  const size_t length = strlen((const char *)b.payload.data);
-
-  // Because we always use the same initialization vector for AES,
-  // add randomness to make the plaintext unpredictable. This avoids
-  // having to send the initialization vector in another cookie.
-  esp_fill_random(&b.payload.header.random, sizeof(b.payload.header.random));
-
-
-  // Calculate padding, because AES will only process data of a size that
-  // is a multiple of 16.
-  const size_t padding = roundup(length + sizeof(b.payload.header), 16)
-   - (length + sizeof(b.payload.header));
-  memset(&b.payload.data[length], 0, padding);
-
-  // Add a 32-bit checksum to the encrypted content, to defeat bit manipulation
-  // and to verify successful decryption. We checksum the padding because when
-  // we decrypt the payload, it includes the padding and it's difficult to figure
-  // out the length of the padding in the read function without a size field.
-  b.payload.header.crc32 = esp_rom_crc32_le(
-   0,
-   (uint8_t *)&b.payload.header.random,
-   sizeof(b.payload.header.random) + length + padding);
-
-  // AES modifies the IV so that you can use it to stream. So, make a temporary
-  // copy.
-  uint8_t iv[sizeof(GM.aes_cookie_iv)];
-  memcpy(iv, GM.aes_cookie_iv, sizeof(iv));
-
-  // Encrypt the payload.
-  (void) esp_aes_crypt_cbc(
-   &GM.aes_cookie_context,
-   ESP_AES_ENCRYPT,
-   length + sizeof(b.payload.header) + padding,
-   iv,
-   b.bytes,
-   a);
-
-  // Base-64-encode the encrypted payload, because the Set-Cookie datum can't
-  // contain binary data or characters important to the parse like space or
-  // semicolon.
-  size_t base64_length = 0;
-  char * const encoded = base64_encode(
-   a,
-   sizeof(b.payload.header) + length + padding,
-   &base64_length);
-
-  // Construct the Set-Cookie datum.
-  memcpy(b.cookie.start, cookie_start, sizeof(b.cookie.start));
-  // base64_encode adds a newline character, don't include it.
-  base64_length--;
-  memcpy(b.cookie.data, encoded, base64_length);
-  free(encoded);
+  memcpy(set_cookie, cookie_start, sizeof(cookie_start) - 1);
+  const size_t length = base64url_encode_in_place(encoded, size);
   // This includes null-termination.
-  memcpy(&b.cookie.data[base64_length], cookie_end, sizeof(cookie_end));
-
-  httpd_resp_set_hdr(req, "Set-Cookie", b.characters);
-}
+  memcpy(&encoded[length], cookie_end, sizeof(cookie_end));
 
-void
-cookie_test()
-{
+  httpd_resp_set_hdr(req, "Set-Cookie", set_cookie);
 }
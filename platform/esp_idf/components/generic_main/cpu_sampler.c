@@ -0,0 +1,271 @@
+// CPU sampler.
+//
+// Every second, take the run time of each task from uxTaskGetSystemState(),
+// and keep how much of a core each one used since the last sample. The
+// previous run times are found by task handle in a small hash table, so a
+// sample is O(n) in the number of tasks. All of the memory is allocated when
+// the sampler starts.
+//
+// A ring keeps the last HISTORY_SAMPLES samples, each with the busy share of
+// every core and the busiest tasks, so that a spike can be lined up with what
+// else was logged at the time. "tasks --cpu" shows the tasks like top, and
+// "tasks --history" and GET /cpu show the history.
+//
+// Shares are in per mille of one core, so a task that keeps a core busy is at
+// 1000, and the busy share of a core is 1000 less that of its idle task.
+#include <string.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <esp_timer.h>
+#include "generic_main.h"
+
+#define SAMPLE_INTERVAL_MS	1000
+#define HISTORY_SAMPLES		300
+#define MAXIMUM_TASKS		40
+// A power of two, at least twice MAXIMUM_TASKS, so that probes are short.
+#define HASH_SIZE		128
+// The average is over about this many samples.
+#define AVERAGE_SAMPLES		10
+
+_Static_assert(portNUM_PROCESSORS <= GM_CPU_MAXIMUM_CORES, "Raise GM_CPU_MAXIMUM_CORES.");
+
+// What is known about a task by its handle, from the last sample.
+typedef struct _entry {
+  TaskHandle_t	handle;
+  uint32_t	run_time;
+  uint8_t	task;
+} entry_t;
+
+static pthread_mutex_t		lock = PTHREAD_MUTEX_INITIALIZER;
+static esp_timer_handle_t	timer = NULL;
+static TaskStatus_t *		status = NULL;
+static entry_t *		previous = NULL;
+static entry_t *		current = NULL;
+static gm_cpu_sample_t *	history = NULL;
+static gm_cpu_task_t		tasks[GM_CPU_MAXIMUM_TASKS];
+// The averages, in 1/256 per mille, so that small shares register.
+static uint32_t			averages[GM_CPU_MAXIMUM_TASKS];
+static size_t			number_of_tasks = 0;
+static uint32_t			next_sample = 0;
+static uint32_t			last_total = 0;
+static bool			primed = false;
+
+static size_t
+hash(TaskHandle_t handle)
+{
+  const uintptr_t h = (uintptr_t)handle;
+
+  return ((h >> 2) ^ (h >> 9)) & (HASH_SIZE - 1);
+}
+
+static entry_t *
+find(entry_t * table, TaskHandle_t handle)
+{
+  for ( size_t i = hash(handle); ; i = (i + 1) & (HASH_SIZE - 1) ) {
+    if ( table[i].handle == handle || table[i].handle == NULL )
+      return &table[i];
+  }
+}
+
+// The task with a name, by which it's known in the history. A task that is
+// deleted and made again with the same name is the same task. Called with
+// the lock held.
+static uint8_t
+task_named(const char * name, int core)
+{
+  for ( size_t i = 0; i < number_of_tasks; i++ ) {
+    if ( strncmp(tasks[i].name, name, sizeof(tasks[i].name)) == 0 )
+      return i;
+  }
+  if ( number_of_tasks >= GM_CPU_MAXIMUM_TASKS ) {
+    GM_WARN_ONCE("CPU sampler: More than %d task names, the rest are not kept.\n", GM_CPU_MAXIMUM_TASKS);
+    return GM_CPU_NO_TASK;
+  }
+  gm_cpu_task_t * const t = &tasks[number_of_tasks];
+
+  strncpy(t->name, name, sizeof(t->name) - 1);
+  t->core = core;
+  return number_of_tasks++;
+}
+
+// Put a task's share into the busiest ones of a sample, in order.
+static void
+add_top(gm_cpu_sample_t * s, uint8_t task, uint16_t share)
+{
+  for ( size_t i = 0; i < GM_CPU_TOP; i++ ) {
+    if ( s->top[i].task == GM_CPU_NO_TASK || share > s->top[i].share ) {
+      memmove(&s->top[i + 1], &s->top[i], (GM_CPU_TOP - 1 - i) * sizeof(s->top[0]));
+      s->top[i].task = task;
+      s->top[i].share = share;
+      return;
+    }
+  }
+}
+
+static void
+take_sample(void * data)
+{
+  uint32_t		total;
+  const UBaseType_t	n = uxTaskGetSystemState(status, MAXIMUM_TASKS, &total);
+  gm_cpu_sample_t *	s = NULL;
+  entry_t *		swap;
+  uint32_t		elapsed;
+
+  if ( n == 0 ) {
+    GM_WARN_ONCE("CPU sampler: More than %d tasks, not sampling.\n", MAXIMUM_TASKS);
+    return;
+  }
+
+  pthread_mutex_lock(&lock);
+  elapsed = total - last_total;
+  last_total = total;
+  memset(current, 0, HASH_SIZE * sizeof(*current));
+
+  // The first sample only has run times to start from.
+  if ( primed ) {
+    s = &history[next_sample % HISTORY_SAMPLES];
+    memset(s, 0, sizeof(*s));
+    s->sequence = next_sample++;
+    s->time_ms = esp_timer_get_time() / 1000;
+    for ( size_t i = 0; i < GM_CPU_TOP; i++ )
+      s->top[i].task = GM_CPU_NO_TASK;
+    for ( size_t core = 0; core < portNUM_PROCESSORS; core++ )
+      s->busy[core] = 1000;
+    for ( size_t i = 0; i < number_of_tasks; i++ )
+      tasks[i].live = false;
+  }
+
+  for ( UBaseType_t i = 0; i < n; i++ ) {
+    const TaskStatus_t * const	t = &status[i];
+    const entry_t * const	was = find(previous, t->xHandle);
+    entry_t * const		e = find(current, t->xHandle);
+    const int			core = t->xCoreID < portNUM_PROCESSORS ? (int)t->xCoreID : -1;
+    // A deleted task's handle may be reused by a new one.
+    const bool			same = was->handle != NULL
+     && (was->task == GM_CPU_NO_TASK || strncmp(tasks[was->task].name, t->pcTaskName, sizeof(tasks[0].name) - 1) == 0);
+    uint32_t			used = 0;
+    uint16_t			share = 0;
+
+    e->handle = t->xHandle;
+    e->run_time = t->ulRunTimeCounter;
+    e->task = same ? was->task : task_named(t->pcTaskName, core);
+
+    if ( s == NULL || e->task == GM_CPU_NO_TASK )
+      continue;
+
+    // A task that is new since the last sample has no share yet.
+    if ( same && elapsed > 0 ) {
+      used = t->ulRunTimeCounter - was->run_time;
+      share = (uint64_t)used * 1000 / elapsed > 1000 ? 1000 : (uint64_t)used * 1000 / elapsed;
+    }
+
+    gm_cpu_task_t * const task = &tasks[e->task];
+
+    task->live = true;
+    task->core = core;
+    task->share = share;
+    averages[e->task] = averages[e->task] - averages[e->task] / AVERAGE_SAMPLES + share * 256 / AVERAGE_SAMPLES;
+    task->average = averages[e->task] / 256;
+    if ( share > task->peak )
+      task->peak = share;
+    task->run_time_us += used;
+
+    if ( core >= 0 && t->xHandle == xTaskGetIdleTaskHandleForCore(core) )
+      s->busy[core] = 1000 - share;
+    else
+      add_top(s, e->task, share);
+  }
+
+  swap = previous;
+  previous = current;
+  current = swap;
+  primed = true;
+  pthread_mutex_unlock(&lock);
+}
+
+static void
+timer_expired(void * data)
+{
+  gm_run(take_sample, NULL, GM_SLOW);
+}
+
+// Start the sampler. It takes the GM_SLOW job runner.
+void
+gm_cpu_sampler_start(void)
+{
+  status = gm_calloc(GM_MEMORY_CPU, MAXIMUM_TASKS, sizeof(*status));
+  previous = gm_calloc(GM_MEMORY_CPU, HASH_SIZE, sizeof(*previous));
+  current = gm_calloc(GM_MEMORY_CPU, HASH_SIZE, sizeof(*current));
+  history = gm_calloc(GM_MEMORY_CPU, HISTORY_SAMPLES, sizeof(*history));
+  if ( status == NULL || previous == NULL || current == NULL || history == NULL ) {
+    GM_WARN_ONCE("CPU sampler: Not enough memory.\n");
+    return;
+  }
+
+  const esp_timer_create_args_t timer_args = {
+    .callback = timer_expired,
+    .name = "cpu sampler"
+  };
+  ESP_ERROR_CHECK(esp_timer_create(&timer_args, &timer));
+  ESP_ERROR_CHECK(esp_timer_start_periodic(timer, SAMPLE_INTERVAL_MS * 1000LL));
+}
+
+// Copy the tasks that have been seen, live or not, busiest first. Returns the
+// number copied.
+size_t
+gm_cpu_tasks(gm_cpu_task_t * copy, size_t size)
+{
+  size_t n;
+
+  pthread_mutex_lock(&lock);
+  n = number_of_tasks < size ? number_of_tasks : size;
+  memcpy(copy, tasks, n * sizeof(*copy));
+  pthread_mutex_unlock(&lock);
+
+  // Insertion sort, there are a few dozen at most.
+  for ( size_t i = 1; i < n; i++ ) {
+    const gm_cpu_task_t t = copy[i];
+    size_t j = i;
+
+    for ( ; j > 0 && copy[j - 1].average < t.average; j-- )
+      copy[j] = copy[j - 1];
+    copy[j] = t;
+  }
+  return n;
+}
+
+// The name of a task in a sample's top list, or NULL if there is no such
+// task.
+const char *
+gm_cpu_task_name(unsigned int task)
+{
+  // A name, once added, doesn't change, so this needs no lock.
+  return task < number_of_tasks ? tasks[task].name : NULL;
+}
+
+// Visit the samples made at or after a time, in milliseconds since boot,
+// oldest first. Each is copied, so the visitor runs without the lock.
+void
+gm_cpu_history(uint32_t since_ms, gm_cpu_visitor_t visitor, void * context)
+{
+  uint32_t sequence = 0;
+
+  for ( ; ; ) {
+    gm_cpu_sample_t s;
+
+    pthread_mutex_lock(&lock);
+    if ( history == NULL || sequence >= next_sample ) {
+      pthread_mutex_unlock(&lock);
+      return;
+    }
+    // Skip what the ring has overwritten.
+    if ( next_sample - sequence > HISTORY_SAMPLES )
+      sequence = next_sample - HISTORY_SAMPLES;
+    s = history[sequence % HISTORY_SAMPLES];
+    pthread_mutex_unlock(&lock);
+
+    sequence++;
+    if ( (int32_t)(s.time_ms - since_ms) >= 0 )
+      visitor(&s, context);
+  }
+}
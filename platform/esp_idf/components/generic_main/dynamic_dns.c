@@ -17,6 +17,21 @@ struct param {
   const char * param_name;
 };
 
+typedef enum _ddns_result {
+  DDNS_OK,
+  DDNS_RETRY,
+  DDNS_REFUSED
+} ddns_result_t;
+
+// The addresses the provider was last given, kept across boots so that a
+// restart doesn't send an update that changes nothing. Providers ban clients
+// that send too many of those.
+typedef struct _ddns_published {
+  uint32_t		settings_hash;
+  struct in_addr	ipv4;
+  struct in6_addr	ipv6;
+} ddns_published;
+
 struct ddns_provider {
   const char * name;
   const char * url;
@@ -40,15 +55,33 @@ static const struct ddns_provider ddns_providers[] = {
   { 0, 0, 0 }
 };
 
+#define NVS_NAMESPACE		"ddns"
+#define NVS_KEY			"published"
+#define MINIMUM_BACKOFF_S	60
+#define MAXIMUM_BACKOFF_S	(6 * 60 * 60)
+
+static pthread_mutex_t		lock = PTHREAD_MUTEX_INITIALIZER;
+static ddns_published		published;
+static bool			loaded = false;
+static uint32_t			backoff_s[2];	// Indexed by ipv6.
+static esp_timer_handle_t	retry_timers[2];
+// The address being published, for parameter(). Only used with the lock held.
+static union {
+  struct in_addr	ipv4;
+  struct in6_addr	ipv6;
+} sending;
+
+static int publish(bool ipv6, bool force);
+
 // Get a variable to substitute into the pattern string.
 static int parameter(const char * name,  char * buffer, size_t buffer_size)
 {
   if ( strcmp(name, "ipv4") == 0 ) {
-    inet_ntop(AF_INET, &GM.net_interfaces[GM_STA].ip4.router_public_ip.s_addr, buffer, buffer_size);
+    inet_ntop(AF_INET, &sending.ipv4, buffer, buffer_size);
     return 0;
   }
   else if ( strcmp(name, "ipv6") == 0 ) {
-    inet_ntop(AF_INET6, &GM.net_interfaces[GM_STA].ip6.router_public_ip.s6_addr, buffer, buffer_size);
+    inet_ntop(AF_INET6, &sending.ipv6, buffer, buffer_size);
     return 0;
   }
   else {
@@ -56,11 +89,12 @@ static int parameter(const char * name,  char * buffer, size_t buffer_size)
 
     while ( p->name ) {
       if ( strcmp(name, p->name) == 0 ) {
-        gm_nonvolatile_result_t result;
+        const char * const value = gm_nonvolatile_string(p->param_name);
 
-        result = gm_nonvolatile_get(p->param_name, buffer, buffer_size);
-        if ( result == GM_NORMAL || result == GM_SECRET )
+        if ( value ) {
+          strlcpy(buffer, value, buffer_size);
           return 0;
+        }
         else {
           GM_WARN_ONCE("Warning: Dynamic DNS parameter %s is required, and is not set.\n", p->param_name);
           return -1;
@@ -73,56 +107,213 @@ static int parameter(const char * name,  char * buffer, size_t buffer_size)
   return 0;
 }
 
-static int
-send_ddns(const char * url)
+// Send an update, and classify the response. The he.net response is
+// "good <address>" or "nochg <address>" on success, the other dyndns2-style
+// codes are all permanent failures except "911", a server problem.
+// This blocks, so it's called without the lock.
+static ddns_result_t
+send_ddns(const char * request)
 {
-  char request[256];
-  char response[256];
+  static const char * const refusals[] = {
+    "badauth", "nohost", "notfqdn", "abuse", "badagent", "!donator", 0
+  };
+  char response[256] = "";
 
-  gm_pattern_string(url, parameter, request, sizeof(request));
   int status = gm_web_get(request, response, sizeof(response));
-  if (status == 200) {
-    ; // gm_printf("\nDynamic DNS succeeded: %s.\n", response);
-    fflush(stderr);
-    return 0;
+  if ( status == 200 && (strncmp(response, "good", 4) == 0 || strncmp(response, "nochg", 5) == 0) )
+    return DDNS_OK;
+
+  if ( status == 401 || status == 403 ) {
+    GM_FAIL("Dynamic DNS refused the update: HTTP status %d.", status);
+    return DDNS_REFUSED;
   }
-  else {
-    ; // gm_printf("Dynamic DNS failed: %d %s\n", status, response);
-    return -1;
+  for ( const char * const * r = refusals; *r; r++ ) {
+    if ( strncmp(response, *r, strlen(*r)) == 0 ) {
+      GM_FAIL("Dynamic DNS refused the update: %s", response);
+      return DDNS_REFUSED;
+    }
   }
+  return DDNS_RETRY;
 }
 
-int gm_ddns(void)
+// FNV-1a of the settings, so that changing them publishes again.
+static uint32_t
+settings_hash(void)
+{
+  uint32_t h = 2166136261;
+
+  for ( const struct param * p = params; p->name; p++ ) {
+    const char * const value = gm_nonvolatile_string(p->param_name);
+
+    for ( const char * c = value ? value : ""; *c; c++ )
+      h = (h ^ (uint8_t)*c) * 16777619;
+    h = (h ^ 0xff) * 16777619;
+  }
+  return h;
+}
+
+// Call with the lock held.
+static void
+load(void)
+{
+  nvs_handle_t	nvs;
+  size_t	size = sizeof(published);
+
+  if ( loaded )
+    return;
+  loaded = true;
+
+  if ( nvs_open(NVS_NAMESPACE, NVS_READONLY, &nvs) == ESP_OK ) {
+    if ( nvs_get_blob(nvs, NVS_KEY, &published, &size) != ESP_OK || size != sizeof(published) )
+      memset(&published, 0, sizeof(published));
+    nvs_close(nvs);
+  }
+}
+
+// Call with the lock held.
+static void
+save(void)
+{
+  nvs_handle_t	nvs;
+  esp_err_t	err;
+
+  if ( (err = nvs_open(NVS_NAMESPACE, NVS_READWRITE, &nvs)) != ESP_OK ) {
+    gm_flash_failure(NVS_NAMESPACE, err);
+    return;
+  }
+  if ( (err = nvs_set_blob(nvs, NVS_KEY, &published, sizeof(published))) == ESP_OK )
+    err = nvs_commit(nvs);
+  nvs_close(nvs);
+  if ( err != ESP_OK )
+    gm_flash_failure(NVS_NAMESPACE, err);
+}
+
+static void
+retry(void * data)
+{
+  (void) publish((bool)(intptr_t)data, false);
+}
+
+static void
+retry_timer_expired(void * data)
+{
+  gm_run(retry, data, GM_SLOW);
+}
+
+// Publish the public address of a family, if the provider doesn't already
+// have it. This blocks, so it's run in the GM_SLOW task or from the console.
+// The address is copied and the request made with the lock held, and the lock
+// is released while the provider is asked, so that a slow provider doesn't
+// hold up the other family or the ddns command.
+static int
+publish(bool ipv6, bool force)
 {
-  char ddns_provider[64];
-  const struct ddns_provider * p = ddns_providers;
-  gm_nonvolatile_result_t result;
-
-  result = gm_nonvolatile_get("ddns_provider", ddns_provider, sizeof(ddns_provider));
-  
-  switch ( result ) {
-  case GM_NOT_SET:
+  const char * const		ddns_provider = gm_nonvolatile_string("ddns_provider");
+  const struct ddns_provider *	p = ddns_providers;
+  const gm_netif_t * const	i = &GM.net_interfaces[GM_STA];
+  const void * const		current = ipv6 ? (const void *)&i->ip6.router_public_ip : (const void *)&i->ip4.router_public_ip;
+  void * const			last = ipv6 ? (void *)&published.ipv6 : (void *)&published.ipv4;
+  const size_t			size = ipv6 ? sizeof(published.ipv6) : sizeof(published.ipv4);
+  const char *			url;
+  char				request[256];
+  uint8_t			address[sizeof(struct in6_addr)];
+  ddns_result_t			status;
+  int				result = 0;
+
+  if ( ddns_provider == NULL ) {
     GM_WARN_ONCE("Warning: Dynamic DNS provider not set.\n");
     return -1;
-  case GM_NORMAL:
-  case GM_SECRET:
-    break;
-  default:
-    GM_WARN_ONCE("Error reading ddns_provider parameter.\n");
+  }
+  while ( p->name && strcmp(p->name, ddns_provider) != 0 )
+    p++;
+  if ( p->name == NULL ) {
+    GM_WARN_ONCE("Dynamic DNS provider %s is not implemented.\n", ddns_provider);
     return -1;
   }
+  url = (ipv6 && p->url_ipv6) ? p->url_ipv6 : p->url;
 
+  pthread_mutex_lock(&lock);
+  memcpy(address, current, size);
+  if ( gm_all_zeroes(address, size) ) {
+    pthread_mutex_unlock(&lock);
+    return -1;
+  }
+  load();
+  const uint32_t hash = settings_hash();
+  if ( published.settings_hash != hash ) {
+    memset(&published, 0, sizeof(published));
+    published.settings_hash = hash;
+  }
 
-  while ( p->name ) {
-    if ( strcmp(p->name, ddns_provider) == 0 ) {
-      send_ddns(p->url);
-      if (p->url_ipv6 && !gm_all_zeroes(&GM.net_interfaces[GM_STA].ip6.router_public_ip.s6_addr, sizeof(GM.net_interfaces[GM_STA].ip6.router_public_ip.s6_addr))) {
-        send_ddns(p->url_ipv6);
-      }
-      return 0;
+  if ( !force && memcmp(last, address, size) == 0 ) {
+    pthread_mutex_unlock(&lock);
+    return 0;
+  }
+  memcpy(&sending, address, size);
+  gm_pattern_string(url, parameter, request, sizeof(request));
+  pthread_mutex_unlock(&lock);
+
+  status = send_ddns(request);
+
+  pthread_mutex_lock(&lock);
+  switch ( status ) {
+  case DDNS_OK:
+    memcpy(last, address, size);
+    save();
+    backoff_s[ipv6] = 0;
+    break;
+  case DDNS_REFUSED:
+    // Retrying would only get the account banned. Wait for the address or
+    // the settings to change, or for the ddns command.
+    backoff_s[ipv6] = 0;
+    result = -1;
+    break;
+  case DDNS_RETRY:
+    if ( backoff_s[ipv6] == 0 )
+      backoff_s[ipv6] = MINIMUM_BACKOFF_S;
+    else if ( backoff_s[ipv6] < MAXIMUM_BACKOFF_S / 2 )
+      backoff_s[ipv6] *= 2;
+    else
+      backoff_s[ipv6] = MAXIMUM_BACKOFF_S;
+    gm_printf("Dynamic DNS update failed, trying again in %lu seconds.\n", (unsigned long)backoff_s[ipv6]);
+    if ( retry_timers[ipv6] == NULL ) {
+      const esp_timer_create_args_t timer_args = {
+        .callback = retry_timer_expired,
+        .arg = (void *)(intptr_t)ipv6,
+        .name = "DDNS"
+      };
+      ESP_ERROR_CHECK(esp_timer_create(&timer_args, &retry_timers[ipv6]));
     }
-    p++;
+    esp_timer_stop(retry_timers[ipv6]);
+    esp_timer_start_once(retry_timers[ipv6], backoff_s[ipv6] * 1000000ULL);
+    result = -1;
+    break;
   }
-  GM_WARN_ONCE("Dynamic DNS provider %s is not implemented.\n", ddns_provider);
-  return -1;
+  pthread_mutex_unlock(&lock);
+  return result;
+}
+
+// A public address changed, in the GM_SLOW task.
+static void
+address_changed(bool ipv6, const struct sockaddr_storage * address, gm_reachability_source_t source)
+{
+  if ( gm_nonvolatile_string("ddns_provider") != NULL )
+    (void) publish(ipv6, false);
+}
+
+// Publish the current addresses whether or not they have changed.
+int gm_ddns(void)
+{
+  int result = publish(false, true);
+
+  if ( !gm_all_zeroes(&GM.net_interfaces[GM_STA].ip6.router_public_ip.s6_addr, sizeof(GM.net_interfaces[GM_STA].ip6.router_public_ip.s6_addr)) )
+    (void) publish(true, true);
+  return result;
+}
+
+// Publish the public addresses when they change. Call once.
+void
+gm_ddns_start(void)
+{
+  gm_reachability_subscribe(address_changed);
 }
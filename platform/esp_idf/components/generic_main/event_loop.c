@@ -2,6 +2,7 @@
 #include <string.h>
 #include <esp_event.h>
 #include "generic_main.h"
+#include "gm_trace.h"
 
 // FIX: Use only one event loop, we've not put any long-running jobs or any need
 // for priority in here.
@@ -27,7 +28,9 @@ handle_run_event(void * handler_arg, esp_event_base_t base, int32_t id, void * e
 {
   gm_run_data_t * run = (gm_run_data_t *)event_data;
 
+  GM_TRACE_BEGIN("gm_run job");
   (run->procedure)(run->data);
+  GM_TRACE_END("gm_run job");
 }
 
 void
@@ -39,7 +42,7 @@ gm_start_user_event_loops(void)
   esp_event_handler_instance_t	medium_run_handler;
 
   create_user_event_loop(&GM.medium_event_loop, "generic main: medium-speed job runner", 0);
-  esp_event_handler_instance_register_with(&GM.medium_event_loop, GM_EVENT, GM_RUN, handle_run_event, 0, &medium_run_handler);
+  esp_event_handler_instance_register_with(GM.medium_event_loop, GM_EVENT, GM_RUN, handle_run_event, 0, &medium_run_handler);
   create_user_event_loop(&GM.slow_event_loop, "generic main: slow job runner", 1);
-  esp_event_handler_instance_register_with(&GM.slow_event_loop, GM_EVENT, GM_RUN, handle_run_event, 0, &slow_run_handler);
+  esp_event_handler_instance_register_with(GM.slow_event_loop, GM_EVENT, GM_RUN, handle_run_event, 0, &slow_run_handler);
 }
@@ -5,6 +5,7 @@
 #include <sys/socket.h>
 #include <sys/un.h>
 #include "generic_main.h"
+#include "gm_trace.h"
 
 // These are events that are delivered via gm_fd_register(), which is the
 // interface to a select() loop. gm_select_task() depends on this to
@@ -74,7 +75,9 @@ event_handler(int fd, void * data, bool readable, bool writable, bool exception,
     // If we get here, the select has already awakened, there's no need to do any more.
     break;
   case GM_EVENT_RUN:
+    GM_TRACE_BEGIN("gm_run fast");
     (event->data.run.procedure)(event->data.run.data);
+    GM_TRACE_END("gm_run fast");
     break;
   }
 }
@@ -164,6 +167,9 @@ gm_run(gm_run_t procedure, void * data, gm_run_speed_t speed)
     abort();
   }
 
+  // The time between this and the job's span is how long it waited.
+  GM_TRACE_INSTANT("gm_run queued", speed);
+
   switch ( speed ) {
   case GM_FAST:
     event.operation = GM_EVENT_RUN;
@@ -176,12 +182,12 @@ gm_run(gm_run_t procedure, void * data, gm_run_speed_t speed)
   case GM_MEDIUM:
     run.procedure = procedure;
     run.data = data;
-    ESP_ERROR_CHECK(esp_event_post_to(&GM.medium_event_loop, GM_EVENT, GM_RUN, &run, sizeof(run), 0));
+    ESP_ERROR_CHECK(esp_event_post_to(GM.medium_event_loop, GM_EVENT, GM_RUN, &run, sizeof(run), 0));
     break;
   case GM_SLOW:
     run.procedure = procedure;
     run.data = data;
-    ESP_ERROR_CHECK(esp_event_post_to(&GM.slow_event_loop, GM_EVENT, GM_RUN, &run, sizeof(run), 0));
+    ESP_ERROR_CHECK(esp_event_post_to(GM.slow_event_loop, GM_EVENT, GM_RUN, &run, sizeof(run), 0));
     break;
   }
 }
@@ -0,0 +1,28 @@
+#include <esp_littlefs.h>
+#include "generic_main.h"
+
+// Mount the littlefs partition at GM_DATA_PATH, for data that changes too
+// often, or is too large, for NVS. It's formatted if it can't be mounted, as
+// it will be on a new device.
+void
+gm_filesystem_initialize(void)
+{
+  const esp_vfs_littlefs_conf_t conf = {
+    .base_path = GM_DATA_PATH,
+    .partition_label = GM_DATA_PARTITION,
+    .format_if_mount_failed = true,
+    .dont_mount = false
+  };
+  size_t total = 0;
+  size_t used = 0;
+
+  const esp_err_t err = esp_vfs_littlefs_register(&conf);
+  if ( err != ESP_OK ) {
+    gm_flash_failure("littlefs mount", err);
+    return;
+  }
+  GM.data_filesystem_mounted = true;
+
+  if ( esp_littlefs_info(conf.partition_label, &total, &used) == ESP_OK )
+    gm_printf("Data filesystem: %d of %d KB used.\n", (int)(used / 1024), (int)(total / 1024));
+}
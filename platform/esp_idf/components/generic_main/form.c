@@ -0,0 +1,450 @@
+// Form Reception
+//
+// Receive the body of a form post, application/x-www-form-urlencoded or
+// multipart/form-data, and decode it incrementally as it arrives from
+// httpd_req_recv(), in constant memory. Fields are delivered to a callback as
+// each one completes. Files of a multipart post are delivered to callbacks in
+// pieces, so that they can be streamed to their destination without being
+// held in memory, and can be of any size, as the web assets image is by
+// POST /assets.
+//
+// The multipart boundary is found with a Knuth-Morris-Pratt matcher. Bytes
+// that might be the start of a boundary are held back only as matcher state:
+// they are always a prefix of the delimiter, so when the match fails they are
+// released from the delimiter string itself rather than from a buffer.
+//
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <esp_http_server.h>
+#include "generic_main.h"
+
+#define RECEIVE_SIZE	512
+#define HEADER_SIZE	256
+// RFC 2046 limits the boundary to 70 characters. The delimiter adds CR LF - -
+#define DELIMITER_SIZE	(70 + 4)
+// Consecutive receive timeouts, of the server's recv_wait_timeout each, before
+// the form is abandoned.
+#define MAXIMUM_TIMEOUTS	3
+
+typedef enum _multipart_state {
+  PREAMBLE,
+  AFTER_DELIMITER,
+  HEADERS,
+  BODY,
+  EPILOGUE
+} multipart_state_t;
+
+typedef struct _form {
+  const gm_form_handlers_t *	handlers;
+  int				error;
+
+  // The name and value of the current field.
+  char				name[GM_FORM_NAME_SIZE];
+  size_t			name_length;
+  char				value[GM_FORM_VALUE_SIZE];
+  size_t			value_length;
+
+  // URL-encoded state.
+  bool				in_value;
+  uint8_t			percent;	// Digits of %xx seen, 0-2.
+  uint8_t			percent_value;
+
+  // Multipart state.
+  multipart_state_t		state;
+  char				delimiter[DELIMITER_SIZE + 1];
+  uint8_t			delimiter_length;
+  uint8_t			failure[DELIMITER_SIZE];
+  uint8_t			matched;
+  uint8_t			after_delimiter[2];
+  uint8_t			after_delimiter_length;
+  char				header[HEADER_SIZE];
+  size_t			header_length;
+  bool				is_file;
+} form_t;
+
+static void
+fail(form_t * f, const char * message)
+{
+  if ( f->error == 0 ) {
+    gm_printf("Form: %s\n", message);
+    f->error = -1;
+  }
+}
+
+static void
+emit_field(form_t * f)
+{
+  f->name[f->name_length] = '\0';
+  f->value[f->value_length] = '\0';
+  if ( f->handlers->field && f->name_length > 0 )
+    (*f->handlers->field)(f->name, f->value, f->handlers->context);
+  f->name_length = 0;
+  f->value_length = 0;
+}
+
+// URL-encoded forms.
+
+static int
+hex_digit(char c)
+{
+  if ( c >= '0' && c <= '9' )
+    return c - '0';
+  c = tolower((unsigned char)c);
+  if ( c >= 'a' && c <= 'f' )
+    return c - 'a' + 10;
+  return -1;
+}
+
+static void
+urlencoded_store(form_t * f, char c)
+{
+  if ( f->in_value ) {
+    if ( f->value_length >= sizeof(f->value) - 1 ) {
+      fail(f, "field value is too long.");
+      return;
+    }
+    f->value[f->value_length++] = c;
+  }
+  else {
+    if ( f->name_length >= sizeof(f->name) - 1 ) {
+      fail(f, "field name is too long.");
+      return;
+    }
+    f->name[f->name_length++] = c;
+  }
+}
+
+static void
+urlencoded(form_t * f, const char * data, size_t size)
+{
+  for ( size_t i = 0; i < size && f->error == 0; i++ ) {
+    const char c = data[i];
+
+    if ( f->percent > 0 ) {
+      const int d = hex_digit(c);
+      if ( d < 0 ) {
+        fail(f, "bad percent-encoding.");
+        return;
+      }
+      f->percent_value = (f->percent_value << 4) | d;
+      if ( ++f->percent > 2 ) {
+        f->percent = 0;
+        urlencoded_store(f, (char)f->percent_value);
+      }
+      continue;
+    }
+
+    switch ( c ) {
+    case '&':
+      emit_field(f);
+      f->in_value = false;
+      break;
+    case '=':
+      if ( !f->in_value ) {
+        f->in_value = true;
+        break;
+      }
+      urlencoded_store(f, c);
+      break;
+    case '+':
+      urlencoded_store(f, ' ');
+      break;
+    case '%':
+      f->percent = 1;
+      f->percent_value = 0;
+      break;
+    default:
+      urlencoded_store(f, c);
+    }
+  }
+}
+
+// Multipart forms.
+
+// Build the KMP failure table: failure[i] is the length of the longest proper
+// prefix of delimiter[0..i] that is also a suffix of it.
+static void
+build_failure_table(form_t * f)
+{
+  uint8_t k = 0;
+
+  f->failure[0] = 0;
+  for ( size_t i = 1; i < f->delimiter_length; i++ ) {
+    while ( k > 0 && f->delimiter[i] != f->delimiter[k] )
+      k = f->failure[k - 1];
+    if ( f->delimiter[i] == f->delimiter[k] )
+      k++;
+    f->failure[i] = k;
+  }
+}
+
+// Copy a quoted or bare parameter of a header, like name="x", into a buffer.
+static bool
+header_parameter(const char * header, const char * name, char * buffer, size_t size)
+{
+  const size_t	length = strlen(name);
+  const char *	s = header;
+
+  for ( ; *s != '\0'; s++ ) {
+    // Make sure it's the whole parameter name, so "name" doesn't match "filename".
+    if ( strncasecmp(s, name, length) == 0
+     && (s == header || s[-1] == ' ' || s[-1] == ';')
+     && s[length] == '=' ) {
+      const char * v = &s[length + 1];
+      const char end = (*v == '"') ? '"' : ';';
+      size_t i = 0;
+
+      if ( *v == '"' )
+        v++;
+      while ( *v != '\0' && *v != end && i < size - 1 )
+        buffer[i++] = *v++;
+      buffer[i] = '\0';
+      return true;
+    }
+  }
+  return false;
+}
+
+static void
+part_header(form_t * f)
+{
+  char file_name[GM_FORM_VALUE_SIZE];
+
+  f->header[f->header_length] = '\0';
+
+  if ( strncasecmp(f->header, "Content-Disposition:", 20) == 0 ) {
+    if ( !header_parameter(f->header, "name", f->name, sizeof(f->name)) )
+      f->name[0] = '\0';
+    f->name_length = strlen(f->name);
+    f->is_file = header_parameter(f->header, "filename", file_name, sizeof(file_name));
+    if ( f->is_file ) {
+      // Keep the file name in the value buffer until the headers are done.
+      strcpy(f->value, file_name);
+    }
+  }
+  else if ( strncasecmp(f->header, "Content-Type:", 13) == 0 ) {
+    // Not used by the callbacks; the file name extension is usually enough.
+  }
+}
+
+static void
+part_start(form_t * f)
+{
+  if ( f->is_file ) {
+    if ( f->handlers->file_start
+     && (*f->handlers->file_start)(f->name, f->value, f->handlers->context) != 0 )
+      fail(f, "file rejected by the handler.");
+  }
+  f->value_length = 0;
+}
+
+// Flush file data collected in the value buffer.
+static void
+flush_file_data(form_t * f)
+{
+  if ( f->is_file && f->value_length > 0 ) {
+    if ( f->handlers->file_data
+     && (*f->handlers->file_data)(f->value, f->value_length, f->handlers->context) != 0 )
+      fail(f, "file data rejected by the handler.");
+    f->value_length = 0;
+  }
+}
+
+static void
+part_end(form_t * f)
+{
+  if ( f->is_file ) {
+    flush_file_data(f);
+    if ( f->handlers->file_end
+     && (*f->handlers->file_end)(f->handlers->context) != 0 )
+      fail(f, "file rejected by the handler.");
+  }
+  else
+    emit_field(f);
+  f->is_file = false;
+  f->name_length = 0;
+  f->value_length = 0;
+}
+
+// Data of a part that is known not to be part of the delimiter.
+static void
+part_data(form_t * f, const char * data, size_t size)
+{
+  if ( f->state != BODY )
+    return;	// The preamble is discarded.
+
+  while ( size > 0 && f->error == 0 ) {
+    size_t room = sizeof(f->value) - 1 - f->value_length;
+
+    if ( room == 0 ) {
+      if ( !f->is_file ) {
+        fail(f, "field value is too long.");
+        return;
+      }
+      flush_file_data(f);
+      room = sizeof(f->value) - 1;
+    }
+    const size_t n = size < room ? size : room;
+    memcpy(&f->value[f->value_length], data, n);
+    f->value_length += n;
+    data += n;
+    size -= n;
+  }
+}
+
+static void
+multipart_byte(form_t * f, char c)
+{
+  switch ( f->state ) {
+  case PREAMBLE:
+  case BODY:
+    while ( f->matched > 0 && f->delimiter[f->matched] != c ) {
+      const uint8_t k = f->failure[f->matched - 1];
+      // The bytes held back are the delimiter prefix; release the ones that
+      // can no longer be part of a match.
+      part_data(f, f->delimiter, f->matched - k);
+      f->matched = k;
+    }
+    if ( f->delimiter[f->matched] == c ) {
+      if ( ++f->matched == f->delimiter_length ) {
+        if ( f->state == BODY )
+          part_end(f);
+        f->matched = 0;
+        f->after_delimiter_length = 0;
+        f->state = AFTER_DELIMITER;
+      }
+    }
+    else
+      part_data(f, &c, 1);
+    break;
+  case AFTER_DELIMITER:
+    // Either "--" for the end of the body, or CR LF for another part.
+    f->after_delimiter[f->after_delimiter_length++] = c;
+    if ( f->after_delimiter_length == 2 ) {
+      if ( f->after_delimiter[0] == '-' && f->after_delimiter[1] == '-' )
+        f->state = EPILOGUE;
+      else if ( f->after_delimiter[0] == '\r' && f->after_delimiter[1] == '\n' ) {
+        f->state = HEADERS;
+        f->header_length = 0;
+        f->is_file = false;
+        f->name_length = 0;
+      }
+      else
+        fail(f, "bad multipart delimiter.");
+    }
+    break;
+  case HEADERS:
+    if ( c == '\n' ) {
+      if ( f->header_length > 0 && f->header[f->header_length - 1] == '\r' )
+        f->header_length--;
+      if ( f->header_length == 0 ) {
+        f->state = BODY;
+        part_start(f);
+      }
+      else
+        part_header(f);
+      f->header_length = 0;
+    }
+    else if ( f->header_length < sizeof(f->header) - 1 )
+      f->header[f->header_length++] = c;
+    // Overlong headers are truncated, we only need their start.
+    break;
+  case EPILOGUE:
+    break;
+  }
+}
+
+static void
+multipart(form_t * f, const char * data, size_t size)
+{
+  for ( size_t i = 0; i < size && f->error == 0; i++ )
+    multipart_byte(f, data[i]);
+
+  // Don't hold file data across receives longer than necessary.
+  if ( f->state == BODY && f->value_length > sizeof(f->value) / 2 )
+    flush_file_data(f);
+}
+
+static bool
+multipart_start(form_t * f, const char * content_type)
+{
+  char boundary[DELIMITER_SIZE];
+
+  if ( !header_parameter(content_type, "boundary", boundary, sizeof(boundary))
+   || boundary[0] == '\0'
+   || strlen(boundary) > DELIMITER_SIZE - 4 )
+    return false;
+
+  f->delimiter_length = snprintf(f->delimiter, sizeof(f->delimiter), "\r\n--%s", boundary);
+  build_failure_table(f);
+  f->state = PREAMBLE;
+  // The first delimiter is usually at the very start of the body, without the
+  // CR LF that precedes the others. Start the matcher as if the CR LF had
+  // already been seen.
+  f->matched = 2;
+  return true;
+}
+
+// Receive the body of a form post, and call the handlers with its fields and
+// files. Returns 0 on success, or -1 on error. On error, an HTTP error has not
+// been sent, the caller should send one.
+int
+gm_form_receive(httpd_req_t * req, const gm_form_handlers_t * handlers)
+{
+  form_t	f = {};
+  char		content_type[128];
+  char		buffer[RECEIVE_SIZE];
+  bool		is_multipart = false;
+  size_t	remaining = req->content_len;
+  int		timeouts = 0;
+
+  f.handlers = handlers;
+
+  if ( httpd_req_get_hdr_value_str(req, "Content-Type", content_type, sizeof(content_type)) == ESP_OK
+   && strncasecmp(content_type, "multipart/form-data", 19) == 0 ) {
+    if ( !multipart_start(&f, content_type) ) {
+      gm_printf("Form: multipart boundary is missing or too long.\n");
+      return -1;
+    }
+    is_multipart = true;
+  }
+
+  while ( remaining > 0 && f.error == 0 ) {
+    const int size = httpd_req_recv(req, buffer, remaining < sizeof(buffer) ? remaining : sizeof(buffer));
+
+    if ( size == HTTPD_SOCK_ERR_TIMEOUT ) {
+      // A client that stops sending would otherwise hold the server task.
+      if ( ++timeouts >= MAXIMUM_TIMEOUTS ) {
+        gm_printf("Form: timed out.\n");
+        return -1;
+      }
+      continue;
+    }
+    if ( size <= 0 ) {
+      gm_printf("Form: connection lost.\n");
+      return -1;
+    }
+    timeouts = 0;
+    remaining -= size;
+
+    if ( is_multipart )
+      multipart(&f, buffer, size);
+    else
+      urlencoded(&f, buffer, size);
+  }
+
+  if ( f.error == 0 ) {
+    if ( is_multipart ) {
+      if ( f.state != EPILOGUE )
+        fail(&f, "multipart body ended early.");
+    }
+    else {
+      if ( f.percent > 0 )
+        fail(&f, "bad percent-encoding.");
+      else
+        emit_field(&f);
+    }
+  }
+  return f.error;
+}
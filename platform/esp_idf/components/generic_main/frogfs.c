@@ -13,8 +13,8 @@ static const frogfs_config_t frogfs_config = {
 
 static frogfs_fs_t * fs = 0;
 
-static bool
-client_accepts_compression(httpd_req_t * const req, const char * const type)
+bool
+gm_client_accepts_compression(httpd_req_t * const req, const char * const type)
 {
   char	buffer[128];
 
@@ -68,7 +68,7 @@ frogfs_file_handler(httpd_req_t * const req, const gm_uri * const uri)
     frogfs_fh_t * const fh = frogfs_open(fs, e, 0);
     if ( fh ) {
       if ( s.compression == FROGFS_COMP_ALGO_ZLIB
-       && client_accepts_compression(req, compression) ) {
+       && gm_client_accepts_compression(req, compression) ) {
         // Send compressed file.
         const void * void_data = 0;
   
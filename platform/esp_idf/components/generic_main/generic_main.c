@@ -1,10 +1,12 @@
 // Main
 //
-// Start the program. Initialize system facilities. Set up an event andler
-// to call wifi_event_sta_start() once the WiFi station starts and is ready
-// for configuration.
+// Start the program. Initialize system facilities, in parallel where they
+// don't depend on each other, see boot.c. Set up an event andler to call
+// wifi_event_sta_start() once the WiFi station starts and is ready for
+// configuration.
 //
-// Code in wifi.c starts the web server once WiFi is configured. All other
+// The web server starts listening during initialization, and code in wifi.c
+// starts the network facilities once WiFi has an address. All other
 // facilities are started from the web server.
 //
 #include <string.h>
@@ -22,7 +24,6 @@
 #include <esp_random.h>
 #include <esp_console.h>
 #include <esp_mac.h>
-#include <bootloader_random.h>
 #include <hal/efuse_hal.h>
 #include "generic_main.h"
 
@@ -30,29 +31,48 @@ static const char TASK_NAME[] = "main";
 
 bool	app_main_called = false;
 
-static void initialize()
+// The initialization steps, in the order that they are listed in the table
+// below.
+enum {
+  NETIF,
+  EVENT_LOOP,
+  NAME,
+  NVS,
+  NONVOLATILE,
+  FILESYSTEM,
+  EVENT_LOOPS,
+  CPU_SAMPLER,
+  USERS,
+  SELECT,
+  PERSISTENT_LOG,
+  WIFI,
+  KEYS,
+  CERTIFICATE,
+  WEB_SERVER,
+  CONSOLE
+};
+
+#define NEEDS(step)	(1UL << (step))
+
+static void
+start_netif(void)
 {
-  // const unsigned int chip_revision = efuse_hal_chip_revision();
-
-  // Set the console print lock, so that things in tasks don't print over each other.
-  // This can't be used for non-tasks.
-  pthread_mutex_init(&GM.console_print_mutex, 0);
-
-  gm_wifi_events_initialize();
-
-  // gm_improv_wifi(0);
-
-  gm_user_initialize_early();
-
   // Initialize the TCP/IP stack. gm_select_task uses sockets.
   esp_netif_init();
   int fd = socket(AF_INET, SOCK_STREAM, 0);
   close(fd);
+}
 
+static void
+create_event_loop(void)
+{
   // The global event loop is required for all event handling to work.
   ESP_ERROR_CHECK(esp_event_loop_create_default());
+}
 
-
+static void
+name_device(void)
+{
   // Get the factory-set MAC address, which is a permanent unique number programmed
   // into e-fuse bits of this CPU, and thus is useful for identifying the device.
   esp_efuse_mac_get_default(GM.factory_mac_address);
@@ -72,7 +92,11 @@ static void initialize()
    GM.factory_mac_address[5]);
 
   gm_printf("Device name: %s\n", GM.unique_name);
+}
 
+static void
+start_nvs(void)
+{
   // Connect the non-volatile-storage FLASH partition. Initialize it if
   // necessary.
   esp_err_t err = nvs_flash_init();
@@ -85,48 +109,29 @@ static void initialize()
 
   if ( nvs_open_err != ESP_OK )
     gm_flash_failure("nvs open", nvs_open_err);
+}
 
+static void
+load_keys(void)
+{
   // Create and store an AES key used for encrypting cookie data for
   // login security and other persistent data. This is less secure than
   // storing session data on the host, but this is a memory-constrained
   // environment with a finite number of FLASH write cycles.
   // The esp_fill_random() operation has to happen after WiFi is enabled,
   // as the hardware random generator uses noise from the high-speed ADC
-  // for randomness.
+  // for randomness. So this runs while WiFi associates, and the web server,
+  // which needs the keys, waits for it.
   //
   uint8_t aes_key[32];
   size_t key_size = sizeof(aes_key);
-  size_t iv_size = sizeof(GM.aes_cookie_iv);
-  size_t hmac_key_size = sizeof(GM.hmac_key);
   const char key_name[] = "aes_key";
-  const char iv_name[] = "cookie_iv";
-  const char hmac_key_name[] = "hmac_key";
-
-  const esp_err_t blob1_err = nvs_get_blob(GM.nvs, key_name, aes_key, &key_size);
-  const esp_err_t blob2_err = nvs_get_blob(
-   GM.nvs,
-   iv_name,
-   GM.aes_cookie_iv,
-   &iv_size);
-  const esp_err_t blob3_err = nvs_get_blob(
-   GM.nvs,
-   hmac_key_name,
-   GM.hmac_key,
-   &hmac_key_size);
-
-  if ( blob1_err != ESP_OK
-   ||  blob2_err != ESP_OK
-   ||  blob3_err != ESP_OK
+
+  const esp_err_t blob_err = nvs_get_blob(GM.nvs, key_name, aes_key, &key_size);
+
+  if ( blob_err != ESP_OK
    ||  key_size != sizeof(aes_key) 
-   ||  iv_size != sizeof(GM.aes_cookie_iv) 
-   ||  hmac_key_size != sizeof(GM.aes_cookie_iv) 
-   || *(unsigned long *)&aes_key == 0
-   || *(unsigned long *)&GM.aes_cookie_iv == 0
-   || *(unsigned long *)&GM.hmac_key == 0 ) {
-    // WiFi is not yet started, as we need encryption first.
-    // So, use the bootloader random source (one or more of the ADCs, Espressif
-    // says thermal noise, but possibly including radio reception).
-    bootloader_random_enable();
+   || gm_all_zeroes(aes_key, sizeof(aes_key)) ) {
     esp_fill_random(aes_key, sizeof(aes_key));
     const esp_err_t set_key_err = nvs_set_blob(
      GM.nvs,
@@ -134,53 +139,88 @@ static void initialize()
      aes_key,
      sizeof(aes_key));
 
-    // We use the same AES initialization vector all of the time for cookie 
-    // encryption, so the cookie plaintext _must_ contain randomness.
-    esp_fill_random(GM.aes_cookie_iv, sizeof(GM.aes_cookie_iv));
-    const esp_err_t set_iv_err = nvs_set_blob(
-     GM.nvs,
-     iv_name,
-     GM.aes_cookie_iv,
-     sizeof(GM.aes_cookie_iv));
-
-    esp_fill_random(GM.hmac_key, sizeof(GM.hmac_key));
-    const esp_err_t set_hmac_key_err = nvs_set_blob(
-     GM.nvs,
-     iv_name,
-     GM.aes_cookie_iv,
-     sizeof(GM.aes_cookie_iv));
-
     const esp_err_t nvs_commit_error = nvs_commit(GM.nvs);
 
     esp_err_t err;
     if ( (err = set_key_err)
-     || (err = set_iv_err)
-     || (err = set_hmac_key_err)
      || (err = nvs_commit_error) ) {
       (void)gm_flash_failure("nvs cryptographic keys", err);
     }
-    bootloader_random_disable();
   }
 
-  // Initialize a hardware AES context with the cookie encryption key.
-  esp_aes_init(&GM.aes_cookie_context);
-  esp_aes_setkey(&GM.aes_cookie_context, aes_key, 256);
-
-  gm_select_task();
-  gm_wifi_start();
+  // Initialize an AES-GCM context with the cookie encryption key. The AES
+  // block operations use the hardware.
+  mbedtls_gcm_init(&GM.cookie_gcm);
+  if ( mbedtls_gcm_setkey(&GM.cookie_gcm, MBEDTLS_CIPHER_ID_AES, aes_key, 256) != 0 )
+    GM_FAIL("Can't set the cookie encryption key.\n");
+  memset(aes_key, 0, sizeof(aes_key));
+}
 
+static void
+start_console(void)
+{
 #ifndef CONFIG_ESP_SYSTEM_GDBSTUB_RUNTIME
   // The GDB stub uses the console, so don't run the interpreter if it's in use.
   gm_command_interpreter_start();
 #endif
 }
 
+// Each step starts as soon as the ones it needs are done, so that WiFi
+// associates while the keys and the filesystem load, and the web server is
+// listening before there is an address to reach it at.
+static const gm_boot_step_t steps[] = {
+  [NETIF] = { "netif", start_netif, 0 },
+  [EVENT_LOOP] = { "event loop", create_event_loop, 0 },
+  [NAME] = { "name", name_device, 0 },
+  [NVS] = { "nvs", start_nvs, 0 },
+  [NONVOLATILE] = { "nonvolatile", gm_nonvolatile_initialize, NEEDS(NVS) },
+  [FILESYSTEM] = { "filesystem", gm_filesystem_initialize, 0 },
+  // The medium and slow job runners for gm_run().
+  [EVENT_LOOPS] = { "job runners", gm_start_user_event_loops, 0 },
+  [CPU_SAMPLER] = { "cpu sampler", gm_cpu_sampler_start, NEEDS(EVENT_LOOPS) },
+  [USERS] = { "users", gm_user_directory_load, NEEDS(NVS) },
+  [SELECT] = { "select task", gm_select_task, NEEDS(NETIF) },
+  // After the select task, as the persistent log uses gm_run().
+  [PERSISTENT_LOG] = {
+    "persistent log",
+    gm_persistent_log_start,
+    NEEDS(SELECT) | NEEDS(EVENT_LOOPS) | NEEDS(FILESYSTEM) | NEEDS(NONVOLATILE)
+  },
+  [WIFI] = {
+    "wifi",
+    gm_wifi_start,
+    NEEDS(NETIF) | NEEDS(EVENT_LOOP) | NEEDS(NAME) | NEEDS(NVS) | NEEDS(NONVOLATILE) | NEEDS(SELECT) | NEEDS(EVENT_LOOPS)
+  },
+  [KEYS] = { "keys", load_keys, NEEDS(NVS) | NEEDS(WIFI) },
+  // Made at the first boot, which needs the random generator, and so WiFi.
+  [CERTIFICATE] = { "certificate", gm_certificate_load, NEEDS(NAME) | NEEDS(WIFI) },
+  [WEB_SERVER] = {
+    "web server",
+    gm_webserver_initialize,
+    NEEDS(KEYS) | NEEDS(CERTIFICATE) | NEEDS(USERS) | NEEDS(NONVOLATILE) | NEEDS(SELECT) | NEEDS(EVENT_LOOPS)
+  },
+  [CONSOLE] = { "console", start_console, NEEDS(NONVOLATILE) | NEEDS(USERS) | NEEDS(SELECT) }
+};
+
+static void initialize()
+{
+  // const unsigned int chip_revision = efuse_hal_chip_revision();
+
+  gm_boot_milestone("app_main");
+  gm_wifi_events_initialize();
+
+  // gm_improv_wifi(0);
+
+  gm_user_initialize_early();
+
+  gm_boot_run(steps, COUNTOF(steps));
+}
+
 void app_main()
 {
   if ( app_main_called )
     return;
 
   app_main_called = true;
-  GM.log_file_pointer = stderr;
   initialize();
 }
@@ -5,6 +5,20 @@
 
 esp_err_t frogfs_file_handler(httpd_req_t * const req, const gm_uri * const uri);
 
+// How long it takes to boot, to where the device is useful. The server has
+// one task, so the flag needs no lock.
+static void
+responded(void)
+{
+  static bool once = false;
+
+  if ( !once ) {
+    once = true;
+    if ( gm_boot_milestone("first https response") )
+      gm_boot_report();
+  }
+}
+
 static esp_err_t
 http_root_handler(httpd_req_t *req)
 {
@@ -13,15 +27,20 @@ http_root_handler(httpd_req_t *req)
   httpd_resp_set_status(req, "301 Moved Permanently");
   httpd_resp_set_hdr(req, "Location", "/index.html");
   httpd_resp_send(req, NULL, 0);
+  responded();
   return ESP_OK;
 }
 
 static esp_err_t
-http_file_handler(httpd_req_t * const req)
+serve(httpd_req_t * const req)
 {
-  gm_session(req);
   gm_uri uri = {};
 
+  if ( gm_session(req) != ESP_OK ) {
+    httpd_resp_send_500(req);
+    return ESP_FAIL;
+  }
+
   if ( gm_uri_parse(req->uri, &uri) != 0 )
     return ESP_ERR_INVALID_ARG;
 
@@ -50,18 +69,32 @@ http_file_handler(httpd_req_t * const req)
   if ( gm_web_handler_run(req, &uri, GET) == 0 )
     return ESP_OK;
 
+  // Assets in the field-updatable partition take precedence over the copies
+  // built into the firmware.
+  if ( gm_assets_file_handler(req, &uri) == ESP_OK )
+    return ESP_OK;
+
   if ( frogfs_file_handler(req, &uri) == ESP_OK )
     return ESP_OK;
 
   // FIX: Test and enable.
   // req->uri = "/404.html";
-  // return http_file_handler(req);
+  // return serve(req);
 
   // We get here if the file isn't found.
   httpd_resp_send_404(req);
   return ESP_OK;
 }
 
+static esp_err_t
+http_file_handler(httpd_req_t * const req)
+{
+  const esp_err_t err = serve(req);
+
+  responded();
+  return err;
+}
+
 void
 gm_get_handlers(httpd_handle_t server)
 {
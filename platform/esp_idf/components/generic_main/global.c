@@ -26,11 +26,6 @@ generic_main_t GM = {
       "IPv4-mapped-IPv6"
   },
 
-  // File descriptor upon which logging is emitted.
-  // This will change while the log server has accepted a connection.
-  //
-  .log_fd = 2,
-
   // Magic number for non-volatile storage.
   //
   .nvs_index = nvs_index
@@ -0,0 +1,866 @@
+// Micro-benchmarks of the string and codec functions on the request path:
+// URI and parameter parsing, pattern strings, address bit compares, the
+// session cookie, the STUN and PCP packet encoders and decoders, and the
+// fan-out of live telemetry. They are
+// the real generic_main files, built on the host over the stubs in
+// bench_stubs.c.
+//
+//   make -f platform/Makefile.native bench
+//   make -f platform/Makefile.native bench_baseline
+//
+// Each benchmark is warmed up, its batch size is calibrated to take about
+// BATCH_NS, and the best of REPETITIONS batches is its time per operation,
+// which is the least disturbed by the rest of the machine. Allocations are
+// counted by wrapping the C library allocator.
+//
+// The speed of a shared or throttled machine drifts during a run, so a batch
+// of the reference, fixed work on text like that of the benchmarks, is run
+// before each batch of a benchmark, and what is compared is the best time
+// relative to the best of the reference batches beside it. With --baseline,
+// a change of more than the tolerance, or any more allocations per operation,
+// is a regression, and the exit status is 1. A benchmark of less than
+// SHORT_NS is a few dozen instructions, which code alignment and contention
+// for the core change the most, so it's allowed twice the tolerance.
+// Benchmarks that seem slower are measured again in later passes, up to
+// ATTEMPTS times, and --write stores the median of ATTEMPTS passes.
+#define _GNU_SOURCE
+#include <errno.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <lwip/sockets.h>
+#include <esp_random.h>
+#include <esp_timer.h>
+#include <mbedtls/gcm.h>
+#include "generic_main.h"
+#include "bench_stubs.h"
+
+#define WARM_UP_NS	50000000LL
+#define BATCH_NS	20000000LL
+#define REPETITIONS	9
+#define ATTEMPTS	5
+// Before each pass of measuring again, wait this long times the attempt.
+#define PAUSE_MS	1000
+#define MAXIMUM_NAME	32
+#define MAXIMUM_BENCHMARKS	32
+#define SHORT_NS	100
+
+typedef struct _benchmark {
+  const char *	name;
+  void		(*setup)(void);	// Once, before it's measured. May be NULL.
+  void		(*run)(void);	// One operation.
+} benchmark_t;
+
+typedef struct _result {
+  char		name[MAXIMUM_NAME];
+  double	ns;		// Best of the batches.
+  double	median_ns;
+  double	allocations;
+  double	reference_ns;	// Best of the reference batches beside it.
+  double	relative;	// The best time relative to the best reference.
+} result_t;
+
+// Not in a header. Its packet is the private pcp_packet_t, which is built
+// here as bytes, as it arrives from the router.
+extern void	decode_packet(void * packet, ssize_t size, const struct sockaddr_storage * address);
+
+static volatile uintptr_t	sink;
+static unsigned long		allocations = 0;
+static unsigned long		reference_n = 1;
+
+// Count the allocations of everything, including the AES-GCM of OpenSSL.
+extern void *	__libc_malloc(size_t);
+extern void *	__libc_calloc(size_t, size_t);
+extern void *	__libc_realloc(void *, size_t);
+extern void	__libc_free(void *);
+
+void *
+malloc(size_t size)
+{
+  allocations++;
+  return __libc_malloc(size);
+}
+
+void *
+calloc(size_t number, size_t size)
+{
+  allocations++;
+  return __libc_calloc(number, size);
+}
+
+void *
+realloc(void * p, size_t size)
+{
+  allocations++;
+  return __libc_realloc(p, size);
+}
+
+void
+free(void * p)
+{
+  __libc_free(p);
+}
+
+// There is no select loop or timer task. The PCP socket isn't opened, and
+// PCP only sets its timer once it's started.
+esp_err_t
+esp_timer_create(const esp_timer_create_args_t * args, esp_timer_handle_t * timer)
+{
+  *timer = NULL;
+  return ESP_OK;
+}
+
+esp_err_t
+esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout_us)
+{
+  return ESP_OK;
+}
+
+esp_err_t
+esp_timer_start_periodic(esp_timer_handle_t timer, uint64_t period_us)
+{
+  return ESP_OK;
+}
+
+esp_err_t
+esp_timer_stop(esp_timer_handle_t timer)
+{
+  return ESP_OK;
+}
+
+void
+gm_run(gm_run_t function, void * data, gm_run_speed_t speed)
+{
+  (*function)(data);
+}
+
+void
+gm_fd_register(int fd, gm_fd_handler_t handler, void * data, bool readable, bool writable, bool exception, uint32_t seconds)
+{
+}
+
+void
+gm_fd_register_ms(int fd, gm_fd_handler_t handler, void * data, bool readable, bool writable, bool exception, uint32_t milliseconds)
+{
+}
+
+void
+gm_fd_unregister(int fd)
+{
+}
+
+// The HTTPS server task of telemetry.c is the benchmark, which runs the one
+// piece of queued work itself, and keeps the last frame sent.
+static httpd_work_fn_t	queued_work = NULL;
+static void *		queued_arg;
+static char		sent[1536];
+static size_t		sent_size = 0;
+
+esp_err_t
+httpd_queue_work(httpd_handle_t server, httpd_work_fn_t work, void * arg)
+{
+  if ( queued_work )
+    return ESP_FAIL;
+  queued_work = work;
+  queued_arg = arg;
+  return ESP_OK;
+}
+
+static void
+run_queued_work(void)
+{
+  const httpd_work_fn_t work = queued_work;
+
+  queued_work = NULL;
+  if ( work )
+    (*work)(queued_arg);
+}
+
+int
+httpd_socket_send(httpd_handle_t server, int fd, const char * buffer, size_t length, int flags)
+{
+  sent_size = length < sizeof(sent) - 1 ? length : sizeof(sent) - 1;
+  memcpy(sent, buffer, sent_size);
+  sent[sent_size] = '\0';
+  return length;
+}
+
+static int64_t
+now_ns(void)
+{
+  struct timespec t;
+
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+static void
+pause_ms(int64_t ms)
+{
+  const struct timespec t = { .tv_sec = ms / 1000, .tv_nsec = (ms % 1000) * 1000000 };
+
+  nanosleep(&t, NULL);
+}
+
+static void
+fail(const char * what)
+{
+  fprintf(stderr, "bench: %s.\n", what);
+  exit(2);
+}
+
+// A fixed amount of work like that of the benchmarks, loads and branches on
+// text, to scale the baseline to the speed of this machine at the moment.
+static void
+reference(void)
+{
+  static const char	text[] = "GET /setting?name=wifi_ssid&value=Home%20Network HTTP/1.1";
+  uint32_t		h = 2166136261 + (uint32_t)sink;
+
+  for ( int round = 0; round < 8; round++ ) {
+    for ( const char * c = text; *c; c++ ) {
+      if ( *c == '%' || *c == '&' || *c == '?' )
+        h = (h ^ 0xff) * 16777619;
+      else
+        h = (h ^ (uint8_t)*c) * 16777619;
+    }
+  }
+  sink = h;
+}
+
+// URIs and parameters, as a GET of a setting and a form post arrive. The
+// parsers write into their input, so it's copied first, as the web server
+// copies the URI out of the request.
+static const char	setting_uri[] = "/setting?name=wifi_ssid&value=Home%20Network&save=1";
+static const char	asset_uri[] = "/assets/fonts/Noto%20Sans%20Mono%20Bold.woff2?v%3D1.2%26t%3D5";
+static const char	form[] = "callsign=K6BP&password=correct-horse&country=US&license_class=extra&admin=1&transmit=1";
+static char		copy[GM_COOKIE_SIZE];
+static gm_uri		uri;
+static gm_param_t	params[10];
+
+static void
+uri_parse(void)
+{
+  memcpy(copy, setting_uri, sizeof(setting_uri));
+  sink = gm_uri_parse(copy, &uri);
+}
+
+static void
+uri_decode(void)
+{
+  char	path[128];
+
+  sink = gm_uri_decode(asset_uri, path, sizeof(path));
+  sink += path[20];
+}
+
+static void
+param_parse(void)
+{
+  memcpy(copy, form, sizeof(form));
+  sink = gm_param_parse(copy, params, COUNTOF(params));
+}
+
+static void
+param_setup(void)
+{
+  static char parsed[sizeof(form)];
+
+  memcpy(parsed, form, sizeof(form));
+  memset(params, 0, sizeof(params));
+  if ( gm_param_parse(parsed, params, COUNTOF(params)) != 0 )
+    fail("gm_param_parse() failed");
+}
+
+static void
+param_lookup(void)
+{
+  sink = (uintptr_t)gm_param(params, COUNTOF(params), "transmit");
+}
+
+static int
+pattern_coroutine(const char * name, char * result, size_t size)
+{
+  static const char * const values[][2] = {
+    { "application", "k6vp" },
+    { "callsign", "K6BP" },
+    { "version", "1.4.2" },
+    { "address", "203.0.113.7" }
+  };
+
+  for ( size_t i = 0; i < COUNTOF(values); i++ ) {
+    if ( strcmp(name, values[i][0]) == 0 ) {
+      snprintf(result, size, "%s", values[i][1]);
+      return 0;
+    }
+  }
+  return -1;
+}
+
+static void
+pattern_string(void)
+{
+  char	page[256];
+
+  sink = gm_pattern_string(
+   "<title>{application}</title><p>{callsign} is running version {version} at {address}.</p>",
+   pattern_coroutine,
+   page,
+   sizeof(page));
+}
+
+static struct in6_addr	address_a;
+static struct in6_addr	address_b;
+
+static void
+match_bits_setup(void)
+{
+  inet_pton(AF_INET6, "2001:db8:85a3:42::8a2e:370:7334", &address_a);
+  inet_pton(AF_INET6, "2001:db8:85a3:42:1::1", &address_b);
+}
+
+static void
+match_bits(void)
+{
+  sink = gm_match_bits(&address_a, &address_b, sizeof(address_a));
+}
+
+// The 10 zero bytes of an IPv4-mapped-IPv6 address, as PCP checks them, and a
+// zeroed 64-byte key that isn't word-aligned.
+static uint32_t	zeroes[20];
+
+static void
+all_zeroes_mapped(void)
+{
+  sink = gm_all_zeroes(zeroes, 10);
+}
+
+static void
+all_zeroes_unaligned(void)
+{
+  sink = gm_all_zeroes((const uint8_t *)zeroes + 1, 64);
+}
+
+// The session cookie, encrypted with AES-GCM and Base64url-encoded into the
+// session context's Set-Cookie, and decoded back from the browser.
+static gm_session_context_t	session;
+static httpd_req_t		request = { .sess_ctx = &session };
+static gm_cookie_t		login = { .user_name = "k6bp" };
+static char			cookie_value[GM_COOKIE_SIZE];
+static size_t			cookie_length;
+
+static void
+cookie_write(void)
+{
+  gm_write_cookie(&request, &login);
+  sink = session.set_cookie[10];
+}
+
+static void
+cookie_setup(void)
+{
+  gm_cookie_t	c;
+
+  gm_write_cookie(&request, &login);
+  if ( strncmp(session.set_cookie, "c=", 2) != 0 )
+    fail("gm_write_cookie() didn't set the cookie");
+  cookie_length = strcspn(&session.set_cookie[2], ";");
+  memcpy(cookie_value, &session.set_cookie[2], cookie_length);
+  memcpy(copy, cookie_value, cookie_length);
+  if ( !gm_decode_cookie(copy, cookie_length, &c) || strcmp(c.user_name, login.user_name) != 0 || c.issued != login.issued )
+    fail("gm_decode_cookie() didn't decode the written cookie");
+}
+
+static void
+cookie_decode(void)
+{
+  gm_cookie_t	c;
+
+  memcpy(copy, cookie_value, cookie_length);
+  sink = gm_decode_cookie(copy, cookie_length, &c);
+}
+
+// A binding request, and the response of a typical public server: SOFTWARE,
+// XOR-MAPPED-ADDRESS, and FINGERPRINT.
+static uint32_t		stun_response[32];
+static size_t		stun_response_size;
+
+static void
+stun_message(void)
+{
+  uint32_t	buffer[GM_STUN_MESSAGE_SIZE / sizeof(uint32_t)];
+  uint32_t	transaction_id[3];
+
+  sink = gm_stun_message(buffer, false, transaction_id);
+}
+
+static size_t
+put_attribute(uint8_t * p, uint16_t type, const void * value, uint16_t length)
+{
+  p[0] = type >> 8;
+  p[1] = type;
+  p[2] = length >> 8;
+  p[3] = length;
+  memcpy(&p[4], value, length);
+  memset(&p[4 + length], 0, (4 - (length & 3)) & 3);
+  return 4 + ((length + 3) & ~3);
+}
+
+static void
+stun_setup(void)
+{
+  uint8_t * const		p = (uint8_t *)stun_response;
+  static const uint8_t		magic[4] = { 0x21, 0x12, 0xa4, 0x42 };
+  const uint8_t			address[4] = { 203, 0, 113, 7 };
+  const uint16_t		port = 49152;
+  uint8_t			mapped[8] = { 0, 1, (port >> 8) ^ magic[0], (port & 0xff) ^ magic[1] };
+  const uint8_t			fingerprint[4] = { 0x5a, 0x1f, 0x3e, 0x77 };
+  struct sockaddr_storage	s;
+  size_t			size = 20;
+
+  for ( int i = 0; i < 4; i++ )
+    mapped[4 + i] = address[i] ^ magic[i];
+
+  p[0] = 0x01;
+  p[1] = 0x01;
+  memcpy(&p[4], magic, sizeof(magic));
+  esp_fill_random(&p[8], 12);
+  size += put_attribute(&p[size], 0x8022, "bench server", 12);
+  size += put_attribute(&p[size], 0x0020, mapped, sizeof(mapped));
+  size += put_attribute(&p[size], 0x8028, fingerprint, sizeof(fingerprint));
+  p[2] = (size - 20) >> 8;
+  p[3] = size - 20;
+  stun_response_size = size;
+
+  if ( !gm_stun_mapped_address(stun_response, stun_response_size, false, &s)
+   || ((struct sockaddr_in *)&s)->sin_addr.s_addr != htonl(0xcb007107)
+   || ((struct sockaddr_in *)&s)->sin_port != htons(port) )
+    fail("gm_stun_mapped_address() didn't decode the mapped address");
+}
+
+static void
+stun_mapped_address(void)
+{
+  struct sockaddr_storage	s;
+
+  sink = gm_stun_mapped_address(stun_response, stun_response_size, false, &s);
+}
+
+// PCP on the station interface, with the router answering a MAP request with
+// its external IPv4 address. The renewal is the steady state: the same grant
+// again. The cycle requests a new mapping, decodes the grant, and releases
+// it, which encodes the delete request. The PCP socket isn't open, so the
+// requests are built but not sent.
+#define PCP_LIFETIME	900
+static uint32_t			pcp_response[32];
+static struct sockaddr_storage	router;
+
+static void
+put_pcp_response(uint16_t internal_port, uint16_t external_port)
+{
+  uint8_t * const	p = (uint8_t *)pcp_response;
+  const uint32_t	lifetime = htonl(PCP_LIFETIME);
+  const uint32_t	epoch = htonl(3600);
+
+  memset(pcp_response, 0, sizeof(pcp_response));
+  p[0] = 2;		// Version.
+  p[1] = 0x81;		// MAP response.
+  memcpy(&p[4], &lifetime, sizeof(lifetime));
+  memcpy(&p[8], &epoch, sizeof(epoch));
+  memcpy(&p[24], bench_last_random, 12);	// The nonce of the request.
+  p[36] = GM_PCP_TCP;
+  p[40] = internal_port >> 8;
+  p[41] = internal_port;
+  p[42] = external_port >> 8;
+  p[43] = external_port;
+  p[54] = p[55] = 0xff;	// ::ffff:203.0.113.7
+  p[56] = 203;
+  p[57] = 0;
+  p[58] = 113;
+  p[59] = 7;
+}
+
+static void
+pcp_setup(void)
+{
+  struct sockaddr_in * const	r = (struct sockaddr_in *)&router;
+  gm_netif_t * const		sta = &GM.net_interfaces[GM_STA];
+  struct sockaddr_storage	external;
+
+  inet_pton(AF_INET, "192.168.1.50", &sta->ip4.address);
+  inet_pton(AF_INET, "192.168.1.1", &sta->ip4.router);
+  r->sin_family = AF_INET;
+  r->sin_addr = sta->ip4.router;
+  r->sin_port = htons(5351);
+
+  // Each benchmark starts from the same random numbers, so the mapping is
+  // made again, with the same nonce.
+  gm_pcp_release_mapping(false, GM_PCP_TCP, 443);
+  gm_pcp_request_mapping_ipv4(sta, GM_PCP_TCP, 443, 443);
+  put_pcp_response(443, 443);
+  decode_packet(pcp_response, 60, &router);
+  if ( !gm_pcp_external_address(false, GM_PCP_TCP, 443, &external) || external.ss_family != AF_INET )
+    fail("The PCP mapping wasn't granted");
+}
+
+static void
+pcp_renewal(void)
+{
+  decode_packet(pcp_response, 60, &router);
+}
+
+static void
+pcp_cycle(void)
+{
+  static uint32_t	response[32];
+  uint8_t * const	p = (uint8_t *)response;
+
+  gm_pcp_request_mapping_ipv4(&GM.net_interfaces[GM_STA], GM_PCP_TCP, 8443, 8443);
+  // The renewal's response, with the new nonce and port.
+  memcpy(response, pcp_response, sizeof(response));
+  memcpy(&p[24], bench_last_random, 12);
+  p[40] = p[42] = 8443 >> 8;
+  p[41] = p[43] = 8443 & 0xff;
+  decode_packet(response, 60, &router);
+  gm_pcp_release_mapping(false, GM_PCP_TCP, 8443);
+}
+
+// A browser watching live telemetry: each RSSI sample fans out to its queue,
+// and the HTTPS server task formats and sends it as a chunk. The setup checks
+// that a scanner hit gets from the producer through the client's queue to
+// the socket.
+static httpd_req_t	telemetry_request = { .handle = &telemetry_request };
+static float		telemetry_rssi = 0;
+
+static void
+telemetry_setup(void)
+{
+  // One client, however many times this is measured.
+  gm_telemetry_socket_closed(httpd_req_to_sockfd(&telemetry_request));
+  gm_telemetry_add_client(&telemetry_request);
+  run_queued_work();
+  sent_size = 0;
+  gm_telemetry_scan(146.52f, 87.0f);
+  run_queued_work();
+  if ( sent_size == 0 || strstr(sent, "event: scan\ndata: {\"frequency\":146.52000,\"rssi\":87}") == NULL )
+    fail("The scanner hit didn't reach the telemetry client");
+}
+
+static void
+telemetry_sample(void)
+{
+  telemetry_rssi = telemetry_rssi < 255 ? telemetry_rssi + 1 : 0;
+  gm_telemetry_sample(GM_TELEMETRY_RSSI, telemetry_rssi);
+  run_queued_work();
+  sink = sent_size;
+}
+
+static const benchmark_t benchmarks[] = {
+  { "uri_parse", NULL, uri_parse },
+  { "uri_decode", NULL, uri_decode },
+  { "param_parse", NULL, param_parse },
+  { "param_lookup", param_setup, param_lookup },
+  { "pattern_string", NULL, pattern_string },
+  { "match_bits", match_bits_setup, match_bits },
+  { "all_zeroes_mapped", NULL, all_zeroes_mapped },
+  { "all_zeroes_unaligned", NULL, all_zeroes_unaligned },
+  { "cookie_write", NULL, cookie_write },
+  { "cookie_decode", cookie_setup, cookie_decode },
+  { "stun_message", NULL, stun_message },
+  { "stun_mapped_address", stun_setup, stun_mapped_address },
+  { "pcp_renewal", pcp_setup, pcp_renewal },
+  { "pcp_cycle", pcp_setup, pcp_cycle },
+  { "telemetry_sample", telemetry_setup, telemetry_sample }
+};
+
+static int
+compare_doubles(const void * a, const void * b)
+{
+  const double x = *(const double *)a;
+  const double y = *(const double *)b;
+
+  return (x > y) - (x < y);
+}
+
+static int
+compare_relative(const void * a, const void * b)
+{
+  return compare_doubles(&((const result_t *)a)->relative, &((const result_t *)b)->relative);
+}
+
+static int64_t
+batch(void (*run)(void), unsigned long n)
+{
+  const int64_t start = now_ns();
+
+  for ( unsigned long i = 0; i < n; i++ )
+    (*run)();
+  return now_ns() - start;
+}
+
+// The number of operations for a batch of about BATCH_NS.
+static unsigned long
+calibrate(void (*run)(void))
+{
+  unsigned long n = 1;
+
+  while ( batch(run, n) < BATCH_NS / 4 )
+    n *= 2;
+  return n * 4;
+}
+
+static void
+measure(const benchmark_t * b, result_t * r)
+{
+  double		ns[REPETITIONS];
+  double		reference_ns[REPETITIONS];
+  unsigned long		n;
+  unsigned long		a = 0;
+  const int64_t		start = now_ns();
+
+  bench_seed(1);
+  if ( b->setup )
+    (*b->setup)();
+
+  while ( now_ns() - start < WARM_UP_NS )
+    (*b->run)();
+
+  n = calibrate(b->run);
+
+  for ( int i = 0; i < REPETITIONS; i++ ) {
+    const unsigned long before = allocations;
+
+    reference_ns[i] = (double)batch(reference, reference_n) / reference_n;
+    ns[i] = (double)batch(b->run, n) / n;
+    a += allocations - before;
+  }
+
+  qsort(ns, REPETITIONS, sizeof(*ns), compare_doubles);
+  qsort(reference_ns, REPETITIONS, sizeof(*reference_ns), compare_doubles);
+  snprintf(r->name, sizeof(r->name), "%s", b->name);
+  r->ns = ns[0];
+  r->median_ns = ns[REPETITIONS / 2];
+  r->allocations = (double)a / ((double)n * REPETITIONS);
+  r->reference_ns = reference_ns[0];
+  r->relative = ns[0] / reference_ns[0];
+}
+
+static size_t
+read_baseline(const char * file, result_t * baseline)
+{
+  FILE * const	f = fopen(file, "r");
+  char		line[256];
+  size_t	n = 0;
+
+  if ( f == NULL ) {
+    perror(file);
+    exit(2);
+  }
+  while ( fgets(line, sizeof(line), f) && n < MAXIMUM_BENCHMARKS ) {
+    result_t * const r = &baseline[n];
+
+    if ( line[0] == '#' )
+      continue;
+    if ( sscanf(line, "%31s %lf %lf %lf", r->name, &r->ns, &r->allocations, &r->relative) == 4 && r->relative > 0 )
+      n++;
+  }
+  fclose(f);
+  return n;
+}
+
+static void
+write_baseline(const char * file, const result_t * results, size_t n)
+{
+  FILE * const f = fopen(file, "w");
+
+  if ( f == NULL ) {
+    perror(file);
+    exit(2);
+  }
+  fprintf(f, "# The baseline of host/bench.c: name, best ns/op, allocations/op, and the\n");
+  fprintf(f, "# time relative to the reference. Rewrite it with\n");
+  fprintf(f, "#  make -f platform/Makefile.native bench_baseline\n");
+  for ( size_t i = 0; i < n; i++ )
+    fprintf(f, "%-24s %10.1f %8.3f %10.4f\n", results[i].name, results[i].ns, results[i].allocations, results[i].relative);
+  if ( fclose(f) != 0 ) {
+    perror(file);
+    exit(2);
+  }
+}
+
+static const result_t *
+find(const result_t * results, size_t n, const char * name)
+{
+  for ( size_t i = 0; i < n; i++ ) {
+    if ( strcmp(results[i].name, name) == 0 )
+      return &results[i];
+  }
+  return NULL;
+}
+
+// The tolerance of a benchmark, which is wider for the shortest.
+static double
+tolerance_of(const result_t * r, double tolerance)
+{
+  return r->ns < SHORT_NS ? tolerance * 2 : tolerance;
+}
+
+int
+main(int argc, char * * argv)
+{
+  static const unsigned char	key[32] = "generic_main bench cookie key...";
+  result_t			results[MAXIMUM_BENCHMARKS];
+  result_t			baseline[MAXIMUM_BENCHMARKS];
+  const benchmark_t *		measured[MAXIMUM_BENCHMARKS];
+  size_t			number_of_results = 0;
+  size_t			number_in_baseline = 0;
+  const char *			baseline_file = NULL;
+  const char *			write_file = NULL;
+  const char *			filter = NULL;
+  double			tolerance = 0.3;
+  int				regressions = 0;
+
+  for ( int i = 1; i < argc; i++ ) {
+    if ( strcmp(argv[i], "--baseline") == 0 && i + 1 < argc )
+      baseline_file = argv[++i];
+    else if ( strcmp(argv[i], "--write") == 0 && i + 1 < argc )
+      write_file = argv[++i];
+    else if ( strcmp(argv[i], "--tolerance") == 0 && i + 1 < argc )
+      tolerance = atof(argv[++i]);
+    else if ( argv[i][0] != '-' && filter == NULL )
+      filter = argv[i];
+    else {
+      fprintf(stderr, "Usage: %s [--baseline file [--tolerance fraction]] [--write file] [name]\n", argv[0]);
+      return 2;
+    }
+  }
+  if ( baseline_file )
+    number_in_baseline = read_baseline(baseline_file, baseline);
+
+  // One CPU, so that the batches aren't moved between cores of different speeds.
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  if ( sched_getaffinity(0, sizeof(cpus), &cpus) == 0 ) {
+    for ( int i = 0; i < CPU_SETSIZE; i++ ) {
+      if ( CPU_ISSET(i, &cpus) ) {
+        CPU_ZERO(&cpus);
+        CPU_SET(i, &cpus);
+        (void) sched_setaffinity(0, sizeof(cpus), &cpus);
+        break;
+      }
+    }
+  }
+
+  mbedtls_gcm_init(&GM.cookie_gcm);
+  if ( mbedtls_gcm_setkey(&GM.cookie_gcm, MBEDTLS_CIPHER_ID_AES, key, 256) != 0 )
+    fail("Can't set the cookie key");
+  // Cookies aren't issued until the clock has been set, and expire by it.
+  GM.time_last_synchronized = gm_clock_us();
+  login.issued = (uint32_t)gm_clock_time();
+
+  // The reference batches are shorter, they only need to catch the speed.
+  reference_n = calibrate(reference) / 4;
+
+  printf("%-24s %10s %10s %10s", "benchmark", "ns/op", "median", "allocs/op");
+  if ( number_in_baseline > 0 )
+    printf(" %10s %8s", "baseline", "change");
+  printf("\n");
+
+  for ( size_t i = 0; i < COUNTOF(benchmarks); i++ ) {
+    const benchmark_t * const b = &benchmarks[i];
+
+    if ( filter && strstr(b->name, filter) == NULL )
+      continue;
+    measure(b, &results[number_of_results]);
+    measured[number_of_results++] = b;
+  }
+
+  // Contention from the rest of the machine comes and goes, in bursts that
+  // can outlast several measurements of one benchmark. So the attempts are
+  // made in passes over all of the benchmarks, which spreads them over the
+  // run.
+  if ( write_file ) {
+    // The baseline is the typical time, not that of a lucky moment.
+    result_t attempts[MAXIMUM_BENCHMARKS][ATTEMPTS];
+
+    for ( size_t i = 0; i < number_of_results; i++ )
+      attempts[i][0] = results[i];
+    for ( int attempt = 1; attempt < ATTEMPTS; attempt++ ) {
+      for ( size_t i = 0; i < number_of_results; i++ )
+        measure(measured[i], &attempts[i][attempt]);
+    }
+    for ( size_t i = 0; i < number_of_results; i++ ) {
+      qsort(attempts[i], ATTEMPTS, sizeof(*attempts[i]), compare_relative);
+      results[i] = attempts[i][ATTEMPTS / 2];
+    }
+  }
+  else {
+    // A regression doesn't come and go. Those that seem slower are measured
+    // again, after a pause that gives a burst time to pass, and only one that
+    // is slow every time is counted.
+    for ( int attempt = 1; attempt < ATTEMPTS; attempt++ ) {
+      bool slower = false;
+
+      for ( size_t i = 0; i < number_of_results; i++ ) {
+        const result_t * const base = find(baseline, number_in_baseline, results[i].name);
+
+        slower = slower || (base && results[i].relative > base->relative * (1 + tolerance_of(&results[i], tolerance)));
+      }
+      if ( !slower )
+        break;
+      pause_ms(attempt * PAUSE_MS);
+
+      for ( size_t i = 0; i < number_of_results; i++ ) {
+        result_t * const	r = &results[i];
+        const result_t * const	base = find(baseline, number_in_baseline, r->name);
+        result_t		again;
+
+        if ( base == NULL || r->relative <= base->relative * (1 + tolerance_of(r, tolerance)) )
+          continue;
+        measure(measured[i], &again);
+        if ( again.relative < r->relative )
+          *r = again;
+      }
+    }
+  }
+
+  for ( size_t i = 0; i < number_of_results; i++ ) {
+    const result_t * const r = &results[i];
+    const result_t * const base = find(baseline, number_in_baseline, r->name);
+
+    printf("%-24s %10.1f %10.1f %10.3f", r->name, r->ns, r->median_ns, r->allocations);
+
+    if ( base ) {
+      const double	change = r->relative / base->relative - 1;
+      // The baseline's time, at the speed of this machine now.
+      const double	expected = r->ns / (1 + change);
+      const bool	slower = change > tolerance_of(r, tolerance);
+      const bool	allocates = r->allocations > base->allocations + 0.001;
+
+      printf(" %10.1f %+7.1f%%", expected, change * 100);
+      if ( slower || allocates ) {
+        printf("  REGRESSION%s%s", slower ? ", slower" : "", allocates ? ", allocates more" : "");
+        regressions++;
+      }
+    }
+    else if ( number_in_baseline > 0 )
+      printf(" %10s", "new");
+    printf("\n");
+  }
+
+  if ( write_file )
+    write_baseline(write_file, results, number_of_results);
+  if ( bench_failures > 0 ) {
+    fprintf(stderr, "bench: %lu failures, the results aren't valid.\n", bench_failures);
+    return 1;
+  }
+  if ( regressions > 0 ) {
+    fprintf(stderr, "bench: %d regressions, more than %.0f%% slower (%.0f%% under %d ns) or allocating more.\n", regressions, tolerance * 100, tolerance * 200, SHORT_NS);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,334 @@
+// The thin layer under the generic_main files that bench.c and pcp_sim.c run
+// on the host: the ESP-IDF and generic_main functions that they call, but
+// that aren't being measured. The select loop and the timers are bench.c's or
+// sim_net.c's. Randomness is a fixed-seed generator, so that every run
+// does the same work. AES-GCM is OpenSSL's, which, like the AES hardware on
+// the device, is much faster than the software rounds.
+#include <errno.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <openssl/evp.h>
+#include <esp_random.h>
+#include "generic_main.h"
+#include "bench_stubs.h"
+
+const char	gm_build_version[] = "bench";
+const char	gm_build_number[] = "0";
+
+uint8_t		bench_last_random[BENCH_LAST_RANDOM_SIZE];
+unsigned long	bench_failures = 0;
+void		(*bench_print)(const char * text) = NULL;
+static uint64_t	random_state = 0x9e3779b97f4a7c15ULL;
+
+void
+bench_seed(uint64_t seed)
+{
+  random_state = seed ? seed : 0x9e3779b97f4a7c15ULL;
+}
+
+// xorshift64*.
+static uint64_t
+next_random(void)
+{
+  random_state ^= random_state >> 12;
+  random_state ^= random_state << 25;
+  random_state ^= random_state >> 27;
+  return random_state * 0x2545f4914f6cdd1dULL;
+}
+
+void
+esp_fill_random(void * buffer, size_t size)
+{
+  uint8_t * const	b = buffer;
+
+  for ( size_t i = 0; i < size; i += sizeof(uint64_t) ) {
+    const uint64_t r = next_random();
+
+    memcpy(&b[i], &r, size - i < sizeof(r) ? size - i : sizeof(r));
+  }
+  memcpy(bench_last_random, buffer, size < sizeof(bench_last_random) ? size : sizeof(bench_last_random));
+}
+
+uint32_t
+esp_random(void)
+{
+  return next_random() >> 32;
+}
+
+const char *
+esp_err_to_name(esp_err_t err)
+{
+  return err == ESP_OK ? "ESP_OK" : "ESP_FAIL";
+}
+
+// The classification of lwIP's ip6_addr_isglobal() and friends.
+esp_ip6_addr_type_t
+esp_netif_ip6_get_addr_type(esp_ip6_addr_t * a)
+{
+  const uint8_t * const	b = (const uint8_t *)a->addr;
+  static const uint8_t	mapped[12] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff };
+
+  if ( memcmp(b, mapped, sizeof(mapped)) == 0 )
+    return ESP_IP6_ADDR_IS_IPV4_MAPPED_IPV6;
+  if ( b[0] == 0xfe && (b[1] & 0xc0) == 0x80 )
+    return ESP_IP6_ADDR_IS_LINK_LOCAL;
+  if ( b[0] == 0xfe && (b[1] & 0xc0) == 0xc0 )
+    return ESP_IP6_ADDR_IS_SITE_LOCAL;
+  if ( (b[0] & 0xfe) == 0xfc )
+    return ESP_IP6_ADDR_IS_UNIQUE_LOCAL;
+  if ( (b[0] & 0xe0) == 0x20 )
+    return ESP_IP6_ADDR_IS_GLOBAL;
+  return ESP_IP6_ADDR_IS_UNKNOWN;
+}
+
+int
+esp_netif_get_netif_impl_index(esp_netif_t * netif)
+{
+  return 1;
+}
+
+esp_err_t
+esp_netif_get_netif_impl_name(esp_netif_t * netif, char * name)
+{
+  strcpy(name, "lo");
+  return ESP_OK;
+}
+
+// NVS is always empty, and writes are discarded.
+void
+nvs_close(nvs_handle_t handle)
+{
+}
+
+esp_err_t
+nvs_commit(nvs_handle_t handle)
+{
+  return ESP_OK;
+}
+
+esp_err_t
+nvs_get_blob(nvs_handle_t handle, const char * key, void * value, size_t * size)
+{
+  return ESP_ERR_NOT_FOUND;
+}
+
+esp_err_t
+nvs_open(const char * name, nvs_open_mode_t mode, nvs_handle_t * handle)
+{
+  *handle = 1;
+  return ESP_OK;
+}
+
+esp_err_t
+nvs_set_blob(nvs_handle_t handle, const char * key, const void * value, size_t size)
+{
+  return ESP_OK;
+}
+
+esp_err_t
+httpd_req_get_cookie_val(httpd_req_t * req, const char * name, char * value, size_t * size)
+{
+  return ESP_ERR_NOT_FOUND;
+}
+
+esp_err_t
+httpd_resp_set_hdr(httpd_req_t * req, const char * field, const char * value)
+{
+  return ESP_OK;
+}
+
+int
+httpd_req_to_sockfd(httpd_req_t * req)
+{
+  return 3;
+}
+
+esp_err_t
+httpd_resp_send(httpd_req_t * req, const char * buffer, ssize_t length)
+{
+  return ESP_OK;
+}
+
+esp_err_t
+httpd_resp_send_chunk(httpd_req_t * req, const char * buffer, ssize_t length)
+{
+  return ESP_OK;
+}
+
+esp_err_t
+httpd_resp_set_status(httpd_req_t * req, const char * status)
+{
+  return ESP_OK;
+}
+
+esp_err_t
+httpd_resp_set_type(httpd_req_t * req, const char * type)
+{
+  return ESP_OK;
+}
+
+esp_err_t
+httpd_sess_trigger_close(httpd_handle_t server, int fd)
+{
+  return ESP_OK;
+}
+
+// There are no log sinks, gm_printf() is bench_print.
+bool
+gm_log_sink_add(gm_log_sink_t sink, void * data)
+{
+  return true;
+}
+
+// The benchmark provides the session context, as the session cache would.
+esp_err_t
+gm_session(httpd_req_t * req)
+{
+  return ESP_OK;
+}
+
+// Messages are discarded unless there is a bench_print, so that formatting
+// them for a terminal isn't measured. Failures are counted and shown, since a
+// benchmark that fails isn't measuring what it should.
+int
+gm_printf(const char * format, ...)
+{
+  char		buffer[256];
+  va_list	args;
+
+  if ( bench_print == NULL )
+    return 0;
+  va_start(args, format);
+  const int size = vsnprintf(buffer, sizeof(buffer), format, args);
+  va_end(args);
+  (*bench_print)(buffer);
+  return size;
+}
+
+void
+gm_fail(const char * function, const char * file, int line, const char * pattern, ...)
+{
+  va_list args;
+
+  bench_failures++;
+  fprintf(stderr, "%s:%d: %s: ", file, line, function);
+  va_start(args, pattern);
+  vfprintf(stderr, pattern, args);
+  va_end(args);
+  fputc('\n', stderr);
+}
+
+void
+gm_fail_with_os_error(const char * function, const char * file, int line, const char * pattern, ...)
+{
+  va_list args;
+
+  bench_failures++;
+  fprintf(stderr, "%s:%d: %s: ", file, line, function);
+  va_start(args, pattern);
+  vfprintf(stderr, pattern, args);
+  va_end(args);
+  fprintf(stderr, ": %s\n", strerror(errno));
+}
+
+esp_err_t
+gm_flash_failure(const char * name, esp_err_t err)
+{
+  return err;
+}
+
+void
+gm_reachability_report(bool ipv6, gm_reachability_source_t source, const struct sockaddr_storage * address)
+{
+}
+
+void
+gm_keepalive_add(gm_keepalive_t * flow)
+{
+}
+
+void
+gm_keepalive_remove(gm_keepalive_t * flow)
+{
+}
+
+void
+mbedtls_gcm_init(mbedtls_gcm_context * ctx)
+{
+  ctx->cipher = NULL;
+}
+
+void
+mbedtls_gcm_free(mbedtls_gcm_context * ctx)
+{
+  EVP_CIPHER_CTX_free(ctx->cipher);
+  ctx->cipher = NULL;
+}
+
+int
+mbedtls_gcm_setkey(mbedtls_gcm_context * ctx, mbedtls_cipher_id_t cipher, const unsigned char * key, unsigned int key_bits)
+{
+  const EVP_CIPHER *	type;
+
+  switch ( key_bits ) {
+  case 128: type = EVP_aes_128_gcm(); break;
+  case 192: type = EVP_aes_192_gcm(); break;
+  case 256: type = EVP_aes_256_gcm(); break;
+  default: return MBEDTLS_ERR_GCM_BAD_INPUT;
+  }
+  if ( cipher != MBEDTLS_CIPHER_ID_AES )
+    return MBEDTLS_ERR_GCM_BAD_INPUT;
+
+  if ( ctx->cipher == NULL && (ctx->cipher = EVP_CIPHER_CTX_new()) == NULL )
+    return MBEDTLS_ERR_GCM_BAD_INPUT;
+  // The key schedule is kept, each operation only sets the IV.
+  if ( !EVP_CipherInit_ex(ctx->cipher, type, NULL, key, NULL, 1) )
+    return MBEDTLS_ERR_GCM_BAD_INPUT;
+  return 0;
+}
+
+static int
+gcm(mbedtls_gcm_context * ctx, int encrypt, size_t length, const unsigned char * iv, size_t iv_length, const unsigned char * add, size_t add_length, const unsigned char * input, unsigned char * output)
+{
+  int	n;
+
+  if ( ctx->cipher == NULL
+   || !EVP_CipherInit_ex(ctx->cipher, NULL, NULL, NULL, NULL, encrypt)
+   || !EVP_CIPHER_CTX_ctrl(ctx->cipher, EVP_CTRL_GCM_SET_IVLEN, iv_length, NULL)
+   || !EVP_CipherInit_ex(ctx->cipher, NULL, NULL, NULL, iv, encrypt)
+   || (add_length > 0 && !EVP_CipherUpdate(ctx->cipher, NULL, &n, add, add_length))
+   || (length > 0 && !EVP_CipherUpdate(ctx->cipher, output, &n, input, length)) )
+    return MBEDTLS_ERR_GCM_BAD_INPUT;
+  return 0;
+}
+
+int
+mbedtls_gcm_crypt_and_tag(mbedtls_gcm_context * ctx, int mode, size_t length, const unsigned char * iv, size_t iv_length, const unsigned char * add, size_t add_length, const unsigned char * input, unsigned char * output, size_t tag_length, unsigned char * tag)
+{
+  unsigned char	end[16];
+  int		n;
+
+  if ( gcm(ctx, mode == MBEDTLS_GCM_ENCRYPT, length, iv, iv_length, add, add_length, input, output) != 0
+   || !EVP_CipherFinal_ex(ctx->cipher, end, &n)
+   || !EVP_CIPHER_CTX_ctrl(ctx->cipher, EVP_CTRL_GCM_GET_TAG, tag_length, tag) )
+    return MBEDTLS_ERR_GCM_BAD_INPUT;
+  return 0;
+}
+
+int
+mbedtls_gcm_auth_decrypt(mbedtls_gcm_context * ctx, size_t length, const unsigned char * iv, size_t iv_length, const unsigned char * add, size_t add_length, const unsigned char * tag, size_t tag_length, const unsigned char * input, unsigned char * output)
+{
+  unsigned char	end[16];
+  int		n;
+
+  if ( gcm(ctx, 0, length, iv, iv_length, add, add_length, input, output) != 0
+   || !EVP_CIPHER_CTX_ctrl(ctx->cipher, EVP_CTRL_GCM_SET_TAG, tag_length, (void *)tag) )
+    return MBEDTLS_ERR_GCM_BAD_INPUT;
+  if ( !EVP_CipherFinal_ex(ctx->cipher, end, &n) ) {
+    memset(output, 0, length);
+    return MBEDTLS_ERR_GCM_AUTH_FAILED;
+  }
+  return 0;
+}
@@ -0,0 +1,17 @@
+#pragma once
+// What bench.c and pcp_sim.c see of the stub layer under the generic_main
+// files, see bench_stubs.c.
+#include <stdint.h>
+
+#define BENCH_LAST_RANDOM_SIZE	16
+
+// The start of the last buffer filled by esp_fill_random(), such as the
+// nonce of the last PCP request.
+extern uint8_t		bench_last_random[BENCH_LAST_RANDOM_SIZE];
+// GM_FAIL() calls since the start.
+extern unsigned long	bench_failures;
+// Where gm_printf() messages go, if anywhere.
+extern void		(*bench_print)(const char * text);
+
+// Restart the random numbers, so that each benchmark does the same work.
+extern void		bench_seed(uint64_t seed);
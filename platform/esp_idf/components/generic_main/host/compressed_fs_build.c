@@ -0,0 +1,284 @@
+// Build a compressed_fs image from a directory, for the assets partition.
+//
+//   compressed_fs_build directory image
+//
+// Each file is named by its path under the directory, with a leading slash, as
+// it appears in a URL. Files are compressed with zlib, unless that doesn't
+// make them smaller. The image is read back and checked before it's written.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include "compressed_fs.h"
+
+typedef struct file {
+  char *	name;
+  uint8_t *	data;
+  size_t	size;
+  uint8_t *	compressed;
+  size_t	compressed_size;
+  uint32_t	method;
+} file_t;
+
+static file_t *	files = NULL;
+static size_t	number_of_files = 0;
+static size_t	files_capacity = 0;
+
+static void
+fail(const char * message, const char * name)
+{
+  fprintf(stderr, "compressed_fs_build: %s: %s\n", name, message);
+  exit(1);
+}
+
+static uint8_t *
+read_file(const char * path, size_t * size)
+{
+  FILE * const f = fopen(path, "rb");
+  struct stat s;
+
+  if ( f == NULL || fstat(fileno(f), &s) != 0 )
+    fail(strerror(errno), path);
+
+  uint8_t * const data = malloc(s.st_size + 1);
+  if ( data == NULL || (s.st_size > 0 && fread(data, s.st_size, 1, f) != 1) )
+    fail("Can't read.", path);
+  fclose(f);
+  *size = s.st_size;
+  return data;
+}
+
+// Compress with a small window, so that the device can decompress in pieces
+// with a small buffer.
+static void
+compress_file(file_t * f)
+{
+  z_stream z = {};
+  const size_t bound = deflateBound(&z, f->size) + 64;
+
+  f->compressed = malloc(bound);
+  if ( f->compressed == NULL
+   || deflateInit2(&z, Z_BEST_COMPRESSION, Z_DEFLATED, COMPRESSED_FS_WINDOW_BITS, 9, Z_DEFAULT_STRATEGY) != Z_OK )
+    fail("Can't initialize compression.", f->name);
+
+  z.next_in = f->data;
+  z.avail_in = f->size;
+  z.next_out = f->compressed;
+  z.avail_out = bound;
+  if ( deflate(&z, Z_FINISH) != Z_STREAM_END )
+    fail("Compression failed.", f->name);
+  f->compressed_size = z.total_out;
+  deflateEnd(&z);
+}
+
+static void
+add_file(const char * path, const char * name)
+{
+  if ( number_of_files == files_capacity ) {
+    files_capacity = files_capacity ? files_capacity * 2 : 64;
+    files = realloc(files, files_capacity * sizeof(*files));
+    if ( files == NULL )
+      fail("Out of memory.", path);
+  }
+
+  file_t * const f = &files[number_of_files++];
+  memset(f, 0, sizeof(*f));
+  f->name = strdup(name);
+  f->data = read_file(path, &f->size);
+
+  if ( f->size == 0 ) {
+    f->method = ZERO_LENGTH;
+    return;
+  }
+  compress_file(f);
+  if ( f->compressed_size < f->size )
+    f->method = ZLIB;
+  else
+    f->method = NONE;
+}
+
+static void
+walk(const char * directory, const char * prefix)
+{
+  DIR * const d = opendir(directory);
+  struct dirent * entry;
+
+  if ( d == NULL )
+    fail(strerror(errno), directory);
+
+  while ( (entry = readdir(d)) != NULL ) {
+    char	path[1024];
+    char	name[1024];
+    struct stat	s;
+
+    if ( entry->d_name[0] == '.' )
+      continue;
+    snprintf(path, sizeof(path), "%s/%s", directory, entry->d_name);
+    snprintf(name, sizeof(name), "%s/%s", prefix, entry->d_name);
+    if ( stat(path, &s) != 0 )
+      fail(strerror(errno), path);
+    if ( S_ISDIR(s.st_mode) )
+      walk(path, name);
+    else if ( S_ISREG(s.st_mode) )
+      add_file(path, name);
+  }
+  closedir(d);
+}
+
+static int
+compare_files(const void * a, const void * b)
+{
+  return strcmp(((const file_t *)a)->name, ((const file_t *)b)->name);
+}
+
+static size_t
+align(size_t n)
+{
+  return (n + 3) & ~(size_t)3;
+}
+
+static uint8_t *
+build(size_t * image_size)
+{
+  uint32_t hash_size = 1;
+
+  // At most half full, so that probes are short.
+  while ( hash_size < number_of_files * 2 || hash_size <= number_of_files )
+    hash_size *= 2;
+
+  const size_t table_offset = align(sizeof(struct compressed_fs_header));
+  const size_t hash_offset = align(table_offset + number_of_files * sizeof(struct compressed_fs_entry));
+  const size_t names_offset = hash_offset + hash_size * sizeof(uint32_t);
+  size_t size = names_offset;
+
+  for ( size_t i = 0; i < number_of_files; i++ )
+    size += strlen(files[i].name) + 1;
+  size = align(size);
+  for ( size_t i = 0; i < number_of_files; i++ ) {
+    if ( files[i].method == ZLIB )
+      size += align(files[i].compressed_size);
+    else
+      size += align(files[i].size);
+  }
+
+  uint8_t * const image = calloc(1, size);
+  if ( image == NULL )
+    fail("Out of memory.", "image");
+
+  struct compressed_fs_header * const h = (struct compressed_fs_header *)image;
+  struct compressed_fs_entry * const entries = (struct compressed_fs_entry *)(image + table_offset);
+  uint32_t * const hash = (uint32_t *)(image + hash_offset);
+
+  memcpy(h->magic, compressed_fs_magic, sizeof(h->magic));
+  h->number_of_files = number_of_files;
+  h->table_offset = table_offset;
+  h->hash_offset = hash_offset;
+  h->hash_size = hash_size;
+  h->image_size = size;
+
+  size_t names = names_offset;
+  for ( size_t i = 0; i < number_of_files; i++ ) {
+    const size_t length = strlen(files[i].name) + 1;
+
+    entries[i].name_offset = names;
+    memcpy(image + names, files[i].name, length);
+    names += length;
+
+    uint32_t slot = compressed_fs_hash(files[i].name) & (hash_size - 1);
+    while ( hash[slot] != 0 )
+      slot = (slot + 1) & (hash_size - 1);
+    hash[slot] = i + 1;
+  }
+
+  size_t data = align(names);
+  for ( size_t i = 0; i < number_of_files; i++ ) {
+    file_t * const f = &files[i];
+    const uint8_t * const source = f->method == ZLIB ? f->compressed : f->data;
+    const size_t length = f->method == ZLIB ? f->compressed_size : f->size;
+
+    entries[i].data_offset = data;
+    entries[i].compressed_size = length;
+    entries[i].size = f->size;
+    entries[i].method = f->method;
+    memcpy(image + data, source, length);
+    data += align(length);
+  }
+
+  *image_size = size;
+  return image;
+}
+
+// Read the image back as the device would.
+static void
+verify(const uint8_t * image, size_t size)
+{
+  compressed_fs_t fs;
+
+  if ( !compressed_fs_open(&fs, image, size) )
+    fail("The image doesn't validate.", "image");
+
+  for ( size_t i = 0; i < number_of_files; i++ ) {
+    const file_t * const f = &files[i];
+    const struct compressed_fs_entry * const e = compressed_fs_find(&fs, f->name);
+
+    if ( e == NULL || e != compressed_fs_bsearch(&fs, f->name) )
+      fail("Not found in the image.", f->name);
+
+    if ( e->method == ZLIB ) {
+      uLongf length = f->size;
+      uint8_t * const out = malloc(f->size);
+
+      if ( out == NULL
+       || uncompress(out, &length, compressed_fs_data(&fs, e), e->compressed_size) != Z_OK
+       || length != f->size
+       || memcmp(out, f->data, f->size) != 0 )
+        fail("Doesn't decompress correctly.", f->name);
+      free(out);
+    }
+    else if ( e->size > 0 && memcmp(compressed_fs_data(&fs, e), f->data, f->size) != 0 )
+      fail("Data doesn't match.", f->name);
+  }
+  if ( compressed_fs_find(&fs, "/no such file") != NULL )
+    fail("Found a file that doesn't exist.", "image");
+}
+
+int
+main(int argc, char * * argv)
+{
+  size_t size = 0;
+  size_t total = 0;
+
+  if ( argc != 3 ) {
+    fprintf(stderr, "Usage: %s directory image\n", argv[0]);
+    return 1;
+  }
+
+  walk(argv[1], "");
+  qsort(files, number_of_files, sizeof(*files), compare_files);
+
+  uint8_t * const image = build(&size);
+  verify(image, size);
+
+  FILE * const out = fopen(argv[2], "wb");
+  if ( out == NULL || fwrite(image, size, 1, out) != 1 || fclose(out) != 0 )
+    fail(strerror(errno), argv[2]);
+
+  for ( size_t i = 0; i < number_of_files; i++ ) {
+    static const char * const methods[] = { "none", "empty", "zlib" };
+    const file_t * const f = &files[i];
+
+    printf(
+     "%-32s %8zu %8zu %s\n",
+     f->name,
+     f->size,
+     f->method == ZLIB ? f->compressed_size : f->size,
+     methods[f->method]);
+    total += f->size;
+  }
+  printf("%zu files, %zu bytes, image %zu bytes.\n", number_of_files, total, size);
+  return 0;
+}
@@ -0,0 +1,98 @@
+// Benchmark the configuration store against a simulated NVS partition, to
+// compare the FLASH wear and time of committing each key separately with
+// transactions that write several keys at once.
+//
+//   make -f platform/Makefile.native config_bench
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "gm_config_store.h"
+#include "sim_flash.h"
+
+// The NVS partition of the k4vp_2 platform.
+#define PARTITION_SIZE		(24 * 1024)
+#define NUMBER_OF_CHANGES	2000
+#define KEYS_PER_CHANGE		5
+// For projecting life, assume a configuration change every hour.
+#define CHANGES_PER_DAY		24
+
+static const char * const keys[KEYS_PER_CHANGE] = {
+  "ssid",
+  "wifi_password",
+  "ddns_hostname",
+  "ddns_username",
+  "timezone"
+};
+
+typedef enum _mode {
+  PER_KEY,
+  TRANSACTION,
+  TRANSACTION_MOSTLY_UNCHANGED
+} bench_mode_t;
+
+static void
+run(const char * name, bench_mode_t mode)
+{
+  sim_flash_t * const		f = sim_flash_create(PARTITION_SIZE);
+  const gm_config_backend_t	backend = sim_flash_backend(f);
+  sim_flash_stats_t		s;
+  gm_config_wear_t		w;
+  gm_config_life_t		life;
+  char				value[64];
+
+  gm_config_init(&backend, NULL);
+
+  for ( int change = 0; change < NUMBER_OF_CHANGES; change++ ) {
+    if ( mode != PER_KEY )
+      gm_config_begin();
+    for ( int k = 0; k < KEYS_PER_CHANGE; k++ ) {
+      // In the last mode, only two of the five values really change.
+      const int generation = (mode == TRANSACTION_MOSTLY_UNCHANGED && k >= 2) ? 0 : change;
+      snprintf(value, sizeof(value), "%s-value-%d", keys[k], generation);
+      gm_config_set(keys[k], value);
+      if ( mode == PER_KEY )
+        gm_config_flush();
+    }
+    if ( mode != PER_KEY )
+      gm_config_commit();
+  }
+
+  sim_flash_stats(f, &s);
+  gm_config_wear(&w);
+  // Project with the simulated elapsed time of one change per hour.
+  gm_config_estimate_life(&w, PARTITION_SIZE, (double)NUMBER_OF_CHANGES * 86400.0 / CHANGES_PER_DAY, &life);
+
+  printf(
+   "%-28s %8llu %8llu %6lu %6lu %10.1f %10.2f %12.0f\n",
+   name,
+   (unsigned long long)s.entries_written,
+   (unsigned long long)s.page_erases,
+   (unsigned long)s.max_page_erases,
+   (unsigned long)s.commits,
+   s.microseconds / 1000.0,
+   (s.microseconds / 1000.0) / NUMBER_OF_CHANGES,
+   life.days_remaining);
+
+  sim_flash_destroy(f);
+}
+
+int
+main(void)
+{
+  printf("%d changes of %d keys each, %d KB partition.\n", NUMBER_OF_CHANGES, KEYS_PER_CHANGE, PARTITION_SIZE / 1024);
+  printf(
+   "%-28s %8s %8s %6s %6s %10s %10s %12s\n",
+   "mode",
+   "entries",
+   "erases",
+   "max",
+   "commit",
+   "flash ms",
+   "ms/change",
+   "life days");
+  run("commit per key", PER_KEY);
+  run("transaction", TRANSACTION);
+  run("transaction, 3/5 unchanged", TRANSACTION_MOSTLY_UNCHANGED);
+  return 0;
+}
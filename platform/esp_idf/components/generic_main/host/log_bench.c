@@ -0,0 +1,200 @@
+// Benchmark the log store against a simulated littlefs partition, to compare
+// the FLASH programming, erases, and time of compressed blocks written in
+// aligned chunks with appending each message to a file as it's logged.
+//
+//   make -f platform/Makefile.native log_bench
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "gm_log_store.h"
+#include "sim_littlefs.h"
+
+#define NUMBER_OF_MESSAGES	50000
+#define SEGMENT_SIZE		(32 * 1024)
+#define BUDGET			(256 * 1024)
+// The device flushes partial chunks this often.
+#define FLUSH_MICROSECONDS	(300 * 1000000LL)
+
+typedef struct _count {
+  unsigned long	messages;
+  unsigned long	bytes;
+  int64_t	first_time;
+  int64_t	previous_time;
+  bool		ordered;
+} count_t;
+
+// Synthetic log text, like what the firmware logs.
+static size_t
+message(int n, char * text, size_t size)
+{
+  const int r = rand();
+
+  switch ( r % 5 ) {
+  case 0:
+    return snprintf(text, size, "wifi: rssi %d dBm, channel %d.\n", -40 - r % 50, 1 + r % 11);
+  case 1:
+    return snprintf(
+     text,
+     size,
+     "pcp: Mapped port %d to 203.0.113.%d:%d for %d seconds.\n",
+     8000 + r % 8,
+     r % 254 + 1,
+     40000 + r % 1000,
+     7200);
+  case 2:
+    return snprintf(text, size, "web: GET /status 200, %d bytes in %d ms.\n", 400 + r % 2000, r % 90);
+  case 3:
+    return snprintf(text, size, "stun: Answer from 198.51.100.%d:3478, address 203.0.113.%d.\n", r % 254 + 1, r % 254 + 1);
+  default:
+    return snprintf(text, size, "radio: Channel %d, squelch %s, message %d.\n", r % 32, (r & 1) ? "open" : "closed", n);
+  }
+}
+
+static int
+counter(int64_t time, const char * text, size_t size, void * context)
+{
+  count_t * const c = context;
+
+  (void)text;
+  if ( c->messages == 0 )
+    c->first_time = time;
+  else if ( time < c->previous_time )
+    c->ordered = false;
+  c->previous_time = time;
+  c->messages++;
+  c->bytes += size;
+  return 0;
+}
+
+static void
+print_row(const char * name, unsigned long long text_bytes, const sim_littlefs_stats_t * s, double cpu_seconds)
+{
+  printf(
+   "%-20s %10llu %10llu %8llu %8llu %8.2f %10.1f %10.3f %10.1f\n",
+   name,
+   text_bytes,
+   (unsigned long long)s->bytes_programmed,
+   (unsigned long long)s->erases,
+   (unsigned long long)s->commits,
+   (double)s->bytes_programmed / text_bytes,
+   s->microseconds / 1e6,
+   s->microseconds / 1000.0 / NUMBER_OF_MESSAGES,
+   cpu_seconds > 0 ? text_bytes / cpu_seconds / 1e6 : 0.0);
+}
+
+static void
+read_range(sim_littlefs_t * fs, const char * name, int64_t from, int64_t to)
+{
+  sim_littlefs_stats_t	before;
+  sim_littlefs_stats_t	after;
+  count_t		c = { .ordered = true };
+  clock_t		start;
+
+  sim_littlefs_stats(fs, &before);
+  start = clock();
+  gm_log_store_read(from, to, counter, &c);
+  sim_littlefs_stats(fs, &after);
+  printf(
+   "%-28s %8lu messages, %8lu bytes of text, %8llu bytes read, %6.2f ms, %s.\n",
+   name,
+   c.messages,
+   c.bytes,
+   (unsigned long long)(after.bytes_read - before.bytes_read),
+   (double)(clock() - start) * 1000.0 / CLOCKS_PER_SEC,
+   c.ordered ? "in order" : "OUT OF ORDER");
+}
+
+int
+main(void)
+{
+  sim_littlefs_t * const	naive = sim_littlefs_create();
+  sim_littlefs_t * const	fs = sim_littlefs_create();
+  const gm_log_store_backend_t	backend = sim_littlefs_backend(fs);
+  const gm_log_store_config_t	config = { .segment_size = SEGMENT_SIZE, .budget = BUDGET };
+  sim_littlefs_stats_t		s;
+  gm_log_store_stats_t		ls;
+  unsigned long long		text_bytes = 0;
+  int64_t			time = 1700000000LL * 1000000;
+  int64_t			last_flush = time;
+  double			cpu = 0;
+  char				line[160];
+  char				text[128];
+
+  printf(
+   "%d messages, %d KB segments, %d KB budget.\n",
+   NUMBER_OF_MESSAGES,
+   SEGMENT_SIZE / 1024,
+   BUDGET / 1024);
+  printf(
+   "%-20s %10s %10s %8s %8s %8s %10s %10s %10s\n",
+   "mode",
+   "text",
+   "programmed",
+   "erases",
+   "commits",
+   "amplify",
+   "flash s",
+   "ms/message",
+   "CPU MB/s");
+
+  srand(1);
+  for ( int n = 0; n < NUMBER_OF_MESSAGES; n++ ) {
+    const size_t size = message(n, text, sizeof(text));
+
+    time += 10000 + rand() % 500000;
+    snprintf(line, sizeof(line), "%lld %s", (long long)(time / 1000000), text);
+    sim_littlefs_append(naive, 0, line, strlen(line));
+    text_bytes += size;
+  }
+  sim_littlefs_stats(naive, &s);
+  print_row("append per message", text_bytes, &s, 0);
+
+  gm_log_store_init(&backend, &config);
+  srand(1);
+  time = 1700000000LL * 1000000;
+  for ( int n = 0; n < NUMBER_OF_MESSAGES; n++ ) {
+    const size_t	size = message(n, text, sizeof(text));
+    const clock_t	start = clock();
+
+    time += 10000 + rand() % 500000;
+    if ( gm_log_store_write(time, text, size) )
+      gm_log_store_flush(false);
+    if ( time - last_flush >= FLUSH_MICROSECONDS ) {
+      gm_log_store_flush(true);
+      last_flush = time;
+    }
+    cpu += (double)(clock() - start) / CLOCKS_PER_SEC;
+  }
+  gm_log_store_flush(true);
+  sim_littlefs_stats(fs, &s);
+  print_row("log store", text_bytes, &s, cpu);
+
+  gm_log_store_stats(&ls);
+  printf(
+   "\nCompressed %llu bytes to %llu in %lu blocks, %.2f:1, %llu appends, %llu dropped.\n",
+   (unsigned long long)ls.raw_bytes,
+   (unsigned long long)ls.stored_bytes,
+   (unsigned long)ls.blocks,
+   (double)ls.raw_bytes / ls.stored_bytes,
+   (unsigned long long)ls.appends,
+   (unsigned long long)ls.dropped);
+  printf(
+   "%lu segments of %llu bytes kept, %lu removed.\n\n",
+   (unsigned long)ls.number_of_segments,
+   (unsigned long long)ls.total_size,
+   (unsigned long)ls.segments_removed);
+
+  read_range(fs, "all", INT64_MIN, INT64_MAX);
+  read_range(fs, "the last 10 minutes", time - 600 * 1000000LL, time);
+
+  // A reboot reads the index and scans the last segment.
+  gm_log_store_init(&backend, &config);
+  read_range(fs, "all, after a reboot", INT64_MIN, INT64_MAX);
+  read_range(fs, "the last 10 minutes, reboot", time - 600 * 1000000LL, time);
+
+  sim_littlefs_destroy(naive);
+  sim_littlefs_destroy(fs);
+  return 0;
+}
@@ -0,0 +1,476 @@
+// Days of PCP port mapping in seconds: the real port_control_protocol.c and
+// select_task.c, on the simulated clock and network of sim_net.c, against a
+// simulated router.
+//
+//   make -f platform/Makefile.native pcp_sim
+//   build.$(ARCH)/pcp_sim --days 30 --mappings 64 --reboot-hours 6 --loss 0.05
+//
+// The router grants each MAP request up to --lifetime seconds, and answers
+// with its epoch, the seconds since it booted. Every --reboot-hours, it loses
+// its mappings and is down for --down seconds, and then multicasts an
+// ANNOUNCE, unless --no-announce, so that the device must find the reset from
+// the epoch of its next renewal. --idle descriptors sit in the select loop
+// with the 30-second timeout of the redirector's connections, and each of
+// their timeouts is checked.
+//
+// At the end, it reports the requests that reached the router and their
+// peaks, the time that mappings weren't held by the router, and the load on
+// the select loop. A mapping that expires at the router while it's up, a
+// late timeout, or a GM_FAIL() is an error, and the exit status is 1, though
+// with enough --loss, mappings will expire. The same --seed makes the same
+// run, to reproduce a timing bug exactly. -v shows the messages of PCP and
+// the router with their simulated times.
+//
+// --late-answer makes the router ignore the requests for a mapping that it
+// holds until the mapping has less than that many seconds left, so that
+// renewals are retransmitted close to expiry:
+//
+//   build.$(ARCH)/pcp_sim --days 1 --lifetime 60 --late-answer 3
+//
+// Mappings are expected to expire then, and aren't counted as errors. A
+// mapping that is requested twice at the same simulated time was sent twice
+// in one batch, which is an error in any run.
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <lwip/sockets.h>
+#include <esp_timer.h>
+#include "generic_main.h"
+#include "bench_stubs.h"
+#include "sim_net.h"
+
+#define SECOND_US		1000000LL
+#define HOUR_US			(3600 * SECOND_US)
+#define DAY_US			(24 * HOUR_US)
+#define FIRST_PORT		10000
+#define MAXIMUM_MAPPINGS	64	// As port_control_protocol.c.
+#define MAP_SIZE		60	// A MAP request or response, without options.
+#define ANNOUNCE_SIZE		24
+#define IDLE_S			30	// The redirector's connection timeout.
+#define MAXIMUM_IDLE		64
+// As select_task.c handles a timeout early, rather than sleeping again.
+#define GRANULARITY_US		10000
+// Requests of one mapping closer than this were sent in the same batch.
+#define REPEAT_US		1000
+
+// What the router holds for an internal port.
+typedef struct _grant {
+  bool		held;
+  bool		ever;		// Granted at least once.
+  int64_t	expires;
+  int64_t	lost;		// When it stopped being held.
+  int64_t	requested;	// The last request.
+} grant_t;
+
+typedef struct _idle {
+  int		fd;
+  int64_t	registered;
+  int64_t	interval_us;
+} idle_t;
+
+typedef struct _window {
+  int64_t	index;
+  uint32_t	count;
+  uint32_t	peak;
+} window_t;
+
+// Options.
+static double			days = 7;
+static unsigned int		number_of_mappings = 16;
+static uint32_t			maximum_lifetime = 900;
+static double			reboot_hours = 24;
+static uint32_t			down_s = 60;
+static bool			announce = true;
+static unsigned int		number_of_idle = 8;
+static uint32_t			late_answer_s = 0;
+static uint64_t			seed = 1;
+static bool			verbose = false;
+
+static struct sockaddr_storage	router;
+static struct sockaddr_storage	all_hosts;
+static grant_t			grants[MAXIMUM_MAPPINGS];
+static idle_t			idle[MAXIMUM_IDLE];
+static bool			router_down = false;
+static int64_t			router_boot;
+static esp_timer_handle_t	reboot_timer;
+static esp_timer_handle_t	up_timer;
+
+// Results.
+static uint64_t			requests = 0;
+static uint64_t			dropped_while_down = 0;
+static uint64_t			reboots = 0;
+static uint64_t			lapses = 0;	// Expired while the router was up.
+static uint64_t			outages = 0;
+static int64_t			outage_us = 0;
+static int64_t			longest_outage_us = 0;
+static uint64_t			idle_timeouts = 0;
+static uint64_t			late_timeouts = 0;
+static uint64_t			repeats = 0;
+static window_t			per_second = { -1 };
+static window_t			per_minute = { -1 };
+
+static const char *
+format_time(int64_t us, char * buffer, size_t size)
+{
+  const int64_t	s = us / SECOND_US;
+
+  snprintf(buffer, size, "%lldd %02lld:%02lld:%02lld.%03lld",
+   (long long)(s / 86400),
+   (long long)(s / 3600 % 24),
+   (long long)(s / 60 % 60),
+   (long long)(s % 60),
+   (long long)(us / 1000 % 1000));
+  return buffer;
+}
+
+static void
+print_message(const char * text)
+{
+  char	when[32];
+
+  printf("%s %s", format_time(gm_clock_us(), when, sizeof(when)), text);
+}
+
+// Errors are shown with their simulated times, with or without -v.
+static void
+error(const char * format, ...)
+{
+  char		when[32];
+  va_list	args;
+
+  printf("%s ", format_time(gm_clock_us(), when, sizeof(when)));
+  va_start(args, format);
+  vprintf(format, args);
+  va_end(args);
+}
+
+static void
+count(window_t * w, int64_t length_us)
+{
+  const int64_t index = gm_clock_us() / length_us;
+
+  if ( index != w->index ) {
+    w->index = index;
+    w->count = 0;
+  }
+  if ( ++w->count > w->peak )
+    w->peak = w->count;
+}
+
+static void
+end_outage(grant_t * g, int64_t now)
+{
+  const int64_t length = now - g->lost;
+
+  outages++;
+  outage_us += length;
+  if ( length > longest_outage_us )
+    longest_outage_us = length;
+}
+
+static uint32_t
+get_32(const uint8_t * p)
+{
+  return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static void
+put_32(uint8_t * p, uint32_t v)
+{
+  p[0] = v >> 24;
+  p[1] = v >> 16;
+  p[2] = v >> 8;
+  p[3] = v;
+}
+
+static uint32_t
+epoch(void)
+{
+  return (uint32_t)((gm_clock_us() - router_boot) / SECOND_US);
+}
+
+// The router's PCP server.
+static void
+router_receive(const void * packet, size_t size, const struct sockaddr_storage * from, void * context)
+{
+  const uint8_t * const	request = packet;
+  uint8_t		response[MAP_SIZE];
+  const int64_t		now = gm_clock_us();
+
+  if ( router_down ) {
+    dropped_while_down++;
+    return;
+  }
+  if ( size < MAP_SIZE || request[0] != 2 || request[1] != 1 )
+    return;
+
+  requests++;
+  count(&per_second, SECOND_US);
+  count(&per_minute, 60 * SECOND_US);
+
+  const unsigned int port = (request[40] << 8) | request[41];
+  if ( port < FIRST_PORT || port >= FIRST_PORT + number_of_mappings )
+    return;
+  grant_t * const g = &grants[port - FIRST_PORT];
+
+  if ( g->ever && now - g->requested < REPEAT_US ) {
+    repeats++;
+    error("Router: port %u was requested again after %lld us.\n", port, (long long)(now - g->requested));
+  }
+  g->requested = now;
+
+  if ( late_answer_s > 0 && g->held && g->expires - now >= late_answer_s * SECOND_US )
+    return;
+
+  if ( g->held && g->expires <= now ) {
+    g->held = false;
+    g->lost = g->expires;
+    lapses++;
+    if ( verbose )
+      gm_printf("Router: the mapping of port %u expired.\n", port);
+  }
+
+  uint32_t lifetime = get_32(&request[4]);
+  if ( lifetime > maximum_lifetime )
+    lifetime = maximum_lifetime;
+
+  if ( lifetime == 0 )
+    g->held = false;
+  else {
+    if ( !g->held && g->ever )
+      end_outage(g, now);
+    g->held = g->ever = true;
+    g->expires = now + lifetime * SECOND_US;
+  }
+
+  memcpy(response, request, sizeof(response));
+  response[1] |= 0x80;
+  response[3] = 0;	// Success.
+  put_32(&response[4], lifetime);
+  put_32(&response[8], epoch());
+  memset(&response[12], 0, 12);
+  // The external address is ::ffff:203.0.113.7, and the port is the same.
+  memset(&response[44], 0, 10);
+  response[54] = response[55] = 0xff;
+  response[56] = 203;
+  response[57] = 0;
+  response[58] = 113;
+  response[59] = 7;
+  sim_net_send(response, sizeof(response), &router, from);
+}
+
+static void
+router_up(void * data)
+{
+  router_down = false;
+  router_boot = gm_clock_us();
+  if ( announce ) {
+    uint8_t p[ANNOUNCE_SIZE] = { 2, 0x80 };
+
+    put_32(&p[8], epoch());
+    sim_net_send(p, sizeof(p), &router, &all_hosts);
+  }
+}
+
+static void
+router_reboot(void * data)
+{
+  const int64_t now = gm_clock_us();
+
+  reboots++;
+  for ( unsigned int i = 0; i < number_of_mappings; i++ ) {
+    grant_t * const g = &grants[i];
+
+    if ( g->held && g->expires > now ) {
+      g->held = false;
+      g->lost = now;
+    }
+  }
+  router_down = true;
+  ESP_ERROR_CHECK(esp_timer_start_once(up_timer, down_s * SECOND_US));
+}
+
+static void
+idle_handler(int fd, void * data, bool readable, bool writable, bool exception, bool timeout)
+{
+  idle_t * const	c = data;
+  const int64_t		now = gm_clock_us();
+  const int64_t		elapsed = now - c->registered;
+
+  if ( !timeout )
+    return;
+  idle_timeouts++;
+  if ( elapsed < c->interval_us - GRANULARITY_US || elapsed > c->interval_us + GRANULARITY_US ) {
+    late_timeouts++;
+    error("Descriptor %d timed out after %lld us, rather than %lld us.\n", fd, (long long)elapsed, (long long)c->interval_us);
+  }
+  // Each starts at its own point, and then times out every IDLE_S.
+  if ( c->interval_us != IDLE_S * SECOND_US ) {
+    c->interval_us = IDLE_S * SECOND_US;
+    gm_fd_register(fd, idle_handler, c, true, false, false, IDLE_S);
+  }
+  c->registered = now;
+}
+
+static void
+usage(const char * name)
+{
+  fprintf(stderr, "Usage: %s [--days n] [--mappings n] [--lifetime s] [--reboot-hours n] [--down s] [--no-announce] [--loss fraction] [--latency-ms n] [--idle n] [--late-answer s] [--seed n] [-v]\n", name);
+  exit(2);
+}
+
+int
+main(int argc, char * * argv)
+{
+  for ( int i = 1; i < argc; i++ ) {
+    const bool has_value = i + 1 < argc;
+
+    if ( strcmp(argv[i], "--days") == 0 && has_value )
+      days = atof(argv[++i]);
+    else if ( strcmp(argv[i], "--mappings") == 0 && has_value )
+      number_of_mappings = atoi(argv[++i]);
+    else if ( strcmp(argv[i], "--lifetime") == 0 && has_value )
+      maximum_lifetime = atoi(argv[++i]);
+    else if ( strcmp(argv[i], "--reboot-hours") == 0 && has_value )
+      reboot_hours = atof(argv[++i]);
+    else if ( strcmp(argv[i], "--down") == 0 && has_value )
+      down_s = atoi(argv[++i]);
+    else if ( strcmp(argv[i], "--no-announce") == 0 )
+      announce = false;
+    else if ( strcmp(argv[i], "--loss") == 0 && has_value )
+      sim_net_loss = atof(argv[++i]);
+    else if ( strcmp(argv[i], "--latency-ms") == 0 && has_value )
+      sim_net_latency_us = atof(argv[++i]) * 1000;
+    else if ( strcmp(argv[i], "--idle") == 0 && has_value )
+      number_of_idle = atoi(argv[++i]);
+    else if ( strcmp(argv[i], "--late-answer") == 0 && has_value )
+      late_answer_s = atoi(argv[++i]);
+    else if ( strcmp(argv[i], "--seed") == 0 && has_value )
+      seed = strtoull(argv[++i], NULL, 0);
+    else if ( strcmp(argv[i], "-v") == 0 )
+      verbose = true;
+    else
+      usage(argv[0]);
+  }
+  if ( days <= 0 || number_of_mappings < 1 || number_of_mappings > MAXIMUM_MAPPINGS
+   || maximum_lifetime < 1 || number_of_idle > MAXIMUM_IDLE ) {
+    fprintf(stderr, "pcp_sim: --mappings is 1 to %d, --idle is at most %d, and --days and --lifetime must be positive.\n", MAXIMUM_MAPPINGS, MAXIMUM_IDLE);
+    return 2;
+  }
+
+  bench_seed(seed);
+  if ( verbose )
+    bench_print = print_message;
+
+  struct timespec	wall_start;
+  struct timespec	wall_end;
+  clock_gettime(CLOCK_MONOTONIC, &wall_start);
+
+  sim_net_start();
+  sim_net_set_time(1767225600);	// 2026-01-01, as SNTP would set it.
+  GM.time_last_synchronized = gm_clock_us();
+
+  // The station interface, behind the router.
+  gm_netif_t * const		sta = &GM.net_interfaces[GM_STA];
+  struct sockaddr_in * const	r = (struct sockaddr_in *)&router;
+  struct sockaddr_in * const	a = (struct sockaddr_in *)&all_hosts;
+
+  inet_pton(AF_INET, "192.168.1.50", &sta->ip4.address);
+  inet_pton(AF_INET, "192.168.1.1", &sta->ip4.router);
+  r->sin_family = AF_INET;
+  r->sin_addr = sta->ip4.router;
+  r->sin_port = htons(5351);
+  a->sin_family = AF_INET;
+  a->sin_addr.s_addr = htonl((224 << 24) + 1);
+  a->sin_port = htons(5350);
+  sim_net_listen(&router, router_receive, NULL);
+  router_boot = gm_clock_us() - HOUR_US;	// Up for a while already.
+
+  const esp_timer_create_args_t reboot_args = { .callback = router_reboot, .name = "reboot" };
+  const esp_timer_create_args_t up_args = { .callback = router_up, .name = "router up" };
+  ESP_ERROR_CHECK(esp_timer_create(&reboot_args, &reboot_timer));
+  ESP_ERROR_CHECK(esp_timer_create(&up_args, &up_timer));
+  if ( reboot_hours > 0 )
+    ESP_ERROR_CHECK(esp_timer_start_periodic(reboot_timer, reboot_hours * HOUR_US));
+
+  for ( unsigned int i = 0; i < number_of_idle; i++ ) {
+    idle_t * const c = &idle[i];
+
+    c->fd = socket(AF_INET6, SOCK_STREAM, 0);
+    c->registered = gm_clock_us();
+    c->interval_us = (1 + i * IDLE_S * 1000 / number_of_idle) * 1000LL;
+    gm_fd_register_ms(c->fd, idle_handler, c, true, false, false, c->interval_us / 1000);
+  }
+
+  gm_pcp_start_ipv4(sta);
+  for ( unsigned int i = 0; i < number_of_mappings; i++ )
+    gm_pcp_request_mapping_ipv4(sta, GM_PCP_TCP, FIRST_PORT + i, FIRST_PORT + i);
+
+  const int64_t start = gm_clock_us();
+  const int64_t end = start + (int64_t)(days * DAY_US);
+  sim_net_run(end);
+
+  // Mappings that are down at the end, and those that expired unrenewed.
+  for ( unsigned int i = 0; i < number_of_mappings; i++ ) {
+    grant_t * const g = &grants[i];
+
+    if ( g->held && g->expires <= end ) {
+      g->held = false;
+      g->lost = g->expires;
+      lapses++;
+      if ( verbose )
+        gm_printf("Router: the mapping of port %u expired.\n", FIRST_PORT + i);
+    }
+    if ( !g->held && g->ever )
+      end_outage(g, end);
+    else if ( !g->ever ) {
+      lapses++;
+      error("Router: the mapping of port %u was never granted.\n", FIRST_PORT + i);
+    }
+  }
+  gm_pcp_stop(sta);
+
+  clock_gettime(CLOCK_MONOTONIC, &wall_end);
+  const double wall_s = (wall_end.tv_sec - wall_start.tv_sec) + (wall_end.tv_nsec - wall_start.tv_nsec) / 1e9;
+  const double mapping_hours = number_of_mappings * (double)(end - start) / HOUR_US;
+  char when[32];
+
+  printf("Simulated %s in %.2f s, %.0f times real time.\n", format_time(end - start, when, sizeof(when)), wall_s, (end - start) / 1e6 / wall_s);
+  printf("PCP: %u mappings, lifetime %u s, %llu router reboots, %.1f%% loss, %.1f ms latency.\n",
+   number_of_mappings,
+   maximum_lifetime,
+   (unsigned long long)reboots,
+   sim_net_loss * 100,
+   sim_net_latency_us / 1000.0);
+  printf("Router: %llu requests, %.2f per mapping-hour, at most %u in a second and %u in a minute, %llu dropped while down.\n",
+   (unsigned long long)requests,
+   requests / mapping_hours,
+   per_second.peak,
+   per_minute.peak,
+   (unsigned long long)dropped_while_down);
+  printf("Outages: %llu, %.1f s per mapping, the longest %.1f s. %llu expired at the router.\n",
+   (unsigned long long)outages,
+   outage_us / 1e6 / number_of_mappings,
+   longest_outage_us / 1e6,
+   (unsigned long long)lapses);
+  printf("Select loop: %llu passes, %.1f per hour, %llu timers, %llu runs, %llu wakeups, %llu idle timeouts, %llu late.\n",
+   (unsigned long long)sim_net_stats.selects,
+   sim_net_stats.selects / ((double)(end - start) / HOUR_US),
+   (unsigned long long)sim_net_stats.timers_fired,
+   (unsigned long long)sim_net_stats.runs,
+   (unsigned long long)sim_net_stats.wakeups,
+   (unsigned long long)idle_timeouts,
+   (unsigned long long)late_timeouts);
+  printf("Network: %llu datagrams, %llu lost, %llu undeliverable. %lu failures, %llu repeated requests.\n",
+   (unsigned long long)sim_net_stats.datagrams_sent,
+   (unsigned long long)sim_net_stats.datagrams_lost,
+   (unsigned long long)sim_net_stats.datagrams_undeliverable,
+   bench_failures,
+   (unsigned long long)repeats);
+
+  return (lapses > 0 && late_answer_s == 0) || late_timeouts > 0 || bench_failures > 0 || repeats > 0;
+}
@@ -0,0 +1,300 @@
+// Symbolize a dump of the profiler, from the "profile" command or GET
+// /profile, against the ELF of the program, into folded stacks:
+//
+//   <task>;<outermost function>;...;<innermost function> <samples>
+//
+// which flamegraph.pl, speedscope, and Perfetto read.
+//
+//   profile_fold <elf> [dump] > profile.folded
+//   profile_fold build.k4vp/k4vp_2.elf https://<device>/profile > profile.folded
+//
+// A dump that starts with http:// or https:// is fetched with curl. A dump
+// captured from the telnet log server may have other log text in it, which
+// is skipped, and if it has more than one dump, the last is used. Addresses
+// are looked up with the addr2line for the architecture in the dump, or the
+// one in the ADDR2LINE environment variable.
+//
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MAXIMUM_TASKS	64
+#define MAXIMUM_DEPTH	32
+#define NAME_SIZE	64
+#define LINE_SIZE	1024
+
+typedef struct _task {
+  unsigned long	address;
+  char		name[NAME_SIZE];
+} task_t;
+
+typedef struct _sampled {
+  unsigned long	count;
+  unsigned long	task;
+  int		depth;
+  unsigned long	addresses[MAXIMUM_DEPTH];
+} sampled_t;
+
+typedef struct _symbol {
+  unsigned long	address;
+  char *	name;
+} symbol_t;
+
+typedef struct _folded {
+  char *	text;
+  unsigned long	count;
+} folded_t;
+
+static task_t		tasks[MAXIMUM_TASKS];
+static int		number_of_tasks = 0;
+static sampled_t *	stacks = NULL;
+static size_t		number_of_stacks = 0;
+static symbol_t *	symbols = NULL;
+static size_t		number_of_symbols = 0;
+static char		architecture[32] = "xtensa";
+
+static void
+fail(const char * what)
+{
+  fprintf(stderr, "profile_fold: %s.\n", what);
+  exit(1);
+}
+
+static void *
+grow(void * p, size_t number, size_t size)
+{
+  // Doubling, at each power of two.
+  if ( (number & (number - 1)) == 0 ) {
+    if ( (p = realloc(p, (number ? number * 2 : 16) * size)) == NULL )
+      fail("Out of memory");
+  }
+  return p;
+}
+
+static const char *
+task_name(unsigned long address)
+{
+  static char name[NAME_SIZE];
+
+  for ( int i = 0; i < number_of_tasks; i++ ) {
+    if ( tasks[i].address == address )
+      return tasks[i].name;
+  }
+  snprintf(name, sizeof(name), "task %lx", address);
+  return name;
+}
+
+static void
+read_dump(FILE * in)
+{
+  char line[LINE_SIZE];
+
+  while ( fgets(line, sizeof(line), in) ) {
+    char * const	end = line + strcspn(line, "\r\n");
+    int			n = 0;
+
+    *end = '\0';
+    if ( strncmp(line, "# gm_profile ", 13) == 0 ) {
+      // A later dump replaces an earlier one.
+      number_of_tasks = 0;
+      number_of_stacks = 0;
+      continue;
+    }
+    if ( line[0] == 'P' ) {
+      unsigned long samples;
+      unsigned long dropped;
+
+      if ( sscanf(line, "P %31s %*u %lu %lu", architecture, &samples, &dropped) == 3 && dropped > 0 )
+        fprintf(stderr, "profile_fold: %lu of %lu samples were dropped.\n", dropped, samples);
+      continue;
+    }
+    if ( line[0] == 'T' ) {
+      unsigned long address;
+
+      if ( sscanf(line, "T %lx %n", &address, &n) >= 1 && n > 0 && number_of_tasks < MAXIMUM_TASKS ) {
+        tasks[number_of_tasks].address = address;
+        snprintf(tasks[number_of_tasks].name, NAME_SIZE, "%s", &line[n]);
+        number_of_tasks++;
+      }
+      continue;
+    }
+    // The log may have other text in it.
+    if ( line[0] < '0' || line[0] > '9' )
+      continue;
+
+    sampled_t *	s;
+    const char *	p = line;
+
+    stacks = grow(stacks, number_of_stacks, sizeof(*stacks));
+    s = &stacks[number_of_stacks];
+    if ( sscanf(p, "%lu %lx %n", &s->count, &s->task, &n) < 2 || n == 0 )
+      continue;
+    p += n;
+    for ( s->depth = 0; s->depth < MAXIMUM_DEPTH && sscanf(p, "%lx %n", &s->addresses[s->depth], &n) == 1; s->depth++ )
+      p += n;
+    number_of_stacks++;
+  }
+}
+
+static int
+compare_symbols(const void * a, const void * b)
+{
+  const unsigned long x = ((const symbol_t *)a)->address;
+  const unsigned long y = ((const symbol_t *)b)->address;
+
+  return (x > y) - (x < y);
+}
+
+static const char *
+symbol(unsigned long address)
+{
+  const symbol_t	key = { .address = address };
+  const symbol_t *	s = bsearch(&key, symbols, number_of_symbols, sizeof(*symbols), compare_symbols);
+
+  return s ? s->name : "??";
+}
+
+// Look up every address at once, with one run of addr2line.
+static void
+symbolize(const char * elf)
+{
+  const char *	addr2line = getenv("ADDR2LINE");
+  char		path[] = "/tmp/profile_foldXXXXXX";
+  char		command[LINE_SIZE];
+  char		line[LINE_SIZE];
+  FILE *	f;
+  int		fd;
+  size_t	unique = 0;
+
+  if ( addr2line == NULL ) {
+    if ( strcmp(architecture, "host") == 0 )
+      addr2line = "addr2line";
+    else if ( strcmp(architecture, "riscv") == 0 )
+      addr2line = "riscv32-esp-elf-addr2line";
+    else
+      addr2line = "xtensa-esp32-elf-addr2line";
+  }
+
+  for ( size_t i = 0; i < number_of_stacks; i++ ) {
+    for ( int j = 0; j < stacks[i].depth; j++ ) {
+      symbols = grow(symbols, number_of_symbols, sizeof(*symbols));
+      symbols[number_of_symbols].address = stacks[i].addresses[j];
+      symbols[number_of_symbols++].name = NULL;
+    }
+  }
+  if ( number_of_symbols == 0 )
+    return;
+  qsort(symbols, number_of_symbols, sizeof(*symbols), compare_symbols);
+  for ( size_t i = 0; i < number_of_symbols; i++ ) {
+    if ( unique == 0 || symbols[i].address != symbols[unique - 1].address )
+      symbols[unique++] = symbols[i];
+  }
+  number_of_symbols = unique;
+
+  if ( (fd = mkstemp(path)) < 0 || (f = fdopen(fd, "w")) == NULL )
+    fail("Can't make a temporary file");
+  for ( size_t i = 0; i < number_of_symbols; i++ )
+    fprintf(f, "%#lx\n", symbols[i].address);
+  fclose(f);
+
+  snprintf(command, sizeof(command), "%s -f -C -e '%s' < '%s'", addr2line, elf, path);
+  if ( (f = popen(command, "r")) == NULL )
+    fail("Can't run addr2line");
+  // Two lines for each address: the function, and the file and line.
+  for ( size_t i = 0; i < number_of_symbols && fgets(line, sizeof(line), f); i++ ) {
+    line[strcspn(line, "\r\n")] = '\0';
+    if ( strcmp(line, "??") == 0 )
+      snprintf(line, sizeof(line), "%#lx", symbols[i].address);
+    if ( (symbols[i].name = strdup(line)) == NULL )
+      fail("Out of memory");
+    if ( fgets(line, sizeof(line), f) == NULL )
+      break;
+  }
+  if ( pclose(f) != 0 )
+    fprintf(stderr, "profile_fold: %s failed. Set ADDR2LINE to the one for the ELF.\n", addr2line);
+  unlink(path);
+}
+
+static int
+compare_folded(const void * a, const void * b)
+{
+  return strcmp(((const folded_t *)a)->text, ((const folded_t *)b)->text);
+}
+
+// Different addresses in a function fold into the same stack, so the counts
+// of the same folded stack are added.
+static void
+fold(void)
+{
+  folded_t *	folded = calloc(number_of_stacks + 1, sizeof(*folded));
+  size_t	n = 0;
+
+  if ( folded == NULL )
+    fail("Out of memory");
+  for ( size_t i = 0; i < number_of_stacks; i++ ) {
+    const sampled_t * const	s = &stacks[i];
+    char			text[LINE_SIZE * 2];
+    int				size;
+
+    size = snprintf(text, sizeof(text), "%s", task_name(s->task));
+    for ( int j = s->depth - 1; j >= 0 && size < (int)sizeof(text); j-- )
+      size += snprintf(&text[size], sizeof(text) - size, ";%s", symbol(s->addresses[j]));
+    // A space ends the stack, so there can be none in it.
+    for ( char * p = text; *p != '\0'; p++ ) {
+      if ( *p == ' ' )
+        *p = '_';
+    }
+    if ( (folded[n].text = strdup(text)) == NULL )
+      fail("Out of memory");
+    folded[n++].count = s->count;
+  }
+  qsort(folded, n, sizeof(*folded), compare_folded);
+  for ( size_t i = 0; i < n; i++ ) {
+    unsigned long count = folded[i].count;
+
+    while ( i + 1 < n && strcmp(folded[i].text, folded[i + 1].text) == 0 )
+      count += folded[++i].count;
+    printf("%s %lu\n", folded[i].text, count);
+  }
+}
+
+int
+main(int argc, char * * argv)
+{
+  FILE *	in = stdin;
+  const bool	url = argc == 3 && (strncmp(argv[2], "http://", 7) == 0 || strncmp(argv[2], "https://", 8) == 0);
+  char		command[LINE_SIZE];
+
+  if ( argc < 2 || argc > 3 ) {
+    fprintf(stderr, "Usage: %s elf [dump or URL]\n", argv[0]);
+    return 1;
+  }
+  if ( url ) {
+    // -k, as the device's certificate is self-signed.
+    snprintf(command, sizeof(command), "curl -s -S -f -k '%s'", argv[2]);
+    if ( (in = popen(command, "r")) == NULL ) {
+      perror("curl");
+      return 1;
+    }
+  }
+  else if ( argc == 3 && (in = fopen(argv[2], "r")) == NULL ) {
+    perror(argv[2]);
+    return 1;
+  }
+
+  read_dump(in);
+  if ( url ) {
+    if ( pclose(in) != 0 )
+      fail("Can't get the dump");
+  }
+  else if ( in != stdin )
+    fclose(in);
+
+  if ( number_of_stacks == 0 )
+    fail("There are no samples in the dump");
+  symbolize(argv[1]);
+  fold();
+  return 0;
+}
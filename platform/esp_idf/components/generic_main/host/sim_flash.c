@@ -0,0 +1,231 @@
+// Simulated FLASH key-value store. See sim_flash.h
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sim_flash.h"
+
+#define PAGE_SIZE		4096
+#define ENTRY_SIZE		32
+#define ENTRIES_PER_PAGE	126
+// Typical SPI NOR FLASH: program a 32-byte entry, and erase a 4K sector.
+#define PROGRAM_MICROSECONDS	50.0
+#define ERASE_MICROSECONDS	45000.0
+#define MAXIMUM_ITEMS		256
+
+typedef struct _item {
+  char		key[GM_CONFIG_KEY_SIZE];
+  char *	value;
+  size_t	page;
+  size_t	span;
+} item_t;
+
+typedef struct _page {
+  size_t	used;		// Entries written since the last erase.
+  size_t	erased;		// Of those, entries no longer live.
+  uint32_t	erase_count;
+} page_t;
+
+struct _sim_flash {
+  page_t *		pages;
+  size_t		number_of_pages;
+  size_t		active;
+  item_t		items[MAXIMUM_ITEMS];
+  size_t		number_of_items;
+  sim_flash_stats_t	stats;
+};
+
+static size_t
+span_of(const char * value)
+{
+  return 1 + (strlen(value) + 1 + ENTRY_SIZE - 1) / ENTRY_SIZE;
+}
+
+static item_t *
+find(sim_flash_t * f, const char * key)
+{
+  for ( size_t i = 0; i < f->number_of_items; i++ ) {
+    if ( strcmp(f->items[i].key, key) == 0 )
+      return &f->items[i];
+  }
+  return NULL;
+}
+
+static void
+erase_page(sim_flash_t * f, size_t p)
+{
+  f->pages[p].used = 0;
+  f->pages[p].erased = 0;
+  f->pages[p].erase_count++;
+  if ( f->pages[p].erase_count > f->stats.max_page_erases )
+    f->stats.max_page_erases = f->pages[p].erase_count;
+  f->stats.page_erases++;
+  f->stats.microseconds += ERASE_MICROSECONDS;
+}
+
+static void append(sim_flash_t * f, item_t * item);
+
+// Find a page with room, collecting garbage if there is none. Like NVS, one
+// page is always kept empty so that live entries can be moved into it.
+static void
+make_room(sim_flash_t * f, size_t span)
+{
+  for ( ;; ) {
+    size_t empty = 0;
+    size_t next = f->number_of_pages;
+
+    if ( f->pages[f->active].used + span <= ENTRIES_PER_PAGE )
+      return;
+
+    for ( size_t p = 0; p < f->number_of_pages; p++ ) {
+      if ( p != f->active && f->pages[p].used == 0 ) {
+        if ( next == f->number_of_pages )
+          next = p;
+        empty++;
+      }
+    }
+    if ( empty >= 2 ) {
+      f->active = next;
+      continue;
+    }
+    if ( next == f->number_of_pages ) {
+      fprintf(stderr, "Simulated FLASH has no spare page.\n");
+      abort();
+    }
+
+    // Collect the page with the most dead entries into the spare page.
+    size_t victim = f->number_of_pages;
+    for ( size_t p = 0; p < f->number_of_pages; p++ ) {
+      if ( p != next && f->pages[p].used > 0
+       && (victim == f->number_of_pages || f->pages[p].erased > f->pages[victim].erased) )
+        victim = p;
+    }
+    if ( victim == f->number_of_pages || f->pages[victim].erased == 0 ) {
+      fprintf(stderr, "Simulated FLASH is full.\n");
+      abort();
+    }
+    f->active = next;
+    for ( size_t i = 0; i < f->number_of_items; i++ ) {
+      if ( f->items[i].page == victim )
+        append(f, &f->items[i]);
+    }
+    erase_page(f, victim);
+  }
+}
+
+static void
+append(sim_flash_t * f, item_t * item)
+{
+  const size_t span = span_of(item->value);
+
+  make_room(f, span);
+  item->page = f->active;
+  item->span = span;
+  f->pages[f->active].used += span;
+  f->stats.entries_written += span;
+  f->stats.microseconds += span * PROGRAM_MICROSECONDS;
+}
+
+static void
+kill(sim_flash_t * f, item_t * item)
+{
+  f->pages[item->page].erased += item->span;
+  // Marking an entry erased is a write of its state bits.
+  f->stats.microseconds += PROGRAM_MICROSECONDS;
+}
+
+static gm_config_result_t
+get(void * context, const char * key, char * buffer, size_t size)
+{
+  sim_flash_t * const	f = context;
+  const item_t * const	item = find(f, key);
+
+  if ( item == NULL )
+    return GM_CONFIG_NOT_FOUND;
+  if ( strlen(item->value) >= size )
+    return GM_CONFIG_ERROR;
+  strcpy(buffer, item->value);
+  return GM_CONFIG_OK;
+}
+
+static gm_config_result_t
+set(void * context, const char * key, const char * value)
+{
+  sim_flash_t * const	f = context;
+  item_t *		item = find(f, key);
+
+  if ( item ) {
+    kill(f, item);
+    free(item->value);
+  }
+  else {
+    if ( f->number_of_items == MAXIMUM_ITEMS )
+      return GM_CONFIG_ERROR;
+    item = &f->items[f->number_of_items++];
+    strcpy(item->key, key);
+  }
+  item->value = strdup(value);
+  append(f, item);
+  return GM_CONFIG_OK;
+}
+
+static gm_config_result_t
+erase(void * context, const char * key)
+{
+  sim_flash_t * const	f = context;
+  item_t * const	item = find(f, key);
+
+  if ( item == NULL )
+    return GM_CONFIG_NOT_FOUND;
+  kill(f, item);
+  free(item->value);
+  *item = f->items[--f->number_of_items];
+  return GM_CONFIG_OK;
+}
+
+static gm_config_result_t
+commit(void * context)
+{
+  sim_flash_t * const f = context;
+
+  // NVS writes as it goes, commit is nearly free.
+  f->stats.commits++;
+  return GM_CONFIG_OK;
+}
+
+sim_flash_t *
+sim_flash_create(size_t size)
+{
+  sim_flash_t * const f = calloc(1, sizeof(*f));
+
+  f->number_of_pages = size / PAGE_SIZE;
+  f->pages = calloc(f->number_of_pages, sizeof(*f->pages));
+  return f;
+}
+
+void
+sim_flash_destroy(sim_flash_t * f)
+{
+  for ( size_t i = 0; i < f->number_of_items; i++ )
+    free(f->items[i].value);
+  free(f->pages);
+  free(f);
+}
+
+gm_config_backend_t
+sim_flash_backend(sim_flash_t * f)
+{
+  const gm_config_backend_t b = {
+    .get = get,
+    .set = set,
+    .erase = erase,
+    .commit = commit,
+    .context = f
+  };
+  return b;
+}
+
+void
+sim_flash_stats(const sim_flash_t * f, sim_flash_stats_t * stats)
+{
+  *stats = f->stats;
+}
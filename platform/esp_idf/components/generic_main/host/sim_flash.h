@@ -0,0 +1,24 @@
+#pragma once
+// Simulated FLASH key-value store for benchmarking on the host. It models the
+// log structure of ESP-IDF NVS: 4096-byte pages of 126 32-byte entries, written
+// sequentially, with garbage collection into a spare page. It counts page
+// erases and entry writes, and accumulates the time that the operations
+// would take on typical SPI FLASH.
+#include <stddef.h>
+#include <stdint.h>
+#include "gm_config_store.h"
+
+typedef struct _sim_flash sim_flash_t;
+
+typedef struct _sim_flash_stats {
+  uint64_t	entries_written;
+  uint64_t	page_erases;
+  uint32_t	max_page_erases;
+  uint64_t	commits;
+  double	microseconds;	// Simulated FLASH busy time.
+} sim_flash_stats_t;
+
+extern gm_config_backend_t	sim_flash_backend(sim_flash_t * f);
+extern sim_flash_t *		sim_flash_create(size_t size);
+extern void			sim_flash_destroy(sim_flash_t * f);
+extern void			sim_flash_stats(const sim_flash_t * f, sim_flash_stats_t * stats);
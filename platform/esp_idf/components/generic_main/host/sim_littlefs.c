@@ -0,0 +1,224 @@
+// Simulated littlefs. See sim_littlefs.h
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sim_littlefs.h"
+
+#define BLOCK_SIZE		4096
+#define PROGRAM_SIZE		128
+// A commit to a metadata pair, and its compaction every this many commits.
+#define COMMIT_SIZE		128
+#define COMMITS_PER_COMPACTION	32
+#define COMPACTION_SIZE		512
+// Typical SPI NOR FLASH: program a 256-byte page, and erase a 4K sector.
+#define PAGE_MICROSECONDS	700.0
+#define ERASE_MICROSECONDS	45000.0
+#define MAXIMUM_FILES		130
+// The file number of the index.
+#define INDEX_FILE		UINT32_MAX
+
+typedef struct _file {
+  uint32_t	number;
+  uint8_t *	data;
+  size_t	size;
+} file_t;
+
+struct _sim_littlefs {
+  file_t		files[MAXIMUM_FILES];
+  size_t		number_of_files;
+  uint32_t		commits_since_compaction;
+  sim_littlefs_stats_t	stats;
+};
+
+static file_t *
+find(sim_littlefs_t * fs, uint32_t number)
+{
+  for ( size_t i = 0; i < fs->number_of_files; i++ ) {
+    if ( fs->files[i].number == number )
+      return &fs->files[i];
+  }
+  return NULL;
+}
+
+static void
+program(sim_littlefs_t * fs, size_t size)
+{
+  size = (size + PROGRAM_SIZE - 1) / PROGRAM_SIZE * PROGRAM_SIZE;
+  fs->stats.bytes_programmed += size;
+  fs->stats.microseconds += size * PAGE_MICROSECONDS / 256.0;
+}
+
+static void
+erase(sim_littlefs_t * fs)
+{
+  fs->stats.erases++;
+  fs->stats.microseconds += ERASE_MICROSECONDS;
+}
+
+static void
+commit(sim_littlefs_t * fs)
+{
+  fs->stats.commits++;
+  program(fs, COMMIT_SIZE);
+  if ( ++fs->commits_since_compaction == COMMITS_PER_COMPACTION ) {
+    fs->commits_since_compaction = 0;
+    erase(fs);
+    program(fs, COMPACTION_SIZE);
+  }
+}
+
+// The FLASH operations of appending to a file of a size.
+static void
+write_blocks(sim_littlefs_t * fs, size_t offset, size_t size)
+{
+  const size_t tail = offset % BLOCK_SIZE;
+
+  // The partly written last block is copied to a new block with the data.
+  if ( tail != 0 ) {
+    const size_t n = size < BLOCK_SIZE - tail ? size : BLOCK_SIZE - tail;
+
+    erase(fs);
+    program(fs, tail + n);
+    offset += n;
+    size -= n;
+  }
+  while ( size > 0 ) {
+    const size_t n = size < BLOCK_SIZE ? size : BLOCK_SIZE;
+
+    erase(fs);
+    program(fs, n);
+    offset += n;
+    size -= n;
+  }
+}
+
+static file_t *
+open_file(sim_littlefs_t * fs, uint32_t number)
+{
+  file_t * f = find(fs, number);
+
+  if ( f == NULL ) {
+    if ( fs->number_of_files == MAXIMUM_FILES )
+      return NULL;
+    f = &fs->files[fs->number_of_files++];
+    f->number = number;
+    f->data = NULL;
+    f->size = 0;
+  }
+  return f;
+}
+
+int
+sim_littlefs_append(sim_littlefs_t * fs, uint32_t number, const void * data, size_t size)
+{
+  file_t * const	f = open_file(fs, number);
+  uint8_t *		bigger;
+
+  if ( f == NULL || (bigger = realloc(f->data, f->size + size)) == NULL )
+    return -1;
+  f->data = bigger;
+  write_blocks(fs, f->size, size);
+  memcpy(&f->data[f->size], data, size);
+  f->size += size;
+  commit(fs);
+  return 0;
+}
+
+static int
+append(void * context, uint32_t segment, const void * data, size_t size)
+{
+  return sim_littlefs_append(context, segment, data, size);
+}
+
+static long
+read_segment(void * context, uint32_t segment, size_t offset, void * data, size_t size)
+{
+  sim_littlefs_t * const	fs = context;
+  const file_t * const		f = find(fs, segment);
+
+  if ( f == NULL )
+    return -1;
+  if ( offset >= f->size )
+    return 0;
+  if ( size > f->size - offset )
+    size = f->size - offset;
+  memcpy(data, &f->data[offset], size);
+  fs->stats.bytes_read += size;
+  return size;
+}
+
+static int
+remove_segment(void * context, uint32_t segment)
+{
+  sim_littlefs_t * const	fs = context;
+  file_t * const		f = find(fs, segment);
+
+  if ( f == NULL )
+    return -1;
+  free(f->data);
+  *f = fs->files[--fs->number_of_files];
+  commit(fs);
+  return 0;
+}
+
+// Written to a new file that is renamed over the index, two commits.
+static int
+write_index(void * context, const void * data, size_t size)
+{
+  sim_littlefs_t * const	fs = context;
+  file_t * const		f = open_file(fs, INDEX_FILE);
+  uint8_t *			copy;
+
+  if ( f == NULL || (copy = malloc(size)) == NULL )
+    return -1;
+  memcpy(copy, data, size);
+  free(f->data);
+  f->data = copy;
+  f->size = size;
+  // A file that fits in the metadata is inlined there.
+  if ( size > COMMIT_SIZE )
+    write_blocks(fs, 0, size);
+  commit(fs);
+  commit(fs);
+  return 0;
+}
+
+static long
+read_index(void * context, void * data, size_t size)
+{
+  return read_segment(context, INDEX_FILE, 0, data, size);
+}
+
+gm_log_store_backend_t
+sim_littlefs_backend(sim_littlefs_t * fs)
+{
+  const gm_log_store_backend_t b = {
+    .append = append,
+    .read = read_segment,
+    .remove = remove_segment,
+    .write_index = write_index,
+    .read_index = read_index,
+    .context = fs
+  };
+  return b;
+}
+
+sim_littlefs_t *
+sim_littlefs_create(void)
+{
+  return calloc(1, sizeof(sim_littlefs_t));
+}
+
+void
+sim_littlefs_destroy(sim_littlefs_t * fs)
+{
+  for ( size_t i = 0; i < fs->number_of_files; i++ )
+    free(fs->files[i].data);
+  free(fs);
+}
+
+void
+sim_littlefs_stats(const sim_littlefs_t * fs, sim_littlefs_stats_t * stats)
+{
+  *stats = fs->stats;
+}
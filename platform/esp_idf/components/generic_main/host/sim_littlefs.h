@@ -0,0 +1,28 @@
+#pragma once
+// Simulated littlefs for benchmarking the log store on the host. It models
+// what littlefs does to the FLASH when a file is appended to and closed: data
+// goes into 4096-byte erase blocks, programmed in 128-byte units, and an
+// append to a block that was left partly written copies that block to a new
+// one. Each close commits to a metadata pair, which is compacted every few
+// commits. It counts bytes programmed and erases, and accumulates the time
+// that the operations would take on typical SPI FLASH.
+#include <stddef.h>
+#include <stdint.h>
+#include "gm_log_store.h"
+
+typedef struct _sim_littlefs sim_littlefs_t;
+
+typedef struct _sim_littlefs_stats {
+  uint64_t	bytes_programmed;
+  uint64_t	erases;
+  uint64_t	commits;
+  uint64_t	bytes_read;
+  double	microseconds;	// Simulated FLASH busy time.
+} sim_littlefs_stats_t;
+
+// Append to a file and close it, as a naive logger would.
+extern int			sim_littlefs_append(sim_littlefs_t * fs, uint32_t file, const void * data, size_t size);
+extern gm_log_store_backend_t	sim_littlefs_backend(sim_littlefs_t * fs);
+extern sim_littlefs_t *		sim_littlefs_create(void);
+extern void			sim_littlefs_destroy(sim_littlefs_t * fs);
+extern void			sim_littlefs_stats(const sim_littlefs_t * fs, sim_littlefs_stats_t * stats);
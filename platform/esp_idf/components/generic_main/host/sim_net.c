@@ -0,0 +1,585 @@
+// Simulated clock, timer task, and UDP network. See sim_net.h
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/select.h>
+#include <sys/syscall.h>
+#include <lwip/sockets.h>
+#include <esp_timer.h>
+#include "generic_main.h"
+#include "sim_net.h"
+
+// At least select_task.c's NUMBER_OF_FDS.
+#define NUMBER_OF_SOCKETS	100
+#define NUMBER_OF_LISTENERS	8
+#define NUMBER_OF_TIMERS	32
+#define NUMBER_OF_RUNS		256
+
+typedef struct _datagram {
+  struct _datagram *		next;
+  int64_t			arrival;
+  struct sockaddr_storage	from;
+  struct sockaddr_storage	to;
+  size_t			size;
+  uint8_t			data[];
+} datagram_t;
+
+typedef struct _sim_socket {
+  bool				open;
+  struct sockaddr_storage	bound;
+  datagram_t *			head;	// Received, not yet read.
+  datagram_t *			tail;
+} sim_socket_t;
+
+typedef struct _listener {
+  struct sockaddr_storage	address;
+  sim_receive_t			receive;
+  void *			context;
+} listener_t;
+
+typedef struct _run {
+  gm_run_t			function;
+  void *			data;
+} run_t;
+
+struct esp_timer {
+  esp_timer_cb_t		callback;
+  void *			arg;
+  int64_t			deadline;
+  int64_t			period;	// 0 for a one-shot timer.
+  bool				armed;
+};
+
+int64_t			sim_net_latency_us = 1000;
+double			sim_net_loss = 0;
+sim_net_stats_t		sim_net_stats;
+
+// Start a second after boot, so that no time is 0, which select_task.c takes
+// as no timeout.
+static int64_t		now = 1000000;
+static int64_t		end = INT64_MAX;
+// The time of day at boot.
+static time_t		boot_time = 0;
+static uint64_t		loss_state = 0x2545f4914f6cdd1dULL;
+
+static sim_socket_t	sockets[NUMBER_OF_SOCKETS];
+static listener_t	listeners[NUMBER_OF_LISTENERS];
+static size_t		number_of_listeners = 0;
+static struct esp_timer	timers[NUMBER_OF_TIMERS];
+static size_t		number_of_timers = 0;
+// In order of arrival.
+static datagram_t *	in_flight = NULL;
+
+static int		event_fd = -1;
+static run_t		runs[NUMBER_OF_RUNS];
+static size_t		run_head = 0;
+static size_t		run_count = 0;
+static bool		wake_pending = false;
+
+int64_t
+gm_clock_us(void)
+{
+  return now;
+}
+
+time_t
+gm_clock_time(void)
+{
+  return boot_time + (time_t)(now / 1000000);
+}
+
+void
+sim_net_set_time(time_t t)
+{
+  boot_time = t - (time_t)(now / 1000000);
+}
+
+// Timers.
+
+esp_err_t
+esp_timer_create(const esp_timer_create_args_t * args, esp_timer_handle_t * timer)
+{
+  if ( number_of_timers >= NUMBER_OF_TIMERS )
+    return ESP_ERR_NO_MEM;
+
+  struct esp_timer * const t = &timers[number_of_timers++];
+  t->callback = args->callback;
+  t->arg = args->arg;
+  *timer = t;
+  return ESP_OK;
+}
+
+int64_t
+esp_timer_get_time(void)
+{
+  return now;
+}
+
+// Like ESP-IDF, starting a timer that is running is an error.
+esp_err_t
+esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout_us)
+{
+  if ( timer->armed )
+    return ESP_ERR_INVALID_STATE;
+  timer->deadline = now + (int64_t)timeout_us;
+  timer->period = 0;
+  timer->armed = true;
+  return ESP_OK;
+}
+
+esp_err_t
+esp_timer_start_periodic(esp_timer_handle_t timer, uint64_t period_us)
+{
+  if ( timer->armed )
+    return ESP_ERR_INVALID_STATE;
+  timer->deadline = now + (int64_t)period_us;
+  timer->period = (int64_t)period_us;
+  timer->armed = true;
+  return ESP_OK;
+}
+
+esp_err_t
+esp_timer_stop(esp_timer_handle_t timer)
+{
+  if ( !timer->armed )
+    return ESP_ERR_INVALID_STATE;
+  timer->armed = false;
+  return ESP_OK;
+}
+
+static struct esp_timer *
+earliest_timer(void)
+{
+  struct esp_timer * earliest = NULL;
+
+  for ( size_t i = 0; i < number_of_timers; i++ ) {
+    if ( timers[i].armed && (earliest == NULL || timers[i].deadline < earliest->deadline) )
+      earliest = &timers[i];
+  }
+  return earliest;
+}
+
+// Call the callbacks of the timers that are due, in order, as the timer task
+// would.
+static void
+fire_timers(void)
+{
+  struct esp_timer * t;
+
+  while ( (t = earliest_timer()) != NULL && t->deadline <= now ) {
+    if ( t->period )
+      t->deadline += t->period;
+    else
+      t->armed = false;
+    sim_net_stats.timers_fired++;
+    (*t->callback)(t->arg);
+  }
+}
+
+// The network.
+
+static in_port_t
+port_of(const struct sockaddr_storage * s)
+{
+  if ( s->ss_family == AF_INET6 )
+    return ((const struct sockaddr_in6 *)s)->sin6_port;
+  else
+    return ((const struct sockaddr_in *)s)->sin_port;
+}
+
+static bool
+is_any(const struct sockaddr_storage * s)
+{
+  if ( s->ss_family == AF_INET6 )
+    return gm_all_zeroes(&((const struct sockaddr_in6 *)s)->sin6_addr, sizeof(struct in6_addr));
+  else
+    return ((const struct sockaddr_in *)s)->sin_addr.s_addr == INADDR_ANY;
+}
+
+static bool
+is_multicast(const struct sockaddr_storage * s)
+{
+  if ( s->ss_family == AF_INET6 )
+    return ((const struct sockaddr_in6 *)s)->sin6_addr.s6_addr[0] == 0xff;
+  else
+    return (ntohl(((const struct sockaddr_in *)s)->sin_addr.s_addr) >> 28) == 0xe;
+}
+
+static bool
+same_address(const struct sockaddr_storage * a, const struct sockaddr_storage * b)
+{
+  if ( a->ss_family != b->ss_family || port_of(a) != port_of(b) )
+    return false;
+  if ( a->ss_family == AF_INET6 )
+    return memcmp(&((const struct sockaddr_in6 *)a)->sin6_addr, &((const struct sockaddr_in6 *)b)->sin6_addr, sizeof(struct in6_addr)) == 0;
+  else
+    return ((const struct sockaddr_in *)a)->sin_addr.s_addr == ((const struct sockaddr_in *)b)->sin_addr.s_addr;
+}
+
+static bool
+host_part_matches(const struct sockaddr_storage * bound, const struct sockaddr_storage * to)
+{
+  if ( is_any(bound) || is_multicast(to) )
+    return true;
+  if ( bound->ss_family != to->ss_family )
+    return false;
+  if ( to->ss_family == AF_INET6 )
+    return memcmp(&((const struct sockaddr_in6 *)bound)->sin6_addr, &((const struct sockaddr_in6 *)to)->sin6_addr, sizeof(struct in6_addr)) == 0;
+  else
+    return ((const struct sockaddr_in *)bound)->sin_addr.s_addr == ((const struct sockaddr_in *)to)->sin_addr.s_addr;
+}
+
+static bool
+lost(void)
+{
+  if ( sim_net_loss <= 0 )
+    return false;
+
+  // xorshift64*, apart from esp_random(), so that the loss doesn't change
+  // the random numbers that the protocols see.
+  loss_state ^= loss_state >> 12;
+  loss_state ^= loss_state << 25;
+  loss_state ^= loss_state >> 27;
+  return (double)((loss_state * 0x2545f4914f6cdd1dULL) >> 11) / (double)(1ULL << 53) < sim_net_loss;
+}
+
+static void
+enqueue(const void * packet, size_t size, const struct sockaddr_storage * from, const struct sockaddr_storage * to)
+{
+  sim_net_stats.datagrams_sent++;
+  if ( lost() ) {
+    sim_net_stats.datagrams_lost++;
+    return;
+  }
+
+  datagram_t * const d = malloc(sizeof(*d) + size);
+  if ( d == NULL ) {
+    GM_FAIL("Simulated network: out of memory.");
+    return;
+  }
+  d->next = NULL;
+  d->arrival = now + sim_net_latency_us;
+  d->from = *from;
+  d->to = *to;
+  d->size = size;
+  memcpy(d->data, packet, size);
+
+  // The latency is the same for all, so this is almost always the end.
+  datagram_t * *	p = &in_flight;
+  while ( *p && (*p)->arrival <= d->arrival )
+    p = &(*p)->next;
+  d->next = *p;
+  *p = d;
+}
+
+void
+sim_net_send(const void * packet, size_t size, const struct sockaddr_storage * from, const struct sockaddr_storage * to)
+{
+  enqueue(packet, size, from, to);
+}
+
+void
+sim_net_listen(const struct sockaddr_storage * address, sim_receive_t receive, void * context)
+{
+  if ( number_of_listeners >= NUMBER_OF_LISTENERS ) {
+    GM_FAIL("Simulated network: too many listeners.");
+    return;
+  }
+  listeners[number_of_listeners++] = (listener_t){ *address, receive, context };
+}
+
+static void
+append(sim_socket_t * s, datagram_t * d)
+{
+  d->next = NULL;
+  if ( s->tail )
+    s->tail->next = d;
+  else
+    s->head = d;
+  s->tail = d;
+}
+
+// Give a datagram that has arrived to its listener, or to the sockets bound
+// to its port.
+static void
+deliver(datagram_t * d)
+{
+  for ( size_t i = 0; i < number_of_listeners; i++ ) {
+    if ( same_address(&listeners[i].address, &d->to) ) {
+      (*listeners[i].receive)(d->data, d->size, &d->from, listeners[i].context);
+      free(d);
+      return;
+    }
+  }
+
+  datagram_t *	next = d;
+
+  for ( int fd = 0; fd < NUMBER_OF_SOCKETS && next; fd++ ) {
+    sim_socket_t * const s = &sockets[fd];
+
+    if ( s->open && port_of(&s->bound) == port_of(&d->to) && host_part_matches(&s->bound, &d->to) ) {
+      datagram_t * copy = next;
+
+      // A multicast goes to each socket that's bound to its port.
+      if ( is_multicast(&d->to) ) {
+        if ( (copy = malloc(sizeof(*d) + d->size)) == NULL )
+          break;
+        memcpy(copy, d, sizeof(*d) + d->size);
+      }
+      else
+        next = NULL;
+      append(s, copy);
+    }
+  }
+  if ( next == d ) {
+    if ( !is_multicast(&d->to) )
+      sim_net_stats.datagrams_undeliverable++;
+    free(d);
+  }
+}
+
+static void
+deliver_arrived(void)
+{
+  while ( in_flight && in_flight->arrival <= now ) {
+    datagram_t * const d = in_flight;
+
+    in_flight = d->next;
+    deliver(d);
+  }
+}
+
+static sim_socket_t *
+sim_socket(int fd)
+{
+  if ( fd < 0 || fd >= NUMBER_OF_SOCKETS || !sockets[fd].open ) {
+    errno = EBADF;
+    return NULL;
+  }
+  return &sockets[fd];
+}
+
+int
+socket(int domain, int type, int protocol)
+{
+  const int fd = open("/dev/null", O_RDWR);
+
+  if ( fd < 0 )
+    return -1;
+  if ( fd >= NUMBER_OF_SOCKETS ) {
+    syscall(SYS_close, fd);
+    errno = EMFILE;
+    return -1;
+  }
+  memset(&sockets[fd], 0, sizeof(sockets[fd]));
+  sockets[fd].open = true;
+  sockets[fd].bound.ss_family = domain;
+  return fd;
+}
+
+int
+bind(int fd, const struct sockaddr * address, socklen_t size)
+{
+  sim_socket_t * const s = sim_socket(fd);
+
+  if ( s == NULL )
+    return -1;
+  memset(&s->bound, 0, sizeof(s->bound));
+  memcpy(&s->bound, address, size < sizeof(s->bound) ? size : sizeof(s->bound));
+  return 0;
+}
+
+int
+setsockopt(int fd, int level, int name, const void * value, socklen_t size)
+{
+  return sim_socket(fd) ? 0 : -1;
+}
+
+int
+shutdown(int fd, int how)
+{
+  return sim_socket(fd) ? 0 : -1;
+}
+
+int
+close(int fd)
+{
+  if ( fd >= 0 && fd < NUMBER_OF_SOCKETS && sockets[fd].open ) {
+    sim_socket_t * const s = &sockets[fd];
+
+    while ( s->head ) {
+      datagram_t * const d = s->head;
+
+      s->head = d->next;
+      free(d);
+    }
+    memset(s, 0, sizeof(*s));
+  }
+  return syscall(SYS_close, fd);
+}
+
+ssize_t
+sendto(int fd, const void * packet, size_t size, int flags, const struct sockaddr * to, socklen_t to_size)
+{
+  sim_socket_t * const		s = sim_socket(fd);
+  struct sockaddr_storage	destination = {};
+
+  if ( s == NULL )
+    return -1;
+  memcpy(&destination, to, to_size < sizeof(destination) ? to_size : sizeof(destination));
+  enqueue(packet, size, &s->bound, &destination);
+  return size;
+}
+
+ssize_t
+recvfrom(int fd, void * buffer, size_t size, int flags, struct sockaddr * from, socklen_t * from_size)
+{
+  sim_socket_t * const s = sim_socket(fd);
+
+  if ( s == NULL )
+    return -1;
+
+  datagram_t * const d = s->head;
+  if ( d == NULL ) {
+    errno = EAGAIN;
+    return -1;
+  }
+  if ( (s->head = d->next) == NULL )
+    s->tail = NULL;
+
+  const size_t length = d->size < size ? d->size : size;
+  memcpy(buffer, d->data, length);
+  if ( from && from_size ) {
+    const socklen_t address_size = d->from.ss_family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+
+    memcpy(from, &d->from, *from_size < address_size ? *from_size : address_size);
+    *from_size = address_size;
+  }
+  free(d);
+  return length;
+}
+
+// The event descriptor, which stands for the event server's socket.
+
+void
+gm_run(gm_run_t function, void * data, gm_run_speed_t speed)
+{
+  if ( run_count >= NUMBER_OF_RUNS ) {
+    GM_FAIL("Simulated event server: too many runs queued.");
+    return;
+  }
+  runs[(run_head + run_count++) % NUMBER_OF_RUNS] = (run_t){ function, data };
+  sim_net_stats.runs++;
+}
+
+void
+gm_select_wakeup(void)
+{
+  wake_pending = true;
+  sim_net_stats.wakeups++;
+}
+
+// Like the event server, handle one event each time that select() returns.
+static void
+event_handler(int fd, void * data, bool readable, bool writable, bool exception, bool timeout)
+{
+  if ( wake_pending ) {
+    wake_pending = false;
+    return;
+  }
+  if ( run_count > 0 ) {
+    const run_t r = runs[run_head];
+
+    run_head = (run_head + 1) % NUMBER_OF_RUNS;
+    run_count--;
+    (*r.function)(r.data);
+  }
+}
+
+void
+sim_net_start(void)
+{
+  if ( event_fd >= 0 )
+    return;
+  event_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  gm_fd_register(event_fd, event_handler, NULL, true, false, false, 0);
+}
+
+// select(), on the virtual clock.
+
+static bool
+readable(int fd)
+{
+  if ( fd >= NUMBER_OF_SOCKETS || !sockets[fd].open )
+    return false;
+  if ( fd == event_fd )
+    return wake_pending || run_count > 0;
+  return sockets[fd].head != NULL;
+}
+
+static int
+ready_descriptors(int nfds, fd_set * r, fd_set * w, fd_set * e, bool apply)
+{
+  int	ready = 0;
+
+  for ( int fd = 0; fd < nfds; fd++ ) {
+    const bool read_ready = r && FD_ISSET(fd, r) && readable(fd);
+    const bool write_ready = w && FD_ISSET(fd, w) && fd < NUMBER_OF_SOCKETS && sockets[fd].open;
+
+    ready += read_ready + write_ready;
+    if ( apply ) {
+      if ( r && !read_ready )
+        FD_CLR(fd, r);
+      if ( w && !write_ready )
+        FD_CLR(fd, w);
+      if ( e )
+        FD_CLR(fd, e);
+    }
+  }
+  return ready;
+}
+
+int
+select(int nfds, fd_set * r, fd_set * w, fd_set * e, struct timeval * timeout)
+{
+  const int64_t deadline = timeout
+   ? now + timeout->tv_sec * 1000000LL + timeout->tv_usec
+   : INT64_MAX;
+
+  sim_net_stats.selects++;
+  for ( ; ; ) {
+    const int ready = ready_descriptors(nfds, r, w, e, false);
+
+    if ( ready > 0 )
+      return ready_descriptors(nfds, r, w, e, true);
+    if ( now >= deadline || now >= end ) {
+      (void) ready_descriptors(nfds, r, w, e, true);
+      return 0;
+    }
+
+    // Sleep until the first thing that could happen.
+    int64_t next = deadline < end ? deadline : end;
+    const struct esp_timer * const t = earliest_timer();
+    if ( t && t->deadline < next )
+      next = t->deadline;
+    if ( in_flight && in_flight->arrival < next )
+      next = in_flight->arrival;
+    if ( next > now )
+      now = next;
+
+    fire_timers();
+    deliver_arrived();
+  }
+}
+
+void
+sim_net_run(int64_t end_time)
+{
+  end = end_time;
+  while ( now < end )
+    gm_select_once();
+}
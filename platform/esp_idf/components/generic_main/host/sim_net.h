@@ -0,0 +1,49 @@
+#pragma once
+// A simulated clock, timer task, and UDP network, under the generic_main
+// files on the host. gm_clock_us() is virtual time, which only moves when the
+// select loop would sleep: select() jumps it to the earliest timeout, timer,
+// or datagram arrival. The esp_timer callbacks run at their virtual times,
+// and gm_run() and gm_select_wakeup() go through an event descriptor that
+// select_task.c watches, as the event server's socket is on the device.
+//
+// socket(), bind(), sendto(), recvfrom(), and select() are replaced by
+// simulated ones. A simulated socket is a real descriptor on /dev/null, so
+// that select_task.c's check for closed descriptors works on it. A datagram
+// sent to an address given to sim_net_listen() goes to that function, which
+// stands for a server on the network, otherwise to the simulated sockets
+// bound to its port. Everything is deterministic, given the seed of
+// esp_random(), so a run can be repeated exactly.
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/socket.h>
+
+typedef struct _sim_net_stats {
+  uint64_t	selects;		// Passes of the select loop.
+  uint64_t	timers_fired;
+  uint64_t	runs;			// gm_run() calls.
+  uint64_t	wakeups;		// gm_select_wakeup() calls.
+  uint64_t	datagrams_sent;
+  uint64_t	datagrams_lost;
+  uint64_t	datagrams_undeliverable;
+} sim_net_stats_t;
+
+// Called with each datagram sent to an address given to sim_net_listen().
+typedef void (*sim_receive_t)(const void * packet, size_t size, const struct sockaddr_storage * from, void * context);
+
+// The one-way delay of datagrams, and the fraction of them that is lost.
+extern int64_t		sim_net_latency_us;
+extern double		sim_net_loss;
+extern sim_net_stats_t	sim_net_stats;
+
+// Receive the datagrams sent to *address*.
+extern void		sim_net_listen(const struct sockaddr_storage * address, sim_receive_t receive, void * context);
+// Run the select loop until gm_clock_us() is *end*.
+extern void		sim_net_run(int64_t end);
+// Send a datagram from a server, to arrive after sim_net_latency_us.
+extern void		sim_net_send(const void * packet, size_t size, const struct sockaddr_storage * from, const struct sockaddr_storage * to);
+// Set the time of day, as SNTP does.
+extern void		sim_net_set_time(time_t t);
+// Open the event descriptor. Call this before the first gm_run().
+extern void		sim_net_start(void);
@@ -0,0 +1,12 @@
+#pragma once
+typedef int (*esp_console_cmd_func_t)(int argc, char * * argv);
+
+typedef struct {
+  const char *		command;
+  const char *		help;
+  const char *		hint;
+  esp_console_cmd_func_t func;
+  void *		argtable;
+} esp_console_cmd_t;
+
+typedef struct esp_console_repl_s esp_console_repl_t;
@@ -0,0 +1,25 @@
+#pragma once
+// Host stand-ins for the ESP-IDF headers that generic_main.h and the files
+// built by the "bench" target include. Only what those files use is here.
+#include <stdio.h>
+#include <stdlib.h>
+
+typedef int esp_err_t;
+
+#define ESP_OK			0
+#define ESP_FAIL		-1
+#define ESP_ERR_NO_MEM		0x101
+#define ESP_ERR_INVALID_ARG	0x102
+#define ESP_ERR_INVALID_STATE	0x103
+#define ESP_ERR_NOT_FOUND	0x105
+
+#define ESP_ERROR_CHECK(x) \
+  do { \
+    const esp_err_t e = (x); \
+    if ( e != ESP_OK ) { \
+      fprintf(stderr, "%s:%d: %s failed: %d.\n", __FILE__, __LINE__, #x, e); \
+      abort(); \
+    } \
+  } while ( 0 )
+
+extern const char *	esp_err_to_name(esp_err_t);
@@ -0,0 +1,32 @@
+#pragma once
+#include <stddef.h>
+#include <sys/types.h>
+#include "esp_err.h"
+
+typedef void * httpd_handle_t;
+typedef void (*httpd_free_ctx_fn_t)(void * ctx);
+typedef void (*httpd_work_fn_t)(void * arg);
+
+#define HTTPD_RESP_USE_STRLEN	-1
+
+typedef struct httpd_req {
+  httpd_handle_t	handle;
+  int			method;
+  const char		uri[513];
+  size_t		content_len;
+  void *		aux;
+  void *		user_ctx;
+  void *		sess_ctx;
+  httpd_free_ctx_fn_t	free_ctx;
+} httpd_req_t;
+
+extern esp_err_t	httpd_req_get_cookie_val(httpd_req_t *, const char * name, char * value, size_t * size);
+extern esp_err_t	httpd_resp_set_hdr(httpd_req_t *, const char * field, const char * value);
+extern esp_err_t	httpd_queue_work(httpd_handle_t, httpd_work_fn_t work, void * arg);
+extern int		httpd_req_to_sockfd(httpd_req_t *);
+extern esp_err_t	httpd_resp_send(httpd_req_t *, const char * buffer, ssize_t length);
+extern esp_err_t	httpd_resp_send_chunk(httpd_req_t *, const char * buffer, ssize_t length);
+extern esp_err_t	httpd_resp_set_status(httpd_req_t *, const char * status);
+extern esp_err_t	httpd_resp_set_type(httpd_req_t *, const char * type);
+extern esp_err_t	httpd_sess_trigger_close(httpd_handle_t, int fd);
+extern int		httpd_socket_send(httpd_handle_t, int fd, const char * buffer, size_t length, int flags);
@@ -0,0 +1,4 @@
+#pragma once
+#include "esp_http_server.h"
+
+struct httpd_ssl_config;
@@ -0,0 +1,24 @@
+#pragma once
+#include <stdint.h>
+#include "esp_err.h"
+
+typedef struct esp_netif_obj esp_netif_t;
+
+typedef struct {
+  uint32_t	addr[4];
+  uint8_t	zone;
+} esp_ip6_addr_t;
+
+// In the order of GM.ipv6_address_types.
+typedef enum {
+  ESP_IP6_ADDR_IS_UNKNOWN,
+  ESP_IP6_ADDR_IS_GLOBAL,
+  ESP_IP6_ADDR_IS_LINK_LOCAL,
+  ESP_IP6_ADDR_IS_SITE_LOCAL,
+  ESP_IP6_ADDR_IS_UNIQUE_LOCAL,
+  ESP_IP6_ADDR_IS_IPV4_MAPPED_IPV6
+} esp_ip6_addr_type_t;
+
+extern esp_ip6_addr_type_t	esp_netif_ip6_get_addr_type(esp_ip6_addr_t *);
+extern int			esp_netif_get_netif_impl_index(esp_netif_t *);
+extern esp_err_t		esp_netif_get_netif_impl_name(esp_netif_t *, char * name);
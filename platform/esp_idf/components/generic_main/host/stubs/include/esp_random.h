@@ -0,0 +1,6 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+extern void	esp_fill_random(void * buffer, size_t size);
+extern uint32_t	esp_random(void);
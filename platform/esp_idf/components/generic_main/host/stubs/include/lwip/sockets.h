@@ -0,0 +1,18 @@
+#pragma once
+// lwIP's BSD socket API is the host's.
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+// As in lwIP, these are constant expressions, for static initializers.
+#undef htons
+#undef ntohs
+#undef htonl
+#undef ntohl
+#define htons(x)	((uint16_t)__builtin_bswap16(x))
+#define ntohs(x)	htons(x)
+#define htonl(x)	((uint32_t)__builtin_bswap32(x))
+#define ntohl(x)	htonl(x)
@@ -0,0 +1,24 @@
+#pragma once
+// AES-GCM, done with OpenSSL on the host, see bench_stubs.c.
+#include <stddef.h>
+
+#define MBEDTLS_GCM_ENCRYPT		1
+#define MBEDTLS_GCM_DECRYPT		0
+#define MBEDTLS_ERR_GCM_AUTH_FAILED	-0x0012
+#define MBEDTLS_ERR_GCM_BAD_INPUT	-0x0014
+
+typedef enum {
+  MBEDTLS_CIPHER_ID_NONE = 0,
+  MBEDTLS_CIPHER_ID_NULL,
+  MBEDTLS_CIPHER_ID_AES
+} mbedtls_cipher_id_t;
+
+typedef struct mbedtls_gcm_context {
+  void *	cipher;	// An EVP_CIPHER_CTX.
+} mbedtls_gcm_context;
+
+extern int	mbedtls_gcm_auth_decrypt(mbedtls_gcm_context *, size_t length, const unsigned char * iv, size_t iv_length, const unsigned char * add, size_t add_length, const unsigned char * tag, size_t tag_length, const unsigned char * input, unsigned char * output);
+extern int	mbedtls_gcm_crypt_and_tag(mbedtls_gcm_context *, int mode, size_t length, const unsigned char * iv, size_t iv_length, const unsigned char * add, size_t add_length, const unsigned char * input, unsigned char * output, size_t tag_length, unsigned char * tag);
+extern void	mbedtls_gcm_free(mbedtls_gcm_context *);
+extern void	mbedtls_gcm_init(mbedtls_gcm_context *);
+extern int	mbedtls_gcm_setkey(mbedtls_gcm_context *, mbedtls_cipher_id_t cipher, const unsigned char * key, unsigned int key_bits);
@@ -0,0 +1,19 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+
+#define NVS_KEY_NAME_MAX_SIZE	16
+
+typedef uint32_t nvs_handle_t;
+
+typedef enum {
+  NVS_READONLY,
+  NVS_READWRITE
+} nvs_open_mode_t;
+
+extern void		nvs_close(nvs_handle_t);
+extern esp_err_t	nvs_commit(nvs_handle_t);
+extern esp_err_t	nvs_get_blob(nvs_handle_t, const char * key, void * value, size_t * size);
+extern esp_err_t	nvs_open(const char * name, nvs_open_mode_t mode, nvs_handle_t * handle);
+extern esp_err_t	nvs_set_blob(nvs_handle_t, const char * key, const void * value, size_t size);
@@ -0,0 +1,2 @@
+#pragma once
+// generic_main.h includes this relative to the include directory.
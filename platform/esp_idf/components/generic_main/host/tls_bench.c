@@ -0,0 +1,277 @@
+// Benchmark the latency of full and resumed TLS handshakes, each with a small
+// HTTP request and response, as a browser makes when it opens a page.
+//
+// With no arguments, it runs against a server in this process, with an
+// RSA-2048 key and with a P-256 key, to compare them with each other and full
+// handshakes with resumed ones. The server is limited to TLS 1.2 and tickets,
+// as the device is. The host does RSA much faster, for its ECDSA speed, than
+// the device does, so the numbers that count are from the device. With an
+// address, it runs against one:
+//
+//   make -f platform/Makefile.native tls_bench
+//   build.$(arch)/tls_bench 192.168.1.50 [port] [handshakes]
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+
+#define DEFAULT_HANDSHAKES	200
+#define MAXIMUM_HANDSHAKES	10000
+
+static const char request[] = "GET / HTTP/1.1\r\nHost: device\r\nConnection: close\r\n\r\n";
+static const char response[] = "HTTP/1.1 301 Moved Permanently\r\nLocation: /index.html\r\nContent-Length: 0\r\n\r\n";
+
+typedef struct _server {
+  SSL_CTX *	context;
+  int		fd;
+} server_t;
+
+// Without this, the small writes of a resumed handshake wait for the delayed
+// ACK, and it measures that.
+static void
+no_delay(int fd)
+{
+  const int on = 1;
+
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+}
+
+static double
+now_ms(void)
+{
+  struct timespec t;
+
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000.0 + t.tv_nsec / 1e6;
+}
+
+static int
+compare(const void * a, const void * b)
+{
+  const double x = *(const double *)a;
+  const double y = *(const double *)b;
+
+  return (x > y) - (x < y);
+}
+
+static void
+fail(const char * what)
+{
+  fprintf(stderr, "tls_bench: %s.\n", what);
+  ERR_print_errors_fp(stderr);
+  exit(1);
+}
+
+// A self-signed certificate for a key, as the device makes.
+static X509 *
+certificate(EVP_PKEY * key)
+{
+  X509 * const	x = X509_new();
+  X509_NAME *	name;
+
+  X509_set_version(x, 2);
+  ASN1_INTEGER_set(X509_get_serialNumber(x), 1);
+  X509_gmtime_adj(X509_getm_notBefore(x), 0);
+  X509_gmtime_adj(X509_getm_notAfter(x), 3600);
+  X509_set_pubkey(x, key);
+  name = X509_get_subject_name(x);
+  X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (const unsigned char *)"tls_bench", -1, -1, 0);
+  X509_set_issuer_name(x, name);
+  if ( X509_sign(x, key, EVP_sha256()) == 0 )
+    fail("Can't sign the certificate");
+  return x;
+}
+
+static void *
+serve(void * data)
+{
+  server_t * const	s = data;
+  char			buffer[512];
+
+  for ( ; ; ) {
+    const int	fd = accept(s->fd, NULL, NULL);
+    SSL *	ssl;
+
+    if ( fd < 0 )
+      return NULL;
+    no_delay(fd);
+    ssl = SSL_new(s->context);
+    SSL_set_fd(ssl, fd);
+    if ( SSL_accept(ssl) == 1 && SSL_read(ssl, buffer, sizeof(buffer)) > 0 )
+      SSL_write(ssl, response, sizeof(response) - 1);
+    SSL_shutdown(ssl);
+    SSL_free(ssl);
+    close(fd);
+  }
+}
+
+// Start a server on a loopback port, with a new key of the given type.
+static int
+start_server(const char * algorithm, const char * parameter, server_t * s)
+{
+  EVP_PKEY *		key;
+  X509 *		x;
+  struct sockaddr_in	address = { .sin_family = AF_INET };
+  socklen_t		size = sizeof(address);
+  pthread_t		thread;
+
+  if ( strcmp(algorithm, "RSA") == 0 )
+    key = EVP_PKEY_Q_keygen(NULL, NULL, "RSA", (size_t)atoi(parameter));
+  else
+    key = EVP_PKEY_Q_keygen(NULL, NULL, "EC", parameter);
+  if ( key == NULL )
+    fail("Can't make a key");
+  x = certificate(key);
+
+  s->context = SSL_CTX_new(TLS_server_method());
+  SSL_CTX_set_max_proto_version(s->context, TLS1_2_VERSION);
+  // Like mbedtls, tickets but no cache of sessions by ID.
+  SSL_CTX_set_session_cache_mode(s->context, SSL_SESS_CACHE_OFF);
+  if ( SSL_CTX_use_certificate(s->context, x) != 1 || SSL_CTX_use_PrivateKey(s->context, key) != 1 )
+    fail("Can't use the key");
+  X509_free(x);
+  EVP_PKEY_free(key);
+
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  s->fd = socket(AF_INET, SOCK_STREAM, 0);
+  if ( s->fd < 0
+   ||  bind(s->fd, (struct sockaddr *)&address, sizeof(address)) != 0
+   ||  listen(s->fd, 16) != 0
+   ||  getsockname(s->fd, (struct sockaddr *)&address, &size) != 0 )
+    fail("Can't listen");
+  pthread_create(&thread, NULL, serve, s);
+  pthread_detach(thread);
+  return ntohs(address.sin_port);
+}
+
+static int
+connect_to(const char * host, int port)
+{
+  struct addrinfo	hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+  struct addrinfo *	list;
+  char			service[16];
+  int			fd = -1;
+
+  snprintf(service, sizeof(service), "%d", port);
+  if ( getaddrinfo(host, service, &hints, &list) != 0 )
+    fail("Can't look up the host");
+  for ( const struct addrinfo * a = list; a != NULL && fd < 0; a = a->ai_next ) {
+    fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+    if ( fd >= 0 && connect(fd, a->ai_addr, a->ai_addrlen) != 0 ) {
+      close(fd);
+      fd = -1;
+    }
+  }
+  freeaddrinfo(list);
+  if ( fd < 0 )
+    fail("Can't connect");
+  no_delay(fd);
+  return fd;
+}
+
+// One connection: the handshake, a request, and the response. Returns the
+// milliseconds it took, and the session to resume, which replaces *session.
+static double
+exchange(SSL_CTX * context, const char * host, int port, SSL_SESSION ** session, int * resumed)
+{
+  const double	start = now_ms();
+  const int	fd = connect_to(host, port);
+  SSL * const	ssl = SSL_new(context);
+  char		buffer[512];
+  double	elapsed;
+
+  SSL_set_fd(ssl, fd);
+  if ( *session )
+    SSL_set_session(ssl, *session);
+  if ( SSL_connect(ssl) != 1 )
+    fail("The handshake failed");
+  SSL_write(ssl, request, sizeof(request) - 1);
+  while ( SSL_read(ssl, buffer, sizeof(buffer)) > 0 )
+    ;
+  elapsed = now_ms() - start;
+
+  *resumed = SSL_session_reused(ssl);
+  if ( *session )
+    SSL_SESSION_free(*session);
+  *session = SSL_get1_session(ssl);
+  SSL_shutdown(ssl);
+  SSL_free(ssl);
+  close(fd);
+  return elapsed;
+}
+
+static void
+run(const char * name, const char * host, int port, int handshakes)
+{
+  SSL_CTX * const	context = SSL_CTX_new(TLS_client_method());
+  double *		times = calloc(handshakes, sizeof(*times));
+  SSL_SESSION *		session = NULL;
+  int			resumed;
+  int			number_resumed = 0;
+
+  SSL_CTX_set_verify(context, SSL_VERIFY_NONE, NULL);
+
+  for ( int resume = 0; resume <= 1; resume++ ) {
+    for ( int i = 0; i < handshakes; i++ ) {
+      if ( !resume && session ) {
+        SSL_SESSION_free(session);
+        session = NULL;
+      }
+      times[i] = exchange(context, host, port, &session, &resumed);
+      number_resumed += resume && resumed;
+    }
+    qsort(times, handshakes, sizeof(*times), compare);
+    printf(
+     "%-12s %-8s %8.2f %8.2f %8.2f\n",
+     name,
+     resume ? "resumed" : "full",
+     times[handshakes / 2],
+     times[handshakes * 9 / 10],
+     times[handshakes - 1]);
+  }
+  if ( number_resumed < handshakes )
+    printf("%-12s %d of %d sessions weren't resumed.\n", name, handshakes - number_resumed, handshakes);
+
+  if ( session )
+    SSL_SESSION_free(session);
+  SSL_CTX_free(context);
+  free(times);
+}
+
+int
+main(int argc, char * * argv)
+{
+  int handshakes = DEFAULT_HANDSHAKES;
+
+  if ( argc > 3 )
+    handshakes = atoi(argv[3]);
+  if ( handshakes < 1 || handshakes > MAXIMUM_HANDSHAKES ) {
+    fprintf(stderr, "Usage: %s [host [port [handshakes]]]\n", argv[0]);
+    return 1;
+  }
+
+  printf("%d handshakes each, ms:\n", handshakes);
+  printf("%-12s %-8s %8s %8s %8s\n", "server", "mode", "median", "90%", "maximum");
+
+  if ( argc > 1 )
+    run(argv[1], argv[1], argc > 2 ? atoi(argv[2]) : 443, handshakes);
+  else {
+    server_t rsa;
+    server_t ecdsa;
+
+    run("RSA-2048", "127.0.0.1", start_server("RSA", "2048", &rsa), handshakes);
+    run("P-256", "127.0.0.1", start_server("EC", "P-256", &ecdsa), handshakes);
+  }
+  return 0;
+}
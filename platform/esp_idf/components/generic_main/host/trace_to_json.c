@@ -0,0 +1,169 @@
+// Convert a dump of the trace ring, from the "trace" command or GET /trace,
+// to the Chrome trace JSON format, which chrome://tracing and Perfetto
+// (ui.perfetto.dev) open.
+//
+//   trace_to_json [dump] > trace.json
+//
+// Each task is a thread of the timeline. The ring holds the most recent
+// events, so the start of a span may have been overwritten; an end without
+// a beginning is dropped, rather than drawn from the start of the trace.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAXIMUM_TASKS	64
+#define NAME_SIZE	64
+
+typedef struct _task {
+  unsigned long	address;
+  char		name[NAME_SIZE];
+  int		depth;		// Of spans that are open.
+} task_t;
+
+static task_t	tasks[MAXIMUM_TASKS];
+static int	number_of_tasks = 0;
+static int	number_of_events = 0;
+
+static task_t *
+find_task(unsigned long address)
+{
+  for ( int i = 0; i < number_of_tasks; i++ ) {
+    if ( tasks[i].address == address )
+      return &tasks[i];
+  }
+  if ( number_of_tasks == MAXIMUM_TASKS )
+    return NULL;
+
+  task_t * const t = &tasks[number_of_tasks++];
+
+  t->address = address;
+  snprintf(t->name, sizeof(t->name), "task %lx", address);
+  t->depth = 0;
+  return t;
+}
+
+static void
+print_string(const char * s)
+{
+  putchar('"');
+  for ( ; *s != '\0'; s++ ) {
+    if ( *s == '"' || *s == '\\' )
+      printf("\\%c", *s);
+    else if ( (unsigned char)*s < ' ' )
+      printf("\\u%04x", *s);
+    else
+      putchar(*s);
+  }
+  putchar('"');
+}
+
+// Start a JSON event object.
+static void
+start_event(const char * name, char phase, long long time, int tid)
+{
+  printf("%s\n{\"name\":", number_of_events++ ? "," : "");
+  print_string(name);
+  printf(",\"ph\":\"%c\",\"ts\":%lld,\"pid\":0,\"tid\":%d", phase, time, tid);
+}
+
+static void
+event(const char * line)
+{
+  long long	time;
+  char		type;
+  int		core;
+  unsigned long	address;
+  long		value;
+  int		n = 0;
+  task_t *	t;
+
+  if ( sscanf(line, "%lld %c %d %lx %ld %n", &time, &type, &core, &address, &value, &n) < 5 || n == 0 ) {
+    fprintf(stderr, "trace_to_json: Can't parse: %s\n", line);
+    return;
+  }
+  if ( (t = find_task(address)) == NULL )
+    return;
+
+  const char * const	name = &line[n];
+  const int		tid = (int)(t - tasks) + 1;
+
+  switch ( type ) {
+  case 'B':
+    t->depth++;
+    start_event(name, 'B', time, tid);
+    printf(",\"args\":{\"core\":%d,\"value\":%ld}}", core, value);
+    break;
+  case 'E':
+    if ( t->depth == 0 )
+      return;
+    t->depth--;
+    start_event(name, 'E', time, tid);
+    printf("}");
+    break;
+  case 'i':
+    start_event(name, 'i', time, tid);
+    printf(",\"s\":\"t\",\"args\":{\"core\":%d,\"value\":%ld}}", core, value);
+    break;
+  case 'C':
+    start_event(name, 'C', time, tid);
+    printf(",\"args\":{");
+    print_string(name);
+    printf(":%ld}}", value);
+    break;
+  default:
+    fprintf(stderr, "trace_to_json: Unknown event type '%c'.\n", type);
+    break;
+  }
+}
+
+int
+main(int argc, char * * argv)
+{
+  FILE *	in = stdin;
+  char		line[512];
+
+  if ( argc > 2 ) {
+    fprintf(stderr, "Usage: %s [dump]\n", argv[0]);
+    return 1;
+  }
+  if ( argc == 2 && (in = fopen(argv[1], "r")) == NULL ) {
+    perror(argv[1]);
+    return 1;
+  }
+
+  printf("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+
+  while ( fgets(line, sizeof(line), in) ) {
+    char * const	end = line + strcspn(line, "\r\n");
+    unsigned long	address;
+    int			n = 0;
+
+    *end = '\0';
+    if ( line[0] == '\0' || line[0] == '#' )
+      continue;
+    if ( line[0] == 'T' ) {
+      task_t * t;
+
+      if ( sscanf(line, "T %lx %n", &address, &n) >= 1 && n > 0 && (t = find_task(address)) != NULL )
+        snprintf(t->name, sizeof(t->name), "%s", &line[n]);
+      continue;
+    }
+    // The log may have other text in it.
+    if ( line[0] < '0' || line[0] > '9' )
+      continue;
+    event(line);
+  }
+
+  for ( int i = 0; i < number_of_tasks; i++ ) {
+    start_event("thread_name", 'M', 0, i + 1);
+    printf(",\"args\":{\"name\":");
+    print_string(tasks[i].name);
+    printf("}}");
+  }
+  printf("\n]}\n");
+
+  if ( in != stdin )
+    fclose(in);
+  return 0;
+}
@@ -1,23 +1,77 @@
+#pragma once
+// compressed_fs: a read-only image of files, built on the host by
+// host/compressed_fs_build.c, and used in place, memory-mapped from a FLASH
+// partition.
+//
+// Layout, all numbers are 32-bit little-endian, and each part is 4-byte aligned:
+//
+//   struct compressed_fs_header
+//   struct compressed_fs_entry [number_of_files]	Sorted by name, with strcmp().
+//   uint32_t [hash_size]				Entry index + 1, or 0 if empty.
+//   names						Null-terminated.
+//   data
+//
+// The hash index is open-addressed with linear probing, so a lookup is one
+// hash and usually one string comparison. The sorted table allows a binary
+// search, and listing in order.
+//
+// ZLIB data is in the zlib format, which is what HTTP calls "deflate", so it
+// can be sent to a client as it is. It's compressed with a window of
+// 1 << COMPRESSED_FS_WINDOW_BITS bytes, so that it can be decompressed in
+// pieces with a buffer that size, rather than the usual 32K.
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
-extern const uint8_t	compressed_fs_magic[80];
+#define COMPRESSED_FS_MAGIC_SIZE	80
+#define COMPRESSED_FS_WINDOW_BITS	12
+#define COMPRESSED_FS_WINDOW_SIZE	(1 << COMPRESSED_FS_WINDOW_BITS)
+
+extern const uint8_t	compressed_fs_magic[COMPRESSED_FS_MAGIC_SIZE];
 
 enum compression_method {
   NONE,	// The file is not compressed, to prevent re-compressing image files, etc.
   ZERO_LENGTH, // This is a zero-length file, it has a name but no data.
-  ZLIB	// The file was compressed with zlib compress2(..., Z_BEST_COMPRESSION).
+  ZLIB	// The file was compressed with zlib deflate, Z_BEST_COMPRESSION.
 };
 
 struct compressed_fs_header {
-  uint8_t	magic[80];
+  uint8_t	magic[COMPRESSED_FS_MAGIC_SIZE];
   uint32_t	number_of_files;
   uint32_t	table_offset;
+  uint32_t	hash_offset;
+  uint32_t	hash_size;	// A power of two.
+  uint32_t	image_size;
 };
 
 struct compressed_fs_entry {
-  uint32_t			name_offset;
-  uint32_t			data_offset;
-  uint32_t			compressed_size;
-  uint32_t			size;
-  enum compression_method	method;
+  uint32_t	name_offset;
+  uint32_t	data_offset;
+  uint32_t	compressed_size;
+  uint32_t	size;
+  uint32_t	method;		// enum compression_method
 };
+
+// An image, validated by compressed_fs_open().
+typedef struct compressed_fs {
+  const uint8_t *				image;
+  size_t					size;
+  const struct compressed_fs_header *		header;
+  const struct compressed_fs_entry *		entries;
+  const uint32_t *				hash;
+} compressed_fs_t;
+
+// Decompression state for compressed_fs_read(). It's large, allocate it.
+typedef struct compressed_fs_reader compressed_fs_reader_t;
+
+extern const struct compressed_fs_entry *	compressed_fs_bsearch(const compressed_fs_t * fs, const char * name);
+extern const void *				compressed_fs_data(const compressed_fs_t * fs, const struct compressed_fs_entry * e);
+extern const struct compressed_fs_entry *	compressed_fs_find(const compressed_fs_t * fs, const char * name);
+extern uint32_t					compressed_fs_hash(const char * name);
+extern const char *				compressed_fs_name(const compressed_fs_t * fs, const struct compressed_fs_entry * e);
+extern bool					compressed_fs_open(compressed_fs_t * fs, const void * image, size_t size);
+
+// Stream decompression, on the device.
+extern compressed_fs_reader_t *			compressed_fs_reader_create(const compressed_fs_t * fs, const struct compressed_fs_entry * e);
+extern void					compressed_fs_reader_destroy(compressed_fs_reader_t * r);
+extern int					compressed_fs_read(compressed_fs_reader_t * r, void * buffer, size_t size);
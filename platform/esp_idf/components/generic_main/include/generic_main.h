@@ -17,6 +17,11 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <esp_debug_helpers.h>
+#include <mbedtls/gcm.h>
+#include "gm_clock.h"
+#include "gm_config_store.h"
+#include "gm_memory.h"
+#include "gm_telemetry.h"
 
 
 #define CONSTRUCTOR static void __attribute__ ((constructor))
@@ -44,6 +49,7 @@ extern void gm_fail_with_os_error(const char *, const char *, int, const char *,
 ESP_EVENT_DECLARE_BASE(GM_EVENT);
 
 typedef enum _gm_nonvolatile_result {
+  GM_INVALID = -3,
   GM_ERROR = -2,
   GM_NOT_IN_PARAMETER_TABLE = -1,
   GM_NORMAL = 0,
@@ -76,10 +82,21 @@ typedef enum _gm_event_id {
   GM_RUN
 } gm_event_id_t;
 
+// Where a public address came from, from the least to the most authoritative.
+typedef enum _gm_reachability_source {
+  GM_REACHABILITY_NONE = 0,
+  GM_REACHABILITY_HTTPS,	// An IP-echo web site.
+  GM_REACHABILITY_STUN,
+  GM_REACHABILITY_PCP		// The router.
+} gm_reachability_source_t;
+
 typedef void (*gm_fd_handler_t)(int fd, void * data, bool readable, bool writable, bool exception, bool timeout);
 typedef void (*gm_run_t)(void *);
 typedef void (*gm_stun_after_t)(bool success, bool ipv6, struct sockaddr * address);
 typedef void (*gm_ipv6_router_advertisement_after_t)(struct sockaddr_in6 * address, uint16_t lifetime);
+typedef void (*gm_reachability_handler_t)(bool ipv6, const struct sockaddr_storage * address, gm_reachability_source_t source);
+// Given each formatted log message, with its esp_timer_get_time() time.
+typedef void (*gm_log_sink_t)(int64_t time, const char * text, size_t size, void * data);
 
 typedef struct _gm_run_data {
   gm_run_t	procedure;
@@ -109,16 +126,20 @@ typedef struct _gm_netif gm_netif_t;
 
 // This is arranged in the hope of reducing unnecessary padding.
 // Note the enums restricted in size as bit-fields.
+// Times are gm_clock_us(), which doesn't jump when SNTP sets the clock.
 typedef struct _gm_port_mapping { 
   uint32_t			lifetime;
-  struct _gm_port_mapping *	next;
+  uint32_t			retransmit_ms;
+  struct _gm_port_mapping *	next_by_nonce;
+  struct _gm_port_mapping *	next_by_port;
   gm_netif_t *			interface;
-  struct timeval		granted_time;
-  struct timeval		expiration_time;
+  int64_t			expires;
+  int64_t			deadline;	// Of the next request.
   struct sockaddr_storage	internal;
   struct sockaddr_storage	external;
   gm_pcp_nonce_t		nonce;
   uint8_t			request_count;
+  uint8_t			heap_index;
   gm_pcp_protocol_t		protocol:6;
   gm_port_mapping_type_t	type:2;
 } gm_port_mapping_t;
@@ -132,7 +153,6 @@ struct _gm_netif {
     uint32_t		netmask;
     struct in_addr	router_public_ip;
     int			nat;	// 1 for NAT, 2 for double-nat.
-    gm_port_mapping_t *	port_mappings;
   } ip4;
   struct gm_netif_ip6 {
     struct in6_addr	link_local;
@@ -141,7 +161,6 @@ struct _gm_netif {
     struct in6_addr	global[3];
     struct in6_addr	router;
     struct in6_addr	router_public_ip;
-    gm_port_mapping_t *	port_mappings;
     bool pat66; // True if there is prefix-address-translation. Ugh.
     bool nat6;  // True if there is NAT6 that is not PAT66. Double-ugh.
   } ip6;
@@ -168,12 +187,56 @@ typedef struct _gm_user_data {
   uint8_t	banned:1;
 } gm_user_data_t;
 
+// The largest cookie value that we read. Our own cookie is much smaller.
+#define GM_COOKIE_SIZE		512
+// Our Set-Cookie datum, with its attributes.
+#define GM_SET_COOKIE_SIZE	200
+
+// The session data that the browser keeps for us, in an encrypted cookie.
+typedef struct _gm_cookie {
+  // User names are NVS keys, so they have the same size limit.
+  char		user_name[NVS_KEY_NAME_MAX_SIZE];
+  // Seconds since the epoch when the cookie was issued, 0 if unknown.
+  uint32_t	issued;
+} gm_cookie_t;
+
 typedef struct _gm_session_context {
-  cJSON *		json;
-  char *		user_name;
+  gm_cookie_t		cookie;
+  // Points to cookie.user_name if the user exists, otherwise NULL.
+  const char *		user_name;
   gm_user_data_t	user_data;
+  char			set_cookie[GM_SET_COOKIE_SIZE];
 } gm_session_context_t;
 
+typedef struct _gm_session_cache_stats {
+  uint32_t	hits;
+  uint32_t	misses;
+  uint32_t	expirations;
+  uint32_t	evictions;
+  uint32_t	invalidations;
+  uint32_t	entries;
+  uint32_t	size;
+} gm_session_cache_stats_t;
+
+// A binding request or indication, with no attributes.
+#define GM_STUN_MESSAGE_SIZE		20
+#define GM_STUN_TRANSACTION_ID_OFFSET	8
+
+// A UDP flow whose NAT binding is kept alive, see keepalive.c.
+typedef struct _gm_keepalive {
+  int				fd;
+  struct sockaddr_storage	peer;
+  bool				stun;		// The peer is a STUN server.
+  int64_t			last_sent;	// gm_clock_us(), set by keepalive.c.
+  struct _gm_keepalive *	next;
+} gm_keepalive_t;
+
+// Where the littlefs data partition is mounted.
+#define GM_DATA_PATH		"/data"
+#define GM_DATA_PARTITION	"littlefs1"
+// Holds the TLS key and certificate, see certificate.c.
+#define GM_KEYS_PARTITION	"keys"
+
 enum _gm_interface_index {
   GM_STA,
   GM_AP,
@@ -185,7 +248,6 @@ typedef struct _generic_main {
   gm_netif_t		net_interfaces[3]; // ap, sta, eth
   size_t		next_free_net_interface;
   esp_console_repl_t *	repl;
-  pthread_mutex_t 	console_print_mutex;
   int64_t		time_last_synchronized;
   uint8_t		factory_mac_address[6];
   const char *		application_name;
@@ -196,16 +258,12 @@ typedef struct _generic_main {
   const char * const	build_number;
   const char * const	nvs_index;
   const char * const	ipv6_address_types[6];
-  int			log_fd;
-  FILE *		log_file_pointer;
-  esp_aes_context	aes_cookie_context;
-  // We use the same AES initialization vector for cookie encoding all of the time,
-  // to avoid sending the IV as a second cookie.
-  // So the cookie plaintext _must_ contain randomness.
-  uint8_t		aes_cookie_iv[16];
-  uint8_t		hmac_key[64];
+  // AES-GCM context for cookie encryption and authentication.
+  mbedtls_gcm_context	cookie_gcm;
   // Set to the error if there is an indication that FLASH is failing.
   esp_err_t		flash_failure ;
+  // The littlefs partition is mounted at GM_DATA_PATH.
+  bool			data_filesystem_mounted;
 } generic_main_t;
 
 typedef struct _gm_param_t {
@@ -224,12 +282,74 @@ typedef struct gm_web_handler {
   struct gm_web_handler * next;
 } gm_web_handler_t;
 
+#define GM_FORM_NAME_SIZE	64
+#define GM_FORM_VALUE_SIZE	256
+
+// Callbacks for gm_form_receive(). Any of them may be NULL. The file callbacks
+// return 0 to continue, or non-zero to abort reception.
+typedef struct _gm_form_handlers {
+  // A complete field: a URL-encoded field, or a multipart part that isn't a file.
+  void	(*field)(const char * name, const char * value, void * context);
+  // The start of a file part of a multipart form.
+  int	(*file_start)(const char * name, const char * file_name, void * context);
+  // Some of the data of a file, in order.
+  int	(*file_data)(const char * data, size_t size, void * context);
+  // The end of a file.
+  int	(*file_end)(void * context);
+  void *	context;
+} gm_form_handlers_t;
+
+// A step of initialization, for gm_boot_run().
+typedef struct _gm_boot_step {
+  const char *	name;
+  void		(*run)(void);
+  uint32_t	needs;	// Bit (1 << index) for each step that must be done first.
+} gm_boot_step_t;
+
+// The CPU sampler, see cpu_sampler.c. Shares are in per mille of one core.
+#define GM_CPU_MAXIMUM_CORES	2
+#define GM_CPU_MAXIMUM_TASKS	48
+#define GM_CPU_TOP		4	// The busiest tasks kept in each sample.
+#define GM_CPU_NO_TASK		0xff
+
+typedef struct _gm_cpu_task {
+  char		name[16];
+  int8_t	core;		// -1 if it runs on either core.
+  bool		live;		// It was in the last sample.
+  uint16_t	share;		// In the last sample.
+  uint16_t	average;	// Over about the last ten samples.
+  uint16_t	peak;
+  uint64_t	run_time_us;	// Since the sampler started.
+} gm_cpu_task_t;
+
+typedef struct _gm_cpu_sample {
+  uint32_t	sequence;
+  uint32_t	time_ms;	// Since boot.
+  uint16_t	busy[GM_CPU_MAXIMUM_CORES];	// The share of each core that isn't idle.
+  struct {
+    uint8_t	task;		// For gm_cpu_task_name(), or GM_CPU_NO_TASK.
+    uint16_t	share;
+  } top[GM_CPU_TOP];
+} gm_cpu_sample_t;
+
+typedef void (*gm_cpu_visitor_t)(const gm_cpu_sample_t * sample, void * context);
+
 struct _GM_Array;
 
 typedef struct _GM_Array GM_Array;
+// Writes a new image into the assets partition, see assets.c.
+typedef struct _gm_assets_writer gm_assets_writer_t;
+typedef struct _gm_nonvolatile_subscription {
+  const char *	name;
+  void		(*changed)(const char * name, void * context);
+  void *	context;
+  struct _gm_nonvolatile_subscription * next;
+} gm_nonvolatile_subscription_t;
+
 typedef void (*gm_nonvolatile_list_coroutine_t)(const char *, const char *, const char *, gm_nonvolatile_result_t);
 typedef int (*gm_pattern_coroutine_t)(const char * name, char * result, size_t result_size);
 typedef void (*gm_web_get_coroutine_t)(const char * data, size_t size);
+typedef void (*gm_user_list_coroutine_t)(const char * name, const gm_user_data_t * data, void * context);
 
 extern generic_main_t		GM;
 
@@ -241,25 +361,44 @@ extern void			gm_array_destroy(GM_Array * array);
 extern const void *		gm_array_get(GM_Array * array, size_t index);
 extern size_t			gm_array_size(GM_Array * array);
 
+extern esp_err_t		gm_assets_file_handler(httpd_req_t * req, const gm_uri * uri);
+extern esp_err_t		gm_assets_write(gm_assets_writer_t * w, const void * data, size_t size);
+extern gm_assets_writer_t *	gm_assets_write_begin(void);
+extern esp_err_t		gm_assets_write_end(gm_assets_writer_t * w, bool complete);
+extern bool			gm_boot_milestone(const char * name);
+extern void			gm_boot_report(void);
+extern void			gm_boot_run(const gm_boot_step_t * steps, size_t count);
+extern void			gm_certificate_load(void);
 extern size_t			gm_choose_one(size_t number_of_entries);
+extern void			gm_cpu_history(uint32_t since_ms, gm_cpu_visitor_t visitor, void * context);
+extern void			gm_cpu_sampler_start(void);
+extern const char *		gm_cpu_task_name(unsigned int task);
+extern size_t			gm_cpu_tasks(gm_cpu_task_t * tasks, size_t size);
+extern bool			gm_client_accepts_compression(httpd_req_t * req, const char * type);
 extern void			gm_command_add_registered_to_console(void);
 extern void			gm_command_interpreter_start(void);
 extern void			gm_command_register(const esp_console_cmd_t * command);
+extern esp_err_t		gm_delete_user(const char * name);
+extern bool			gm_decode_cookie(char * value, size_t length, gm_cookie_t * cookie);
+extern int			gm_form_receive(httpd_req_t * req, const gm_form_handlers_t * handlers);
+extern void			gm_filesystem_initialize(void);
 extern esp_err_t		gm_flash_failure(const char *, esp_err_t err);
 extern int			gm_ddns(void);
+extern void			gm_ddns_start(void);
 
 extern void			gm_event_server(void);
 
 extern void			gm_get_handlers(httpd_handle_t server);
 extern esp_err_t		gm_get_user_data(const char * name, gm_user_data_t * data);
-extern cJSON *			gm_read_cookie(httpd_req_t * req);
 extern size_t			gm_match_bits(const void * const restrict av, const void * const restrict bv, size_t size);
 extern void			gm_sntp_start();
 extern void			gm_sntp_stop();
 extern esp_err_t		gm_start_redirect_to_https();
+extern void			gm_start_user_event_loops(void);
 extern void			gm_stop_redirect_to_https();
 extern void			gm_run(gm_run_t function, void * data, gm_run_speed_t speed);
 extern void			gm_fd_register(int fd, gm_fd_handler_t handler, void * data, bool readable, bool writable, bool exception, uint32_t seconds);
+extern void			gm_fd_register_ms(int fd, gm_fd_handler_t handler, void * data, bool readable, bool writable, bool exception, uint32_t milliseconds);
 extern void			gm_fd_unregister(int fd);
 
 extern void			gm_icmpv6_start_listener_ipv6(gm_ipv6_router_advertisement_after_t after);
@@ -267,39 +406,82 @@ extern void			gm_icmpv6_stop_listener_ipv6(void);
 
 extern void			gm_improv_wifi(int fd);
 
+extern void			gm_keepalive_activity(gm_keepalive_t * flow);
+extern void			gm_keepalive_add(gm_keepalive_t * flow);
+extern uint32_t			gm_keepalive_interval(void);
+extern void			gm_keepalive_remove(gm_keepalive_t * flow);
+extern void			gm_keepalive_start(void);
+extern void			gm_keepalive_stop(void);
+
+extern void			gm_log_console(int64_t time, const char * text, size_t size, void * data);
+extern void			gm_log_flush(void);
 extern void			gm_log_server_start(void);
 extern void			gm_log_server_stop(void);
+extern bool			gm_log_sink_add(gm_log_sink_t sink, void * data);
+extern void			gm_log_sink_remove(gm_log_sink_t sink, void * data);
+extern void			gm_log_start(void);
+extern void			gm_log_text(const char * text, size_t size);
 
+extern void			gm_nonvolatile_abort(void);
 extern gm_nonvolatile_result_t	gm_nonvolatile_erase(const char * name);
+extern bool			gm_nonvolatile_float(const char * name, double * number);
 extern gm_nonvolatile_result_t	gm_nonvolatile_get(const char * name, char * buffer, size_t size);
+extern void			gm_nonvolatile_initialize(void);
+extern bool			gm_nonvolatile_int(const char * name, long * integer);
 extern void			gm_nonvolatile_list(gm_nonvolatile_list_coroutine_t coroutine);
 extern gm_nonvolatile_result_t	gm_nonvolatile_set(const char * name, const char * value);
+extern const char *		gm_nonvolatile_string(const char * name);
+extern void			gm_nonvolatile_subscribe(gm_nonvolatile_subscription_t * subscription);
 
 extern void			gm_ntop(const struct sockaddr_storage * const s, char * const buffer, const size_t size);
 extern const char *		gm_param(const gm_param_t * p, int count, const char * name);
 extern int			gm_param_parse(const char * s, gm_param_t * p, int count);
 extern int			gm_pattern_string(const char * string, gm_pattern_coroutine_t coroutine, char * buffer, size_t buffer_size);
-extern void			gm_pcp_request_mapping_ipv4(gm_netif_t *);
-extern void			gm_pcp_request_mapping_ipv6(gm_netif_t *);
+extern bool			gm_pcp_external_address(bool ipv6, gm_pcp_protocol_t protocol, uint16_t internal_port, struct sockaddr_storage * external);
+extern void			gm_pcp_release_mapping(bool ipv6, gm_pcp_protocol_t protocol, uint16_t internal_port);
+extern void			gm_pcp_request_mapping_ipv4(gm_netif_t *, gm_pcp_protocol_t protocol, uint16_t internal_port, uint16_t external_port);
+extern void			gm_pcp_request_mapping_ipv6(gm_netif_t *, gm_pcp_protocol_t protocol, uint16_t internal_port, uint16_t external_port);
 extern void			gm_pcp_start_ipv4(gm_netif_t *);
 extern void			gm_pcp_start_ipv6(gm_netif_t *);
 extern void			gm_pcp_stop(gm_netif_t *);
+extern void			gm_persistent_log_start(void);
 extern int			gm_printf(const char * format, ...);
 extern int			gm_public_ipv4(char * data, size_t size);
 
+extern bool			gm_reachability_address(bool ipv6, struct sockaddr_storage * address, gm_reachability_source_t * source, uint32_t * age_s);
+extern void			gm_reachability_report(bool ipv6, gm_reachability_source_t source, const struct sockaddr_storage * address);
+extern const char *		gm_reachability_source_name(gm_reachability_source_t source);
+extern void			gm_reachability_start(bool ipv6);
+extern void			gm_reachability_stop(void);
+extern void			gm_reachability_subscribe(gm_reachability_handler_t handler);
+
 extern void			gm_self_signed_ssl_certificates(struct httpd_ssl_config * c);
-extern void			gm_session(httpd_req_t * req);
-extern int			gm_stun(bool ipv6, struct sockaddr * address, gm_stun_after_t after);
+extern esp_err_t		gm_session(httpd_req_t * req);
+extern void			gm_session_cache_invalidate(const char * user_name);
+extern void			gm_session_cache_stats(gm_session_cache_stats_t * stats);
+extern esp_err_t		gm_set_user_data(const char * name, const gm_user_data_t * data);
+extern int			gm_stun(bool ipv6, gm_stun_after_t after);
+extern bool			gm_stun_mapped_address(const void * packet, size_t size, bool ipv6, struct sockaddr_storage * address);
+extern size_t			gm_stun_message(void * buffer, bool indication, uint32_t transaction_id[3]);
+extern bool			gm_stun_server(bool ipv6, struct sockaddr_storage * address);
 extern void			gm_stun_stop();
 
+extern void			gm_select_once(void);
 extern void			gm_select_task(void);
 extern void			gm_select_wakeup(void);
 
+extern int			gm_telemetry_add_client(httpd_req_t * req);
+extern void			gm_telemetry_socket_closed(int fd);
 extern void			gm_timer_to_human(int64_t, char *, size_t);
 
 extern void			gm_uart_initialize(void);
+extern void			gm_user_directory_load(void);
+extern cJSON *			gm_user_export(void);
+extern int			gm_user_import(const cJSON * array);
 extern void			gm_user_initialize_early(void);
 extern void			gm_user_initialize_late(void);
+extern size_t			gm_user_list(gm_user_list_coroutine_t coroutine, void * context);
+extern bool			gm_user_may_transmit(const char * name);
 extern int			gm_uri_decode(const char * uri, char * buffer, size_t size);
 extern int			gm_uri_parse(const char * uri, gm_uri * u) ;
 
@@ -313,6 +495,7 @@ extern void			gm_web_handler_register(gm_web_handler_t * handler, gm_web_method
 extern int			gm_web_handler_run(httpd_req_t * req, const gm_uri * uri, gm_web_method method);
 extern void			gm_web_send_to_client (const char *d, size_t size);
 extern void			gm_web_set_request(void * context);
+extern void			gm_webserver_initialize(void);
 
 extern bool			gm_wifi_is_connected(void);
 extern void			gm_wifi_events_initialize(void);
@@ -322,4 +505,4 @@ extern void			gm_wifi_stop(void);
 extern void			gm_wifi_wait_until_disconnected(void);
 extern void			gm_wifi_wait_until_ready(void);
 
-void				gm_write_cookie(httpd_req_t * const req, cJSON * const json);
+extern void			gm_write_cookie(httpd_req_t * const req, const gm_cookie_t * const cookie);
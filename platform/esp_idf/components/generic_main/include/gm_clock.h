@@ -0,0 +1,28 @@
+#ifndef _GM_CLOCK_DOT_H_
+#define _GM_CLOCK_DOT_H_
+// The clock of the protocols.
+//
+// The select loop's timeouts, PCP renewal, STUN, the keepalives, the SNTP
+// synchronization time, and session and cookie expiry all read the time
+// here, rather than from esp_timer_get_time(), gettimeofday(), or time(), so
+// that the host simulation can run them on a virtual clock, and days of
+// protocol time pass in seconds:
+//
+//   make -f platform/Makefile.native pcp_sim
+//
+// gm_clock_us() is monotonic microseconds since boot. It doesn't jump when
+// SNTP sets the time of day. gm_clock_time() is the time of day in seconds
+// since 1970, which is only right once SNTP has set it, see
+// GM.time_last_synchronized. Timers are esp_timer's, and the simulation fires
+// them on its clock too.
+//
+// Diagnostics that measure the firmware itself, such as the profiler, the
+// trace ring, and the boot timings, stay on the real clock.
+
+#include <stdint.h>
+#include <time.h>
+
+extern int64_t	gm_clock_us(void);
+extern time_t	gm_clock_time(void);
+
+#endif
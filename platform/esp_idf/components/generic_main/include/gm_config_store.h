@@ -0,0 +1,62 @@
+#pragma once
+// Configuration store: transactions, a RAM write-back buffer, and FLASH wear
+// accounting, over a key-value backend. This is portable C, so that it can be
+// run on the host with a simulated FLASH for benchmarking.
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// The same as NVS_KEY_NAME_MAX_SIZE.
+#define GM_CONFIG_KEY_SIZE	16
+#define GM_CONFIG_VALUE_SIZE	256
+// Changes held in RAM before they must be written.
+#define GM_CONFIG_PENDING	8
+// Keys with write counters.
+#define GM_CONFIG_COUNTERS	32
+// The key that holds the write counters.
+#define GM_CONFIG_WEAR_KEY	"wear"
+
+typedef enum _gm_config_result {
+  GM_CONFIG_ERROR = -1,
+  GM_CONFIG_OK = 0,
+  GM_CONFIG_NOT_FOUND = 1
+} gm_config_result_t;
+
+typedef struct _gm_config_backend {
+  gm_config_result_t	(*get)(void * context, const char * key, char * buffer, size_t size);
+  gm_config_result_t	(*set)(void * context, const char * key, const char * value);
+  gm_config_result_t	(*erase)(void * context, const char * key);
+  gm_config_result_t	(*commit)(void * context);
+  void *		context;
+} gm_config_backend_t;
+
+// Called after a flush with the keys that were actually changed.
+typedef void (*gm_config_changed_t)(const char * const keys[], size_t count);
+typedef void (*gm_config_counter_coroutine_t)(const char * key, uint32_t writes, void * context);
+
+typedef struct _gm_config_wear {
+  uint32_t	commits;	// Backend commits.
+  uint32_t	writes;		// Keys written or erased.
+  uint32_t	skipped;	// Sets that didn't change the stored value.
+  uint64_t	entries;	// Estimated 32-byte FLASH entries written.
+  uint64_t	entries_since_start;	// Since gm_config_init().
+} gm_config_wear_t;
+
+typedef struct _gm_config_life {
+  double	erase_cycles;		// Average erase cycles of each page, so far.
+  double	remaining_fraction;	// Of the rated erase cycles.
+  double	days_remaining;		// At the observed rate, or < 0 if unknown.
+} gm_config_life_t;
+
+extern gm_config_result_t	gm_config_abort(void);
+extern gm_config_result_t	gm_config_begin(void);
+extern gm_config_result_t	gm_config_commit(void);
+extern void			gm_config_counters(gm_config_counter_coroutine_t coroutine, void * context);
+extern gm_config_result_t	gm_config_erase(const char * key);
+extern void			gm_config_estimate_life(const gm_config_wear_t * wear, size_t partition_size, double seconds_since_start, gm_config_life_t * life);
+extern gm_config_result_t	gm_config_flush(void);
+extern gm_config_result_t	gm_config_get(const char * key, char * buffer, size_t size);
+extern void			gm_config_init(const gm_config_backend_t * backend, gm_config_changed_t changed);
+extern bool			gm_config_pending(void);
+extern gm_config_result_t	gm_config_set(const char * key, const char * value);
+extern void			gm_config_wear(gm_config_wear_t * wear);
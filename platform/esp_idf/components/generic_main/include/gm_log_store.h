@@ -0,0 +1,56 @@
+#pragma once
+// Persistent log store: compressed blocks of log messages in size-rotated
+// segments, with an index of the time range of each segment. This is portable
+// C, so that it can be run on the host with a simulated FLASH for
+// benchmarking. On the device, persistent_log.c keeps it in files on the
+// littlefs data partition.
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Log text is gathered into blocks of this size before it's compressed.
+#define GM_LOG_STORE_BLOCK_SIZE		4096
+// Compressed blocks are written to the backend in chunks of this size, at
+// offsets in the segment that are multiples of it, which is the erase block
+// size of littlefs.
+#define GM_LOG_STORE_CHUNK_SIZE		4096
+#define GM_LOG_STORE_MAXIMUM_SEGMENTS	64
+
+typedef struct _gm_log_store_backend {
+  // Append to a segment, creating it if it doesn't exist. Return 0, or -1 on error.
+  int	(*append)(void * context, uint32_t segment, const void * data, size_t size);
+  // Read from a segment. Return the number of bytes read, 0 at the end, or -1.
+  long	(*read)(void * context, uint32_t segment, size_t offset, void * data, size_t size);
+  int	(*remove)(void * context, uint32_t segment);
+  // Replace the index, atomically if possible.
+  int	(*write_index)(void * context, const void * data, size_t size);
+  long	(*read_index)(void * context, void * data, size_t size);
+  void *	context;
+} gm_log_store_backend_t;
+
+typedef struct _gm_log_store_config {
+  size_t	segment_size;	// Start a new segment after this many bytes.
+  size_t	budget;		// Delete the oldest segments to stay within this.
+} gm_log_store_config_t;
+
+typedef struct _gm_log_store_stats {
+  uint64_t	messages;
+  uint64_t	dropped;	// Messages that arrived while both blocks were full.
+  uint64_t	raw_bytes;	// Of the messages, with their times and lengths.
+  uint64_t	stored_bytes;	// Compressed blocks with their headers.
+  uint64_t	appends;	// Backend append operations.
+  uint32_t	blocks;
+  uint32_t	segments_removed;
+  uint32_t	number_of_segments;
+  uint64_t	total_size;	// Of the segments.
+} gm_log_store_stats_t;
+
+// Called for each stored message in a time range, in time order.
+// Return non-zero to stop reading.
+typedef int (*gm_log_store_reader_t)(int64_t time, const char * text, size_t size, void * context);
+
+extern void	gm_log_store_flush(bool all);
+extern int	gm_log_store_init(const gm_log_store_backend_t * backend, const gm_log_store_config_t * config);
+extern int	gm_log_store_read(int64_t from, int64_t to, gm_log_store_reader_t reader, void * context);
+extern void	gm_log_store_stats(gm_log_store_stats_t * stats);
+extern bool	gm_log_store_write(int64_t time, const char * text, size_t size);
@@ -0,0 +1,90 @@
+#ifndef _GM_MEMORY_DOT_H_
+#define _GM_MEMORY_DOT_H_
+// Tagged memory allocation, for accounting of the heap by subsystem.
+//
+// gm_malloc() and its friends take a tag for the subsystem that the memory is
+// for, and keep, per tag, the bytes that are live, their peak, the number of
+// allocations, frees, and failures, and the largest free block of the heap
+// when the peak was last sampled, which shows if the subsystem is running
+// into fragmentation rather than a lack of memory. Memory from gm_malloc()
+// must be released with gm_free(), and vice versa for malloc() and free().
+//
+// Every live allocation is on a list with where it was allocated and a
+// sequence number, so that the allocations made since a mark, and still
+// live, can be listed by their site, to find leaks:
+//
+//   const uint32_t mark = gm_memory_mark();
+//   ... do something that should leave no memory allocated ...
+//   gm_memory_since(mark, reporter, context);
+//
+// The "mem" console command and GET /memory report these.
+//
+// This is portable C, so that the radio driver can use it on the host.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef enum _gm_memory_tag {
+  GM_MEMORY_OTHER = 0,
+  GM_MEMORY_ASSETS,
+  GM_MEMORY_CHANNELS,
+  GM_MEMORY_COMMANDS,
+  GM_MEMORY_CONFIG,
+  GM_MEMORY_CPU,
+  GM_MEMORY_LOG,
+  GM_MEMORY_PCP,
+  GM_MEMORY_PROFILE,
+  GM_MEMORY_RADIO,
+  GM_MEMORY_REDIRECT,
+  GM_MEMORY_SESSION,
+  GM_MEMORY_STUN,
+  GM_MEMORY_TEMPLATE,
+  GM_MEMORY_TRACE,
+  GM_MEMORY_TAGS		// The number of tags, not a tag.
+} gm_memory_tag_t;
+
+typedef struct _gm_memory_stats {
+  size_t	live_bytes;
+  size_t	peak_bytes;
+  uint32_t	live_allocations;
+  uint32_t	allocations;	// Since boot, including reallocations.
+  uint32_t	frees;
+  uint32_t	failures;
+  // The largest free block of the heap when the peak was last sampled, 0 if
+  // it's unknown.
+  size_t	largest_free_at_peak;
+} gm_memory_stats_t;
+
+typedef struct _gm_memory_heap {
+  size_t	free_bytes;
+  size_t	minimum_free_bytes;	// Since boot.
+  size_t	largest_free_block;
+} gm_memory_heap_t;
+
+// Called for each site with live allocations made since a mark.
+typedef void (*gm_memory_site_t)(
+ gm_memory_tag_t	tag,
+ const char *		file,
+ int			line,
+ uint32_t		allocations,
+ size_t			bytes,
+ void *			context);
+
+extern void *		gm_memory_allocate(gm_memory_tag_t tag, size_t size, const char * file, int line);
+extern void *		gm_memory_allocate_zeroed(gm_memory_tag_t tag, size_t number, size_t size, const char * file, int line);
+extern char *		gm_memory_duplicate_string(gm_memory_tag_t tag, const char * s, const char * file, int line);
+extern void		gm_memory_heap(gm_memory_heap_t * heap);
+extern uint32_t		gm_memory_mark(void);
+extern void *		gm_memory_reallocate(gm_memory_tag_t tag, void * p, size_t size, const char * file, int line);
+extern void		gm_memory_since(uint32_t mark, gm_memory_site_t site, void * context);
+extern void		gm_memory_stats(gm_memory_tag_t tag, gm_memory_stats_t * stats);
+extern const char *	gm_memory_tag_name(gm_memory_tag_t tag);
+extern void		gm_free(void * p);
+
+#define gm_malloc(tag, size)		gm_memory_allocate((tag), (size), __FILE__, __LINE__)
+#define gm_calloc(tag, number, size)	gm_memory_allocate_zeroed((tag), (number), (size), __FILE__, __LINE__)
+#define gm_realloc(tag, p, size)	gm_memory_reallocate((tag), (p), (size), __FILE__, __LINE__)
+#define gm_strdup(tag, s)		gm_memory_duplicate_string((tag), (s), __FILE__, __LINE__)
+
+#endif
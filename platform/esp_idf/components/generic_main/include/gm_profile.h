@@ -0,0 +1,64 @@
+#ifndef _GM_PROFILE_DOT_H_
+#define _GM_PROFILE_DOT_H_
+// Statistical profiler.
+//
+// A timer interrupts each core at a fixed rate, and the interrupted PC, a
+// short backtrace, and the task are counted in a histogram in RAM. The
+// stacks that are counted most are where the cycles go. On the host, the
+// timer is SIGPROF, which counts the CPU time of the process.
+//
+// Start and stop it with the "profile" console command, and dump it with
+// that command, which writes to the log sinks, including the telnet log
+// server, or GET /profile. host/profile_fold.c symbolizes a dump against the
+// ELF into folded stacks, which flamegraph.pl and speedscope read:
+//
+//   make -f platform/Makefile.native profile_fold
+//   build.$(arch)/profile_fold build.k4vp/k4vp_2.elf https://<device>/profile > profile.folded
+//
+// The dump is text, one stack per line, innermost address first:
+//
+//   # gm_profile 1
+//   P <architecture> <rate in Hz> <samples> <dropped samples>
+//   T <task> <task name>
+//   <count> <task> <address> ...
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// The addresses kept for a sample, the interrupted PC and its callers.
+#ifndef GM_PROFILE_DEPTH
+#define GM_PROFILE_DEPTH	8
+#endif
+
+// The distinct stacks that the histogram holds. A sample of a stack that
+// isn't in a full histogram is counted as dropped.
+#ifndef GM_PROFILE_STACKS
+#define GM_PROFILE_STACKS	256
+#endif
+
+// A prime, so that the samples don't fall into step with the 1 kHz tick and
+// the periodic timers.
+#define GM_PROFILE_DEFAULT_RATE	997
+#define GM_PROFILE_MAXIMUM_RATE	10000
+
+// Writes the dump, a line at a time.
+typedef void (*gm_profile_writer_t)(const char * text, size_t size, void * context);
+
+extern void		gm_profile_clear(void);
+extern void		gm_profile_dump(gm_profile_writer_t writer, void * context);
+extern bool		gm_profile_running(void);
+// Returns NULL, or why it couldn't start.
+extern const char *	gm_profile_start(unsigned int rate);
+extern void		gm_profile_stop(void);
+
+#ifndef ESP_PLATFORM
+// On the host, profile the whole run of the program if GM_PROFILE is set to
+// the file for the dump, at GM_PROFILE_RATE if that is set:
+//
+//   GM_PROFILE=profile.txt build.$(arch)/channel_bench
+//   build.$(arch)/profile_fold build.$(arch)/channel_bench profile.txt
+extern void		gm_profile_from_environment(void);
+#endif
+
+#endif
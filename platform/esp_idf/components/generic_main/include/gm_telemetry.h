@@ -0,0 +1,33 @@
+#ifndef _GM_TELEMETRY_DOT_H_
+#define _GM_TELEMETRY_DOT_H_
+// The producer side of live telemetry, see telemetry.c.
+//
+// These may be called from any task, and cost a lock and a copy. The radio
+// calls them through radio/radio.c, so that every driver reports the same
+// way. They compile to nothing unless GM_TELEMETRY is 1, which it is on the
+// device, so that the host builds of the radio code don't need the web
+// server.
+
+#ifndef GM_TELEMETRY
+#ifdef ESP_PLATFORM
+#define GM_TELEMETRY	1
+#else
+#define GM_TELEMETRY	0
+#endif
+#endif
+
+typedef enum _gm_telemetry_sample {
+  GM_TELEMETRY_RSSI,
+  GM_TELEMETRY_TRANSMIT,
+  GM_TELEMETRY_NUMBER_OF_SAMPLES
+} gm_telemetry_sample_t;
+
+#if GM_TELEMETRY
+extern void	gm_telemetry_sample(gm_telemetry_sample_t which, float value);
+extern void	gm_telemetry_scan(float frequency, float rssi);
+#else
+#define gm_telemetry_sample(which, value)	((void)(which), (void)(value))
+#define gm_telemetry_scan(frequency, rssi)	((void)(frequency), (void)(rssi))
+#endif
+
+#endif
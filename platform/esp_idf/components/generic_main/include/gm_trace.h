@@ -0,0 +1,60 @@
+#ifndef _GM_TRACE_DOT_H_
+#define _GM_TRACE_DOT_H_
+// Trace points, for a timeline of what the firmware did.
+//
+// GM_TRACE_BEGIN() and GM_TRACE_END() mark a span of time on the current task,
+// and must be paired on the same task. GM_TRACE_INSTANT() marks a moment, and
+// GM_TRACE_COUNTER() records the value of a counter. The name must be a string
+// constant, only its address is recorded. Events go into a fixed ring in RAM
+// that keeps the most recent GM_TRACE_EVENTS of them. Dump it with the "trace"
+// console command, which writes to the log sinks, including the telnet log
+// server, or GET /trace, and convert the dump for chrome://tracing or Perfetto
+// with:
+//
+//   make -f platform/Makefile.native trace_to_json
+//   build.$(arch)/trace_to_json trace.txt > trace.json
+//
+// The trace points compile to nothing unless GM_TRACE is 1. Build with
+// "-DGM_TRACE=1" on the idf.py command line to enable them.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef GM_TRACE
+#define GM_TRACE	0
+#endif
+
+#ifndef GM_TRACE_EVENTS
+#define GM_TRACE_EVENTS	512
+#endif
+
+typedef enum _gm_trace_type {
+  GM_TRACE_TYPE_BEGIN = 'B',
+  GM_TRACE_TYPE_END = 'E',
+  GM_TRACE_TYPE_INSTANT = 'i',
+  GM_TRACE_TYPE_COUNTER = 'C'
+} gm_trace_type_t;
+
+// Writes the dump, a line or more at a time.
+typedef void (*gm_trace_writer_t)(const char * text, size_t size, void * context);
+
+extern void	gm_trace_clear(void);
+extern void	gm_trace_dump(gm_trace_writer_t writer, void * context);
+
+#if GM_TRACE
+extern void	gm_trace_record(gm_trace_type_t type, const char * name, int32_t value);
+
+#define GM_TRACE_BEGIN(name)		gm_trace_record(GM_TRACE_TYPE_BEGIN, (name), 0)
+#define GM_TRACE_BEGIN_VALUE(name, v)	gm_trace_record(GM_TRACE_TYPE_BEGIN, (name), (v))
+#define GM_TRACE_END(name)		gm_trace_record(GM_TRACE_TYPE_END, (name), 0)
+#define GM_TRACE_INSTANT(name, v)	gm_trace_record(GM_TRACE_TYPE_INSTANT, (name), (v))
+#define GM_TRACE_COUNTER(name, v)	gm_trace_record(GM_TRACE_TYPE_COUNTER, (name), (v))
+#else
+#define GM_TRACE_BEGIN(name)		((void)0)
+#define GM_TRACE_BEGIN_VALUE(name, v)	((void)0)
+#define GM_TRACE_END(name)		((void)0)
+#define GM_TRACE_INSTANT(name, v)	((void)0)
+#define GM_TRACE_COUNTER(name, v)	((void)0)
+#endif
+
+#endif
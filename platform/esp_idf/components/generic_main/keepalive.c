@@ -0,0 +1,459 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <lwip/sockets.h>
+#include <esp_timer.h>
+#include "generic_main.h"
+
+// NAT keepalives.
+//
+// A NAT forgets a UDP binding that has been idle for its binding timeout, and
+// then the public address that STUN found for a flow no longer reaches it.
+// RFC 4787 asks for at least two minutes, but consumer NATs use as little as
+// 30 seconds. Rather than guess a short interval, this measures the timeout:
+// PROBES sockets each get their mapping from a STUN server, stay idle for a
+// different interval, and ask again. If the mapping is the same, the binding
+// outlived that interval. Rounds of probes narrow the bracket between the
+// longest interval that survived and the shortest that didn't.
+//
+// Flows registered with gm_keepalive_add() are then sent the smallest packet
+// that refreshes the binding, a 20-byte STUN binding indication to a STUN
+// server or an empty datagram to another peer, only when they have been idle
+// for nearly the binding timeout.
+//
+// A NAT that preserves the local port maps to the same port after a binding
+// expires, so the mapping doesn't show that it did. For those, the default
+// interval is kept.
+//
+// This is IPv4 only. IPv6 normally has no NAT, but a stateful firewall could
+// be measured the same way.
+
+#define PROBES			3
+// Keepalive interval until the timeout is known, or if it can't be.
+#define DEFAULT_INTERVAL_S	25
+// The longest interval probed. A NAT that keeps bindings longer is treated as
+// if it kept them this long.
+#define MAXIMUM_INTERVAL_S	300
+// Stop when the bracket is this narrow.
+#define RESOLUTION_S		10
+#define MAXIMUM_ROUNDS		4
+// Wait this long for a STUN response, and retry this many times.
+#define RESPONSE_MS		1000
+#define TRIES			3
+
+typedef enum _probe_state {
+  PROBE_MAPPING,
+  PROBE_IDLE,
+  PROBE_CHECKING,
+  PROBE_DONE
+} probe_state_t;
+
+typedef struct _probe {
+  int				sock;
+  probe_state_t			state;
+  uint32_t			interval_s;
+  unsigned int			tries;
+  uint32_t			transaction_id[3];
+  struct sockaddr_storage	mapped;
+  bool				conclusive;
+  bool				alive;
+} probe_t;
+
+static pthread_mutex_t		lock = PTHREAD_MUTEX_INITIALIZER;
+static gm_keepalive_t *		flows = NULL;
+static esp_timer_handle_t	timer = NULL;
+static uint32_t			interval_s = DEFAULT_INTERVAL_S;
+// Discovery state. Only used in the select task.
+static bool			running = false;
+static struct sockaddr_storage	server;
+static probe_t			probes[PROBES];
+static unsigned int		round_number;
+static uint32_t			alive_s;	// The longest interval that survived.
+static uint32_t			expired_s;	// The shortest that didn't, or 0.
+static bool			port_preserved;
+static bool			no_nat;
+
+static const uint32_t first_round[PROBES] = { 30, 120, MAXIMUM_INTERVAL_S };
+
+static void finish(void);
+static void probe_event(int fd, void * data, bool readable, bool writable, bool exception, bool timeout);
+static void schedule(void);
+
+static socklen_t
+address_size(const struct sockaddr_storage * a)
+{
+  return a->ss_family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+}
+
+static bool
+same_mapping(const struct sockaddr_storage * a, const struct sockaddr_storage * b)
+{
+  const struct sockaddr_in * const ia = (const struct sockaddr_in *)a;
+  const struct sockaddr_in * const ib = (const struct sockaddr_in *)b;
+
+  return ia->sin_port == ib->sin_port && ia->sin_addr.s_addr == ib->sin_addr.s_addr;
+}
+
+static void
+probe_send(probe_t * p)
+{
+  uint32_t buffer[GM_STUN_MESSAGE_SIZE / sizeof(uint32_t)];
+
+  gm_stun_message(buffer, false, p->transaction_id);
+  (void) sendto(p->sock, buffer, GM_STUN_MESSAGE_SIZE, 0, (struct sockaddr *)&server, address_size(&server));
+  gm_fd_register_ms(p->sock, probe_event, p, true, false, true, RESPONSE_MS);
+}
+
+// Read a response to the probe's last request, without sending anything.
+static bool
+probe_receive(probe_t * p, struct sockaddr_storage * mapped)
+{
+  uint32_t	buffer[144];
+  ssize_t	size;
+  bool		got = false;
+
+  while ( (size = recv(p->sock, buffer, sizeof(buffer), MSG_DONTWAIT)) > 0 ) {
+    if ( gm_stun_mapped_address(buffer, size, false, mapped)
+     && memcmp((uint8_t *)buffer + GM_STUN_TRANSACTION_ID_OFFSET, p->transaction_id, sizeof(p->transaction_id)) == 0 )
+      got = true;
+  }
+  return got;
+}
+
+static void
+round_start(void)
+{
+  uint32_t	high = expired_s ? expired_s : MAXIMUM_INTERVAL_S;
+  bool		pending = false;
+
+  round_number++;
+  for ( int i = 0; i < PROBES; i++ ) {
+    probe_t * const p = &probes[i];
+
+    memset(p, 0, sizeof(*p));
+    // The first round spans the usual timeouts, later ones divide the
+    // bracket evenly.
+    if ( round_number == 1 )
+      p->interval_s = first_round[i];
+    else
+      p->interval_s = alive_s + ((high - alive_s) * (i + 1)) / (PROBES + 1);
+    p->state = PROBE_MAPPING;
+    p->sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if ( p->sock < 0 ) {
+      GM_FAIL_WITH_OS_ERROR("Can't get socket");
+      p->state = PROBE_DONE;
+      continue;
+    }
+    probe_send(p);
+    pending = true;
+  }
+  // Without sockets there's nothing to wait for. Another round would most
+  // likely fail the same way.
+  if ( !pending )
+    finish();
+}
+
+static void
+finish(void)
+{
+  uint32_t timeout_s;
+
+  running = false;
+  if ( no_nat )
+    timeout_s = MAXIMUM_INTERVAL_S;
+  else if ( port_preserved || alive_s == 0 )
+    timeout_s = 0;
+  else if ( expired_s == 0 )
+    timeout_s = MAXIMUM_INTERVAL_S;
+  else
+    timeout_s = alive_s;
+
+  pthread_mutex_lock(&lock);
+  if ( timeout_s == 0 )
+    interval_s = DEFAULT_INTERVAL_S;
+  else {
+    // Just inside the longest interval known to keep the binding.
+    const uint32_t margin = timeout_s / 10 > 2 ? timeout_s / 10 : 2;
+    interval_s = timeout_s - margin;
+  }
+  pthread_mutex_unlock(&lock);
+
+  if ( timeout_s == 0 )
+    gm_printf(
+     "NAT binding timeout: %s, keepalive every %u seconds.\n",
+     port_preserved ? "can't be measured, the NAT preserves ports" : "unknown",
+     (unsigned int)interval_s);
+  else
+    gm_printf(
+     "NAT binding timeout: at least %u seconds%s, keepalive every %u seconds.\n",
+     (unsigned int)timeout_s,
+     no_nat ? " (there is no NAT)" : (expired_s ? "" : " (the longest probed)"),
+     (unsigned int)interval_s);
+  schedule();
+}
+
+static void
+round_end(void)
+{
+  for ( int i = 0; i < PROBES; i++ ) {
+    const probe_t * const p = &probes[i];
+
+    if ( !p->conclusive )
+      continue;
+    if ( p->alive ) {
+      if ( p->interval_s > alive_s )
+        alive_s = p->interval_s;
+    }
+    else if ( expired_s == 0 || p->interval_s < expired_s )
+      expired_s = p->interval_s;
+  }
+
+  // A NAT is inconsistent if a binding expired before a longer one did.
+  if ( expired_s != 0 && alive_s >= expired_s )
+    alive_s = 0;
+
+  if ( port_preserved || no_nat || round_number >= MAXIMUM_ROUNDS
+   || (expired_s == 0 && alive_s >= MAXIMUM_INTERVAL_S)
+   || (expired_s != 0 && expired_s - alive_s <= RESOLUTION_S) )
+    finish();
+  else
+    round_start();
+}
+
+static void
+close_probes(void)
+{
+  for ( int i = 0; i < PROBES; i++ ) {
+    if ( probes[i].state != PROBE_DONE && probes[i].sock >= 0 ) {
+      gm_fd_unregister(probes[i].sock);
+      close(probes[i].sock);
+    }
+    probes[i].state = PROBE_DONE;
+  }
+}
+
+static void
+probe_done(probe_t * p, bool conclusive, bool alive)
+{
+  gm_fd_unregister(p->sock);
+  close(p->sock);
+  p->sock = -1;
+  p->state = PROBE_DONE;
+  p->conclusive = conclusive;
+  p->alive = alive;
+
+  for ( int i = 0; i < PROBES; i++ ) {
+    if ( probes[i].state != PROBE_DONE )
+      return;
+  }
+  round_end();
+}
+
+static void
+probe_event(int fd, void * data, bool readable, bool writable, bool exception, bool timeout)
+{
+  probe_t * const		p = data;
+  struct sockaddr_storage	mapped;
+  struct sockaddr_in		local;
+  socklen_t			local_size = sizeof(local);
+
+  if ( exception ) {
+    probe_done(p, false, false);
+    return;
+  }
+
+  switch ( p->state ) {
+  case PROBE_MAPPING:
+  case PROBE_CHECKING:
+    if ( readable && probe_receive(p, &mapped) ) {
+      if ( p->state == PROBE_CHECKING ) {
+        probe_done(p, true, same_mapping(&mapped, &p->mapped));
+        return;
+      }
+      p->mapped = mapped;
+      if ( ((struct sockaddr_in *)&mapped)->sin_addr.s_addr == GM.net_interfaces[GM_STA].ip4.address.s_addr )
+        no_nat = true;
+      else if ( getsockname(p->sock, (struct sockaddr *)&local, &local_size) == 0
+       && local.sin_port == ((struct sockaddr_in *)&mapped)->sin_port )
+        port_preserved = true;
+      // Then the mapping can't show the timeout, there's no need to wait.
+      if ( no_nat || port_preserved ) {
+        close_probes();
+        finish();
+        return;
+      }
+      // Now stay quiet, the only thing that can keep the binding alive.
+      p->state = PROBE_IDLE;
+      p->tries = 0;
+      gm_fd_register_ms(p->sock, probe_event, p, true, false, true, p->interval_s * 1000);
+    }
+    else if ( timeout ) {
+      if ( ++p->tries >= TRIES )
+        probe_done(p, false, false);
+      else
+        probe_send(p);
+    }
+    break;
+  case PROBE_IDLE:
+    if ( readable )
+      (void) probe_receive(p, &mapped);
+    if ( timeout ) {
+      p->state = PROBE_CHECKING;
+      probe_send(p);
+    }
+    break;
+  case PROBE_DONE:
+    break;
+  }
+}
+
+static void
+discovery_start(void * data)
+{
+  if ( running )
+    return;
+  if ( !gm_stun_server(false, &server) ) {
+    gm_printf("NAT keepalive: no STUN server address, using %u seconds.\n", DEFAULT_INTERVAL_S);
+    return;
+  }
+  running = true;
+  round_number = 0;
+  alive_s = 0;
+  expired_s = 0;
+  port_preserved = false;
+  no_nat = false;
+  round_start();
+}
+
+static void
+discovery_stop(void * data)
+{
+  if ( !running )
+    return;
+  running = false;
+  close_probes();
+}
+
+// Send to the flows that have been idle for the interval, in the select task.
+static void
+send_due(void * data)
+{
+  const int64_t	now = gm_clock_us();
+  uint32_t	buffer[GM_STUN_MESSAGE_SIZE / sizeof(uint32_t)];
+
+  pthread_mutex_lock(&lock);
+  for ( gm_keepalive_t * f = flows; f; f = f->next ) {
+    if ( now - f->last_sent < interval_s * 1000000LL )
+      continue;
+    if ( f->stun ) {
+      gm_stun_message(buffer, true, NULL);
+      (void) sendto(f->fd, buffer, GM_STUN_MESSAGE_SIZE, 0, (struct sockaddr *)&f->peer, address_size(&f->peer));
+    }
+    else
+      (void) sendto(f->fd, buffer, 0, 0, (struct sockaddr *)&f->peer, address_size(&f->peer));
+    f->last_sent = now;
+  }
+  pthread_mutex_unlock(&lock);
+  schedule();
+}
+
+static void
+timer_expired(void * data)
+{
+  gm_run(send_due, NULL, GM_FAST);
+}
+
+// Set the timer for the flow that will be idle longest soonest.
+static void
+schedule(void)
+{
+  int64_t earliest = INT64_MAX;
+
+  pthread_mutex_lock(&lock);
+  for ( gm_keepalive_t * f = flows; f; f = f->next ) {
+    const int64_t due = f->last_sent + interval_s * 1000000LL;
+
+    if ( due < earliest )
+      earliest = due;
+  }
+  pthread_mutex_unlock(&lock);
+
+  if ( timer == NULL )
+    return;
+  esp_timer_stop(timer);
+  if ( earliest != INT64_MAX ) {
+    const int64_t delay = earliest - gm_clock_us();
+    esp_timer_start_once(timer, delay > 0 ? delay : 0);
+  }
+}
+
+// Note that a flow has sent something, which refreshes the binding as well as
+// a keepalive would.
+void
+gm_keepalive_activity(gm_keepalive_t * flow)
+{
+  const int64_t now = gm_clock_us();
+
+  pthread_mutex_lock(&lock);
+  flow->last_sent = now;
+  pthread_mutex_unlock(&lock);
+}
+
+// Keep the NAT binding of a UDP flow alive. *flow* must stay valid until
+// gm_keepalive_remove().
+void
+gm_keepalive_add(gm_keepalive_t * flow)
+{
+  flow->last_sent = gm_clock_us();
+  pthread_mutex_lock(&lock);
+  flow->next = flows;
+  flows = flow;
+  pthread_mutex_unlock(&lock);
+  schedule();
+}
+
+// The current keepalive interval in seconds.
+uint32_t
+gm_keepalive_interval(void)
+{
+  return interval_s;
+}
+
+void
+gm_keepalive_remove(gm_keepalive_t * flow)
+{
+  pthread_mutex_lock(&lock);
+  for ( gm_keepalive_t * * f = &flows; *f; f = &(*f)->next ) {
+    if ( *f == flow ) {
+      *f = flow->next;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&lock);
+  schedule();
+}
+
+// Measure the NAT binding timeout. Call after STUN has found the public IPv4
+// address, which means that a STUN server address is known.
+void
+gm_keepalive_start(void)
+{
+  if ( timer == NULL ) {
+    const esp_timer_create_args_t timer_args = {
+      .callback = timer_expired,
+      .name = "NAT keepalive"
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&timer_args, &timer));
+  }
+  // Flows may have been added before there was a timer.
+  schedule();
+  gm_run(discovery_start, NULL, GM_FAST);
+}
+
+void
+gm_keepalive_stop(void)
+{
+  gm_run(discovery_stop, NULL, GM_FAST);
+  if ( timer )
+    esp_timer_stop(timer);
+}
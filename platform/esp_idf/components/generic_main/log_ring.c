@@ -0,0 +1,703 @@
+// Logging
+//
+// gm_printf() used to take a global mutex, format with vfprintf(), and
+// fflush() to the console or to the telnet log client while holding it, so
+// a slow log client stalled every task that logged, including the real-time
+// ones. Now gm_printf() only copies its arguments into a binary record in a
+// ring buffer, and the records are formatted later in the select task and
+// written to each of the sinks: the console, telnet clients, live telemetry,
+// or anything else that calls gm_log_sink_add().
+//
+// A record is the time, the address of the pattern, which is a string
+// constant, and the raw arguments. Strings are copied, since the caller's
+// buffer may not live until the record is formatted. There is a ring for each
+// CPU core, so that the cores don't contend for one ring. Space is reserved
+// with a compare-and-swap on the head of the ring, which also works when
+// tasks on the same core preempt each other, and a record is marked ready
+// when it's complete. There is no backpressure: when a ring is full, the
+// record is dropped and counted, and the count is logged when there is room.
+//
+// The select task is asked to drain the rings DRAIN_DELAY_MS after the first
+// record since the last drain, so a burst of logging costs one wakeup.
+// Records of the two rings are merged in time order.
+//
+// Records that are too large for a ring, such as the output of some console
+// commands, are formatted at once by the caller after the rings are drained,
+// as is everything before gm_log_start(). gm_log_flush() drains the rings at
+// once, gm_fail() uses it so that the message precedes the backtrace.
+
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#define INCLUDE_xTaskGetCurrentTaskHandle 1
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <esp_timer.h>
+#include "generic_main.h"
+
+#define RING_SIZE		4096	// Per core, a power of two.
+#define RECORD_MAXIMUM		512	// Bytes of arguments.
+#define LINE_SIZE		512
+#define DRAIN_DELAY_MS		10
+// The console or up to 3 telnet clients, the persistent log, live telemetry,
+// and one to spare.
+#define MAXIMUM_SINKS		6
+#define SPEC_SIZE		32
+
+#define READY			0x10000
+#define PADDING			0x20000
+#define SIZE_MASK		0xffff
+#define ALIGN(n)		(((n) + 7) & ~7)
+
+typedef struct _record {
+  _Atomic uint32_t	state;		// The size of the record, READY, PADDING.
+  uint32_t		size;		// Of the arguments.
+  const char *		pattern;
+  int64_t		time;
+  uint8_t		arguments[];
+} record_t;
+
+typedef struct _ring {
+  _Atomic uint32_t	head;		// Reserved by the writers up to here.
+  _Atomic uint32_t	tail;		// Drained up to here.
+  _Atomic uint32_t	dropped;
+  uint32_t		reported;	// The drops that have been logged.
+  uint8_t		data[RING_SIZE] __attribute__((aligned(8)));
+} ring_t;
+
+typedef struct _sink {
+  gm_log_sink_t	sink;
+  void *	data;
+} sink_t;
+
+typedef enum _argument_type {
+  NO_ARGUMENT,
+  INT,
+  LONG,
+  LONG_LONG,
+  SIZE,
+  PTRDIFF,
+  INTMAX,
+  DOUBLE,
+  LONG_DOUBLE,
+  POINTER,
+  STRING,
+  COUNT
+} argument_type_t;
+
+// One conversion specification of a pattern.
+typedef struct _conversion {
+  const char *		start;		// The '%'.
+  const char *		end;		// After the conversion character.
+  bool			width_star;
+  bool			precision_star;
+  int			precision;	// -1 if there isn't one in the pattern.
+  argument_type_t	type;
+} conversion_t;
+
+static ring_t			rings[portNUM_PROCESSORS];
+static _Atomic bool		drain_scheduled = false;
+static esp_timer_handle_t	drain_timer = NULL;
+static volatile bool		started = false;
+
+// Held while draining, and while the sinks are called or changed.
+static pthread_mutex_t		drain_lock = PTHREAD_MUTEX_INITIALIZER;
+static volatile TaskHandle_t	draining_task = NULL;
+static _Atomic uint32_t		dropped_while_draining = 0;
+static sink_t			sinks[MAXIMUM_SINKS] = { { gm_log_console, NULL } };
+static size_t			number_of_sinks = 1;
+static char			line[LINE_SIZE];
+
+// Find the next conversion specification in a pattern.
+// \return NULL if there are no more.
+static const char *
+next_conversion(const char * p, conversion_t * c)
+{
+  if ( (p = strchr(p, '%')) == NULL )
+    return NULL;
+
+  c->start = p++;
+  c->width_star = c->precision_star = false;
+  c->precision = -1;
+
+  while ( *p == '-' || *p == '+' || *p == ' ' || *p == '#' || *p == '0' )
+    p++;
+  if ( *p == '*' ) {
+    c->width_star = true;
+    p++;
+  }
+  else {
+    while ( *p >= '0' && *p <= '9' )
+      p++;
+  }
+  if ( *p == '.' ) {
+    p++;
+    if ( *p == '*' ) {
+      c->precision_star = true;
+      p++;
+    }
+    else {
+      c->precision = 0;
+      while ( *p >= '0' && *p <= '9' )
+        c->precision = c->precision * 10 + *p++ - '0';
+    }
+  }
+
+  argument_type_t integer = INT;
+  bool long_double = false;
+
+  switch ( *p ) {
+  case 'h':
+    p += p[1] == 'h' ? 2 : 1;
+    break;
+  case 'l':
+    if ( p[1] == 'l' ) {
+      integer = LONG_LONG;
+      p += 2;
+    }
+    else {
+      integer = LONG;
+      p++;
+    }
+    break;
+  case 'q':
+    integer = LONG_LONG;
+    p++;
+    break;
+  case 'j':
+    integer = INTMAX;
+    p++;
+    break;
+  case 'z':
+    integer = SIZE;
+    p++;
+    break;
+  case 't':
+    integer = PTRDIFF;
+    p++;
+    break;
+  case 'L':
+    long_double = true;
+    p++;
+    break;
+  }
+
+  switch ( *p ) {
+  case 'd': case 'i': case 'u': case 'o': case 'x': case 'X':
+    c->type = integer;
+    break;
+  case 'c':
+    c->type = INT;
+    break;
+  case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+    c->type = long_double ? LONG_DOUBLE : DOUBLE;
+    break;
+  case 'p':
+    c->type = POINTER;
+    break;
+  case 's':
+    c->type = STRING;
+    break;
+  case 'n':
+    c->type = COUNT;
+    break;
+  case '\0':
+    // A stray '%' at the end of the pattern.
+    c->type = NO_ARGUMENT;
+    c->end = p;
+    return p;
+  default:
+    c->type = NO_ARGUMENT;
+    break;
+  }
+  c->end = p + 1;
+  return c->end;
+}
+
+#define PUT(type, value) \
+{ \
+  const type v = (value); \
+  if ( a + sizeof(v) > end ) \
+    return SIZE_MAX; \
+  memcpy(a, &v, sizeof(v)); \
+  a += sizeof(v); \
+}
+
+// Copy the arguments of a pattern into a record.
+// \return The size of the arguments, or SIZE_MAX if they don't fit.
+static size_t
+encode(uint8_t * arguments, size_t size, const char * pattern, va_list args)
+{
+  uint8_t *		a = arguments;
+  uint8_t * const	end = arguments + size;
+  const char *		p = pattern;
+  conversion_t		c;
+
+  while ( (p = next_conversion(p, &c)) != NULL ) {
+    int precision = c.precision;
+
+    if ( c.width_star )
+      PUT(int, va_arg(args, int));
+    if ( c.precision_star ) {
+      precision = va_arg(args, int);
+      PUT(int, precision);
+    }
+
+    switch ( c.type ) {
+    case NO_ARGUMENT:
+      break;
+    case INT:
+      PUT(int, va_arg(args, int));
+      break;
+    case LONG:
+      PUT(long, va_arg(args, long));
+      break;
+    case LONG_LONG:
+      PUT(long long, va_arg(args, long long));
+      break;
+    case SIZE:
+      PUT(size_t, va_arg(args, size_t));
+      break;
+    case PTRDIFF:
+      PUT(ptrdiff_t, va_arg(args, ptrdiff_t));
+      break;
+    case INTMAX:
+      PUT(intmax_t, va_arg(args, intmax_t));
+      break;
+    case DOUBLE:
+      PUT(double, va_arg(args, double));
+      break;
+    case LONG_DOUBLE:
+      PUT(long double, va_arg(args, long double));
+      break;
+    case POINTER:
+      PUT(void *, va_arg(args, void *));
+      break;
+    case COUNT:
+      // Nothing is written through %n, the count wouldn't be known in time.
+      (void)va_arg(args, void *);
+      break;
+    case STRING:
+      {
+        const char *	s = va_arg(args, const char *);
+        size_t		length;
+
+        if ( s == NULL )
+          s = "(null)";
+        // A precision may be given for a string that isn't terminated.
+        length = precision >= 0 ? strnlen(s, precision) : strlen(s);
+        if ( a + length + 1 > end )
+          return SIZE_MAX;
+        memcpy(a, s, length);
+        a[length] = '\0';
+        a += length + 1;
+      }
+      break;
+    }
+  }
+  return a - arguments;
+}
+
+#define GET(type) \
+({ \
+  type v; \
+  memcpy(&v, a, sizeof(v)); \
+  a += sizeof(v); \
+  v; \
+})
+
+// Format a record. Called with the drain lock held.
+// \return The length of the text, which is in line[].
+static size_t
+format(const char * pattern, const uint8_t * a)
+{
+  const char *	p = pattern;
+  const char *	next;
+  size_t	n = 0;
+  conversion_t	c;
+
+  line[0] = '\0';
+  while ( n < sizeof(line) - 1 && (next = next_conversion(p, &c)) != NULL ) {
+    char	spec[SPEC_SIZE];
+    size_t	s = 0;
+    size_t	room;
+    int		length = 0;
+
+    // The text before the conversion.
+    room = sizeof(line) - 1 - n;
+    if ( (size_t)(c.start - p) < room )
+      room = c.start - p;
+    memcpy(&line[n], p, room);
+    n += room;
+    line[n] = '\0';
+
+    // The conversion, with the values of any '*' written in.
+    for ( const char * q = c.start; q < c.end && s < sizeof(spec) - 12; q++ ) {
+      if ( *q == '*' )
+        s += sprintf(&spec[s], "%d", GET(int));
+      else
+        spec[s++] = *q;
+    }
+    spec[s] = '\0';
+
+    room = sizeof(line) - n;
+    switch ( c.type ) {
+    case NO_ARGUMENT:
+    case COUNT:
+      if ( c.end > c.start + 1 && c.end[-1] == '%' )
+        length = snprintf(&line[n], room, "%%");
+      break;
+    case INT:
+      length = snprintf(&line[n], room, spec, GET(int));
+      break;
+    case LONG:
+      length = snprintf(&line[n], room, spec, GET(long));
+      break;
+    case LONG_LONG:
+      length = snprintf(&line[n], room, spec, GET(long long));
+      break;
+    case SIZE:
+      length = snprintf(&line[n], room, spec, GET(size_t));
+      break;
+    case PTRDIFF:
+      length = snprintf(&line[n], room, spec, GET(ptrdiff_t));
+      break;
+    case INTMAX:
+      length = snprintf(&line[n], room, spec, GET(intmax_t));
+      break;
+    case DOUBLE:
+      length = snprintf(&line[n], room, spec, GET(double));
+      break;
+    case LONG_DOUBLE:
+      length = snprintf(&line[n], room, spec, GET(long double));
+      break;
+    case POINTER:
+      length = snprintf(&line[n], room, spec, GET(void *));
+      break;
+    case STRING:
+      length = snprintf(&line[n], room, spec, (const char *)a);
+      a += strlen((const char *)a) + 1;
+      break;
+    }
+    if ( length > 0 )
+      n += (size_t)length < room ? (size_t)length : room - 1;
+    p = next;
+  }
+
+  // The text after the last conversion.
+  if ( n < sizeof(line) - 1 ) {
+    size_t length = strlen(p);
+
+    if ( length > sizeof(line) - 1 - n )
+      length = sizeof(line) - 1 - n;
+    memcpy(&line[n], p, length);
+    n += length;
+    line[n] = '\0';
+  }
+  return n;
+}
+
+// Called with the drain lock held.
+static void
+write_to_sinks(int64_t time, const char * text, size_t size)
+{
+  for ( size_t i = 0; i < number_of_sinks; i++ )
+    (sinks[i].sink)(time, text, size, sinks[i].data);
+}
+
+// The oldest ready record of a ring, skipping padding.
+static record_t *
+oldest(ring_t * r)
+{
+  for ( ; ; ) {
+    const uint32_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+
+    if ( tail == atomic_load_explicit(&r->head, memory_order_acquire) )
+      return NULL;
+
+    record_t * const record = (record_t *)&r->data[tail & (RING_SIZE - 1)];
+    const uint32_t state = atomic_load_explicit(&record->state, memory_order_acquire);
+
+    // Reserved, but the writer hasn't finished it.
+    if ( !(state & READY) )
+      return NULL;
+    if ( !(state & PADDING) )
+      return record;
+    memset(record, 0, state & SIZE_MASK);
+    atomic_store_explicit(&r->tail, tail + (state & SIZE_MASK), memory_order_release);
+  }
+}
+
+// Free a record. The space is zeroed, so that a record later reserved there
+// isn't taken to be ready before it's written.
+static void
+consume(ring_t * r, record_t * record)
+{
+  const uint32_t size = atomic_load_explicit(&record->state, memory_order_relaxed) & SIZE_MASK;
+  const uint32_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+
+  memset(record, 0, size);
+  atomic_store_explicit(&r->tail, tail + size, memory_order_release);
+}
+
+// Format the records of all of the rings in time order. Called with the
+// drain lock held.
+static void
+drain_locked(void)
+{
+  for ( ; ; ) {
+    ring_t *	ring = NULL;
+    record_t *	record = NULL;
+
+    for ( int i = 0; i < portNUM_PROCESSORS; i++ ) {
+      record_t * const r = oldest(&rings[i]);
+
+      if ( r && (record == NULL || r->time < record->time) ) {
+        ring = &rings[i];
+        record = r;
+      }
+    }
+    if ( record == NULL )
+      break;
+
+    const size_t size = format(record->pattern, record->arguments);
+    const int64_t time = record->time;
+
+    consume(ring, record);
+    write_to_sinks(time, line, size);
+  }
+
+  uint32_t dropped = atomic_exchange(&dropped_while_draining, 0);
+
+  for ( int i = 0; i < portNUM_PROCESSORS; i++ ) {
+    const uint32_t d = atomic_load_explicit(&rings[i].dropped, memory_order_relaxed);
+
+    dropped += d - rings[i].reported;
+    rings[i].reported = d;
+  }
+  if ( dropped > 0 ) {
+    const int size = snprintf(line, sizeof(line), "[%lu log records dropped]\n", (unsigned long)dropped);
+
+    write_to_sinks(esp_timer_get_time(), line, size);
+  }
+}
+
+static void
+lock_drain(void)
+{
+  pthread_mutex_lock(&drain_lock);
+  draining_task = xTaskGetCurrentTaskHandle();
+}
+
+static void
+unlock_drain(void)
+{
+  draining_task = NULL;
+  pthread_mutex_unlock(&drain_lock);
+}
+
+// In the select task.
+static void
+drain(void * data)
+{
+  atomic_store(&drain_scheduled, false);
+  lock_drain();
+  drain_locked();
+  unlock_drain();
+}
+
+static void
+drain_timer_expired(void * data)
+{
+  gm_run(drain, NULL, GM_FAST);
+}
+
+// Copy a record into the ring of this core.
+static bool
+ring_write(const char * pattern, int64_t time, const uint8_t * arguments, size_t size)
+{
+  ring_t * const	r = &rings[xPortGetCoreID()];
+  const uint32_t	record_size = ALIGN(sizeof(record_t) + size);
+  uint32_t		head = atomic_load_explicit(&r->head, memory_order_relaxed);
+  uint32_t		offset;
+  uint32_t		padding;
+
+  do {
+    const uint32_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+
+    // A record isn't split across the end of the ring, the rest of the ring
+    // is skipped with padding instead.
+    offset = head & (RING_SIZE - 1);
+    padding = offset + record_size > RING_SIZE ? RING_SIZE - offset : 0;
+    if ( head + padding + record_size - tail > RING_SIZE ) {
+      atomic_fetch_add_explicit(&r->dropped, 1, memory_order_relaxed);
+      return false;
+    }
+  } while ( !atomic_compare_exchange_weak_explicit(&r->head, &head, head + padding + record_size, memory_order_acquire, memory_order_relaxed) );
+
+  if ( padding ) {
+    atomic_store_explicit(&((record_t *)&r->data[offset])->state, padding | PADDING | READY, memory_order_release);
+    offset = 0;
+  }
+
+  record_t * const record = (record_t *)&r->data[offset];
+
+  record->size = size;
+  record->pattern = pattern;
+  record->time = time;
+  memcpy(record->arguments, arguments, size);
+  atomic_store_explicit(&record->state, record_size | READY, memory_order_release);
+  return true;
+}
+
+// Format a message at once, after anything that is already in the rings.
+static void
+write_now(const char * pattern, va_list args)
+{
+  char * text = NULL;
+  int size;
+
+  // A sink, or something it called, is logging. Waiting for the drain lock
+  // would never end.
+  if ( draining_task == xTaskGetCurrentTaskHandle() ) {
+    atomic_fetch_add(&dropped_while_draining, 1);
+    return;
+  }
+
+  lock_drain();
+  drain_locked();
+  if ( (size = vasprintf(&text, pattern, args)) >= 0 ) {
+    write_to_sinks(esp_timer_get_time(), text, size);
+    free(text);
+  }
+  unlock_drain();
+}
+
+// The console sink, which is installed at first.
+void
+gm_log_console(int64_t time, const char * text, size_t size, void * data)
+{
+  fwrite(text, 1, size, stderr);
+  fflush(stderr);
+}
+
+// Write text to the sinks at once, after everything that has been logged,
+// for bulk output such as dumps that wouldn't fit in the rings.
+void
+gm_log_text(const char * text, size_t size)
+{
+  if ( draining_task == xTaskGetCurrentTaskHandle() )
+    return;
+  lock_drain();
+  drain_locked();
+  write_to_sinks(esp_timer_get_time(), text, size);
+  unlock_drain();
+}
+
+// Format and write everything that has been logged, in the calling task.
+void
+gm_log_flush(void)
+{
+  if ( draining_task == xTaskGetCurrentTaskHandle() )
+    return;
+  lock_drain();
+  drain_locked();
+  unlock_drain();
+}
+
+// Add a sink, which is given each formatted message, usually in the select
+// task. A sink must not block, and must not add or remove sinks.
+//
+// \return False if there is no room for another sink.
+bool
+gm_log_sink_add(gm_log_sink_t sink, void * data)
+{
+  bool added = false;
+
+  lock_drain();
+  if ( number_of_sinks < MAXIMUM_SINKS ) {
+    sinks[number_of_sinks].sink = sink;
+    sinks[number_of_sinks].data = data;
+    number_of_sinks++;
+    added = true;
+  }
+  unlock_drain();
+  return added;
+}
+
+void
+gm_log_sink_remove(gm_log_sink_t sink, void * data)
+{
+  lock_drain();
+  for ( size_t i = 0; i < number_of_sinks; i++ ) {
+    if ( sinks[i].sink == sink && sinks[i].data == data ) {
+      memmove(&sinks[i], &sinks[i + 1], (number_of_sinks - i - 1) * sizeof(*sinks));
+      number_of_sinks--;
+      break;
+    }
+  }
+  unlock_drain();
+}
+
+// Start deferring messages to the select task. Called by gm_select_task().
+void
+gm_log_start(void)
+{
+  const esp_timer_create_args_t timer_args = {
+    .callback = drain_timer_expired,
+    .name = "log drain"
+  };
+
+  if ( started )
+    return;
+  ESP_ERROR_CHECK(esp_timer_create(&timer_args, &drain_timer));
+  started = true;
+}
+
+// Log a message. This is usable from any task, but not at interrupt level.
+// \return 0, or -1 if the message was dropped because the ring was full.
+int
+gm_vprintf(const char * pattern, va_list args)
+{
+  uint8_t	arguments[RECORD_MAXIMUM];
+  const int64_t	time = esp_timer_get_time();
+  va_list	copy;
+  size_t	size;
+
+  if ( !started ) {
+    write_now(pattern, args);
+    return 0;
+  }
+
+  va_copy(copy, args);
+  size = encode(arguments, sizeof(arguments), pattern, copy);
+  va_end(copy);
+
+  if ( size == SIZE_MAX ) {
+    write_now(pattern, args);
+    return 0;
+  }
+
+  if ( !ring_write(pattern, time, arguments, size) )
+    return -1;
+
+  if ( !atomic_load_explicit(&drain_scheduled, memory_order_relaxed)
+   && !atomic_exchange(&drain_scheduled, true) )
+    esp_timer_start_once(drain_timer, DRAIN_DELAY_MS * 1000);
+  return 0;
+}
+
+int
+gm_printf(const char * pattern, ...)
+{
+  int result;
+  va_list args;
+  va_start(args, pattern);
+  result = gm_vprintf(pattern, args);
+  va_end(args);
+  return result;
+}
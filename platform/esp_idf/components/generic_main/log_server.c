@@ -2,6 +2,8 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <fcntl.h>
+#include <errno.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/un.h>
@@ -10,40 +12,83 @@
 // FIX: Make this use a dual-stack address for accept.
 
 // Log server. This emits a lot to a stream socket, which you can connect with via
-// telnet. Only one connection is supported. When you connect, logging is diverted
-// from the console to the socket, and it is restored to the console when you disconnect.
+// telnet. Up to NUMBER_OF_CLIENTS connections are supported. While any are
+// connected, logging is diverted from the console to the sockets, and it is
+// restored to the console when the last one disconnects.
 // I wrote this to debug the Improv WiFi protocol, since logging to the same serial port
 // that would be running the Improv protocol was problematic.
+//
+// Each client is a log sink. The sockets don't block, so a client that can't
+// keep up loses log text rather than stalling the logging. It's told how much
+// it lost when there is room again.
+
+#define NUMBER_OF_CLIENTS	3
+
+typedef struct _client {
+  int		fd;
+  uint32_t	dropped;	// Bytes that didn't fit in the socket.
+} client_t;
 
 static int server = -1;
+static client_t clients[NUMBER_OF_CLIENTS] = { { .fd = -1 }, { .fd = -1 }, { .fd = -1 } };
+static int number_of_clients = 0;
+
+// A log sink, called with the log drain lock held.
+static void
+client_sink(int64_t time, const char * text, size_t size, void * data)
+{
+  client_t * const c = (client_t *)data;
+  ssize_t sent;
+
+  if ( c->dropped ) {
+    char notice[48];
+    const int length = snprintf(notice, sizeof(notice), "\n[%lu bytes of log dropped]\n", (unsigned long)c->dropped);
+
+    if ( send(c->fd, notice, length, MSG_DONTWAIT) != length ) {
+      c->dropped += size;
+      return;
+    }
+    c->dropped = 0;
+  }
+
+  sent = send(c->fd, text, size, MSG_DONTWAIT);
+  if ( sent < 0 )
+    sent = 0;
+  c->dropped += size - sent;
+}
 
 static void
-logging_connection_closed()
+logging_connection_closed(client_t * c)
 {
-  if ( GM.log_fd == 2 )
+  if ( c->fd < 0 )
     return;
 
-  gm_fd_unregister(GM.log_fd);
-  fclose(GM.log_file_pointer);
-  GM.log_fd = 2;
-  GM.log_file_pointer = stderr;
-  gm_printf("Now logging to the console.\n");
+  gm_log_sink_remove(client_sink, c);
+  gm_fd_unregister(c->fd);
+  close(c->fd);
+  c->fd = -1;
+  if ( --number_of_clients == 0 ) {
+    gm_log_sink_add(gm_log_console, NULL);
+    gm_printf("Now logging to the console.\n");
+  }
 }
 
 static void
 socket_event_handler(int fd, void * data, bool readable, bool writable, bool exception, bool timeout)
 {
+  client_t * const c = (client_t *)data;
+
   if ( exception ) {
-    logging_connection_closed();
+    logging_connection_closed(c);
     return;
   }
- 
+
   if ( readable ) {
     char	buffer[64];
     int		result;
 
-    if ( (result = recv(fd, buffer, sizeof(buffer), 0)) == 0 ) {
-      logging_connection_closed();
+    if ( (result = recv(fd, buffer, sizeof(buffer), 0)) <= 0 && !(result < 0 && errno == EAGAIN) ) {
+      logging_connection_closed(c);
     }
   }
 }
@@ -54,6 +99,7 @@ accept_handler(int sock, void * data, bool readable, bool writable, bool excepti
   struct sockaddr_storage	client_address;
   socklen_t			size;
   int				connection;
+  client_t *			c = NULL;
 
   if ( readable ) {
     size = sizeof(client_address);
@@ -61,12 +107,39 @@ accept_handler(int sock, void * data, bool readable, bool writable, bool excepti
       GM_FAIL_WITH_OS_ERROR("Select event server accept failed");
       return;
     }
-    gm_printf("Now logging to the telnet client rather than the console.\n");
-    GM.log_fd = connection;
-    GM.log_file_pointer = fdopen(GM.log_fd, "a");
-    setlinebuf(GM.log_file_pointer);
+    for ( int i = 0; i < NUMBER_OF_CLIENTS; i++ ) {
+      if ( clients[i].fd < 0 ) {
+        c = &clients[i];
+        break;
+      }
+    }
+    if ( c == NULL ) {
+      static const char busy[] = "Too many log clients.\n";
+
+      send(connection, busy, sizeof(busy) - 1, MSG_DONTWAIT);
+      close(connection);
+      return;
+    }
+    fcntl(connection, F_SETFL, fcntl(connection, F_GETFL, 0) | O_NONBLOCK);
+    c->fd = connection;
+    c->dropped = 0;
+
+    if ( !gm_log_sink_add(client_sink, c) ) {
+      static const char full[] = "No room for another log sink.\n";
+
+      send(connection, full, sizeof(full) - 1, MSG_DONTWAIT);
+      close(connection);
+      c->fd = -1;
+      return;
+    }
+    if ( number_of_clients++ == 0 ) {
+      gm_printf("Now logging to the telnet client rather than the console.\n");
+      // Write what was logged before this to the console.
+      gm_log_flush();
+      gm_log_sink_remove(gm_log_console, NULL);
+    }
     gm_printf("Logging to the telnet client initiated.\n");
-    gm_fd_register(connection, socket_event_handler, 0, true, false, true, 0);
+    gm_fd_register(connection, socket_event_handler, c, true, false, true, 0);
   }
   if ( exception ) {
     GM_FAIL("Exception on event socket.\n");
@@ -107,7 +180,8 @@ gm_log_server_start(void)
 void
 gm_log_server_stop(void)
 {
-  logging_connection_closed();
+  for ( int i = 0; i < NUMBER_OF_CLIENTS; i++ )
+    logging_connection_closed(&clients[i]);
   if ( server < 0 )
     return;
   gm_fd_unregister(server);
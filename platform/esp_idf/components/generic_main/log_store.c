@@ -0,0 +1,848 @@
+// Persistent Log Store
+//
+// Log messages are gathered in RAM into blocks of GM_LOG_STORE_BLOCK_SIZE
+// bytes. There are two of them, so that messages can be added to one while the
+// other is compressed and written. When a block is full, gm_log_store_write()
+// returns true, and the platform calls gm_log_store_flush() from a task that
+// can wait for the FLASH. If both blocks are full, messages are dropped and
+// counted, rather than making the logger wait.
+//
+// Each message in a block is its time, as a signed variable-length difference
+// from the time of the message before it, its length, and its text. Text
+// compresses well, as logs repeat themselves, with a small LZ77 compressor in
+// the manner of LZ4. That takes a 2 KB hash table and no other memory, where
+// deflate would want hundreds of kilobytes. A compressed block has a header
+// with the range of the times of its messages and a checksum:
+//
+//   magic "GMLB", compressed size (2), raw size (2), checksum (4),
+//   first time (8), minimum time (8), maximum time (8)
+//
+// all little-endian. The compressed blocks are appended to segments in
+// chunks of GM_LOG_STORE_CHUNK_SIZE, at offsets that are multiples of it, so
+// that littlefs programs whole blocks and doesn't have to copy a partial block
+// to append to it. Only gm_log_store_flush(true), which is for shutdown and a
+// periodic flush, writes a partial chunk. The chunk after it ends at the next
+// aligned offset, so that the ones after that are aligned again.
+//
+// A segment is started at each boot and when the current one would grow past
+// the configured segment size. The oldest segments are deleted to keep the
+// total within the budget. The index holds the number, size, and the range of
+// times of each segment, and is rewritten when a segment is started or
+// deleted, so that a read of a time range opens only the segments that cover
+// it, and skips the blocks outside of it by their headers, without
+// decompressing them. The times of the segment being written aren't in the
+// index until the next one is started, so it is always read, and at boot, the
+// last segment is scanned to find its times.
+//
+// This is portable C, without ESP-IDF dependencies, so that it can be
+// benchmarked on the host against a simulated FLASH.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "gm_log_store.h"
+#include "gm_memory.h"
+
+#define BLOCK_MAGIC		0x424c4d47	// "GMLB"
+#define INDEX_MAGIC		0x494c4d47	// "GMLI"
+#define INDEX_VERSION		1
+#define HEADER_SIZE		36
+#define INDEX_HEADER_SIZE	12
+#define INDEX_ENTRY_SIZE	24
+// The longest message that is stored. Longer ones are truncated.
+#define MESSAGE_MAXIMUM		(GM_LOG_STORE_BLOCK_SIZE / 2)
+// The most that a block can grow when it doesn't compress.
+#define COMPRESS_BOUND(size)	((size) + (size) / 255 + 16)
+#define HASH_BITS		10
+#define MINIMUM_MATCH		4
+// Matches don't start this close to the end, so that the compressor can read
+// 4 bytes at a time without checking.
+#define LAST_LITERALS		5
+
+typedef struct _raw_block {
+  size_t	size;
+  uint32_t	sequence;	// To read full blocks in the order they were filled.
+  int64_t	first_time;
+  int64_t	previous_time;
+  int64_t	minimum_time;
+  int64_t	maximum_time;
+  uint8_t	data[GM_LOG_STORE_BLOCK_SIZE];
+} raw_block_t;
+
+typedef struct _block_header {
+  uint16_t	compressed_size;
+  uint16_t	raw_size;
+  uint32_t	checksum;
+  int64_t	first_time;
+  int64_t	minimum_time;
+  int64_t	maximum_time;
+} block_header_t;
+
+typedef struct _segment {
+  uint32_t	number;
+  uint32_t	size;
+  int64_t	minimum_time;
+  int64_t	maximum_time;
+} segment_t;
+
+// The lock protects the RAM blocks that messages are added to, and the
+// statistics. The writer lock protects everything that goes to the backend:
+// compression, the chunk being gathered, and the segments. A read holds the
+// writer lock, so that segments aren't deleted under it.
+static pthread_mutex_t		lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t		writer_lock = PTHREAD_MUTEX_INITIALIZER;
+static const gm_log_store_backend_t * backend = NULL;
+static gm_log_store_config_t	config;
+static gm_log_store_stats_t	stats;
+
+static raw_block_t		blocks[2];
+static bool			full[2] = { false, false };
+static int			filling = 0;
+static uint32_t			next_sequence = 0;
+
+static uint16_t			hash_table[1 << HASH_BITS];
+static uint8_t			compressed[HEADER_SIZE + COMPRESS_BOUND(GM_LOG_STORE_BLOCK_SIZE)];
+static uint8_t			chunk[GM_LOG_STORE_CHUNK_SIZE];
+static size_t			chunk_size = 0;
+static segment_t		segments[GM_LOG_STORE_MAXIMUM_SEGMENTS];
+static size_t			number_of_segments = 0;
+
+static void
+put16(uint8_t * p, uint16_t v)
+{
+  p[0] = v;
+  p[1] = v >> 8;
+}
+
+static void
+put32(uint8_t * p, uint32_t v)
+{
+  put16(p, v);
+  put16(p + 2, v >> 16);
+}
+
+static void
+put64(uint8_t * p, int64_t v)
+{
+  put32(p, (uint64_t)v);
+  put32(p + 4, (uint64_t)v >> 32);
+}
+
+static uint16_t
+get16(const uint8_t * p)
+{
+  return p[0] | (p[1] << 8);
+}
+
+static uint32_t
+get32(const uint8_t * p)
+{
+  return get16(p) | ((uint32_t)get16(p + 2) << 16);
+}
+
+static int64_t
+get64(const uint8_t * p)
+{
+  return (int64_t)(get32(p) | ((uint64_t)get32(p + 4) << 32));
+}
+
+static uint32_t
+read32(const uint8_t * p)
+{
+  uint32_t v;
+
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+// FNV-1a.
+static uint32_t
+checksum(const uint8_t * data, size_t size)
+{
+  uint32_t h = 2166136261u;
+
+  while ( size-- > 0 ) {
+    h ^= *data++;
+    h *= 16777619u;
+  }
+  return h;
+}
+
+static size_t
+put_varint(uint8_t * p, uint64_t v)
+{
+  size_t n = 0;
+
+  while ( v >= 0x80 ) {
+    p[n++] = (v & 0x7f) | 0x80;
+    v >>= 7;
+  }
+  p[n++] = v;
+  return n;
+}
+
+// Return the number of bytes used, or 0 if the varint doesn't fit.
+static size_t
+get_varint(const uint8_t * p, size_t size, uint64_t * v)
+{
+  *v = 0;
+  for ( size_t n = 0; n < size && n < 10; n++ ) {
+    *v |= (uint64_t)(p[n] & 0x7f) << (7 * n);
+    if ( (p[n] & 0x80) == 0 )
+      return n + 1;
+  }
+  return 0;
+}
+
+static uint8_t *
+put_length(uint8_t * o, size_t length)
+{
+  while ( length >= 255 ) {
+    *o++ = 255;
+    length -= 255;
+  }
+  *o++ = length;
+  return o;
+}
+
+static uint8_t *
+put_sequence(uint8_t * o, const uint8_t * literals, size_t literal_length, size_t offset, size_t match_length)
+{
+  uint8_t * const	token = o++;
+  const size_t		match_code = match_length ? match_length - MINIMUM_MATCH : 0;
+
+  *token = ((literal_length < 15 ? literal_length : 15) << 4) | (match_code < 15 ? match_code : 15);
+  if ( literal_length >= 15 )
+    o = put_length(o, literal_length - 15);
+  memcpy(o, literals, literal_length);
+  o += literal_length;
+  if ( match_length == 0 )
+    return o;
+  put16(o, offset);
+  o += 2;
+  if ( match_code >= 15 )
+    o = put_length(o, match_code - 15);
+  return o;
+}
+
+// Compress into out, which must hold COMPRESS_BOUND(size). The input must be
+// smaller than 64K, so that positions fit in the hash table.
+static size_t
+compress(const uint8_t * in, size_t size, uint8_t * out)
+{
+  const uint8_t * const	end = in + size;
+  const uint8_t * const	match_limit = size > LAST_LITERALS + MINIMUM_MATCH ? end - LAST_LITERALS : in;
+  const uint8_t *	anchor = in;
+  const uint8_t *	p = in;
+  uint8_t *		o = out;
+
+  memset(hash_table, 0, sizeof(hash_table));
+  while ( p + MINIMUM_MATCH <= match_limit ) {
+    const uint32_t	v = read32(p);
+    const uint32_t	h = (v * 2654435761u) >> (32 - HASH_BITS);
+    const uint16_t	candidate = hash_table[h];
+
+    // Positions are stored plus one, so that zero is empty.
+    hash_table[h] = (p - in) + 1;
+    if ( candidate == 0 || read32(in + candidate - 1) != v ) {
+      p++;
+      continue;
+    }
+
+    const uint8_t * const	match = in + candidate - 1;
+    size_t			length = MINIMUM_MATCH;
+
+    while ( p + length < end && match[length] == p[length] )
+      length++;
+    o = put_sequence(o, anchor, p - anchor, p - match, length);
+    p += length;
+    anchor = p;
+  }
+  o = put_sequence(o, anchor, end - anchor, 0, 0);
+  return o - out;
+}
+
+// Read an extended length. Return false if it runs past the end.
+static bool
+get_length(const uint8_t * * i, const uint8_t * end, size_t * length)
+{
+  uint8_t b;
+
+  do {
+    if ( *i >= end )
+      return false;
+    b = *(*i)++;
+    *length += b;
+  } while ( b == 255 );
+  return true;
+}
+
+// Return the decompressed size, or -1 if the data is corrupt.
+static long
+decompress(const uint8_t * in, size_t size, uint8_t * out, size_t out_size)
+{
+  const uint8_t * const	end = in + size;
+  const uint8_t *	i = in;
+  size_t		o = 0;
+
+  while ( i < end ) {
+    const uint8_t	token = *i++;
+    size_t		length = token >> 4;
+
+    if ( length == 15 && !get_length(&i, end, &length) )
+      return -1;
+    if ( length > (size_t)(end - i) || length > out_size - o )
+      return -1;
+    memcpy(&out[o], i, length);
+    i += length;
+    o += length;
+    if ( i == end )
+      break;
+
+    if ( end - i < 2 )
+      return -1;
+
+    const size_t offset = get16(i);
+
+    i += 2;
+    length = token & 15;
+    if ( length == 15 && !get_length(&i, end, &length) )
+      return -1;
+    length += MINIMUM_MATCH;
+    if ( offset == 0 || offset > o || length > out_size - o )
+      return -1;
+    // The match may overlap what it is copying, so copy a byte at a time.
+    for ( size_t n = 0; n < length; n++, o++ )
+      out[o] = out[o - offset];
+  }
+  return o;
+}
+
+static size_t
+put_header(uint8_t * p, const block_header_t * h)
+{
+  put32(p, BLOCK_MAGIC);
+  put16(p + 4, h->compressed_size);
+  put16(p + 6, h->raw_size);
+  put32(p + 8, h->checksum);
+  put64(p + 12, h->first_time);
+  put64(p + 20, h->minimum_time);
+  put64(p + 28, h->maximum_time);
+  return HEADER_SIZE;
+}
+
+static bool
+get_header(const uint8_t * p, block_header_t * h)
+{
+  if ( get32(p) != BLOCK_MAGIC )
+    return false;
+  h->compressed_size = get16(p + 4);
+  h->raw_size = get16(p + 6);
+  h->checksum = get32(p + 8);
+  h->first_time = get64(p + 12);
+  h->minimum_time = get64(p + 20);
+  h->maximum_time = get64(p + 28);
+  return h->raw_size <= GM_LOG_STORE_BLOCK_SIZE
+   && h->compressed_size <= COMPRESS_BOUND(GM_LOG_STORE_BLOCK_SIZE);
+}
+
+static void
+write_index(void)
+{
+  uint8_t	data[INDEX_HEADER_SIZE + GM_LOG_STORE_MAXIMUM_SEGMENTS * INDEX_ENTRY_SIZE];
+  uint8_t *	p = data;
+
+  put32(p, INDEX_MAGIC);
+  put32(p + 4, INDEX_VERSION);
+  put32(p + 8, number_of_segments);
+  p += INDEX_HEADER_SIZE;
+  for ( size_t i = 0; i < number_of_segments; i++, p += INDEX_ENTRY_SIZE ) {
+    put32(p, segments[i].number);
+    put32(p + 4, segments[i].size);
+    put64(p + 8, segments[i].minimum_time);
+    put64(p + 16, segments[i].maximum_time);
+  }
+  (void)(backend->write_index)(backend->context, data, p - data);
+}
+
+static void
+read_index(void)
+{
+  uint8_t	data[INDEX_HEADER_SIZE + GM_LOG_STORE_MAXIMUM_SEGMENTS * INDEX_ENTRY_SIZE];
+  const long	size = (backend->read_index)(backend->context, data, sizeof(data));
+  uint32_t	count;
+
+  number_of_segments = 0;
+  if ( size < INDEX_HEADER_SIZE
+   ||  get32(data) != INDEX_MAGIC
+   ||  get32(data + 4) != INDEX_VERSION
+   ||  (count = get32(data + 8)) > GM_LOG_STORE_MAXIMUM_SEGMENTS
+   ||  (size_t)size < INDEX_HEADER_SIZE + count * INDEX_ENTRY_SIZE )
+    return;
+
+  for ( uint32_t i = 0; i < count; i++ ) {
+    const uint8_t * const p = &data[INDEX_HEADER_SIZE + i * INDEX_ENTRY_SIZE];
+
+    segments[i].number = get32(p);
+    segments[i].size = get32(p + 4);
+    segments[i].minimum_time = get64(p + 8);
+    segments[i].maximum_time = get64(p + 16);
+  }
+  number_of_segments = count;
+}
+
+// Find the end of the valid blocks of a segment, and their range of times.
+// A block that was being written when the power failed ends it.
+static void
+scan_segment(segment_t * s)
+{
+  uint8_t	h[HEADER_SIZE];
+  block_header_t header;
+  size_t	offset = 0;
+
+  s->minimum_time = INT64_MAX;
+  s->maximum_time = INT64_MIN;
+  while ( (backend->read)(backend->context, s->number, offset, h, sizeof(h)) == sizeof(h)
+   && get_header(h, &header) ) {
+    const long size = (backend->read)(backend->context, s->number, offset + HEADER_SIZE, compressed, header.compressed_size);
+
+    if ( size != header.compressed_size || checksum(compressed, size) != header.checksum )
+      break;
+    if ( header.minimum_time < s->minimum_time )
+      s->minimum_time = header.minimum_time;
+    if ( header.maximum_time > s->maximum_time )
+      s->maximum_time = header.maximum_time;
+    offset += HEADER_SIZE + header.compressed_size;
+  }
+  s->size = offset;
+}
+
+static void
+remove_oldest(void)
+{
+  (void)(backend->remove)(backend->context, segments[0].number);
+  memmove(&segments[0], &segments[1], (number_of_segments - 1) * sizeof(*segments));
+  number_of_segments--;
+  pthread_mutex_lock(&lock);
+  stats.segments_removed++;
+  pthread_mutex_unlock(&lock);
+}
+
+// Write what is gathered in the chunk.
+static void
+write_chunk(void)
+{
+  segment_t * const s = &segments[number_of_segments - 1];
+
+  if ( chunk_size == 0 )
+    return;
+  if ( (backend->append)(backend->context, s->number, chunk, chunk_size) == 0 )
+    s->size += chunk_size;
+  pthread_mutex_lock(&lock);
+  stats.appends++;
+  pthread_mutex_unlock(&lock);
+  chunk_size = 0;
+}
+
+static void
+start_segment(void)
+{
+  size_t	total = 0;
+  uint32_t	number = 1;
+
+  if ( number_of_segments > 0 ) {
+    write_chunk();
+    number = segments[number_of_segments - 1].number + 1;
+  }
+
+  // Make room for the new segment to grow to its full size.
+  for ( size_t i = 0; i < number_of_segments; i++ )
+    total += segments[i].size;
+  while ( number_of_segments > 0
+   && (number_of_segments == GM_LOG_STORE_MAXIMUM_SEGMENTS || total + config.segment_size > config.budget) ) {
+    total -= segments[0].size;
+    remove_oldest();
+  }
+
+  segment_t * const s = &segments[number_of_segments++];
+
+  s->number = number;
+  s->size = 0;
+  s->minimum_time = INT64_MAX;
+  s->maximum_time = INT64_MIN;
+  write_index();
+}
+
+// Add bytes to the chunk, and write it each time that it reaches an aligned
+// offset in the segment.
+static void
+add_to_chunk(const uint8_t * data, size_t size)
+{
+  while ( size > 0 ) {
+    const size_t	offset = segments[number_of_segments - 1].size;
+    const size_t	limit = GM_LOG_STORE_CHUNK_SIZE - offset % GM_LOG_STORE_CHUNK_SIZE;
+    const size_t	n = size < limit - chunk_size ? size : limit - chunk_size;
+
+    memcpy(&chunk[chunk_size], data, n);
+    chunk_size += n;
+    data += n;
+    size -= n;
+    if ( chunk_size == limit )
+      write_chunk();
+  }
+}
+
+static void
+store_block(const raw_block_t * r)
+{
+  block_header_t	header;
+  const size_t		size = compress(r->data, r->size, &compressed[HEADER_SIZE]);
+  segment_t *		s = &segments[number_of_segments - 1];
+
+  header.compressed_size = size;
+  header.raw_size = r->size;
+  header.checksum = checksum(&compressed[HEADER_SIZE], size);
+  header.first_time = r->first_time;
+  header.minimum_time = r->minimum_time;
+  header.maximum_time = r->maximum_time;
+  put_header(compressed, &header);
+
+  if ( s->size + chunk_size > 0 && s->size + chunk_size + HEADER_SIZE + size > config.segment_size ) {
+    start_segment();
+    s = &segments[number_of_segments - 1];
+  }
+  add_to_chunk(compressed, HEADER_SIZE + size);
+  if ( r->minimum_time < s->minimum_time )
+    s->minimum_time = r->minimum_time;
+  if ( r->maximum_time > s->maximum_time )
+    s->maximum_time = r->maximum_time;
+
+  pthread_mutex_lock(&lock);
+  stats.blocks++;
+  stats.stored_bytes += HEADER_SIZE + size;
+  pthread_mutex_unlock(&lock);
+}
+
+static void
+start_block(raw_block_t * r)
+{
+  r->size = 0;
+  r->sequence = next_sequence++;
+}
+
+// Return the full block that was filled first, or -1.
+static int
+oldest_full_block(void)
+{
+  if ( full[0] && full[1] )
+    return (int32_t)(blocks[1].sequence - blocks[0].sequence) > 0 ? 0 : 1;
+  if ( full[0] )
+    return 0;
+  if ( full[1] )
+    return 1;
+  return -1;
+}
+
+void
+gm_log_store_flush(bool all)
+{
+  int b;
+
+  if ( backend == NULL )
+    return;
+
+  pthread_mutex_lock(&writer_lock);
+  for ( ; ; ) {
+    pthread_mutex_lock(&lock);
+    b = oldest_full_block();
+    // Only the flush fills the block that is being filled.
+    if ( b < 0 && all && blocks[filling].size > 0 ) {
+      b = filling;
+      full[b] = true;
+      filling = !filling;
+      start_block(&blocks[filling]);
+    }
+    pthread_mutex_unlock(&lock);
+    if ( b < 0 )
+      break;
+
+    // A full block isn't touched by writers, so it's compressed without the
+    // lock.
+    store_block(&blocks[b]);
+    pthread_mutex_lock(&lock);
+    full[b] = false;
+    pthread_mutex_unlock(&lock);
+  }
+  if ( all )
+    write_chunk();
+  pthread_mutex_unlock(&writer_lock);
+}
+
+int
+gm_log_store_init(const gm_log_store_backend_t * b, const gm_log_store_config_t * c)
+{
+  pthread_mutex_lock(&writer_lock);
+  pthread_mutex_lock(&lock);
+  backend = NULL;
+  memset(&stats, 0, sizeof(stats));
+  full[0] = full[1] = false;
+  filling = 0;
+  start_block(&blocks[0]);
+  pthread_mutex_unlock(&lock);
+
+  config = *c;
+  if ( config.segment_size < GM_LOG_STORE_CHUNK_SIZE )
+    config.segment_size = GM_LOG_STORE_CHUNK_SIZE;
+  if ( config.budget < config.segment_size )
+    config.budget = config.segment_size;
+  chunk_size = 0;
+
+  backend = b;
+  read_index();
+  if ( number_of_segments > 0 )
+    scan_segment(&segments[number_of_segments - 1]);
+  // Drop segments that were started but never written.
+  while ( number_of_segments > 0 && segments[number_of_segments - 1].size == 0 ) {
+    number_of_segments--;
+    (void)(backend->remove)(backend->context, segments[number_of_segments].number);
+  }
+  start_segment();
+  pthread_mutex_unlock(&writer_lock);
+  return 0;
+}
+
+// Call the reader for each message of a raw block that is in the range.
+static int
+read_messages(
+ const uint8_t *	data,
+ size_t			size,
+ int64_t		time,
+ int64_t		from,
+ int64_t		to,
+ gm_log_store_reader_t	reader,
+ void *			context)
+{
+  size_t offset = 0;
+
+  while ( offset < size ) {
+    uint64_t	delta;
+    uint64_t	length;
+    size_t	n;
+
+    if ( (n = get_varint(&data[offset], size - offset, &delta)) == 0 )
+      return -1;
+    offset += n;
+    if ( (n = get_varint(&data[offset], size - offset, &length)) == 0 || length > size - offset - n )
+      return -1;
+    offset += n;
+    // Zig-zag decoding of the signed difference.
+    time += (int64_t)(delta >> 1) ^ -(int64_t)(delta & 1);
+    if ( time >= from && time <= to && (reader)(time, (const char *)&data[offset], length, context) != 0 )
+      return 1;
+    offset += length;
+  }
+  return 0;
+}
+
+// What is stored of a segment: what is written to the backend, and for the
+// current segment, the chunk that hasn't been written yet.
+typedef struct _source {
+  uint32_t		segment;
+  size_t		written;
+  const uint8_t *	tail;
+  size_t		tail_size;
+} source_t;
+
+static bool
+read_source(const source_t * s, size_t offset, uint8_t * data, size_t size)
+{
+  if ( offset < s->written ) {
+    const size_t n = size < s->written - offset ? size : s->written - offset;
+
+    if ( (backend->read)(backend->context, s->segment, offset, data, n) != (long)n )
+      return false;
+    offset += n;
+    data += n;
+    size -= n;
+  }
+  if ( size == 0 )
+    return true;
+  offset -= s->written;
+  if ( offset + size > s->tail_size )
+    return false;
+  memcpy(data, &s->tail[offset], size);
+  return true;
+}
+
+// Call the reader for the messages of the blocks of a segment. Return 1 if the
+// reader stopped, 0 at the end of the segment, or -1 on error.
+static int
+read_blocks(
+ const source_t *	source,
+ int64_t		from,
+ int64_t		to,
+ gm_log_store_reader_t	reader,
+ void *			context,
+ uint8_t *		data,
+ uint8_t *		raw)
+{
+  uint8_t		h[HEADER_SIZE];
+  block_header_t	header;
+  size_t		offset = 0;
+
+  while ( read_source(source, offset, h, sizeof(h)) && get_header(h, &header) ) {
+    long	size;
+    int		result;
+
+    offset += HEADER_SIZE;
+    if ( header.maximum_time < from || header.minimum_time > to ) {
+      offset += header.compressed_size;
+      continue;
+    }
+    if ( !read_source(source, offset, data, header.compressed_size)
+     || checksum(data, header.compressed_size) != header.checksum
+     || (size = decompress(data, header.compressed_size, raw, GM_LOG_STORE_BLOCK_SIZE)) != header.raw_size )
+      return -1;
+    offset += header.compressed_size;
+    if ( (result = read_messages(raw, size, header.first_time, from, to, reader, context)) != 0 )
+      return result;
+  }
+  return 0;
+}
+
+int
+gm_log_store_read(int64_t from, int64_t to, gm_log_store_reader_t reader, void * context)
+{
+  uint8_t * const	data = gm_malloc(GM_MEMORY_LOG, COMPRESS_BOUND(GM_LOG_STORE_BLOCK_SIZE));
+  raw_block_t * const	raw = gm_malloc(GM_MEMORY_LOG, 2 * sizeof(*raw));
+  int			result = 0;
+  int			number_in_ram = 0;
+
+  if ( data == NULL || raw == NULL ) {
+    gm_free(data);
+    gm_free(raw);
+    return -1;
+  }
+  if ( backend == NULL ) {
+    gm_free(data);
+    gm_free(raw);
+    return 0;
+  }
+
+  pthread_mutex_lock(&writer_lock);
+  for ( size_t i = 0; i < number_of_segments && result == 0; i++ ) {
+    const segment_t * const	s = &segments[i];
+    const bool			current = i == number_of_segments - 1;
+
+    // The times of the current segment only cover what is written.
+    if ( !current && (s->maximum_time < from || s->minimum_time > to) )
+      continue;
+
+    const source_t source = {
+      .segment = s->number,
+      .written = s->size,
+      .tail = current ? chunk : NULL,
+      .tail_size = current ? chunk_size : 0
+    };
+
+    result = read_blocks(&source, from, to, reader, context, data, raw->data);
+    // Corruption ends a segment, but the others are still read.
+    if ( result < 0 )
+      result = 0;
+  }
+
+  // Then the messages still in RAM. While the writer lock is held, the full
+  // blocks aren't stored, but messages are still added, so the blocks are
+  // copied.
+  pthread_mutex_lock(&lock);
+  for ( int b = 0; b < 2; b++ ) {
+    if ( (full[b] || b == filling) && blocks[b].size > 0 )
+      memcpy(&raw[number_in_ram++], &blocks[b], sizeof(*raw));
+  }
+  pthread_mutex_unlock(&lock);
+  pthread_mutex_unlock(&writer_lock);
+
+  // Oldest block first.
+  const bool reversed = number_in_ram == 2 && (int32_t)(raw[1].sequence - raw[0].sequence) < 0;
+
+  for ( int i = 0; i < number_in_ram && result == 0; i++ ) {
+    const int b = reversed ? 1 - i : i;
+
+    result = read_messages(raw[b].data, raw[b].size, raw[b].first_time, from, to, reader, context);
+  }
+
+  gm_free(data);
+  gm_free(raw);
+  return result < 0 ? -1 : 0;
+}
+
+bool
+gm_log_store_write(int64_t time, const char * text, size_t size)
+{
+  uint8_t	prefix[20];
+  size_t	prefix_size;
+  bool		ready = false;
+  raw_block_t *	r;
+
+  if ( backend == NULL )
+    return false;
+  if ( size > MESSAGE_MAXIMUM )
+    size = MESSAGE_MAXIMUM;
+
+  pthread_mutex_lock(&lock);
+  r = &blocks[filling];
+  for ( ; ; ) {
+    const int64_t delta = r->size ? time - r->previous_time : 0;
+
+    // Zig-zag encoding, so that small negative differences are short.
+    prefix_size = put_varint(prefix, ((uint64_t)delta << 1) ^ (uint64_t)(delta >> 63));
+    prefix_size += put_varint(&prefix[prefix_size], size);
+    if ( r->size + prefix_size + size <= GM_LOG_STORE_BLOCK_SIZE )
+      break;
+
+    // The block is full. Switch to the other, unless it hasn't been stored.
+    ready = true;
+    if ( full[!filling] ) {
+      stats.dropped++;
+      pthread_mutex_unlock(&lock);
+      return true;
+    }
+    full[filling] = true;
+    filling = !filling;
+    r = &blocks[filling];
+    start_block(r);
+  }
+
+  if ( r->size == 0 ) {
+    r->first_time = r->minimum_time = r->maximum_time = time;
+  }
+  else {
+    if ( time < r->minimum_time )
+      r->minimum_time = time;
+    if ( time > r->maximum_time )
+      r->maximum_time = time;
+  }
+  r->previous_time = time;
+  memcpy(&r->data[r->size], prefix, prefix_size);
+  memcpy(&r->data[r->size + prefix_size], text, size);
+  r->size += prefix_size + size;
+  stats.messages++;
+  stats.raw_bytes += prefix_size + size;
+  pthread_mutex_unlock(&lock);
+  return ready;
+}
+
+void
+gm_log_store_stats(gm_log_store_stats_t * s)
+{
+  pthread_mutex_lock(&writer_lock);
+  pthread_mutex_lock(&lock);
+  *s = stats;
+  pthread_mutex_unlock(&lock);
+  s->number_of_segments = number_of_segments;
+  s->total_size = chunk_size;
+  for ( size_t i = 0; i < number_of_segments; i++ )
+    s->total_size += segments[i].size;
+  pthread_mutex_unlock(&writer_lock);
+}
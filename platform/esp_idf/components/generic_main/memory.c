@@ -0,0 +1,348 @@
+// Tagged memory allocation. See gm_memory.h
+//
+// Each allocation has a header in front of it, with its size, tag, site, and
+// sequence number, and the links of the list of live allocations. The header
+// is a multiple of the alignment that malloc() gives, so the memory after it
+// is aligned the same. One mutex protects the list and the statistics; it's
+// held only for a few stores, and malloc() takes a lock anyway.
+//
+// This is portable C. On the device, the heap numbers come from heap_caps.
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#ifdef ESP_PLATFORM
+#include <esp_heap_caps.h>
+#endif
+#include "gm_memory.h"
+
+#define MAGIC			0x6d
+// Sample the largest free block when a peak is this much above the last
+// sampled one, so that it's done a few times as a subsystem grows, rather
+// than for every allocation.
+#define SAMPLE_GROWTH(peak)	((peak) / 4 + 256)
+// Sites reported by gm_memory_since().
+#define MAXIMUM_SITES		32
+
+typedef struct _header {
+  struct _header *	previous;
+  struct _header *	next;
+  const char *		file;
+  size_t		size;
+  uint32_t		sequence;
+  uint16_t		line;
+  uint8_t		tag;
+  uint8_t		magic;
+} header_t;
+
+typedef union _aligned_header {
+  header_t	header;
+  max_align_t	alignment[(sizeof(header_t) + sizeof(max_align_t) - 1) / sizeof(max_align_t)];
+} aligned_header_t;
+
+typedef struct _site {
+  const char *	file;
+  uint16_t	line;
+  uint8_t	tag;
+  uint32_t	allocations;
+  size_t	bytes;
+} site_t;
+
+static const char * const names[GM_MEMORY_TAGS] = {
+  [GM_MEMORY_OTHER] = "other",
+  [GM_MEMORY_ASSETS] = "assets",
+  [GM_MEMORY_CHANNELS] = "channels",
+  [GM_MEMORY_COMMANDS] = "commands",
+  [GM_MEMORY_CONFIG] = "config",
+  [GM_MEMORY_CPU] = "cpu",
+  [GM_MEMORY_LOG] = "log",
+  [GM_MEMORY_PCP] = "pcp",
+  [GM_MEMORY_PROFILE] = "profile",
+  [GM_MEMORY_RADIO] = "radio",
+  [GM_MEMORY_REDIRECT] = "redirect",
+  [GM_MEMORY_SESSION] = "session",
+  [GM_MEMORY_STUN] = "stun",
+  [GM_MEMORY_TEMPLATE] = "template",
+  [GM_MEMORY_TRACE] = "trace"
+};
+
+static pthread_mutex_t		lock = PTHREAD_MUTEX_INITIALIZER;
+static gm_memory_stats_t	stats[GM_MEMORY_TAGS];
+static size_t			sampled_peak[GM_MEMORY_TAGS];
+static header_t *		live = NULL;
+static uint32_t			next_sequence = 1;
+
+static size_t
+largest_free_block(void)
+{
+#ifdef ESP_PLATFORM
+  return heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+#else
+  return 0;
+#endif
+}
+
+static gm_memory_tag_t
+valid_tag(gm_memory_tag_t tag)
+{
+  return (unsigned)tag < GM_MEMORY_TAGS ? tag : GM_MEMORY_OTHER;
+}
+
+static header_t *
+header_of(void * p)
+{
+  header_t * const h = &((aligned_header_t *)p - 1)->header;
+
+  if ( h->magic != MAGIC ) {
+    // Memory from malloc(), or a double free.
+    abort();
+  }
+  return h;
+}
+
+// Put an allocation on the list and count it. Called with the lock held.
+static void
+add(header_t * h, gm_memory_tag_t tag, size_t size, const char * file, int line)
+{
+  gm_memory_stats_t * const s = &stats[tag];
+
+  h->file = file;
+  h->line = line;
+  h->size = size;
+  h->tag = tag;
+  h->magic = MAGIC;
+  h->sequence = next_sequence++;
+  h->previous = NULL;
+  h->next = live;
+  if ( live )
+    live->previous = h;
+  live = h;
+
+  s->allocations++;
+  s->live_allocations++;
+  s->live_bytes += size;
+  if ( s->live_bytes > s->peak_bytes )
+    s->peak_bytes = s->live_bytes;
+}
+
+// Take an allocation off of the list. Called with the lock held.
+static void
+remove_live(header_t * h)
+{
+  gm_memory_stats_t * const s = &stats[h->tag];
+
+  if ( h->previous )
+    h->previous->next = h->next;
+  else
+    live = h->next;
+  if ( h->next )
+    h->next->previous = h->previous;
+  s->live_allocations--;
+  s->live_bytes -= h->size;
+  s->frees++;
+}
+
+// Sample the largest free block, if the tag has grown enough since the last
+// sample. heap_caps walks the heap for this, so it's done without the lock.
+static void
+sample(gm_memory_tag_t tag)
+{
+  size_t peak;
+  bool due;
+
+  pthread_mutex_lock(&lock);
+  peak = stats[tag].peak_bytes;
+  due = peak >= sampled_peak[tag] + SAMPLE_GROWTH(sampled_peak[tag]);
+  if ( due )
+    sampled_peak[tag] = peak;
+  pthread_mutex_unlock(&lock);
+
+  if ( due ) {
+    const size_t largest = largest_free_block();
+
+    pthread_mutex_lock(&lock);
+    stats[tag].largest_free_at_peak = largest;
+    pthread_mutex_unlock(&lock);
+  }
+}
+
+static void
+failed(gm_memory_tag_t tag)
+{
+  pthread_mutex_lock(&lock);
+  stats[tag].failures++;
+  pthread_mutex_unlock(&lock);
+}
+
+void *
+gm_memory_allocate(gm_memory_tag_t tag, size_t size, const char * file, int line)
+{
+  aligned_header_t * a;
+
+  tag = valid_tag(tag);
+  if ( size > SIZE_MAX - sizeof(*a) || (a = malloc(sizeof(*a) + size)) == NULL ) {
+    failed(tag);
+    return NULL;
+  }
+  pthread_mutex_lock(&lock);
+  add(&a->header, tag, size, file, line);
+  pthread_mutex_unlock(&lock);
+  sample(tag);
+  return a + 1;
+}
+
+void *
+gm_memory_allocate_zeroed(gm_memory_tag_t tag, size_t number, size_t size, const char * file, int line)
+{
+  void * p;
+
+  if ( size != 0 && number > SIZE_MAX / size ) {
+    failed(valid_tag(tag));
+    return NULL;
+  }
+  if ( (p = gm_memory_allocate(tag, number * size, file, line)) != NULL )
+    memset(p, 0, number * size);
+  return p;
+}
+
+char *
+gm_memory_duplicate_string(gm_memory_tag_t tag, const char * s, const char * file, int line)
+{
+  const size_t	size = strlen(s) + 1;
+  char * const	p = gm_memory_allocate(tag, size, file, line);
+
+  if ( p != NULL )
+    memcpy(p, s, size);
+  return p;
+}
+
+void *
+gm_memory_reallocate(gm_memory_tag_t tag, void * p, size_t size, const char * file, int line)
+{
+  aligned_header_t *	a;
+  header_t *		h;
+
+  if ( p == NULL )
+    return gm_memory_allocate(tag, size, file, line);
+
+  // Off of the list while realloc() may move it.
+  h = header_of(p);
+  tag = h->tag;
+  pthread_mutex_lock(&lock);
+  remove_live(h);
+  stats[tag].frees--;
+  pthread_mutex_unlock(&lock);
+
+  if ( size > SIZE_MAX - sizeof(*a) || (a = realloc((aligned_header_t *)p - 1, sizeof(*a) + size)) == NULL ) {
+    // The old allocation is still good.
+    pthread_mutex_lock(&lock);
+    stats[tag].allocations--;
+    add(h, tag, h->size, h->file, h->line);
+    stats[tag].failures++;
+    pthread_mutex_unlock(&lock);
+    return NULL;
+  }
+  pthread_mutex_lock(&lock);
+  // Counted as an allocation, but the old one isn't counted as a free.
+  add(&a->header, tag, size, file, line);
+  pthread_mutex_unlock(&lock);
+  sample(tag);
+  return a + 1;
+}
+
+void
+gm_free(void * p)
+{
+  header_t * h;
+
+  if ( p == NULL )
+    return;
+  h = header_of(p);
+  pthread_mutex_lock(&lock);
+  remove_live(h);
+  pthread_mutex_unlock(&lock);
+  h->magic = 0;
+  free((aligned_header_t *)p - 1);
+}
+
+void
+gm_memory_heap(gm_memory_heap_t * heap)
+{
+#ifdef ESP_PLATFORM
+  heap->free_bytes = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+  heap->minimum_free_bytes = heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT);
+  heap->largest_free_block = heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+#else
+  memset(heap, 0, sizeof(*heap));
+#endif
+}
+
+uint32_t
+gm_memory_mark(void)
+{
+  uint32_t mark;
+
+  pthread_mutex_lock(&lock);
+  mark = next_sequence;
+  pthread_mutex_unlock(&lock);
+  return mark;
+}
+
+void
+gm_memory_since(uint32_t mark, gm_memory_site_t site, void * context)
+{
+  site_t * const	sites = calloc(MAXIMUM_SITES, sizeof(*sites));
+  site_t		rest = { .file = "other sites" };
+  size_t		number_of_sites = 0;
+
+  if ( sites == NULL )
+    return;
+
+  // Gather under the lock, and report after, as the reporter may allocate.
+  pthread_mutex_lock(&lock);
+  for ( const header_t * h = live; h != NULL; h = h->next ) {
+    site_t *	s = NULL;
+
+    if ( (int32_t)(h->sequence - mark) < 0 )
+      continue;
+    for ( size_t i = 0; i < number_of_sites; i++ ) {
+      if ( sites[i].line == h->line && sites[i].tag == h->tag && sites[i].file == h->file ) {
+        s = &sites[i];
+        break;
+      }
+    }
+    if ( s == NULL ) {
+      if ( number_of_sites < MAXIMUM_SITES ) {
+        s = &sites[number_of_sites++];
+        s->file = h->file;
+        s->line = h->line;
+        s->tag = h->tag;
+      }
+      else
+        s = &rest;
+    }
+    s->allocations++;
+    s->bytes += h->size;
+  }
+  pthread_mutex_unlock(&lock);
+
+  for ( size_t i = 0; i < number_of_sites; i++ )
+    (site)(sites[i].tag, sites[i].file, sites[i].line, sites[i].allocations, sites[i].bytes, context);
+  if ( rest.allocations > 0 )
+    (site)(GM_MEMORY_OTHER, rest.file, 0, rest.allocations, rest.bytes, context);
+  free(sites);
+}
+
+void
+gm_memory_stats(gm_memory_tag_t tag, gm_memory_stats_t * s)
+{
+  pthread_mutex_lock(&lock);
+  *s = stats[valid_tag(tag)];
+  pthread_mutex_unlock(&lock);
+}
+
+const char *
+gm_memory_tag_name(gm_memory_tag_t tag)
+{
+  return names[valid_tag(tag)];
+}
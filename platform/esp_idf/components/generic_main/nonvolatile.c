@@ -1,35 +1,72 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
 #include <time.h>
+#include <esp_timer.h>
 #include "generic_main.h"
 
+// Non-volatile parameters are kept through the configuration store, see
+// config_store.c, which batches their writes to NVS. Changes made outside of a
+// gm_config_begin() / gm_config_commit() transaction are written after a short
+// delay, so that several changes in quick succession are written together.
+#define FLUSH_DELAY_SECONDS	1
+
+// The parameter table is indexed with a perfect hash, and every value is kept
+// in RAM, parsed according to its type, so that reading a parameter costs one
+// hash and one string comparison, and no FLASH access.
+//
+// Each string value has two buffers, used alternately, so that a pointer
+// returned by gm_nonvolatile_string() remains valid until the value has
+// changed twice. Readers that hold on to a value longer than that should
+// subscribe to changes, and re-read it when notified.
+#define HASH_BITS		5
+#define HASH_SIZE		(1 << HASH_BITS)	// Larger than the table.
+#define HASH_SEED_ATTEMPTS	1000
+
 typedef struct gm_nonvolatile {
   const char * 		name;
   gm_nonvolatile_type_t	type;
   bool			secret;
+  uint16_t		size;	// Of the string value, including the terminating null.
   const char *		explanation;
-  void			(*call_after_set)(void);
 } gm_nonvolatile_t;
 
-extern void gm_wifi_restart(void);
+typedef struct _value {
+  char *	strings[2];
+  uint8_t	current;
+  bool		set;
+  long		integer;
+  double	number;
+} value_t;
 
 static const gm_nonvolatile_t gm_nonvolatile[] = {
-  { "admin_password", STRING, true, "The admin user password.\n", 0},
-  { "callsign", STRING, false, "Amateur Radio callsign.\n", 0},
-  { "aprs_destination", STRING, false, "Destination for APRS packets, usually WIDE1.\n", 0},
-  { "ddns_basic_auth", STRING, false, "send HTTP basic authentication on the first transaction with the Dynamic DNS server.\n", 0},
-  { "ddns_hostname", STRING, false, "Hostname for this device to set in dynamic DNS.", 0 },
-  { "ddns_password", STRING, true, "Password for secure access to the dynamic DNS host.", 0 },
-  { "ddns_provider", STRING, false, "Name of the Dynamic DNS provider.", 0 },
-  { "ddns_token", STRING, true, "secret token to set in dynamic DNS.", 0 },
-  { "ddns_username", STRING, false, "User name for secure access to the dynamic DNS host.", 0 },
-  { "ssid", STRING, false, "Name of the WiFi access point", gm_wifi_restart },
-  { "timezone", STRING, false, "Time zone, like PST8PDT, (see https://github.com/nayarsystems/posix_tz_db/blob/master/zones.csv)", 0 },
-  { "wifi_password", STRING, true, "Password of the WiFi access point", gm_wifi_restart },
+  { "admin_password", STRING, true, 64, "The admin user password.\n" },
+  { "callsign", STRING, false, 16, "Amateur Radio callsign.\n" },
+  { "aprs_destination", STRING, false, 16, "Destination for APRS packets, usually WIDE1.\n" },
+  { "ddns_basic_auth", STRING, false, 16, "send HTTP basic authentication on the first transaction with the Dynamic DNS server.\n" },
+  { "ddns_hostname", DOMAIN, false, 254, "Hostname for this device to set in dynamic DNS." },
+  { "ddns_password", STRING, true, 64, "Password for secure access to the dynamic DNS host." },
+  { "ddns_provider", STRING, false, 32, "Name of the Dynamic DNS provider." },
+  { "ddns_token", STRING, true, 128, "secret token to set in dynamic DNS." },
+  { "ddns_username", STRING, false, 64, "User name for secure access to the dynamic DNS host." },
+  { "log_kb", INT, false, 8, "Kilobytes of the data partition to keep the log in, 0 to not keep it. The default is 128." },
+  { "ssid", STRING, false, 33, "Name of the WiFi access point" },
+  { "timezone", STRING, false, 64, "Time zone, like PST8PDT, (see https://github.com/nayarsystems/posix_tz_db/blob/master/zones.csv)" },
+  { "wifi_password", STRING, true, 65, "Password of the WiFi access point" },
   { }
 };
 
+#define NUMBER_OF_PARAMETERS ((sizeof(gm_nonvolatile) / sizeof(*gm_nonvolatile)) - 1)
+
+static pthread_mutex_t				lock = PTHREAD_MUTEX_INITIALIZER;
+static value_t					values[NUMBER_OF_PARAMETERS];
+static uint8_t					hash_index[HASH_SIZE];	// Table index + 1, or 0.
+static uint32_t					hash_seed = 0;
+static gm_nonvolatile_subscription_t *	subscriptions = NULL;
+
 esp_err_t
 gm_flash_failure(const char * module, esp_err_t err) {
   if ( GM.flash_failure == ESP_OK )
@@ -39,30 +76,359 @@ gm_flash_failure(const char * module, esp_err_t err) {
   return err;
 }
 
+static esp_timer_handle_t flush_timer = NULL;
+
+// FNV-1a, seeded. The low bits of FNV depend only on the low bits of the seed
+// and the key, so the bucket is taken from the high bits.
+static uint32_t
+bucket(uint32_t seed, const char * key)
+{
+  uint32_t h = seed;
+
+  while ( *key ) {
+    h ^= (uint8_t)*key++;
+    h *= 16777619;
+  }
+  return h >> (32 - HASH_BITS);
+}
+
+// Find a seed for which every name in the parameter table hashes to its own
+// bucket. The table is constant, so this always finds the same seed.
+static void
+build_index(void)
+{
+  uint32_t seed = 2166136261;
+
+  for ( int attempt = 0; attempt < HASH_SEED_ATTEMPTS; attempt++ ) {
+    size_t i;
+
+    memset(hash_index, 0, sizeof(hash_index));
+    for ( i = 0; i < NUMBER_OF_PARAMETERS; i++ ) {
+      const uint32_t b = bucket(seed, gm_nonvolatile[i].name);
+
+      if ( hash_index[b] != 0 )
+        break;
+      hash_index[b] = i + 1;
+    }
+    if ( i == NUMBER_OF_PARAMETERS ) {
+      hash_seed = seed;
+      return;
+    }
+    seed += 0x9e3779b9;
+  }
+  GM_FAIL("No perfect hash for the non-volatile parameter table, increase HASH_SIZE.\n");
+}
+
+static const gm_nonvolatile_t *
+find(const char * key)
+{
+  const uint8_t i = hash_index[bucket(hash_seed, key)];
+
+  if ( i == 0 || strcmp(gm_nonvolatile[i - 1].name, key) != 0 )
+    return NULL;
+  return &gm_nonvolatile[i - 1];
+}
+
+static value_t *
+value_of(const gm_nonvolatile_t * p)
+{
+  return &values[p - gm_nonvolatile];
+}
+
+static bool
+valid_domain(const char * s)
+{
+  const size_t length = strlen(s);
+  size_t label = 0;
+
+  if ( length == 0 || length > 253 )
+    return false;
+
+  for ( size_t i = 0; i <= length; i++ ) {
+    const char c = s[i];
+
+    if ( c == '.' || c == '\0' ) {
+      if ( label == 0 || label > 63 || s[i - 1] == '-' )
+        return false;
+      label = 0;
+    }
+    else if ( isalnum((unsigned char)c) || (c == '-' && label > 0) )
+      label++;
+    else
+      return false;
+  }
+  return true;
+}
+
+static bool
+valid_url(const char * s)
+{
+  const char * host;
+
+  if ( strncmp(s, "http://", 7) == 0 )
+    host = s + 7;
+  else if ( strncmp(s, "https://", 8) == 0 )
+    host = s + 8;
+  else
+    return false;
+
+  if ( *host == '\0' || *host == '/' || *host == ':' )
+    return false;
+
+  for ( const char * c = host; *c; c++ ) {
+    if ( isspace((unsigned char)*c) || iscntrl((unsigned char)*c) )
+      return false;
+  }
+  return true;
+}
+
+// Check a value against the type of its parameter, and parse it.
+static bool
+parse(const gm_nonvolatile_t * p, const char * s, long * integer, double * number)
+{
+  char * end = NULL;
+
+  *integer = 0;
+  *number = 0.0;
+
+  if ( strlen(s) >= p->size )
+    return false;
+
+  switch ( p->type ) {
+  case STRING:
+    return true;
+  case INT:
+    errno = 0;
+    *integer = strtol(s, &end, 0);
+    *number = *integer;
+    return *s != '\0' && *end == '\0' && errno == 0;
+  case FLOAT:
+    errno = 0;
+    *number = strtod(s, &end);
+    *integer = (long)*number;
+    return *s != '\0' && *end == '\0' && errno == 0;
+  case URL:
+    return valid_url(s);
+  case DOMAIN:
+    return valid_domain(s);
+  default:
+    return false;
+  }
+}
+
+// Set the cached value. Call with the lock held.
+static void
+cache_set(const gm_nonvolatile_t * p, const char * s, long integer, double number)
+{
+  value_t * const v = value_of(p);
+  const uint8_t next = !v->current;
+
+  strlcpy(v->strings[next], s, p->size);
+  v->integer = integer;
+  v->number = number;
+  v->current = next;
+  v->set = true;
+}
+
+// Load the value of a parameter from the configuration store. The store is
+// read without the lock, it may read FLASH.
+static void
+reload(const gm_nonvolatile_t * p)
+{
+  char		buffer[GM_CONFIG_VALUE_SIZE];
+  long		integer;
+  double	number;
+  const bool	found = gm_config_get(p->name, buffer, sizeof(buffer)) == GM_CONFIG_OK;
+  const bool	valid = found && parse(p, buffer, &integer, &number);
+
+  if ( found && !valid )
+    gm_printf("Non-volatile parameter %s has an invalid value, ignored.\n", p->name);
+
+  pthread_mutex_lock(&lock);
+  if ( valid )
+    cache_set(p, buffer, integer, number);
+  else
+    value_of(p)->set = false;
+  pthread_mutex_unlock(&lock);
+}
+
+// Load the value of every parameter from the configuration store.
+static void
+load(void)
+{
+  for ( size_t i = 0; i < NUMBER_OF_PARAMETERS; i++ )
+    reload(&gm_nonvolatile[i]);
+}
+
+static gm_config_result_t
+nvs_backend_get(void * context, const char * key, char * buffer, size_t size)
+{
+  const esp_err_t err = nvs_get_str(GM.nvs, key, buffer, &size);
+
+  switch ( err ) {
+  case ESP_OK:
+    return GM_CONFIG_OK;
+  case ESP_ERR_NVS_NOT_FOUND:
+    return GM_CONFIG_NOT_FOUND;
+  default:
+    gm_flash_failure("nvs", err);
+    return GM_CONFIG_ERROR;
+  }
+}
+
+static gm_config_result_t
+nvs_backend_set(void * context, const char * key, const char * value)
+{
+  const esp_err_t err = nvs_set_str(GM.nvs, key, value);
+
+  if ( err != ESP_OK ) {
+    gm_flash_failure("nvs", err);
+    return GM_CONFIG_ERROR;
+  }
+  return GM_CONFIG_OK;
+}
+
+static gm_config_result_t
+nvs_backend_erase(void * context, const char * key)
+{
+  const esp_err_t err = nvs_erase_key(GM.nvs, key);
+
+  switch ( err ) {
+  case ESP_OK:
+    return GM_CONFIG_OK;
+  case ESP_ERR_NVS_NOT_FOUND:
+    return GM_CONFIG_NOT_FOUND;
+  default:
+    gm_flash_failure("nvs", err);
+    return GM_CONFIG_ERROR;
+  }
+}
+
+static gm_config_result_t
+nvs_backend_commit(void * context)
+{
+  const esp_err_t err = nvs_commit(GM.nvs);
+
+  if ( err != ESP_OK ) {
+    gm_flash_failure("nvs", err);
+    return GM_CONFIG_ERROR;
+  }
+  return GM_CONFIG_OK;
+}
+
+static const gm_config_backend_t nvs_backend = {
+  .get = nvs_backend_get,
+  .set = nvs_backend_set,
+  .erase = nvs_backend_erase,
+  .commit = nvs_backend_commit,
+  .context = NULL
+};
+
+// Notify the subscribers to the changed parameters. Call each subscriber once,
+// even if several of the parameters it subscribed to changed together, so that
+// changing the SSID and the WiFi password restarts WiFi once.
+static void
+changed(const char * const keys[], size_t count)
+{
+  const gm_nonvolatile_subscription_t * called[GM_CONFIG_PENDING];
+  size_t number_called = 0;
+
+  for ( const gm_nonvolatile_subscription_t * s = subscriptions; s; s = s->next ) {
+    size_t i;
+
+    for ( i = 0; i < count; i++ ) {
+      if ( strcmp(s->name, keys[i]) == 0 )
+        break;
+    }
+    if ( i == count )
+      continue;
+
+    for ( i = 0; i < number_called; i++ ) {
+      if ( called[i]->changed == s->changed && called[i]->context == s->context )
+        break;
+    }
+    if ( i < number_called )
+      continue;
+
+    if ( number_called < GM_CONFIG_PENDING )
+      called[number_called++] = s;
+    (*s->changed)(s->name, s->context);
+  }
+}
+
+static void
+flush(void * data)
+{
+  (void) gm_config_flush();
+}
+
+static void
+flush_timer_expired(void * data)
+{
+  // Don't write FLASH in the timer task, it would delay other timers.
+  gm_run(flush, NULL, GM_SLOW);
+}
+
+static void
+schedule_flush(void)
+{
+  if ( flush_timer == NULL )
+    return;
+  esp_timer_stop(flush_timer);
+  esp_timer_start_once(flush_timer, FLUSH_DELAY_SECONDS * 1000000ULL);
+}
+
+// Call after GM.nvs is open.
+void
+gm_nonvolatile_initialize(void)
+{
+  const esp_timer_create_args_t timer_args = {
+    .callback = flush_timer_expired,
+    .name = "nonvolatile flush"
+  };
+  ESP_ERROR_CHECK(esp_timer_create(&timer_args, &flush_timer));
+
+  size_t total = 0;
+  for ( size_t i = 0; i < NUMBER_OF_PARAMETERS; i++ )
+    total += gm_nonvolatile[i].size * 2;
+
+  char * storage = gm_calloc(GM_MEMORY_CONFIG, 1, total);
+  if ( storage == NULL ) {
+    GM_FAIL("Out of memory for the non-volatile parameter cache.\n");
+    return;
+  }
+  for ( size_t i = 0; i < NUMBER_OF_PARAMETERS; i++ ) {
+    values[i].strings[0] = storage;
+    values[i].strings[1] = storage + gm_nonvolatile[i].size;
+    storage += gm_nonvolatile[i].size * 2;
+  }
+
+  build_index();
+  gm_config_init(&nvs_backend, changed);
+  load();
+}
+
+// Abort the configuration transaction, and discard the changes that were
+// pending in it from the cache, too.
+void
+gm_nonvolatile_abort(void)
+{
+  gm_config_abort();
+  load();
+}
+
 void
 gm_nonvolatile_list(gm_nonvolatile_list_coroutine_t coroutine)
 {
   const gm_nonvolatile_t * p = gm_nonvolatile;
-  char buffer[1024];
-  size_t buffer_size;
+  char buffer[GM_CONFIG_VALUE_SIZE];
 
   while (p->type) {
-    buffer_size = sizeof(buffer);
-    esp_err_t err = nvs_get_str(GM.nvs, p->name, buffer, &buffer_size);
-    if ( err != ESP_OK ) {
-      if ( err == ESP_ERR_NVS_NOT_FOUND ) {
-        *buffer = '\0';
-        (*coroutine)(p->name, buffer, p->explanation, GM_NOT_SET);
-      }
-      else
-        gm_flash_failure("nvs", err);
-    }
-    else if ( p->secret ) {
+    gm_nonvolatile_result_t result = gm_nonvolatile_get(p->name, buffer, sizeof(buffer));
+
+    if ( result == GM_SECRET )
       *buffer = '\0';
-      (*coroutine)(p->name, buffer, p->explanation, GM_SECRET);
-    }
-    else
-      (*coroutine)(p->name, buffer, p->explanation, GM_NORMAL);
+    (*coroutine)(p->name, buffer, p->explanation, result);
     p++;
   }
 }
@@ -70,84 +436,140 @@ gm_nonvolatile_list(gm_nonvolatile_list_coroutine_t coroutine)
 gm_nonvolatile_result_t
 gm_nonvolatile_get(const char * key, char * buffer, size_t buffer_size)
 {
-  const gm_nonvolatile_t * p = gm_nonvolatile;
-  while (p->type) {
-    if (strcmp(p->name, key) == 0)
-      break;
-    p++;
-  }
+  const gm_nonvolatile_t * const p = find(key);
 
-  if (!p->type) {
+  if (!p) {
     return GM_NOT_IN_PARAMETER_TABLE;
   }
 
-  esp_err_t err = nvs_get_str(GM.nvs, key, buffer, &buffer_size);
+  const value_t * const v = value_of(p);
 
-  if (err) {
-    if ( err != ESP_ERR_NVS_NOT_FOUND )
-      gm_flash_failure("nvs", err);
+  pthread_mutex_lock(&lock);
+  const bool set = v->set;
+  if ( set )
+    strlcpy(buffer, v->strings[v->current], buffer_size);
+  else
     *buffer = '\0';
-    return GM_NOT_SET;
-  }
+  pthread_mutex_unlock(&lock);
 
-  if (p->secret)
+  if ( !set )
+    return GM_NOT_SET;
+  else if (p->secret)
     return GM_SECRET;
   else
     return GM_NORMAL;
 }
 
+// Zero-copy access to the value of a parameter, or NULL if it's not set.
+// See the comment at the top of this file about how long the pointer is valid.
+const char *
+gm_nonvolatile_string(const char * key)
+{
+  const gm_nonvolatile_t * const p = find(key);
+
+  if ( p == NULL ) {
+    GM_FAIL("%s is not in the non-volatile parameter table.\n", key);
+    return NULL;
+  }
+
+  const value_t * const v = value_of(p);
+  return v->set ? v->strings[v->current] : NULL;
+}
+
+bool
+gm_nonvolatile_int(const char * key, long * integer)
+{
+  const gm_nonvolatile_t * const p = find(key);
+
+  if ( p == NULL || (p->type != INT && p->type != FLOAT) )
+    return false;
+
+  const value_t * const v = value_of(p);
+
+  pthread_mutex_lock(&lock);
+  const bool set = v->set;
+  *integer = v->integer;
+  pthread_mutex_unlock(&lock);
+  return set;
+}
+
+bool
+gm_nonvolatile_float(const char * key, double * number)
+{
+  const gm_nonvolatile_t * const p = find(key);
+
+  if ( p == NULL || (p->type != INT && p->type != FLOAT) )
+    return false;
+
+  const value_t * const v = value_of(p);
+
+  pthread_mutex_lock(&lock);
+  const bool set = v->set;
+  *number = v->number;
+  pthread_mutex_unlock(&lock);
+  return set;
+}
+
 gm_nonvolatile_result_t
 gm_nonvolatile_set(const char * key, const char * value)
 {
-  const gm_nonvolatile_t * p = gm_nonvolatile;
-  while (p->type) {
-    if (strcmp(p->name, key) == 0)
-      break;
-    p++;
-  }
-  if (!p->type) {
+  const gm_nonvolatile_t * const p = find(key);
+  long		integer;
+  double	number;
+
+  if (!p) {
     return GM_NOT_IN_PARAMETER_TABLE;
   }
 
-  esp_err_t err = (nvs_set_str(GM.nvs, key, value));
-  if (err) {
-    gm_flash_failure("nvs", err);
-    return GM_ERROR;
-  }
+  if ( !parse(p, value, &integer, &number) )
+    return GM_INVALID;
 
-  ESP_ERROR_CHECK(nvs_commit(GM.nvs));
+  pthread_mutex_lock(&lock);
+  cache_set(p, value, integer, number);
+  pthread_mutex_unlock(&lock);
 
-  if (p->call_after_set)
-    (p->call_after_set)();
+  // gm_config_set() may write FLASH, and notify the subscribers, who may read
+  // parameters, so it's called without the lock. If it fails, the cache goes
+  // back to what is stored.
+  if ( gm_config_set(key, value) != GM_CONFIG_OK ) {
+    reload(p);
+    return GM_ERROR;
+  }
 
+  schedule_flush();
   return GM_NORMAL;
 }
 
 gm_nonvolatile_result_t
 gm_nonvolatile_erase(const char * key)
 {
-  const gm_nonvolatile_t * p = gm_nonvolatile;
-  while (p->type) {
-    if (strcmp(p->name, key) == 0)
-      break;
-    p++;
-  }
-  if (!p->type) {
+  const gm_nonvolatile_t * const p = find(key);
+
+  if (!p) {
     return GM_NOT_IN_PARAMETER_TABLE;
   }
 
-  esp_err_t err = (nvs_erase_key(GM.nvs, key));
+  pthread_mutex_lock(&lock);
+  value_of(p)->set = false;
+  pthread_mutex_unlock(&lock);
 
-  switch (err) {
-  case ESP_OK:
-    ESP_ERROR_CHECK(nvs_commit(GM.nvs));
-    if (p->call_after_set)
-      (p->call_after_set)();
-    return GM_NORMAL;
-  case ESP_ERR_NVS_NOT_FOUND:
-    return GM_NOT_IN_PARAMETER_TABLE;
-  default:
-    ESP_ERROR_CHECK(err);
+  if ( gm_config_erase(key) != GM_CONFIG_OK ) {
+    reload(p);
     return GM_ERROR;
   }
+
+  schedule_flush();
+  return GM_NORMAL;
+}
+
+// Call a function after a parameter has changed and the change is written to
+// FLASH. The subscription must remain valid, it is usually static.
+// This can be called from a constructor.
+void
+gm_nonvolatile_subscribe(gm_nonvolatile_subscription_t * subscription)
+{
+  pthread_mutex_lock(&lock);
+  subscription->next = subscriptions;
+  subscriptions = subscription;
+  pthread_mutex_unlock(&lock);
 }
@@ -8,6 +8,10 @@ int
 gm_param_parse(const char * s, gm_param_t * p, int count)
 {
   for ( ; ; ) {
+    // There's no room for another parameter.
+    if ( count-- <= 0 )
+      return -1;
+
     char * value = index(s, '=');
     if ( value ) {
       *value++ = '\0';
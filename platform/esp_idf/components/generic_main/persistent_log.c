@@ -0,0 +1,213 @@
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <esp_system.h>
+#include <esp_timer.h>
+#include "generic_main.h"
+#include "gm_log_store.h"
+
+// The persistent log: a log sink that keeps the log in the log store, see
+// log_store.c, in files on the littlefs data partition, so that what happened
+// before a fault can be read after it, over HTTP with GET /log.
+//
+// Full blocks are compressed and written in the GM_SLOW task. A partial block
+// is written every few minutes, and at shutdown, so that a restart loses
+// little.
+#define LOG_DIRECTORY		GM_DATA_PATH "/log"
+#define INDEX_PATH		LOG_DIRECTORY "/index"
+#define NEW_INDEX_PATH		LOG_DIRECTORY "/index.new"
+#define SEGMENT_SIZE		(32 * 1024)
+#define DEFAULT_BUDGET_KB	128
+#define FLUSH_INTERVAL_SECONDS	300
+
+// The segment that reads last opened, as reads go through a segment in order.
+static int			read_fd = -1;
+static uint32_t			read_segment = 0;
+static atomic_bool		flush_queued = false;
+static esp_timer_handle_t	flush_timer = NULL;
+
+static void
+segment_path(uint32_t segment, char * buffer, size_t size)
+{
+  snprintf(buffer, size, LOG_DIRECTORY "/%08lx", (unsigned long)segment);
+}
+
+static void
+close_read_fd(void)
+{
+  if ( read_fd >= 0 ) {
+    close(read_fd);
+    read_fd = -1;
+  }
+}
+
+static int
+append(void * context, uint32_t segment, const void * data, size_t size)
+{
+  char		path[32];
+  int		fd;
+  ssize_t	written;
+
+  // A file that is open for reading may not see what is appended.
+  if ( read_segment == segment )
+    close_read_fd();
+  segment_path(segment, path, sizeof(path));
+  if ( (fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644)) < 0 ) {
+    GM_WARN_ONCE("Persistent log: can't open %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+  written = write(fd, data, size);
+  // The close commits the data to littlefs.
+  if ( close(fd) != 0 || written != (ssize_t)size ) {
+    GM_WARN_ONCE("Persistent log: can't write %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+static long
+read_from(void * context, uint32_t segment, size_t offset, void * data, size_t size)
+{
+  if ( read_fd < 0 || read_segment != segment ) {
+    char path[32];
+
+    close_read_fd();
+    segment_path(segment, path, sizeof(path));
+    if ( (read_fd = open(path, O_RDONLY)) < 0 )
+      return -1;
+    read_segment = segment;
+  }
+  if ( lseek(read_fd, offset, SEEK_SET) < 0 )
+    return -1;
+  return read(read_fd, data, size);
+}
+
+static int
+remove_segment(void * context, uint32_t segment)
+{
+  char path[32];
+
+  if ( read_segment == segment )
+    close_read_fd();
+  segment_path(segment, path, sizeof(path));
+  return unlink(path);
+}
+
+// Write a new index, and rename it over the old one, so that a power failure
+// leaves one or the other.
+static int
+write_index(void * context, const void * data, size_t size)
+{
+  FILE * const f = fopen(NEW_INDEX_PATH, "w");
+
+  if ( f == NULL )
+    return -1;
+  if ( fwrite(data, 1, size, f) != size ) {
+    fclose(f);
+    return -1;
+  }
+  if ( fclose(f) != 0 || rename(NEW_INDEX_PATH, INDEX_PATH) != 0 )
+    return -1;
+  return 0;
+}
+
+static long
+read_index(void * context, void * data, size_t size)
+{
+  FILE * const	f = fopen(INDEX_PATH, "r");
+  size_t	n;
+
+  if ( f == NULL )
+    return -1;
+  n = fread(data, 1, size, f);
+  fclose(f);
+  return n;
+}
+
+static const gm_log_store_backend_t backend = {
+  .append = append,
+  .read = read_from,
+  .remove = remove_segment,
+  .write_index = write_index,
+  .read_index = read_index,
+  .context = NULL
+};
+
+static void
+flush_full_blocks(void * data)
+{
+  atomic_store(&flush_queued, false);
+  gm_log_store_flush(false);
+}
+
+static void
+flush_all(void * data)
+{
+  gm_log_store_flush(true);
+}
+
+static void
+flush_timer_expired(void * data)
+{
+  gm_run(flush_all, NULL, GM_SLOW);
+}
+
+static void
+flush_at_shutdown(void)
+{
+  gm_log_store_flush(true);
+}
+
+// The log ring calls this in the select task. The time is of the monotonic
+// clock, which starts at zero on every boot, so it's converted to wall-clock
+// time, which is what a reader asks for.
+static void
+sink(int64_t time, const char * text, size_t size, void * data)
+{
+  struct timeval	now;
+
+  gettimeofday(&now, NULL);
+  time = (int64_t)now.tv_sec * 1000000 + now.tv_usec - (esp_timer_get_time() - time);
+
+  if ( gm_log_store_write(time, text, size) && !atomic_exchange(&flush_queued, true) )
+    gm_run(flush_full_blocks, NULL, GM_SLOW);
+}
+
+void
+gm_persistent_log_start(void)
+{
+  gm_log_store_config_t	config = { .segment_size = SEGMENT_SIZE };
+  long			budget_kb = DEFAULT_BUDGET_KB;
+
+  if ( !GM.data_filesystem_mounted )
+    return;
+
+  (void)gm_nonvolatile_int("log_kb", &budget_kb);
+  if ( budget_kb <= 0 )
+    return;
+  config.budget = (size_t)budget_kb * 1024;
+
+  if ( mkdir(LOG_DIRECTORY, 0755) != 0 && errno != EEXIST ) {
+    GM_WARN_ONCE("Persistent log: can't create %s: %s\n", LOG_DIRECTORY, strerror(errno));
+    return;
+  }
+  if ( gm_log_store_init(&backend, &config) != 0 )
+    return;
+
+  const esp_timer_create_args_t timer_args = {
+    .callback = flush_timer_expired,
+    .name = "persistent log"
+  };
+  ESP_ERROR_CHECK(esp_timer_create(&timer_args, &flush_timer));
+  ESP_ERROR_CHECK(esp_timer_start_periodic(flush_timer, FLUSH_INTERVAL_SECONDS * 1000000LL));
+  (void)esp_register_shutdown_handler(flush_at_shutdown);
+
+  if ( !gm_log_sink_add(sink, NULL) )
+    GM_FAIL("Can't add the persistent log sink.\n");
+}
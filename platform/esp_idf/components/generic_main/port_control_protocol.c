@@ -1,8 +1,13 @@
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 #include <sys/types.h>
 #include <lwip/sockets.h>
 #include <arpa/inet.h>
+#include <esp_random.h>
+#include <esp_timer.h>
 #include "generic_main.h"
+#include "gm_trace.h"
 
 typedef enum _nat_pmp_opcode {
   NAT_PMP_ANNOUNCE = 0,
@@ -103,33 +108,53 @@ const size_t pcp_max_payload = 1100;
 const size_t pcp_map_packet_size = (size_t)&(((pcp_packet_t *)0)->mp.remote_peer_port);
 const size_t pcp_announce_packet_size = (size_t)&(((pcp_packet_t *)0)->mp);
 
-typedef gm_port_mapping_t * (*mapping_coroutine_t)(gm_port_mapping_t *, const void * const);
+// Mappings are kept in one table for all interfaces, hashed by nonce to match
+// responses, and by protocol and internal port to find the mapping of a
+// service. Each mapping has its own deadline, the time of its next request, in
+// a heap, and one timer is set for the earliest. When it expires, every mapping
+// that is due within BATCH_US is sent at once, along with every mapping that
+// is past half of its lifetime, so that mappings are renewed in a few bursts
+// instead of one wakeup each.
+//
+// Renewals are at a random point between 1/2 and 5/8 of the granted lifetime,
+// as RFC 6887 section 11.2.1 suggests, so that devices behind the same router
+// don't renew in step. Unanswered requests are retransmitted with the
+// exponential backoff of section 8.1.1. All requests pass through a token
+// bucket, so that renewing every mapping after the router loses its state
+// doesn't flood it.
+#define MAXIMUM_MAPPINGS	64
+#define BUCKETS			16	// A power of 2.
+// Retransmission: initial and maximum, RFC 6887 IRT and MRT.
+#define INITIAL_RETRANSMIT_MS	3000
+// Less than the shortest retransmission, so that a request isn't sent again
+// in the batch that sent it.
+#define BATCH_US		(2 * 1000000LL)
+#define MAXIMUM_RETRANSMIT_MS	(1024 * 1000)
+// Requests may be sent in a burst of BURST, and then REQUESTS_PER_SECOND.
+#define BURST			8
+#define REQUESTS_PER_SECOND	4
+#define SEND_INTERVAL_US	(1000000LL / REQUESTS_PER_SECOND)
+// After the router resets, renewals are spread randomly over this.
+#define RESET_SPREAD_US		(5 * 1000000LL)
+// Wait at least this long to retry after a transient error.
+#define MINIMUM_RETRY_S		30
+
+// The server epoch from the last response, RFC 6887 section 8.5.
+typedef struct _epoch {
+  bool		valid;
+  uint32_t	server;	// Seconds.
+  int64_t	client;	// gm_clock_us() when it was received.
+} epoch_t;
 
 static bool is_ipv4_mapped_ipv6(const pcp_address_t *);
-static bool send_request(const pcp_packet_t * const, const struct sockaddr * const, const int, size_t);
 static gm_netif_t * interface_for_sockaddr(const struct sockaddr_storage * const, bool *);
-static gm_pcp_nonce_t random_nonce();
-static gm_port_mapping_t * find_mapping(const gm_pcp_nonce_t * const);
-static gm_port_mapping_t * for_each_mapping(gm_port_mapping_t *, const mapping_coroutine_t, const void * const);
-static gm_port_mapping_t * renew_if_granted(gm_port_mapping_t * m, const void * const);
 static void decode_pcp_announce(const pcp_packet_t * const, const ssize_t, const struct sockaddr_storage * const);
 static void decode_pcp_map(pcp_packet_t *, ssize_t, const struct sockaddr_storage * const);
 static void decode_pcp_peer(pcp_packet_t *, ssize_t, const struct sockaddr_storage * const);
-typedef gm_netif_t * (*for_each_interface_coroutine_t)(gm_netif_t *, const void * const);
-static gm_netif_t * for_each_interface(const for_each_interface_coroutine_t, const void * const);
 static void incoming_packet(int, void *, bool, bool, bool, bool);
-static void maintain_mappings();
-static void remove_pcp_mapping(gm_port_mapping_t *);
-static void renew_all_mappings();
-static void renew_all_mappings_if_router_has_reset(const pcp_packet_t * const);
-static void renew_ipv4(const gm_port_mapping_t * const);
-static void renew_ipv6(const gm_port_mapping_t * const);
-static void renew_mapping(const gm_port_mapping_t * const);
-static void save_pcp_mapping(const pcp_packet_t * const, gm_netif_t *, const gm_port_mapping_type_t);
+static void schedule(int64_t);
 
 static const int requested_mapping_duration = 15 * 60;
-static const uint16_t https_port = 443;
-static const uint16_t external_https_port = 7300;
 
 // The "IPV4" socket is actually an IPV6 "ANY" address socket that it set to receive
 // IPV4 packets as well. sendto() is used on it with an IPV4 address.
@@ -141,7 +166,17 @@ static struct sockaddr_in6	my_ipv6_address = {
   .sin6_family = AF_INET6,
   .sin6_port = htons(PCP_CLIENT_PORT)
 };
-static uint32_t			last_received_epoch = 0;
+
+// The mapping table. All of it is protected by lock.
+static pthread_mutex_t		lock = PTHREAD_MUTEX_INITIALIZER;
+static gm_port_mapping_t *	by_nonce[BUCKETS];
+static gm_port_mapping_t *	by_port[BUCKETS];
+static gm_port_mapping_t *	heap[MAXIMUM_MAPPINGS];
+static size_t			heap_size = 0;
+static epoch_t			epochs[2];	// Indexed by ipv6.
+// The token bucket, as the time when it will be full.
+static int64_t			bucket_full = 0;
+static esp_timer_handle_t	timer = NULL;
 
 // Assignable means of setting sockaddr_storage, so that I can make structures
 // const. It takes IPV4-mapped-IPV6 addresses into account.
@@ -166,15 +201,6 @@ assign_sockaddr(const pcp_address_t * const a, const in_port_t port)
   }
   return storage;
 }
- 
-// Assignable version of gettimeofday(), so that I can make structures const.
-static struct timeval
-current_time()
-{
-  struct timeval t;
-  gettimeofday(&t, 0);
-  return t;
-}
 
 struct in6_addr
 best_matching_ipv6_address(
@@ -187,7 +213,7 @@ best_matching_ipv6_address(
 
   struct in6_addr result = {};
 
-  const struct in6_addr addresses[5] = { 
+  const struct in6_addr addresses[5] = {
     interface->ip6.link_local,
     interface->ip6.site_local,
     interface->ip6.global[0],
@@ -211,18 +237,354 @@ best_matching_ipv6_address(
   return result;
 }
 
+// Vary an interval by +/- 10%.
+static int64_t
+jitter(int64_t us)
+{
+  return us * (90 + (int64_t)(esp_random() % 21)) / 100;
+}
+
+static bool
+is_ipv6(const gm_port_mapping_t * m)
+{
+  return m->internal.ss_family == AF_INET6;
+}
+
+static in_port_t
+internal_port(const gm_port_mapping_t * m)
+{
+  if ( is_ipv6(m) )
+    return ntohs(((const struct sockaddr_in6 *)&m->internal)->sin6_port);
+  else
+    return ntohs(((const struct sockaddr_in *)&m->internal)->sin_port);
+}
+
+static size_t
+nonce_hash(const gm_pcp_nonce_t * n)
+{
+  // The nonce is random.
+  return n->data[0] & (BUCKETS - 1);
+}
+
+static size_t
+port_hash(bool ipv6, gm_pcp_protocol_t protocol, in_port_t port)
+{
+  return (port ^ (port >> 4) ^ (port >> 8) ^ protocol ^ ipv6) & (BUCKETS - 1);
+}
+
+// The heap of mappings, ordered by deadline. These are called with the lock held.
+static void
+heap_swap(size_t a, size_t b)
+{
+  gm_port_mapping_t * const t = heap[a];
+
+  heap[a] = heap[b];
+  heap[b] = t;
+  heap[a]->heap_index = a;
+  heap[b]->heap_index = b;
+}
+
+static void
+heap_up(size_t i)
+{
+  while ( i > 0 ) {
+    const size_t parent = (i - 1) / 2;
+
+    if ( heap[parent]->deadline <= heap[i]->deadline )
+      break;
+    heap_swap(parent, i);
+    i = parent;
+  }
+}
+
+static void
+heap_down(size_t i)
+{
+  for ( ; ; ) {
+    const size_t left = i * 2 + 1;
+    const size_t right = left + 1;
+    size_t earliest = i;
+
+    if ( left < heap_size && heap[left]->deadline < heap[earliest]->deadline )
+      earliest = left;
+    if ( right < heap_size && heap[right]->deadline < heap[earliest]->deadline )
+      earliest = right;
+    if ( earliest == i )
+      return;
+    heap_swap(i, earliest);
+    i = earliest;
+  }
+}
+
+// Move a mapping to its place after its deadline changed.
+static void
+heap_update(gm_port_mapping_t * m)
+{
+  heap_up(m->heap_index);
+  heap_down(m->heap_index);
+}
+
+static gm_port_mapping_t *
+find_by_nonce(const gm_pcp_nonce_t * const n)
+{
+  for ( gm_port_mapping_t * m = by_nonce[nonce_hash(n)]; m; m = m->next_by_nonce ) {
+    if ( memcmp(&m->nonce, n, sizeof(*n)) == 0 )
+      return m;
+  }
+  return NULL;
+}
+
+static gm_port_mapping_t *
+find_by_port(bool ipv6, gm_pcp_protocol_t protocol, in_port_t port)
+{
+  for ( gm_port_mapping_t * m = by_port[port_hash(ipv6, protocol, port)]; m; m = m->next_by_port ) {
+    if ( is_ipv6(m) == ipv6 && m->protocol == protocol && internal_port(m) == port )
+      return m;
+  }
+  return NULL;
+}
+
+static void
+remove_mapping(gm_port_mapping_t * m)
+{
+  gm_port_mapping_t * *	p;
+
+  for ( p = &by_nonce[nonce_hash(&m->nonce)]; *p != m; p = &(*p)->next_by_nonce )
+    ;
+  *p = m->next_by_nonce;
+
+  for ( p = &by_port[port_hash(is_ipv6(m), m->protocol, internal_port(m))]; *p != m; p = &(*p)->next_by_port )
+    ;
+  *p = m->next_by_port;
+
+  const size_t i = m->heap_index;
+  if ( i != --heap_size ) {
+    heap[i] = heap[heap_size];
+    heap[i]->heap_index = i;
+    heap_update(heap[i]);
+  }
+  gm_free(m);
+}
+
+// Consume a token from the bucket, if there is one.
+static bool
+take_token(int64_t now)
+{
+  if ( bucket_full < now )
+    bucket_full = now;
+  if ( bucket_full - now > (BURST - 1) * SEND_INTERVAL_US )
+    return false;
+  bucket_full += SEND_INTERVAL_US;
+  return true;
+}
+
+// Send a MAP request for a mapping. A lifetime of 0 deletes it.
+static bool
+send_map(const gm_port_mapping_t * const m, uint32_t lifetime)
+{
+  pcp_packet_t			p = {
+    .version = PORT_MAPPING_PROTOCOL,
+    .opcode = PCP_MAP,
+    .lifetime = htonl(lifetime),
+    .mp.nonce = m->nonce,
+    .mp.protocol = m->protocol
+  };
+  struct sockaddr_storage	router = {};
+  socklen_t			router_size;
+  int				sock;
+
+  // On the first request, the external address is all zeroes and the port is
+  // the suggested one. On renewals, they are those granted.
+  if ( is_ipv6(m) ) {
+    struct sockaddr_in6 * const r = (struct sockaddr_in6 *)&router;
+
+    p.request.client_address.sin6_addr = my_ipv6_address.sin6_addr;
+    p.mp.internal_port = ((const struct sockaddr_in6 *)&m->internal)->sin6_port;
+    p.mp.external_address.sin6_addr = ((const struct sockaddr_in6 *)&m->external)->sin6_addr;
+    p.mp.external_port = ((const struct sockaddr_in6 *)&m->external)->sin6_port;
+    r->sin6_family = AF_INET6;
+    r->sin6_addr = m->interface->ip6.router;
+    r->sin6_port = htons(PCP_SERVER_PORT);
+    router_size = sizeof(*r);
+    sock = ipv6_socket;
+  }
+  else {
+    struct sockaddr_in * const r = (struct sockaddr_in *)&router;
+
+    // PCP uses IPV4-mapped-IPV6 addresses.
+    p.request.client_address.ipv4_to_ipv6_mapping.all_ones[0] = 0xff;
+    p.request.client_address.ipv4_to_ipv6_mapping.all_ones[1] = 0xff;
+    p.request.client_address.ipv4_to_ipv6_mapping.s_addr = m->interface->ip4.address.s_addr;
+    p.mp.internal_port = ((const struct sockaddr_in *)&m->internal)->sin_port;
+    p.mp.external_address.ipv4_to_ipv6_mapping.all_ones[0] = 0xff;
+    p.mp.external_address.ipv4_to_ipv6_mapping.all_ones[1] = 0xff;
+    p.mp.external_address.ipv4_to_ipv6_mapping.s_addr = ((const struct sockaddr_in *)&m->external)->sin_addr.s_addr;
+    p.mp.external_port = ((const struct sockaddr_in *)&m->external)->sin_port;
+    r->sin_family = AF_INET;
+    r->sin_addr.s_addr = m->interface->ip4.router.s_addr;
+    r->sin_port = htons(PCP_SERVER_PORT);
+    router_size = sizeof(*r);
+    sock = ipv4_socket;
+  }
+
+  if ( sock < 0 )
+    return false;
+
+  if ( sendto(sock, &p, pcp_map_packet_size, 0, (struct sockaddr *)&router, router_size) < 0 ) {
+    GM_FAIL_WITH_OS_ERROR("PCP sendto");
+    return false;
+  }
+  GM_TRACE_INSTANT("pcp request", lifetime);
+  GM_TRACE_COUNTER("pcp mappings", heap_size);
+  return true;
+}
+
+// Send a mapping's request, and set its deadline for the retransmission.
+static void
+transmit(gm_port_mapping_t * m, int64_t now)
+{
+  if ( m->type == GM_GRANTED && now >= m->expires ) {
+    gm_printf("PCP: mapping of port %d expired before it could be renewed.\n", internal_port(m));
+    m->type = GM_REQUEST;
+  }
+
+  if ( m->request_count == 0 )
+    m->retransmit_ms = INITIAL_RETRANSMIT_MS;
+  else if ( m->retransmit_ms < MAXIMUM_RETRANSMIT_MS / 2 )
+    m->retransmit_ms *= 2;
+  else
+    m->retransmit_ms = MAXIMUM_RETRANSMIT_MS;
+
+  (void) send_map(m, requested_mapping_duration);
+  if ( m->request_count < UINT8_MAX )
+    m->request_count++;
+
+  m->deadline = now + jitter(m->retransmit_ms * 1000LL);
+  // Try once more before a granted mapping expires, but not within this
+  // batch, or send_due() would send it again at once.
+  if ( m->type == GM_GRANTED && m->deadline > m->expires ) {
+    m->deadline = m->expires;
+    if ( m->deadline <= now + BATCH_US )
+      m->deadline = now + BATCH_US + 1;
+  }
+  heap_update(m);
+}
+
+// Set the timer for the earliest deadline, or for when the bucket has a token.
+// Called with the lock held.
+static void
+schedule(int64_t now)
+{
+  if ( timer == NULL )
+    return;
+
+  esp_timer_stop(timer);
+  if ( heap_size == 0 )
+    return;
+
+  int64_t when = heap[0]->deadline;
+  const int64_t token = bucket_full - (BURST - 1) * SEND_INTERVAL_US;
+
+  if ( when < token )
+    when = token;
+  esp_timer_start_once(timer, when > now ? when - now : 0);
+}
+
+// Send every request that is due, in the select task.
+static void
+send_due(void * data)
+{
+  const int64_t now = gm_clock_us();
+
+  bool		sent = false;
+
+  pthread_mutex_lock(&lock);
+  while ( heap_size > 0 && heap[0]->deadline <= now + BATCH_US && take_token(now) ) {
+    transmit(heap[0], now);
+    sent = true;
+  }
+
+  // Since this is awake anyway, renew the mappings that are past half of their
+  // lifetime, rather than waking for each at its own random point. Mappings
+  // converge into a few batches.
+  if ( sent ) {
+    for ( size_t i = 0; i < heap_size; i++ ) {
+      gm_port_mapping_t * const m = heap[i];
+
+      if ( m->type == GM_GRANTED && m->request_count == 0
+       && now >= m->expires - m->lifetime * 1000000LL / 2 ) {
+        if ( !take_token(now) )
+          break;
+        transmit(m, now);
+        // The heap moved, start over. This is rare, and the heap is small.
+        i = (size_t)-1;
+      }
+    }
+  }
+  schedule(now);
+  pthread_mutex_unlock(&lock);
+}
+
+static void
+timer_expired(void * data)
+{
+  gm_run(send_due, NULL, GM_FAST);
+}
+
+// Check the server epoch of a response, and if the server has lost its
+// mappings, renew them all. Called with the lock held.
+static void
+check_epoch(bool ipv6, uint32_t server, int64_t now)
+{
+  epoch_t * const	e = &epochs[ipv6];
+  bool			reset = false;
+
+  if ( e->valid ) {
+    const int64_t client_delta = (now - e->client) / 1000000;
+    const int64_t server_delta = (int64_t)server - e->server;
+
+    reset = (int64_t)server + 1 < e->server
+     || client_delta + 2 < server_delta - server_delta / 16
+     || server_delta + 2 < client_delta - client_delta / 16;
+  }
+  e->valid = true;
+  e->server = server;
+  e->client = now;
+
+  if ( !reset )
+    return;
+
+  gm_printf("The PCP server on IPv%d has reset. Renewing all mappings.\n", ipv6 ? 6 : 4);
+  for ( size_t i = 0; i < heap_size; i++ ) {
+    gm_port_mapping_t * const m = heap[i];
+
+    if ( is_ipv6(m) == ipv6 && m->type == GM_GRANTED ) {
+      m->request_count = 0;
+      m->deadline = now + (int64_t)(esp_random() % RESET_SPREAD_US);
+    }
+  }
+  // Many deadlines changed, rebuild the heap rather than update each one.
+  for ( size_t i = heap_size / 2; i-- > 0; )
+    heap_down(i);
+  schedule(now);
+}
+
 void
 decode_packet(pcp_packet_t * p, ssize_t message_size, const struct sockaddr_storage * const address)
 {
   uint16_t	port;
 
-  gm_printf("Decode PCP packet %x\n", p->opcode);
   // This assumes all messages are PCP, we don't currently support NAT-PMP as
   // we'd only need it on really old routers.
 
   bool ipv4;
   gm_netif_t * interface = interface_for_sockaddr(address, &ipv4);
 
+  if ( interface == 0 ) {
+    GM_WARN_ONCE("PCP packet from an address not on any interface, ignored.\n");
+    return;
+  }
+
   if ( ipv4 ) {
     port = ntohs(((struct sockaddr_in *)address)->sin_port);
     if ( ((struct sockaddr_in *)address)->sin_addr.s_addr != interface->ip4.router.s_addr ) {
@@ -246,82 +608,100 @@ decode_packet(pcp_packet_t * p, ssize_t message_size, const struct sockaddr_stor
     return;
   }
 
+  if ( message_size < pcp_announce_packet_size ) {
+    GM_WARN_ONCE("PCP receive packet too small: %d\n", message_size);
+    return;
+  }
+
   const bool response = p->opcode & PCP_RESPONSE;
-  
+
+  if ( !response ) {
+    GM_WARN_ONCE("PCP client received request.\n");
+    return;
+  }
+
   switch ( p->opcode & PCP_OPCODE_MASK ) {
   case PCP_ANNOUNCE:
     decode_pcp_announce(p, message_size, address);
     break;
   case PCP_MAP:
-  case PCP_PEER:
-    if ( !response ) {
-      GM_WARN_ONCE("PCP client received request.\n");
+    if ( message_size < pcp_map_packet_size ) {
+      GM_WARN_ONCE("PCP receive packet too small for MAP: %d\n", message_size);
       return;
     }
-    switch ( p->opcode & PCP_OPCODE_MASK ) {
-    case PCP_MAP:
-      if ( message_size < pcp_map_packet_size ) {
-        GM_WARN_ONCE("PCP receive packet too small for MAP: %d\n", message_size);
-        return;
-      }
-      decode_pcp_map(p, message_size, address);
-      break;
-    case PCP_PEER:
-      if ( message_size < sizeof(pcp_packet_t) ) {
-        GM_WARN_ONCE("PCP receive packet too small for PEER: %d\n", message_size);
-        return;
-      }
-      decode_pcp_peer(p, message_size, address);
-      break;
+    decode_pcp_map(p, message_size, address);
+    break;
+  case PCP_PEER:
+    if ( message_size < sizeof(pcp_packet_t) ) {
+      GM_WARN_ONCE("PCP receive packet too small for PEER: %d\n", message_size);
+      return;
     }
+    decode_pcp_peer(p, message_size, address);
     break;
   default:
     GM_WARN_ONCE("PCP unrecognized opcode %x\n", p->opcode);
   }
 }
 
+// The router multicasts an unsolicited ANNOUNCE response when it restarts.
 static void
 decode_pcp_announce(const pcp_packet_t * const p, const ssize_t message_size, const struct sockaddr_storage * const address)
 {
-  if ( p->opcode != (PCP_ANNOUNCE|PCP_SUCCESS) ) {
-    GM_WARN_ONCE("Received solicitation of PCP announce.\n");
+  if ( p->result_code != PCP_SUCCESS )
     return;
-  }
-  char buffer[INET6_ADDRSTRLEN + 1];
-  gm_ntop(address, buffer, sizeof(buffer));
-  gm_printf("Received PCP Announce from %s.\n", buffer);
-  renew_all_mappings_if_router_has_reset(p);
+
+  pthread_mutex_lock(&lock);
+  check_epoch(address->ss_family == AF_INET6, ntohl(p->response.epoch), gm_clock_us());
+  pthread_mutex_unlock(&lock);
 }
 
 static void
 decode_pcp_map(pcp_packet_t * p, ssize_t message_size, const struct sockaddr_storage * const address)
 {
-  char buffer[INET6_ADDRSTRLEN + 1];
+  char		buffer[INET6_ADDRSTRLEN + 1];
+  const int64_t	now = gm_clock_us();
+  const uint32_t lifetime = ntohl(p->lifetime);
 
-  gm_ntop(address, buffer, sizeof(buffer));
-  gm_printf("Received mapping from %s\n", buffer);
-  inet_ntop(AF_INET6, &p->mp.external_address, buffer, sizeof(buffer));
-  gm_printf("Router public mapping address: %s port: %d\n", buffer, ntohs(p->mp.external_port));
+  pthread_mutex_lock(&lock);
+  check_epoch(address->ss_family == AF_INET6, ntohl(p->response.epoch), now);
 
-  // esp-idf has its own IPv6 address structure.
-  esp_ip6_addr_t esp_addr = {};
-  memcpy(esp_addr.addr, p->mp.external_address.sin6_addr.s6_addr, sizeof(esp_addr.addr));
-  // Get the address type (global, link-local, etc.) for the IPv6 address.
-  esp_ip6_addr_type_t ipv6_type = esp_netif_ip6_get_addr_type(&esp_addr);
-
-  gm_port_mapping_t * m = find_mapping(&p->mp.nonce);
+  gm_port_mapping_t * const m = find_by_nonce(&p->mp.nonce);
   if ( m == 0 ) {
-    GM_WARN_ONCE("PCP: Received unrequested mapping, ignoring.\n");
+    // This is also the response to gm_pcp_release_mapping().
+    if ( lifetime != 0 )
+      GM_WARN_ONCE("PCP: Received unrequested mapping, ignoring.\n");
+    pthread_mutex_unlock(&lock);
     return;
   }
 
-  if ( p->result_code != PCP_SUCCESS ) {
+  switch ( p->result_code ) {
+  case PCP_SUCCESS:
+    break;
+  case PCP_NETWORK_FAILURE:
+  case PCP_NO_RESOURCES:
+  case PCP_USER_EX_QUOTA:
+    // Short-lifetime errors, the lifetime is when to try again.
+    gm_printf("PCP: mapping of port %d refused for now, result code %d.\n", internal_port(m), p->result_code);
+    m->request_count = 0;
+    m->deadline = now + (lifetime > MINIMUM_RETRY_S ? lifetime : MINIMUM_RETRY_S) * 1000000LL;
+    heap_update(m);
+    schedule(now);
+    pthread_mutex_unlock(&lock);
+    return;
+  default:
     GM_FAIL("PCP request failed, result code: %d.", p->result_code);
-    
-    remove_pcp_mapping(m);
+    remove_mapping(m);
+    schedule(now);
+    pthread_mutex_unlock(&lock);
     return;
   }
 
+  // esp-idf has its own IPv6 address structure.
+  esp_ip6_addr_t esp_addr = {};
+  memcpy(esp_addr.addr, p->mp.external_address.sin6_addr.s6_addr, sizeof(esp_addr.addr));
+  // Get the address type (global, link-local, etc.) for the IPv6 address.
+  esp_ip6_addr_type_t ipv6_type = esp_netif_ip6_get_addr_type(&esp_addr);
+
   if ( ipv6_type != ESP_IP6_ADDR_IS_GLOBAL
    && ipv6_type != ESP_IP6_ADDR_IS_IPV4_MAPPED_IPV6) {
     inet_ntop(AF_INET6, p->mp.external_address.sin6_addr.s6_addr, buffer, sizeof(buffer));
@@ -334,16 +714,41 @@ decode_pcp_map(pcp_packet_t * p, ssize_t message_size, const struct sockaddr_sto
     else {
       GM_WARN_ONCE("Warning: The router responded to a PCP map request with a useless mapping to an IPv6 %s address, %s, instead of a global address. This is probably a MiniUPnPd bug.\n", GM.ipv6_address_types[ipv6_type], buffer);
     }
-    remove_pcp_mapping(m);
+    remove_mapping(m);
+    schedule(now);
+    pthread_mutex_unlock(&lock);
     return;
   }
-  else {
-    m->type = GM_GRANTED;
-    m->external = assign_sockaddr(&p->mp.external_address, ntohs(p->mp.external_port));
-    m->granted_time = current_time();
-    m->expiration_time.tv_sec = m->granted_time.tv_sec + ntohl(p->lifetime) - 1;
-    m->expiration_time.tv_usec = m->granted_time.tv_usec;
+
+  if ( lifetime == 0 ) {
+    remove_mapping(m);
+    schedule(now);
+    pthread_mutex_unlock(&lock);
+    return;
+  }
+
+  const struct sockaddr_storage external = assign_sockaddr(&p->mp.external_address, ntohs(p->mp.external_port));
+
+  // Only say so when the mapping is new or has moved, not on every renewal.
+  if ( m->type != GM_GRANTED || memcmp(&external, &m->external, sizeof(external)) != 0 ) {
+    gm_ntop(&external, buffer, sizeof(buffer));
+    gm_printf("PCP: port %d is mapped to %s port %d.\n", internal_port(m), buffer, ntohs(p->mp.external_port));
   }
+  // The router knows its external address, so this is all the discovery
+  // there needs to be.
+  gm_reachability_report(is_ipv6(m), GM_REACHABILITY_PCP, &external);
+
+  m->type = GM_GRANTED;
+  m->external = external;
+  m->lifetime = lifetime;
+  m->expires = now + lifetime * 1000000LL;
+  m->request_count = 0;
+  // Renew between 1/2 and 5/8 of the lifetime.
+  m->deadline = now + lifetime * 1000000LL / 2
+   + (int64_t)(esp_random() % (lifetime * 125 + 1)) * 1000;
+  heap_update(m);
+  schedule(now);
+  pthread_mutex_unlock(&lock);
 }
 
 static void
@@ -354,148 +759,141 @@ decode_pcp_peer(pcp_packet_t * p, ssize_t message_size, const struct sockaddr_st
   gm_printf("Received PCP Peer from %s\n", buffer);
 }
 
-static gm_port_mapping_t *
-find_mapping(const gm_pcp_nonce_t * const n)
-{
-  gm_netif_t *
-  coroutine1(
-   gm_netif_t * const	i,
-   const void * const	d)
-  {
-    gm_port_mapping_t *
-    coroutine2(gm_port_mapping_t * const m, const void * const d)
-    {
-      const gm_pcp_nonce_t * const n = (const gm_pcp_nonce_t *)d;
-    
-      if ( memcmp(&m->nonce, n, sizeof(*n)) == 0 )
-        return m;
-      else
-        return 0;
-    }
-  
-    gm_port_mapping_t * m = for_each_mapping(i->ip4.port_mappings, coroutine2, d);
-    if ( m )
-      return (gm_netif_t *)m;
-    m = for_each_mapping(i->ip6.port_mappings, coroutine2, d);
-    return (gm_netif_t *)m;
+// Get the external address and port of a granted mapping.
+bool
+gm_pcp_external_address(
+ bool				ipv6,
+ gm_pcp_protocol_t		protocol,
+ uint16_t			internal_port,
+ struct sockaddr_storage *	external)
+{
+  bool granted = false;
+
+  pthread_mutex_lock(&lock);
+  const gm_port_mapping_t * const m = find_by_port(ipv6, protocol, internal_port);
+  if ( m && m->type == GM_GRANTED ) {
+    *external = m->external;
+    granted = true;
   }
-  
-  return (gm_port_mapping_t *)for_each_interface(coroutine1, n);
+  pthread_mutex_unlock(&lock);
+  return granted;
 }
 
+// Delete a mapping from the router, and stop renewing it.
+void
+gm_pcp_release_mapping(bool ipv6, gm_pcp_protocol_t protocol, uint16_t internal_port)
+{
+  pthread_mutex_lock(&lock);
+  gm_port_mapping_t * const m = find_by_port(ipv6, protocol, internal_port);
+  if ( m ) {
+    if ( m->type == GM_GRANTED )
+      (void) send_map(m, 0);
+    remove_mapping(m);
+    schedule(gm_clock_us());
+  }
+  pthread_mutex_unlock(&lock);
+}
 
-static gm_netif_t *
-for_each_interface(const for_each_interface_coroutine_t f, const void * const d)
+// Ask the router to map a port, and keep the mapping until gm_pcp_stop() or
+// gm_pcp_release_mapping(). Requesting a port that is already mapped does
+// nothing. *external_port* is only a suggestion to the router.
+static void
+request_mapping(
+ gm_netif_t *		interface,
+ bool			ipv6,
+ gm_pcp_protocol_t	protocol,
+ uint16_t		internal_port,
+ uint16_t		external_port)
 {
-  for ( size_t n = 0; n < (sizeof(GM.net_interfaces) / sizeof(GM.net_interfaces[0])); n++ ) {
-    gm_netif_t * const i = &GM.net_interfaces[n];
-    if ( i ) {
-      gm_netif_t * const result = f(i, d);
-      if ( result )
-        return result;
-    }
+  pthread_mutex_lock(&lock);
+  if ( find_by_port(ipv6, protocol, internal_port) ) {
+    pthread_mutex_unlock(&lock);
+    return;
+  }
+  if ( heap_size >= MAXIMUM_MAPPINGS ) {
+    pthread_mutex_unlock(&lock);
+    GM_FAIL("PCP: Too many port mappings, can't map port %d.", internal_port);
+    return;
   }
 
-  return 0;
-}
+  gm_port_mapping_t * const m = gm_calloc(GM_MEMORY_PCP, 1, sizeof(*m));
+  if ( m == NULL ) {
+    pthread_mutex_unlock(&lock);
+    GM_FAIL("PCP: Out of memory.");
+    return;
+  }
 
-// Process each datun in a chain of port mappings.
-static gm_port_mapping_t *
-for_each_mapping(gm_port_mapping_t * m, const mapping_coroutine_t f, const void * d) {
-  while ( m ) {
-    // *m is potentially changing, so store m->next it before processing.
-    gm_port_mapping_t * const next = m->next;
-    gm_port_mapping_t * const result = f(m, d);
-    if ( result )
-      return result;
-    m = next;
+  if ( ipv6 ) {
+    struct sockaddr_in6 * const i = (struct sockaddr_in6 *)&m->internal;
+    struct sockaddr_in6 * const e = (struct sockaddr_in6 *)&m->external;
+
+    i->sin6_family = e->sin6_family = AF_INET6;
+    i->sin6_addr = my_ipv6_address.sin6_addr;
+    i->sin6_port = htons(internal_port);
+    e->sin6_port = htons(external_port);
   }
-  return 0;
-}
+  else {
+    struct sockaddr_in * const i = (struct sockaddr_in *)&m->internal;
+    struct sockaddr_in * const e = (struct sockaddr_in *)&m->external;
 
-static gm_port_mapping_t *
-free_mapping(gm_port_mapping_t * m, const void * const)
-{
-  free(m);
-  return 0;
+    i->sin_family = e->sin_family = AF_INET;
+    i->sin_addr = interface->ip4.address;
+    i->sin_port = htons(internal_port);
+    e->sin_port = htons(external_port);
+  }
+  m->interface = interface;
+  m->protocol = protocol;
+  m->type = GM_REQUEST;
+  m->lifetime = requested_mapping_duration;
+  esp_fill_random(&m->nonce, sizeof(m->nonce));
+
+  const size_t n = nonce_hash(&m->nonce);
+  m->next_by_nonce = by_nonce[n];
+  by_nonce[n] = m;
+  const size_t p = port_hash(ipv6, protocol, internal_port);
+  m->next_by_port = by_port[p];
+  by_port[p] = m;
+
+  // Due now, so that services registered together are requested together.
+  const int64_t now = gm_clock_us();
+  m->deadline = now;
+  m->heap_index = heap_size;
+  heap[heap_size++] = m;
+  heap_up(m->heap_index);
+  schedule(now);
+  pthread_mutex_unlock(&lock);
 }
 
 void
-gm_pcp_request_mapping_ipv4(gm_netif_t * interface)
+gm_pcp_request_mapping_ipv4(
+ gm_netif_t *		interface,
+ gm_pcp_protocol_t	protocol,
+ uint16_t		internal_port,
+ uint16_t		external_port)
 {
-  const pcp_packet_t p = {
-    .version = PORT_MAPPING_PROTOCOL,
-    .opcode = PCP_MAP,
-    .lifetime = htonl(requested_mapping_duration),
-
-     // IPV6-mapped-IPV4 client address.
-    .request.client_address.ipv4_to_ipv6_mapping.all_ones[0] = 0xff,
-    .request.client_address.ipv4_to_ipv6_mapping.all_ones[1] = 0xff,
-    .request.client_address.ipv4_to_ipv6_mapping.s_addr = interface->ip4.address.s_addr,
-
-    // This sets the requested address to the all-zeroes IPV6-mapped-IPV4
-    // address: ::ffff:0.0.0.0 .
-    // If external_address was all zeroes, it would be the all-zeroes IPV6 address.
-    .mp.external_address.ipv4_to_ipv6_mapping.all_ones[0] = 0xff,
-    .mp.external_address.ipv4_to_ipv6_mapping.all_ones[1] = 0xff,
-
-    .mp.protocol = GM_PCP_TCP,
-    .mp.internal_port = htons(https_port),
-    .mp.external_port = htons(external_https_port),
-   
-    .mp.nonce = random_nonce()
-  };
-
-  const struct sockaddr_in address = {
-    .sin_addr.s_addr = interface->ip4.router.s_addr,
-    .sin_family = AF_INET,
-    .sin_port = htons(PCP_SERVER_PORT)
-  };
-
-  if ( send_request(
-   &p,
-   (const struct sockaddr *)&address,
-   ipv4_socket,
-   sizeof(address)) )
-    save_pcp_mapping(&p, interface, GM_REQUEST);
+  request_mapping(interface, false, protocol, internal_port, external_port);
 }
 
 void
-gm_pcp_request_mapping_ipv6(gm_netif_t * interface)
+gm_pcp_request_mapping_ipv6(
+ gm_netif_t *		interface,
+ gm_pcp_protocol_t	protocol,
+ uint16_t		internal_port,
+ uint16_t		external_port)
 {
-  const pcp_packet_t p = {
-    .version = PORT_MAPPING_PROTOCOL,
-    .opcode = PCP_MAP,
-    .lifetime = htonl(requested_mapping_duration),
-
-    .request.client_address.sin6_addr = my_ipv6_address.sin6_addr,
-    .mp.protocol = GM_PCP_TCP,
-    .mp.internal_port = htons(https_port),
-    .mp.external_port = htons(external_https_port),
-    .mp.nonce = random_nonce()
-  };
-
-  const struct sockaddr_in6 address = {
-    .sin6_family = AF_INET6,
-    .sin6_addr = interface->ip6.router,
-    .sin6_port = htons(PCP_SERVER_PORT)
-  };
-
-#if 0
-  char				buffer[INET6_ADDRSTRLEN + 1];
+  request_mapping(interface, true, protocol, internal_port, external_port);
+}
 
-  gm_ntop(&address, buffer, sizeof(buffer));
-  gm_printf("Request IPv6 port mapping of router %s\n", buffer);
-  inet_ntop(AF_INET6, &address.sin6_addr, buffer, sizeof(buffer));
-  gm_printf("Client is %s\n", buffer);
-#endif
- 
-  if ( send_request(
-   &p,
-   (const struct sockaddr *)&address,
-   ipv6_socket,
-   sizeof(address)) )
-    save_pcp_mapping(&p, interface, GM_REQUEST);
+static void
+create_timer(void)
+{
+  if ( timer == NULL ) {
+    const esp_timer_create_args_t timer_args = {
+      .callback = timer_expired,
+      .name = "PCP"
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&timer_args, &timer));
+  }
 }
 
 void
@@ -515,6 +913,7 @@ gm_pcp_start_ipv4(gm_netif_t * interface)
     return;
   }
 
+  create_timer();
   ipv4_socket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
 
   // Reuse addresses, because other software listens for all-hosts multicast.
@@ -544,8 +943,8 @@ gm_pcp_start_ipv4(gm_netif_t * interface)
       return;
     }
   }
-  gm_fd_register(ipv4_socket, incoming_packet, 0, true, false, true, 1);
-  gm_printf("Done with IPV4 socket.\n");
+  // No timeout, the mappings are renewed from the timer.
+  gm_fd_register(ipv4_socket, incoming_packet, 0, true, false, true, 0);
 }
 
 // Don't start this until a router advertisement is received.
@@ -571,9 +970,11 @@ gm_pcp_start_ipv6(gm_netif_t * interface)
     return;
   }
 
+  create_timer();
   ipv6_socket = socket(AF_INET6, SOCK_DGRAM, IPPROTO_UDP);
   if ( ipv6_socket < 0 ) {
     GM_FAIL_WITH_OS_ERROR("Can't get a socket");
+    return;
   }
 
   // Make the address reusable, because other things have bound to this address.
@@ -619,45 +1020,42 @@ gm_pcp_stop(gm_netif_t * interface)
     close(ipv6_socket);
     ipv6_socket = -1;
   }
-  
+
   // All I/O is shut down, so  at this point, there can be no
   // new port mappings. Remove the existing port mapping data.
-  gm_netif_t *
-  coroutine(gm_netif_t * const interface, const void * const data)
-  {
-    for_each_mapping(interface->ip4.port_mappings, free_mapping, 0);
-    interface->ip4.port_mappings = 0;
-    for_each_mapping(interface->ip6.port_mappings, free_mapping, 0);
-    interface->ip6.port_mappings = 0;
-    return 0;
-  }
-  
-  for_each_interface(coroutine, 0);
+  pthread_mutex_lock(&lock);
+  if ( timer )
+    esp_timer_stop(timer);
+  for ( size_t i = 0; i < heap_size; i++ )
+    gm_free(heap[i]);
+  heap_size = 0;
+  memset(by_nonce, 0, sizeof(by_nonce));
+  memset(by_port, 0, sizeof(by_port));
+  memset(epochs, 0, sizeof(epochs));
+  pthread_mutex_unlock(&lock);
 }
 
 static void
 incoming_packet(int fd, void * data, bool readable, bool writable, bool exception, bool timeout)
 {
-  gm_printf("Incoming packet: readable: %d, writable: %d, exception: %d, timeout: %d\n", readable, writable, exception, timeout);
-
   if ( readable ) {
     pcp_packet_t		packet;
     struct sockaddr_storage	address;
     socklen_t			address_size = sizeof(address);
     ssize_t			message_size;
-  
+
     message_size = recvfrom(fd, &packet, sizeof(packet), MSG_DONTWAIT, (struct sockaddr *)&address, &address_size);
-   
+
     if ( message_size <= 0 ) {
       GM_FAIL_WITH_OS_ERROR("recvfrom returned %d", message_size);
       return;
     }
-  
+
   #if 0
     int port;
     char buffer[INET6_ADDRSTRLEN + 1];
     gm_ntop(&address, buffer, sizeof(buffer));
-  
+
     gm_printf("PCP received %s packet of size %d from %s port %d.\n",
      data != 0 ? "multicast" : "unicast",
      message_size,
@@ -667,7 +1065,6 @@ incoming_packet(int fd, void * data, bool readable, bool writable, bool exceptio
 
     decode_packet(&packet, message_size, &address);
   }
-  maintain_mappings();
 }
 
 gm_netif_t *
@@ -718,260 +1115,3 @@ is_ipv4_mapped_ipv6(const pcp_address_t * a)
   && a->ipv4_to_ipv6_mapping.all_ones[0] == 0xff
   && a->ipv4_to_ipv6_mapping.all_ones[1] == 0xff;
 }
-
-static void
-maintain_mappings()
-{
-  gm_port_mapping_t *
-  coroutine(gm_port_mapping_t * m, const void *)
-  {
-    const struct timeval now = current_time();
-  
-    if ( m->type == GM_GRANTED ) {
-      if ( timercmp(&m->expiration_time, &now, >) ) {
-        m->type = GM_REQUEST;
-        renew_mapping(m);
-      }
-      else {
-        struct timeval remaining;
-        timersub(&m->expiration_time, &now, &remaining);
-        if ( remaining.tv_sec < m->lifetime / 3 )
-          renew_mapping(m);
-      }
-    }
-    else {
-      // This is a requested mapping that hasn't been confirmed by the server.
-      renew_mapping(m);
-    }
-    return 0;
-  }
-  
-  gm_printf("In maintain_mappings.\n");
-  if ( ipv4_socket >= 0 )
-    for_each_mapping(GM.net_interfaces[GM_STA].ip4.port_mappings, coroutine, 0);
-
-  if ( ipv6_socket >= 0 )
-    for_each_mapping(GM.net_interfaces[GM_STA].ip6.port_mappings, coroutine, 0);
-}
-
-// Provide random nonce data in assignable form, so that I can make
-// structures const.
-static gm_pcp_nonce_t
-random_nonce() {
-  gm_pcp_nonce_t n;
-  esp_fill_random(&n, sizeof(n));
-  return n;
-}
-
-// I could do this using pointers to pointers and a custom loop.
-static void
-remove_pcp_mapping(gm_port_mapping_t * m)
-{
-  if ( m == GM.net_interfaces[GM_STA].ip4.port_mappings ) {
-    GM.net_interfaces[GM_STA].ip4.port_mappings = GM.net_interfaces[GM_STA].ip4.port_mappings->next;
-    return;
-  }
-  if ( m == GM.net_interfaces[GM_STA].ip6.port_mappings ) {
-    GM.net_interfaces[GM_STA].ip6.port_mappings = GM.net_interfaces[GM_STA].ip6.port_mappings->next;
-    return;
-  }
-
-  gm_port_mapping_t *
-  coroutine(gm_port_mapping_t * m, const void * n)
-  {
-    while ( m ) {
-      if ( m->next == n ) {
-        m->next = m->next->next;
-        free(m);
-        return (gm_port_mapping_t *)1;
-      }
-    }
-    return 0;
-  }
-  
-  if ( for_each_mapping(GM.net_interfaces[GM_STA].ip4.port_mappings, coroutine, m) )
-    return;
-  if ( for_each_mapping(GM.net_interfaces[GM_STA].ip6.port_mappings, coroutine, m) )
-    return;
-}
-
-static void
-renew_all_mappings()
-{
-  gm_printf("In renew_all_mappings.\n");
-
-  gm_netif_t *
-  coroutine(gm_netif_t * interface, const void * const)
-  {
-    if ( ipv4_socket >= 0 )
-      for_each_mapping(GM.net_interfaces[GM_STA].ip4.port_mappings, renew_if_granted, 0);
-  
-    if ( ipv6_socket >= 0 )
-  	  for_each_mapping(GM.net_interfaces[GM_STA].ip6.port_mappings, renew_if_granted, 0);
-    return 0;
-  }
-  
-  for_each_interface(coroutine, 0);
-}
-
-static void
-renew_all_mappings_if_router_has_reset(const pcp_packet_t * const p)
-{
-  if ( p->response.epoch < last_received_epoch ) {
-    gm_printf("The router has reset. Renewing all PCP mappings.\n");
-    last_received_epoch = p->response.epoch;
-    renew_all_mappings();
-  }
-}
-
-static gm_port_mapping_t *
-renew_if_granted(gm_port_mapping_t * m, const void * const)
-{
-  if ( m->type == GM_GRANTED )
-    renew_mapping(m);
-  return 0;
-}
-
-static void
-renew_ipv4(const gm_port_mapping_t * const m)
-{
-  gm_printf("Renew ipv4\n");
-  const struct sockaddr_in * const s = (struct sockaddr_in *)&m->external;
-
-  const pcp_packet_t p = {
-    .version = PORT_MAPPING_PROTOCOL,
-    .opcode = PCP_MAP,
-    .lifetime = htonl(m->lifetime),
-
-    .request.client_address.ipv4_to_ipv6_mapping.all_ones[0] = 0xff,
-    .request.client_address.ipv4_to_ipv6_mapping.all_ones[1] = 0xff,
-  
-    // PCP uses IPV4-mapped-IPV6 addresses.
-    .mp.external_address.ipv4_to_ipv6_mapping.all_ones[0] = 0xff,
-    .mp.external_address.ipv4_to_ipv6_mapping.all_ones[1] = 0xff,
-    .mp.external_address.ipv4_to_ipv6_mapping.s_addr = s->sin_addr.s_addr,
-    .mp.external_port = htons(s->sin_port),
-    .mp.protocol = m->protocol,
-    .mp.internal_port = htons(((struct sockaddr_in *)&m->internal)->sin_port),
-    .mp.nonce = m->nonce
-  };
-
-  const struct sockaddr_in address = {
-    .sin_addr.s_addr = m->interface->ip4.router.s_addr,
-    .sin_family = AF_INET,
-    .sin_port = htons(PCP_SERVER_PORT)
-  };
-
-  send_request(&p, (struct sockaddr *)&address, ipv4_socket, sizeof(address));
-}
-
-static void
-renew_ipv6(const gm_port_mapping_t * const m)
-{
-  struct sockaddr_in6 * s = (struct sockaddr_in6 *)&m->external;
-  const pcp_packet_t p = {
-    .version = PORT_MAPPING_PROTOCOL,
-    .opcode = PCP_MAP,
-    .lifetime = htonl(m->lifetime),
-
-    .request.client_address.sin6_addr = my_ipv6_address.sin6_addr,
-    .mp.external_address.sin6_addr = s->sin6_addr,
-    .mp.external_port = htons(s->sin6_port),
-    .mp.protocol = m->protocol,
-    .mp.internal_port = htons(((struct sockaddr_in6 *)&m->internal)->sin6_port),
-    .mp.nonce = m->nonce
-  };
-
-  const struct sockaddr_in6 address = {
-    .sin6_addr = m->interface->ip6.router,
-    .sin6_family = AF_INET6,
-    .sin6_port = htons(PCP_SERVER_PORT)
-  };
-  // char		buffer[INET6_ADDRSTRLEN + 1];
-
-  gm_printf("Renew ipv6.\n");
-
-  // gm_ntop(&last_request.address, buffer, sizeof(buffer));
-  // gm_printf("Request IPv6 port mapping of router %s\n", buffer);
-  // inet_ntop(AF_INET6, &address.sin6_addr, buffer, sizeof(buffer));
-  // gm_printf("Client is %s\n", buffer);
- 
-  send_request(&p, (const struct sockaddr *)&address, ipv6_socket, sizeof(address));
-}
-
-static void
-renew_mapping(const gm_port_mapping_t * const m)
-{
-  if ( m->external.ss_family == AF_INET )
-    renew_ipv4(m);
-  else
-    renew_ipv6(m);
-}
-  
-static void
-save_pcp_mapping(
-  const pcp_packet_t * const	p,
-  gm_netif_t *				interface,
-  const gm_port_mapping_type_t		type
-)
-{
-  const gm_port_mapping_t m = {
-    .protocol = p->mp.protocol,
-    .internal = assign_sockaddr(
-     &p->request.client_address,
-     ntohs(p->mp.internal_port)),
-    .external = assign_sockaddr(
-     &p->mp.external_address,
-     ntohs(p->mp.external_port)),
-    .lifetime = ntohl(p->lifetime),
-    .nonce = p->mp.nonce,
-    .granted_time = current_time()
-  };
-
-  const bool ipv4 = is_ipv4_mapped_ipv6(&p->request.client_address);
-
-  gm_port_mapping_t * *	mp;
-
-  if ( ipv4 )
-    mp = &interface->ip4.port_mappings;
-  else
-    mp = &interface->ip6.port_mappings;
-
-  while ( *mp ) {
-    if ( memcmp(&m.nonce, &(*mp)->nonce, sizeof(m.nonce)) == 0 ) {
-      gm_printf("Replaced mapping.\n");
-      **mp = m;
-      return;
-    }
-    mp = &(*mp)->next;
-  }
-
-  *mp = malloc(sizeof(**mp));
-  **mp = m;
-
-  renew_all_mappings_if_router_has_reset(p);
-}
-
-static bool
-send_request(
- const pcp_packet_t * const	p,
- const struct sockaddr * const	address,
- const int			sock,
- size_t				address_size)
-{
-  // Send the packet to the gateway.
-  const int sendto_status = sendto(
-   sock,
-   p,
-   pcp_map_packet_size,
-   0,
-   address,
-   address_size);
-
-  if ( sendto_status < 0 ) {
-    GM_FAIL_WITH_OS_ERROR("PCP sendto");
-    return false;
-  }
-  else
-    return true;
-}
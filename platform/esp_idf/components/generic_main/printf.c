@@ -7,9 +7,9 @@
 #include <freertos/task.h>
 #include "generic_main.h"
 
-// Print to the console, with mutual exclusion.
-// This is only usable in tasks, not anything at interrupt level.
-// Event loops each run in their own task, so it's usable from event handlers.
+// Report failures. The message is logged, and the log is flushed so that it
+// precedes the backtrace, which is printed directly to the console.
+// gm_printf() and gm_vprintf() are in log_ring.c.
 
 void
 gm_fail(const char * function, const char * file, int line, const char * pattern, ...)
@@ -19,9 +19,10 @@ gm_fail(const char * function, const char * file, int line, const char * pattern
   va_start(args, pattern);
   gm_vprintf(pattern, args);
   va_end(args);
+  gm_printf("\n");
+  gm_log_flush();
 
-  fprintf(stderr, "\n");
-  // This isn't on GM.log_file_pointer.
+  // This only goes to the console.
   esp_backtrace_print(100);
   fflush(stderr);
 }
@@ -38,32 +39,10 @@ gm_fail_with_os_error(const char * function, const char * file, int line, const
   va_start(args, pattern);
   gm_vprintf(pattern, args);
   va_end(args);
-  
-  fprintf(stderr, ": %s\n", buffer);
+  gm_printf(": %s\n", buffer);
+  gm_log_flush();
 
-  // This isn't on GM.log_file_pointer.
+  // This only goes to the console.
   esp_backtrace_print(100);
   fflush(stderr);
 }
-
-int
-gm_vprintf(const char * pattern, va_list args)
-{
-  int length;
-  pthread_mutex_lock(&GM.console_print_mutex);
-  length = vfprintf(GM.log_file_pointer, pattern, args);
-  fflush(GM.log_file_pointer);
-  pthread_mutex_unlock(&GM.console_print_mutex);
-  return length;
-}
-
-int
-gm_printf(const char * pattern, ...)
-{
-  int length;
-  va_list args;
-  va_start(args, pattern);
-  length = gm_vprintf(pattern, args);
-  va_end(args);
-  return length;
-}
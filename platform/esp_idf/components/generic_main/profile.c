@@ -0,0 +1,508 @@
+// The statistical profiler of gm_profile.h.
+//
+// On the device, each core has a general-purpose timer whose interrupt is
+// installed on that core, so each interrupt samples the task that it
+// interrupted. The timers are made and deleted by a short-lived task pinned
+// to each core, since allocating them allocates memory and an interrupt,
+// which must not be done in the IPC task. The interrupt entry has saved the task's registers on its
+// stack, and the stack pointer in the first word of the task control block,
+// so the interrupted PC and the backtrace are read from there. The interrupt
+// isn't in IRAM, so there are no samples while the FLASH is written, nor in
+// critical sections, as the interrupt is masked.
+//
+// On the host, SIGPROF is delivered at the rate in CPU time, and the handler
+// takes the backtrace of the thread that it interrupted.
+//
+// A sample is counted in a hash table of stacks, which is allocated when the
+// profiler first starts. The interrupt or signal handler only tries to take
+// the lock, and counts the sample as dropped if it can't, so that it never
+// waits on the task or thread it interrupted.
+#ifndef ESP_PLATFORM
+#define _GNU_SOURCE
+#endif
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#ifdef ESP_PLATFORM
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <driver/gptimer.h>
+#include <esp_debug_helpers.h>
+#if __XTENSA__
+#include <esp_cpu_utils.h>
+#include <xtensa_context.h>
+#endif
+#else
+#include <dlfcn.h>
+#include <errno.h>
+#include <execinfo.h>
+#include <signal.h>
+#include <sys/time.h>
+#endif
+#include "gm_memory.h"
+#include "gm_profile.h"
+
+#define LINE_SIZE	256
+// How far a stack may be from its hash slot.
+#define MAXIMUM_PROBES	16
+
+#ifndef ESP_PLATFORM
+#define ARCHITECTURE	"host"
+#elif __XTENSA__
+#define ARCHITECTURE	"xtensa"
+#else
+#define ARCHITECTURE	"riscv"
+#endif
+
+typedef struct _entry {
+  void *	task;
+  uint32_t	count;
+  uint32_t	depth;
+  uintptr_t	addresses[GM_PROFILE_DEPTH];
+} entry_t;
+
+static pthread_mutex_t	lock = PTHREAD_MUTEX_INITIALIZER;
+static atomic_flag	busy = ATOMIC_FLAG_INIT;
+static entry_t *	entries = NULL;
+static _Atomic uint32_t	samples = 0;
+static _Atomic uint32_t	dropped = 0;
+static unsigned int	rate = 0;
+static bool		running = false;
+
+static uint32_t
+hash(void * task, const uintptr_t * addresses, size_t depth)
+{
+  uint32_t h = 2166136261u ^ (uint32_t)(uintptr_t)task;
+
+  for ( size_t i = 0; i < depth; i++ ) {
+    h ^= (uint32_t)addresses[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+// Count a sample. Called from the interrupt or signal handler.
+static void
+record(void * task, const uintptr_t * addresses, size_t depth)
+{
+  const uint32_t h = hash(task, addresses, depth);
+
+  if ( atomic_flag_test_and_set_explicit(&busy, memory_order_acquire) ) {
+    atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+    return;
+  }
+  for ( size_t i = 0; i < MAXIMUM_PROBES; i++ ) {
+    entry_t * const e = &entries[(h + i) % GM_PROFILE_STACKS];
+
+    if ( e->count == 0 ) {
+      e->task = task;
+      e->depth = depth;
+      memcpy(e->addresses, addresses, depth * sizeof(*addresses));
+      e->count = 1;
+      break;
+    }
+    if ( e->task == task
+     && e->depth == depth
+     && memcmp(e->addresses, addresses, depth * sizeof(*addresses)) == 0 ) {
+      e->count++;
+      break;
+    }
+    if ( i == MAXIMUM_PROBES - 1 )
+      atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+  }
+  atomic_flag_clear_explicit(&busy, memory_order_release);
+  atomic_fetch_add_explicit(&samples, 1, memory_order_relaxed);
+}
+
+static void
+write_line(gm_profile_writer_t writer, void * context, const char * pattern, ...)
+{
+  char		line[LINE_SIZE];
+  va_list	args;
+  int		size;
+
+  va_start(args, pattern);
+  size = vsnprintf(line, sizeof(line), pattern, args);
+  va_end(args);
+  if ( size < 0 )
+    return;
+  if ( (size_t)size >= sizeof(line) )
+    size = sizeof(line) - 1;
+  (writer)(line, size, context);
+}
+
+#ifdef ESP_PLATFORM
+#define CORE_TASK_STACK	3072
+
+typedef struct _on_core {
+  void		(*function)(void * data);
+  esp_err_t *	result;
+  TaskHandle_t	caller;
+} on_core_t;
+
+static gptimer_handle_t	timers[portNUM_PROCESSORS];
+
+static bool
+sample(gptimer_handle_t timer, const gptimer_alarm_event_data_t * event, void * data)
+{
+  TaskHandle_t const	task = xTaskGetCurrentTaskHandleForCore(xPortGetCoreID());
+  uintptr_t		addresses[GM_PROFILE_DEPTH];
+  size_t		depth = 0;
+
+  if ( task == NULL )
+    return false;
+
+#if __XTENSA__
+  // pxTopOfStack, the first member of the task control block.
+  const XtExcFrame * const	frame = *(const XtExcFrame * const *)task;
+  esp_backtrace_frame_t		f = {
+    .pc = frame->pc,
+    .sp = frame->a1,
+    .next_pc = frame->a0,
+    .exc_frame = frame
+  };
+
+  addresses[depth++] = f.pc;
+  while ( depth < GM_PROFILE_DEPTH && f.next_pc != 0 && esp_backtrace_get_next_frame(&f) )
+    addresses[depth++] = esp_cpu_process_stack_pc(f.pc);
+#else
+  // Elsewhere, the samples are only counted by task.
+#endif
+
+  record(task, addresses, depth);
+  return false;
+}
+
+// Runs on each core, so that the interrupt is installed there.
+static void
+start_timer(void * data)
+{
+  esp_err_t * const			result = (esp_err_t *)data;
+  gptimer_handle_t * const		timer = &timers[xPortGetCoreID()];
+  const gptimer_config_t		config = {
+    .clk_src = GPTIMER_CLK_SRC_DEFAULT,
+    .direction = GPTIMER_COUNT_UP,
+    .resolution_hz = 1000000
+  };
+  const gptimer_event_callbacks_t	callbacks = { .on_alarm = sample };
+  const gptimer_alarm_config_t		alarm = {
+    .alarm_count = 1000000 / rate,
+    .reload_count = 0,
+    .flags.auto_reload_on_alarm = true
+  };
+  esp_err_t				err;
+
+  if ( (err = gptimer_new_timer(&config, timer)) != ESP_OK ) {
+    *timer = NULL;
+    *result = err;
+    return;
+  }
+  if ( (err = gptimer_register_event_callbacks(*timer, &callbacks, NULL)) != ESP_OK
+   ||  (err = gptimer_set_alarm_action(*timer, &alarm)) != ESP_OK
+   ||  (err = gptimer_enable(*timer)) != ESP_OK
+   ||  (err = gptimer_start(*timer)) != ESP_OK ) {
+    gptimer_disable(*timer);
+    gptimer_del_timer(*timer);
+    *timer = NULL;
+  }
+  *result = err;
+}
+
+static void
+stop_timer(void * data)
+{
+  gptimer_handle_t * const timer = &timers[xPortGetCoreID()];
+
+  if ( *timer == NULL )
+    return;
+  gptimer_stop(*timer);
+  gptimer_disable(*timer);
+  gptimer_del_timer(*timer);
+  *timer = NULL;
+}
+
+static void
+core_task(void * data)
+{
+  const on_core_t * const o = (const on_core_t *)data;
+
+  (o->function)(o->result);
+  xTaskNotifyGive(o->caller);
+  vTaskDelete(NULL);
+}
+
+// Run a function on each core in turn, in a task pinned there, and wait for
+// it.
+static void
+on_each_core(void (*function)(void * data), esp_err_t * results)
+{
+  for ( int core = 0; core < portNUM_PROCESSORS; core++ ) {
+    const on_core_t o = {
+      .function = function,
+      .result = &results[core],
+      .caller = xTaskGetCurrentTaskHandle()
+    };
+
+    if ( xTaskCreatePinnedToCore(core_task, "profile", CORE_TASK_STACK, (void *)&o, uxTaskPriorityGet(NULL), NULL, core) != pdPASS ) {
+      results[core] = ESP_ERR_NO_MEM;
+      continue;
+    }
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+  }
+}
+
+static const char *
+start_sampling(void)
+{
+  esp_err_t results[portNUM_PROCESSORS] = {};
+
+  on_each_core(start_timer, results);
+  for ( int core = 0; core < portNUM_PROCESSORS; core++ ) {
+    if ( results[core] != ESP_OK ) {
+      on_each_core(stop_timer, results);
+      return "Can't start a timer for each core.";
+    }
+  }
+  return NULL;
+}
+
+static void
+stop_sampling(void)
+{
+  esp_err_t results[portNUM_PROCESSORS];
+
+  on_each_core(stop_timer, results);
+}
+
+// Name the tasks that are running now. Stacks of tasks that have since been
+// deleted are folded with the address of the task as its name.
+static void
+dump_tasks(gm_profile_writer_t writer, void * context)
+{
+  const UBaseType_t	size = uxTaskGetNumberOfTasks() + 4;
+  TaskStatus_t * const	tasks = gm_malloc(GM_MEMORY_PROFILE, size * sizeof(*tasks));
+  UBaseType_t		n;
+
+  if ( tasks == NULL )
+    return;
+  n = uxTaskGetSystemState(tasks, size, NULL);
+  for ( UBaseType_t i = 0; i < n; i++ )
+    write_line(writer, context, "T %#lx %s\n", (unsigned long)(uintptr_t)tasks[i].xHandle, tasks[i].pcTaskName);
+  gm_free(tasks);
+}
+
+static uintptr_t
+dump_address(uintptr_t address)
+{
+  return address;
+}
+#else
+static void
+sample(int number)
+{
+  const int	saved_errno = errno;
+  void *	frames[GM_PROFILE_DEPTH + 2];
+  uintptr_t	addresses[GM_PROFILE_DEPTH];
+  int		n;
+
+  if ( number != SIGPROF )
+    return;
+
+  // The first two frames are this handler and the signal trampoline.
+  n = backtrace(frames, GM_PROFILE_DEPTH + 2) - 2;
+  for ( int i = 0; i < n; i++ )
+    addresses[i] = (uintptr_t)frames[i + 2];
+  if ( n > 0 )
+    record(NULL, addresses, n);
+  errno = saved_errno;
+}
+
+static const char *
+start_sampling(void)
+{
+  struct sigaction	action = { .sa_handler = sample, .sa_flags = SA_RESTART };
+  struct itimerval	interval = { 0 };
+  void *		warm[1];
+
+  // The first backtrace() loads the unwinder, which allocates memory, so it
+  // mustn't be in the signal handler.
+  backtrace(warm, 1);
+
+  sigemptyset(&action.sa_mask);
+  interval.it_interval.tv_usec = 1000000 / rate;
+  interval.it_value = interval.it_interval;
+  if ( sigaction(SIGPROF, &action, NULL) != 0 || setitimer(ITIMER_PROF, &interval, NULL) != 0 )
+    return "Can't start the profiling timer.";
+  return NULL;
+}
+
+static void
+stop_sampling(void)
+{
+  const struct itimerval off = { 0 };
+
+  setitimer(ITIMER_PROF, &off, NULL);
+}
+
+static void
+dump_tasks(gm_profile_writer_t writer, void * context)
+{
+  write_line(writer, context, "T 0 %s\n", program_invocation_short_name);
+}
+
+static void
+write_file(const char * text, size_t size, void * context)
+{
+  fwrite(text, 1, size, (FILE *)context);
+}
+
+static void
+dump_at_exit(void)
+{
+  FILE * const f = fopen(getenv("GM_PROFILE"), "w");
+
+  gm_profile_stop();
+  if ( f == NULL ) {
+    perror(getenv("GM_PROFILE"));
+    return;
+  }
+  gm_profile_dump(write_file, f);
+  fclose(f);
+}
+
+void
+gm_profile_from_environment(void)
+{
+  const char * const	file = getenv("GM_PROFILE");
+  const char * const	rate = getenv("GM_PROFILE_RATE");
+  const char *		error;
+
+  if ( file == NULL || *file == '\0' )
+    return;
+  if ( (error = gm_profile_start(rate ? (unsigned int)atoi(rate) : GM_PROFILE_DEFAULT_RATE)) != NULL ) {
+    fprintf(stderr, "%s\n", error);
+    return;
+  }
+  atexit(dump_at_exit);
+}
+
+// Addresses in the program are written relative to where it was loaded, as
+// addr2line wants them for a position-independent executable.
+static uintptr_t
+dump_address(uintptr_t address)
+{
+  Dl_info program;
+  Dl_info info;
+
+  if ( dladdr((void *)dump_address, &program) != 0
+   &&  dladdr((void *)address, &info) != 0
+   &&  info.dli_fbase == program.dli_fbase )
+    return address - (uintptr_t)program.dli_fbase;
+  return address;
+}
+#endif
+
+// Discard the samples so far.
+void
+gm_profile_clear(void)
+{
+  pthread_mutex_lock(&lock);
+  if ( entries ) {
+    while ( atomic_flag_test_and_set_explicit(&busy, memory_order_acquire) )
+      ;
+    memset(entries, 0, GM_PROFILE_STACKS * sizeof(*entries));
+    atomic_flag_clear_explicit(&busy, memory_order_release);
+  }
+  atomic_store(&samples, 0);
+  atomic_store(&dropped, 0);
+  pthread_mutex_unlock(&lock);
+}
+
+void
+gm_profile_dump(gm_profile_writer_t writer, void * context)
+{
+  pthread_mutex_lock(&lock);
+  write_line(writer, context, "# gm_profile 1\n");
+  write_line(
+   writer,
+   context,
+   "P %s %u %lu %lu\n",
+   ARCHITECTURE,
+   rate,
+   (unsigned long)atomic_load(&samples),
+   (unsigned long)atomic_load(&dropped));
+  dump_tasks(writer, context);
+
+  for ( size_t i = 0; entries != NULL && i < GM_PROFILE_STACKS; i++ ) {
+    entry_t	e;
+    char	line[LINE_SIZE];
+    int		size;
+
+    // Copied, so that the samples are dropped only for a moment.
+    while ( atomic_flag_test_and_set_explicit(&busy, memory_order_acquire) )
+      ;
+    e = entries[i];
+    atomic_flag_clear_explicit(&busy, memory_order_release);
+    if ( e.count == 0 )
+      continue;
+
+    size = snprintf(line, sizeof(line), "%lu %#lx", (unsigned long)e.count, (unsigned long)(uintptr_t)e.task);
+    for ( size_t j = 0; j < e.depth && size < (int)sizeof(line); j++ )
+      size += snprintf(&line[size], sizeof(line) - size, " %#lx", (unsigned long)dump_address(e.addresses[j]));
+    if ( size < (int)sizeof(line) - 1 ) {
+      line[size++] = '\n';
+      (writer)(line, size, context);
+    }
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+bool
+gm_profile_running(void)
+{
+  bool r;
+
+  pthread_mutex_lock(&lock);
+  r = running;
+  pthread_mutex_unlock(&lock);
+  return r;
+}
+
+// Start sampling, in samples per second of each core. The samples are added
+// to any that are already counted.
+const char *
+gm_profile_start(unsigned int new_rate)
+{
+  const char * error = NULL;
+
+  if ( new_rate == 0 || new_rate > GM_PROFILE_MAXIMUM_RATE )
+    return "The rate must be from 1 to 10000 samples per second.";
+
+  pthread_mutex_lock(&lock);
+  if ( running )
+    error = "The profiler is already running.";
+  else if ( entries == NULL
+   && (entries = gm_calloc(GM_MEMORY_PROFILE, GM_PROFILE_STACKS, sizeof(*entries))) == NULL )
+    error = "Not enough memory for the profiler.";
+  else {
+    rate = new_rate;
+    if ( (error = start_sampling()) == NULL )
+      running = true;
+  }
+  pthread_mutex_unlock(&lock);
+  return error;
+}
+
+void
+gm_profile_stop(void)
+{
+  pthread_mutex_lock(&lock);
+  if ( running ) {
+    stop_sampling();
+    running = false;
+  }
+  pthread_mutex_unlock(&lock);
+}
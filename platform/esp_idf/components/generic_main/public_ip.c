@@ -5,6 +5,7 @@
 #include <sys/random.h>
 #include "generic_main.h"
 #include <sys/socket.h>
+#include <arpa/inet.h>
 
 // Sites that return your external IP in JSON with { "ip": "address string" }
 // and don't have a problem being called by robots, or a fee.
@@ -40,11 +41,30 @@ static int gm_public_ipv4_internal(const char * url, char * data, size_t size)
   return return_value;
 }
 
+// Report an address from an IP-echo site to the reachability service. The
+// site answers with whichever family the connection used.
+static void
+report(const char * data)
+{
+  struct sockaddr_storage address = {};
+
+  if ( inet_pton(AF_INET, data, &((struct sockaddr_in *)&address)->sin_addr) == 1 ) {
+    address.ss_family = AF_INET;
+    gm_reachability_report(false, GM_REACHABILITY_HTTPS, &address);
+  }
+  else if ( inet_pton(AF_INET6, data, &((struct sockaddr_in6 *)&address)->sin6_addr) == 1 ) {
+    address.ss_family = AF_INET6;
+    gm_reachability_report(true, GM_REACHABILITY_HTTPS, &address);
+  }
+}
+
 int gm_public_ipv4(char * data, size_t size)
 {
   for (int tries = 0; tries < (number_of_entries * 2); tries++) {
-    if (gm_public_ipv4_internal(urls[gm_choose_one(number_of_entries)], data, size) == 0)
+    if (gm_public_ipv4_internal(urls[gm_choose_one(number_of_entries)], data, size) == 0) {
+      report(data);
       return 0;
+    }
   }
   return -1;
 }
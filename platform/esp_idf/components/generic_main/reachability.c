@@ -0,0 +1,330 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <esp_random.h>
+#include <esp_timer.h>
+#include "generic_main.h"
+
+// The public addresses of the station interface, from the cheapest source
+// that can say what they are.
+//
+// The router is authoritative about its external address, and PCP learns it
+// for free from the mapping it makes anyway, so when a PCP mapping is granted
+// nothing else is asked. If the router doesn't answer PCP within PCP_WAIT_MS,
+// a STUN race costs a UDP round trip. Only if no STUN server answers is an
+// HTTPS IP-echo site asked, which costs a TLS handshake, and then with an
+// exponential backoff.
+//
+// Every source reports here with gm_reachability_report(), including STUN and
+// HTTPS requests that something else started. A report from a less
+// authoritative source doesn't replace a fresh one from a better source. A PCP
+// external address that is private means that there's another NAT beyond the
+// router, and then STUN is asked.
+//
+// When an address changes, the subscribers are called in the GM_SLOW task,
+// where they may block. Changes that happen before they run are coalesced.
+
+#define PCP_WAIT_MS		1500
+// Check the address this often, unless PCP renewals keep it fresh.
+#define REFRESH_S		(30 * 60)
+// An address is stale if it hasn't been reported for this long.
+#define VALID_S			(2 * REFRESH_S)
+#define MINIMUM_BACKOFF_S	60
+#define MAXIMUM_BACKOFF_S	(60 * 60)
+#define MAXIMUM_HANDLERS	4
+
+typedef struct _family {
+  struct sockaddr_storage	address;
+  gm_reachability_source_t	source;
+  int64_t			time;
+  // The address the subscribers were last told about.
+  struct sockaddr_storage	notified;
+  esp_timer_handle_t		timer;
+  uint32_t			backoff_s;
+  bool				running;
+} family_t;
+
+static pthread_mutex_t			lock = PTHREAD_MUTEX_INITIALIZER;
+static family_t				families[2];	// Indexed by ipv6.
+static gm_reachability_handler_t	handlers[MAXIMUM_HANDLERS];
+static size_t				number_of_handlers = 0;
+
+static const char * const source_names[] = { "none", "HTTPS", "STUN", "PCP" };
+
+static void check(void * data);
+
+// Only a globally-routable address is worth publishing.
+static bool
+is_public(const struct sockaddr_storage * a)
+{
+  if ( a->ss_family == AF_INET ) {
+    const uint32_t h = ntohl(((const struct sockaddr_in *)a)->sin_addr.s_addr);
+
+    return !(h == 0
+     || (h >> 24) == 10			// 10/8
+     || (h >> 24) == 127		// 127/8
+     || (h >> 22) == ((100 << 2) | 1)	// 100.64/10, carrier-grade NAT.
+     || (h >> 16) == ((169 << 8) | 254)	// 169.254/16
+     || (h >> 20) == ((172 << 4) | 1)	// 172.16/12
+     || (h >> 16) == ((192 << 8) | 168));	// 192.168/16
+  }
+  else {
+    // 2000::/3 global unicast.
+    return (((const struct sockaddr_in6 *)a)->sin6_addr.s6_addr[0] & 0xe0) == 0x20;
+  }
+}
+
+static bool
+same_address(const struct sockaddr_storage * a, const struct sockaddr_storage * b)
+{
+  if ( a->ss_family != b->ss_family )
+    return false;
+  if ( a->ss_family == AF_INET )
+    return ((const struct sockaddr_in *)a)->sin_addr.s_addr == ((const struct sockaddr_in *)b)->sin_addr.s_addr;
+  else
+    return memcmp(&((const struct sockaddr_in6 *)a)->sin6_addr, &((const struct sockaddr_in6 *)b)->sin6_addr, sizeof(struct in6_addr)) == 0;
+}
+
+// Set the timer of a family, with 10% jitter. Called with the lock held.
+static void
+arm(bool ipv6, uint64_t ms)
+{
+  family_t * const f = &families[ipv6];
+
+  if ( f->timer == NULL || !f->running )
+    return;
+  esp_timer_stop(f->timer);
+  esp_timer_start_once(f->timer, ms * (900 + esp_random() % 201));
+}
+
+static void
+back_off(bool ipv6)
+{
+  family_t * const f = &families[ipv6];
+
+  pthread_mutex_lock(&lock);
+  if ( f->backoff_s == 0 )
+    f->backoff_s = MINIMUM_BACKOFF_S;
+  else if ( f->backoff_s < MAXIMUM_BACKOFF_S / 2 )
+    f->backoff_s *= 2;
+  else
+    f->backoff_s = MAXIMUM_BACKOFF_S;
+  gm_printf("Can't find the public IPv%d address, trying again in %lu seconds.\n", ipv6 ? 6 : 4, (unsigned long)f->backoff_s);
+  arm(ipv6, f->backoff_s * 1000ULL);
+  pthread_mutex_unlock(&lock);
+}
+
+static void
+succeeded(bool ipv6)
+{
+  pthread_mutex_lock(&lock);
+  families[ipv6].backoff_s = 0;
+  arm(ipv6, REFRESH_S * 1000ULL);
+  pthread_mutex_unlock(&lock);
+}
+
+// The last resort, in the GM_SLOW task. The IP-echo sites only do IPv4.
+static void
+ask_https(void * data)
+{
+  char	buffer[INET6_ADDRSTRLEN + 1];
+
+  if ( gm_public_ipv4(buffer, sizeof(buffer)) == 0 )
+    succeeded(false);
+  else
+    back_off(false);
+}
+
+// STUN has already reported the address, this only decides what's next.
+static void
+after_stun(bool success, bool ipv6, struct sockaddr * address)
+{
+  if ( success )
+    succeeded(ipv6);
+  else if ( !ipv6 )
+    gm_run(ask_https, NULL, GM_SLOW);
+  else
+    back_off(ipv6);
+}
+
+// Run in the select task when a family's timer expires.
+static void
+check(void * data)
+{
+  const bool		ipv6 = (bool)(intptr_t)data;
+  family_t * const	f = &families[ipv6];
+  bool			fresh;
+
+  pthread_mutex_lock(&lock);
+  if ( !f->running ) {
+    pthread_mutex_unlock(&lock);
+    return;
+  }
+  fresh = f->source == GM_REACHABILITY_PCP
+   && gm_clock_us() - f->time < VALID_S * 1000000LL;
+  if ( fresh )
+    arm(ipv6, REFRESH_S * 1000ULL);
+  pthread_mutex_unlock(&lock);
+
+  if ( !fresh )
+    gm_stun(ipv6, after_stun);
+}
+
+static void
+timer_expired(void * data)
+{
+  gm_run(check, data, GM_FAST);
+}
+
+// Tell the subscribers about a change, in the GM_SLOW task.
+static void
+notify(void * data)
+{
+  const bool			ipv6 = (bool)(intptr_t)data;
+  family_t * const		f = &families[ipv6];
+  struct sockaddr_storage	address;
+  gm_reachability_source_t	source;
+  gm_reachability_handler_t	h[MAXIMUM_HANDLERS];
+  size_t			n;
+
+  pthread_mutex_lock(&lock);
+  if ( f->source == GM_REACHABILITY_NONE || same_address(&f->address, &f->notified) ) {
+    pthread_mutex_unlock(&lock);
+    return;
+  }
+  address = f->notified = f->address;
+  source = f->source;
+  n = number_of_handlers;
+  memcpy(h, handlers, sizeof(h));
+  pthread_mutex_unlock(&lock);
+
+  for ( size_t i = 0; i < n; i++ )
+    (h[i])(ipv6, &address, source);
+}
+
+// Get the public address of a family, where it came from, and how many seconds
+// ago it was last confirmed.
+//
+// \return False if the address isn't known.
+bool
+gm_reachability_address(
+ bool				ipv6,
+ struct sockaddr_storage *	address,
+ gm_reachability_source_t *	source,
+ uint32_t *			age_s)
+{
+  const family_t * const f = &families[ipv6];
+  bool known;
+
+  pthread_mutex_lock(&lock);
+  known = f->source != GM_REACHABILITY_NONE;
+  if ( known ) {
+    if ( address )
+      *address = f->address;
+    if ( source )
+      *source = f->source;
+    if ( age_s )
+      *age_s = (gm_clock_us() - f->time) / 1000000;
+  }
+  pthread_mutex_unlock(&lock);
+  return known;
+}
+
+const char *
+gm_reachability_source_name(gm_reachability_source_t source)
+{
+  if ( (size_t)source < COUNTOF(source_names) )
+    return source_names[source];
+  return "unknown";
+}
+
+// Report a public address found by a source. Any port in *address* is ignored.
+void
+gm_reachability_report(bool ipv6, gm_reachability_source_t source, const struct sockaddr_storage * address)
+{
+  family_t * const	f = &families[ipv6];
+  const int64_t		now = gm_clock_us();
+  bool			changed;
+
+  if ( !is_public(address) ) {
+    if ( source == GM_REACHABILITY_PCP && !ipv6 ) {
+      GM_WARN_ONCE("The router's external address is private, there is another NAT beyond it.\n");
+      GM.net_interfaces[GM_STA].ip4.nat = 2;
+    }
+    return;
+  }
+
+  pthread_mutex_lock(&lock);
+  if ( source < f->source && now - f->time < VALID_S * 1000000LL ) {
+    pthread_mutex_unlock(&lock);
+    return;
+  }
+  changed = !same_address(address, &f->notified);
+  f->address = *address;
+  f->source = source;
+  f->time = now;
+  if ( ipv6 ) {
+    ((struct sockaddr_in6 *)&f->address)->sin6_port = 0;
+    GM.net_interfaces[GM_STA].ip6.router_public_ip = ((const struct sockaddr_in6 *)address)->sin6_addr;
+  }
+  else {
+    ((struct sockaddr_in *)&f->address)->sin_port = 0;
+    GM.net_interfaces[GM_STA].ip4.router_public_ip = ((const struct sockaddr_in *)address)->sin_addr;
+  }
+  pthread_mutex_unlock(&lock);
+
+  if ( changed )
+    gm_run(notify, (void *)(intptr_t)ipv6, GM_SLOW);
+}
+
+// Start finding the public address of a family, when the station interface
+// gets an address of that family.
+void
+gm_reachability_start(bool ipv6)
+{
+  family_t * const f = &families[ipv6];
+
+  if ( f->timer == NULL ) {
+    const esp_timer_create_args_t timer_args = {
+      .callback = timer_expired,
+      .arg = (void *)(intptr_t)ipv6,
+      .name = "reachability"
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&timer_args, &f->timer));
+  }
+
+  pthread_mutex_lock(&lock);
+  // This may be another network, forget the old address but not what the
+  // subscribers were told, so that they don't hear about it again if it's the same.
+  f->source = GM_REACHABILITY_NONE;
+  f->time = 0;
+  f->backoff_s = 0;
+  f->running = true;
+  arm(ipv6, PCP_WAIT_MS);
+  pthread_mutex_unlock(&lock);
+}
+
+void
+gm_reachability_stop(void)
+{
+  pthread_mutex_lock(&lock);
+  for ( int i = 0; i < 2; i++ ) {
+    families[i].running = false;
+    if ( families[i].timer )
+      esp_timer_stop(families[i].timer);
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+// Call *handler* in the GM_SLOW task whenever a public address changes.
+void
+gm_reachability_subscribe(gm_reachability_handler_t handler)
+{
+  pthread_mutex_lock(&lock);
+  if ( number_of_handlers < MAXIMUM_HANDLERS )
+    handlers[number_of_handlers++] = handler;
+  else
+    GM_FAIL("Too many reachability subscribers.");
+  pthread_mutex_unlock(&lock);
+}
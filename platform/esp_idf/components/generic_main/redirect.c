@@ -144,7 +144,7 @@ io_handler(int sock, void * data, bool readable, bool writable, bool exception,
   gm_fd_unregister(sock);
   (void) shutdown(sock, SHUT_RDWR);
   (void) close(sock);
-  free(data);
+  gm_free(data);
   return;
 }
 
@@ -165,7 +165,7 @@ accept_handler(int sock, void * data, bool readable, bool writable, bool excepti
     GM_FAIL_WITH_OS_ERROR("Select event server accept failed");
     return;
   }
-  struct request * r = (struct request *)malloc(sizeof(struct request));
+  struct request * r = (struct request *)gm_malloc(GM_MEMORY_REDIRECT, sizeof(struct request));
   
   if ( r ) {
     memset(r, 0, sizeof(*r));
@@ -3,11 +3,17 @@
 // file descriptors. This allows us to do event-driven I/O without depending
 // upon the C++ ASIO port.
 //
+// Timeouts are on gm_clock_us(), which doesn't jump when SNTP sets the time
+// of day. On the host, the simulation calls gm_select_once() itself, with
+// select() and the clock simulated, see host/sim_net.c.
+//
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
+#ifdef ESP_PLATFORM
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#endif
 #include <sys/select.h>
 #include <sys/time.h>
 #include <string.h>
@@ -21,6 +27,7 @@
 #include <sys/stat.h>
 #include <errno.h>
 #include "generic_main.h"
+#include "gm_trace.h"
 
 #ifndef MAX
 #define MAX(a, b) (a) > (b) ? (a) : (b)
@@ -28,8 +35,14 @@
 
 #define NUMBER_OF_FDS	100
 #define NUMBER_OF_TIMER_TASKS	25
+// Handle a timeout this close to its expiration now, rather than looping
+// through select() until it runs out.
+#define GRANULARITY_US		10000
+#define FOREVER_US		((int64_t)(1 << 30) * 1000000)
 
+#ifdef ESP_PLATFORM
 static TaskHandle_t select_task_id = NULL;
+#endif
 
 static fd_set read_fds = {};
 static fd_set write_fds = {};
@@ -38,8 +51,10 @@ static fd_set monitored_fds = {};
 static int fd_limit = 0;
 static volatile gm_fd_handler_t handlers[NUMBER_OF_FDS] = {};
 static void * data[NUMBER_OF_FDS] = {};
-static struct timeval intervals[NUMBER_OF_FDS] = {};
-static struct timeval expirations[NUMBER_OF_FDS] = {};
+// Microseconds, 0 for no timeout.
+static int64_t intervals[NUMBER_OF_FDS] = {};
+// gm_clock_us(), 0 for no timeout.
+static int64_t expirations[NUMBER_OF_FDS] = {};
 static volatile bool	in_select = false;
 
 
@@ -52,24 +67,30 @@ gm_fd_register(
   const bool	writable,
   const bool	exception,
   const uint32_t seconds) {
+  gm_fd_register_ms(fd, handler, d, readable, writable, exception, seconds * 1000);
+}
+
+// The same as gm_fd_register(), with the timeout in milliseconds, for
+// protocols that retry or stagger requests in less than a second.
+void
+gm_fd_register_ms(
+  const int	fd,
+  const gm_fd_handler_t handler,
+  void * const	d,
+  const bool	readable,
+  const bool	writable,
+  const bool	exception,
+  const uint32_t milliseconds) {
 
   fd_limit = MAX(fd_limit, fd + 1);
 
   data[fd] = d;
 
-  struct timeval * const interval = &intervals[fd];
-  interval->tv_sec = seconds;
-  interval->tv_usec = 0;
-
-  struct timeval now;
-  gettimeofday(&now, 0);
-  struct timeval * const expiration = &expirations[fd];
-  if ( seconds ) {
-    expiration->tv_sec = now.tv_sec + seconds;
-    expiration->tv_usec = now.tv_usec;
-  }
+  intervals[fd] = milliseconds * 1000LL;
+  if ( milliseconds )
+    expirations[fd] = gm_clock_us() + intervals[fd];
   else
-    timerclear(expiration);
+    expirations[fd] = 0;
   
   if ( readable || writable || exception ) {
     FD_SET(fd, &monitored_fds);
@@ -100,8 +121,8 @@ void
 gm_fd_unregister(const int fd) {
   handlers[fd] = (gm_fd_handler_t)0;
   data[fd] = 0;
-  timerclear(&expirations[fd]);
-  timerclear(&intervals[fd]);
+  expirations[fd] = 0;
+  intervals[fd] = 0;
   FD_CLR(fd, &read_fds);
   FD_CLR(fd, &write_fds);
   FD_CLR(fd, &exception_fds);
@@ -125,120 +146,114 @@ gm_fd_unregister(const int fd) {
   }
 }
 
-static void
-select_task(void * param)
+// Wait in select() for I/O or the earliest timeout, and call the handlers of
+// the descriptors that are ready or have timed out.
+void
+gm_select_once(void)
 {
-  for ( ; ; ) {
-    fd_set read_now;
-    fd_set write_now;
-    fd_set exception_now;
-
-    memcpy(&read_now, &read_fds, sizeof(read_now));
-    memcpy(&write_now, &write_fds, sizeof(write_now));
-    memcpy(&exception_now, &exception_fds, sizeof(exception_now));
-
-    struct timeval time_of_day_before_select;
-    gettimeofday(&time_of_day_before_select, 0);
-
-    struct timeval select_blocking_interval = {};
-    select_blocking_interval.tv_sec = 1 << 30;
-   
-    for ( int i = 0; i < fd_limit; i++ ) {
-      if ( FD_ISSET(i, &monitored_fds) ) {
-        // Check if the FD was closed without being unregistered. Use both
-        // getsockname() and lseek() because lwIP doesn't implement lseek()
-        // and I don't trust lseek() to test a closed file descriptor in the
-        // lwIP range (they are higher numbers than FreeRTOS fds) and correctly
-        // return EBADF rather than ESPIPE.
-        struct sockaddr_storage address;
-        socklen_t length = sizeof(address);
-        if ( (getsockname(i, (struct sockaddr *)&address, &length) < 0 && errno == EBADF) 
-         ||  (lseek(i, 0, SEEK_CUR) < 0 && errno == EBADF) ) {
-          GM_FAIL("select_task(): fd %d isn't an open file descriptor and gm_fd_unregister() wasn't called.\n");
-          gm_fd_unregister(i);
-        }
+  fd_set read_now;
+  fd_set write_now;
+  fd_set exception_now;
 
-        const struct timeval * const t = &expirations[i];
-  
-        if ( timerisset(t) ) {
-          if ( timercmp(t, &time_of_day_before_select, <) ) {
-            timerclear(&select_blocking_interval);
-            break; // Can't get lower than this, so no point in checking more values.
-          }
-          else {
-            struct timeval interval;
-            timersub(t, &time_of_day_before_select, &interval);
-        
-            if ( timercmp(&interval, &select_blocking_interval, <) )
-              select_blocking_interval = interval;
-          }
+  memcpy(&read_now, &read_fds, sizeof(read_now));
+  memcpy(&write_now, &write_fds, sizeof(write_now));
+  memcpy(&exception_now, &exception_fds, sizeof(exception_now));
+
+  const int64_t before_select = gm_clock_us();
+  int64_t blocking_us = FOREVER_US;
+
+  for ( int i = 0; i < fd_limit; i++ ) {
+    if ( FD_ISSET(i, &monitored_fds) ) {
+      // Check if the FD was closed without being unregistered. Use both
+      // getsockname() and lseek() because lwIP doesn't implement lseek()
+      // and I don't trust lseek() to test a closed file descriptor in the
+      // lwIP range (they are higher numbers than FreeRTOS fds) and correctly
+      // return EBADF rather than ESPIPE.
+      struct sockaddr_storage address;
+      socklen_t length = sizeof(address);
+      if ( (getsockname(i, (struct sockaddr *)&address, &length) < 0 && errno == EBADF) 
+       ||  (lseek(i, 0, SEEK_CUR) < 0 && errno == EBADF) ) {
+        GM_FAIL("select_task(): fd %d isn't an open file descriptor and gm_fd_unregister() wasn't called.\n");
+        gm_fd_unregister(i);
+      }
+
+      const int64_t t = expirations[i];
+
+      if ( t != 0 ) {
+        if ( t < before_select ) {
+          blocking_us = 0;
+          break; // Can't get lower than this, so no point in checking more values.
         }
+        else if ( t - before_select < blocking_us )
+          blocking_us = t - before_select;
       }
     }
+  }
 
-    in_select = true;
-    const int number_of_set_fds = select(
-     fd_limit,
-     &read_now,
-     &write_now,
-     &exception_now,
-     &select_blocking_interval);
-    in_select = false;
-
-    if ( number_of_set_fds < 0 ) {
-      // Select failed.
-      if ( errno == EBADF ) {
-        // A file descriptor was closed while select() was sleeping upon it.
-        // The check using getsockname() and lseek() above will unregister it.
-        continue;
-      }
-      else
-        GM_FAIL_WITH_OS_ERROR("Select failed");
+  struct timeval select_blocking_interval = {
+    .tv_sec = blocking_us / 1000000,
+    .tv_usec = blocking_us % 1000000
+  };
+
+  in_select = true;
+  const int number_of_set_fds = select(
+   fd_limit,
+   &read_now,
+   &write_now,
+   &exception_now,
+   &select_blocking_interval);
+  in_select = false;
+
+  if ( number_of_set_fds < 0 ) {
+    // Select failed.
+    if ( errno == EBADF ) {
+      // A file descriptor was closed while select() was sleeping upon it.
+      // The check using getsockname() and lseek() above will unregister it.
+      return;
     }
-    struct timeval time_of_day_after_select;
-    gettimeofday(&time_of_day_after_select, 0);
-
-    for ( unsigned int i = 0; i < fd_limit; i++ ) {
-      if ( FD_ISSET(i, &monitored_fds) ) {
-        const bool readable = FD_ISSET(i, &read_now);
-        const bool writable = FD_ISSET(i, &write_now);
-        const bool exception = FD_ISSET(i, &exception_now);
-        bool timeout = false;
-
-        struct timeval * t = &expirations[i];
-        if ( timerisset(t) ) {
-          if ( timercmp(t, &time_of_day_after_select, <) )
-            timeout = true;
-          else {
-            // Compensate for timer granularity, rather than looping through
-            // select() until the timer runs out. 
-            struct timeval remaining;
-
-            timersub(t, &time_of_day_after_select, &remaining);
-            if ( remaining.tv_sec == 0 && remaining.tv_usec < 10000 )
-              timeout = true;
-          }
-        }
+    else
+      GM_FAIL_WITH_OS_ERROR("Select failed");
+  }
+  const int64_t after_select = gm_clock_us();
+
+  for ( unsigned int i = 0; i < fd_limit; i++ ) {
+    if ( FD_ISSET(i, &monitored_fds) ) {
+      const bool readable = FD_ISSET(i, &read_now);
+      const bool writable = FD_ISSET(i, &write_now);
+      const bool exception = FD_ISSET(i, &exception_now);
+      // Compensate for timer granularity, rather than looping through
+      // select() until the timer runs out. 
+      bool timeout = expirations[i] != 0
+       && expirations[i] - after_select < GRANULARITY_US;
 
-        if ( readable || writable || exception || timeout ) {
-          gm_fd_handler_t handler = handlers[i];
+      if ( readable || writable || exception || timeout ) {
+        gm_fd_handler_t handler = handlers[i];
 
-          if ( readable || writable || exception )
-            timeout = false;
+        if ( readable || writable || exception )
+          timeout = false;
 
-          timeradd(
-           &intervals[i],
-           &time_of_day_after_select,
-           &expirations[i]); 
+        // A descriptor registered without a timeout mustn't get one.
+        if ( intervals[i] != 0 )
+          expirations[i] = after_select + intervals[i];
 
-          if (handler)
-            (handler)(i, data[i], readable, writable, exception, timeout);
+        if (handler) {
+          GM_TRACE_BEGIN_VALUE("select handler", i);
+          (handler)(i, data[i], readable, writable, exception, timeout);
+          GM_TRACE_END("select handler");
         }
       }
     }
   }
 }
 
+#ifdef ESP_PLATFORM
+static void
+select_task(void * param)
+{
+  for ( ; ; )
+    gm_select_once();
+}
+
 void
 gm_select_task(void)
 {
@@ -246,4 +261,7 @@ gm_select_task(void)
   // It will set up an FD to wait upon for accept() before the first select() is called.
   gm_event_server();
   xTaskCreate(select_task, "generic main: select loop", 9000, NULL, 3, &select_task_id);
+  // From now on, log messages are formatted in the select task.
+  gm_log_start();
 }
+#endif
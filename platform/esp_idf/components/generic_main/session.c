@@ -1,39 +1,235 @@
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <mbedtls/sha256.h>
 #include "generic_main.h"
 
+// Decoding a session cookie is relatively heavy-weight: conversion from
+// Base-64, decryption and authentication, parsing, and then a read of the user
+// record from FLASH. Browsers open many connections, and the web server
+// recycles sockets, so the same cookie arrives on new connections again and
+// again. Keep a small cache of decoded sessions, keyed by a digest of the raw
+// cookie value, so that we don't pay for the decode each time.
+//
+// A cookie that fails to decode is cached too, so that a bad cookie sent with
+// every request doesn't cost a decryption each time.
+
+#define NUMBER_OF_CACHE_ENTRIES	8
+#define CACHE_SECONDS		60
+// The cookie of a user is issued again once it's this old, so that it
+// doesn't expire while it's in use.
+#define RENEW_SECONDS		(24 * 60 * 60)
+
+typedef struct _cache_entry {
+  uint8_t		digest[32];	// SHA-256 of the cookie value.
+  int64_t		expires;	// gm_clock_us() microseconds.
+  uint32_t		last_used;
+  bool			valid;
+  bool			has_cookie;
+  bool			has_user;
+  gm_cookie_t		cookie;
+  gm_user_data_t	user_data;
+} cache_entry_t;
+
+static pthread_mutex_t		lock = PTHREAD_MUTEX_INITIALIZER;
+static cache_entry_t		cache[NUMBER_OF_CACHE_ENTRIES];
+static uint32_t			use_count = 0;
+static gm_session_cache_stats_t	stats;
+
 static void
 free_context(void * context)
 {
-  gm_session_context_t * const s = context;
+  gm_free(context);
+}
 
-  cJSON_Delete(s->json);
-  free(s->user_name);
-  free(s);
+// Call with the lock held.
+static void
+discard(cache_entry_t * e)
+{
+  memset(e, 0, sizeof(*e));
 }
 
-void
+// Copy a cache entry to a session context. Call with the lock held.
+static void
+copy_to_session(const cache_entry_t * e, gm_session_context_t * s)
+{
+  if ( e->has_cookie )
+    s->cookie = e->cookie;
+  if ( e->has_user ) {
+    s->user_name = s->cookie.user_name;
+    s->user_data = e->user_data;
+  }
+}
+
+// Call with the lock held.
+static cache_entry_t *
+lookup(const uint8_t * digest, int64_t now)
+{
+  for ( int i = 0; i < NUMBER_OF_CACHE_ENTRIES; i++ ) {
+    cache_entry_t * const e = &cache[i];
+
+    if ( e->valid && memcmp(e->digest, digest, sizeof(e->digest)) == 0 ) {
+      if ( now < e->expires ) {
+        e->last_used = ++use_count;
+        return e;
+      }
+      stats.expirations++;
+      discard(e);
+      return NULL;
+    }
+  }
+  return NULL;
+}
+
+// Call with the lock held. Returns an empty or least-recently-used entry.
+static cache_entry_t *
+victim(void)
+{
+  cache_entry_t * oldest = &cache[0];
+
+  for ( int i = 0; i < NUMBER_OF_CACHE_ENTRIES; i++ ) {
+    if ( !cache[i].valid )
+      return &cache[i];
+    if ( cache[i].last_used < oldest->last_used )
+      oldest = &cache[i];
+  }
+  stats.evictions++;
+  discard(oldest);
+  return oldest;
+}
+
+static void
+decode(gm_session_context_t * s, char * value, size_t length, const uint8_t * digest, int64_t now)
+{
+  const bool has_cookie = gm_decode_cookie(value, length, &s->cookie);
+  bool has_user = false;
+
+  if ( !has_cookie )
+    memset(&s->cookie, 0, sizeof(s->cookie));
+  else if ( s->cookie.user_name[0] != '\0' )
+    has_user = gm_get_user_data(s->cookie.user_name, &s->user_data) == ESP_OK;
+
+  if ( has_user )
+    s->user_name = s->cookie.user_name;
+
+  pthread_mutex_lock(&lock);
+  // Another connection may have decoded the same cookie while we did.
+  if ( lookup(digest, now) == NULL ) {
+    cache_entry_t * const e = victim();
+    memcpy(e->digest, digest, sizeof(e->digest));
+    e->expires = now + (CACHE_SECONDS * 1000000LL);
+    e->last_used = ++use_count;
+    e->has_cookie = has_cookie;
+    e->cookie = s->cookie;
+    e->has_user = has_user;
+    e->user_data = s->user_data;
+    e->valid = true;
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+// Issue the cookie of a logged-in user again, with the current time, if it's
+// old or its issue time isn't known.
+static void
+renew(httpd_req_t * req, const gm_session_context_t * s)
+{
+  if ( s->user_name == NULL || GM.time_last_synchronized == 0 )
+    return;
+
+  const time_t now = gm_clock_time();
+  if ( s->cookie.issued == 0 || now - (time_t)s->cookie.issued > RENEW_SECONDS ) {
+    gm_cookie_t c = s->cookie;
+    c.issued = 0;
+    gm_write_cookie(req, &c);
+  }
+}
+
+// Attach the session context to a request, from the cache or the cookie.
+//
+// \return ESP_ERR_NO_MEM if there's no memory for the context.
+esp_err_t
 gm_session(httpd_req_t * req)
 {
   if ( req->sess_ctx ) {
     // We already have session context for the user. Don't bother decoding our
     // cookie during this request, that's a relatively heavy-weight task with
-    // conversion from Base-64, and decryption, and parsing JSON, and we have
+    // conversion from Base-64, and decryption and authentication, and we have
     // all of that data in-hand.
   }
   else {
-    gm_session_context_t * const s = malloc(sizeof(gm_session_context_t));
+    gm_session_context_t * const s = gm_calloc(GM_MEMORY_SESSION, 1, sizeof(gm_session_context_t));
+    char	cookie[GM_COOKIE_SIZE];
+    size_t	length = sizeof(cookie);
+    uint8_t	digest[32];
+
+    if ( s == NULL )
+      return ESP_ERR_NO_MEM;
     req->sess_ctx = s;
     req->free_ctx = free_context;
-    cJSON * json = gm_read_cookie(req);
-    if ( json ) {
-      s->json = json;
-      const cJSON * const name = cJSON_GetObjectItemCaseSensitive(json, "name");
-      if ( name ) {
-        if ( cJSON_IsString(name) && name->valuestring != NULL ) {
-          if ( gm_get_user_data(name->valuestring, &s->user_data) ) {
-            s->user_name = strdup(name->valuestring);
-          }
-        }
-      }
+
+    const esp_err_t err = httpd_req_get_cookie_val(req, "c", cookie, &length);
+
+    // The most likely error here is simply that the current request did not
+    // contain our session data cookie.
+    if ( err != ESP_OK ) {
+      if ( err != ESP_ERR_NOT_FOUND )
+        gm_printf("Cookie error: %s.\n", esp_err_to_name(err));
+      return ESP_OK;
     }
+    length = strlen(cookie);
+
+    const int64_t now = gm_clock_us();
+    mbedtls_sha256((const unsigned char *)cookie, length, digest, 0);
+
+    pthread_mutex_lock(&lock);
+    const cache_entry_t * const e = lookup(digest, now);
+    if ( e ) {
+      stats.hits++;
+      copy_to_session(e, s);
+      pthread_mutex_unlock(&lock);
+    }
+    else {
+      stats.misses++;
+      pthread_mutex_unlock(&lock);
+      decode(s, cookie, length, digest, now);
+    }
+    renew(req, s);
+  }
+  return ESP_OK;
+}
+
+// Drop the cached sessions of a user, so that changed user data takes effect
+// on the next request. If the name is NULL, drop all cached sessions.
+//
+// The entries without user data go too: the user may just have been
+// created, or a read of the user record that failed may now succeed, and
+// those sessions would otherwise stay logged out until their entries expire.
+void
+gm_session_cache_invalidate(const char * user_name)
+{
+  pthread_mutex_lock(&lock);
+  for ( int i = 0; i < NUMBER_OF_CACHE_ENTRIES; i++ ) {
+    cache_entry_t * const e = &cache[i];
+
+    if ( e->valid
+     && (user_name == NULL || !e->has_user || strcmp(e->cookie.user_name, user_name) == 0) ) {
+      discard(e);
+      stats.invalidations++;
+    }
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+void
+gm_session_cache_stats(gm_session_cache_stats_t * s)
+{
+  pthread_mutex_lock(&lock);
+  *s = stats;
+  s->entries = 0;
+  for ( int i = 0; i < NUMBER_OF_CACHE_ENTRIES; i++ ) {
+    if ( cache[i].valid )
+      s->entries++;
   }
+  s->size = NUMBER_OF_CACHE_ENTRIES;
+  pthread_mutex_unlock(&lock);
 }
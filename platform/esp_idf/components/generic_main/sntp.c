@@ -12,7 +12,7 @@ time_was_synchronized(struct timeval * t)
     esp_sntp_set_sync_mode(SNTP_SYNC_MODE_SMOOTH);
     esp_sntp_restart();
   }
-  GM.time_last_synchronized = esp_timer_get_time();
+  GM.time_last_synchronized = gm_clock_us();
 }
 
 void
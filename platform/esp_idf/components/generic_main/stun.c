@@ -1,10 +1,12 @@
-// FIX: Modify to always send using the link-local or NAT IP address, not
-// the public IPV6 address.
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 #include <sys/types.h>
 #include <lwip/sockets.h>
 #include <netdb.h>
+#include <esp_random.h>
 #include "generic_main.h"
+#include "gm_trace.h"
 
 // The STUN RFC 8489 requires attributes connected with authentication, and requires
 // knowledge of the cleartext password on the server to calculate the MESSAGE-INTEGRITY
@@ -21,6 +23,25 @@
 // MESSAGE-INTEGRITY, MESSAGE-INTEGRITY-SHA256m because a server that doesn't have
 // any password data could not authenticate them. It sends FINGERPRINT, and it could
 // send REALM, although the REALM information would be arbitrary and probably useless.
+//
+// Discovery of the public address is on the critical path to being reachable
+// after WiFi connects, so rather than asking one server and waiting for it to
+// time out before asking another, this races the servers: it sends a request
+// to the best one, and another to the next best every STAGGER_MS until one
+// answers, as in Happy Eyeballs (RFC 8305). IPv4 and IPv6 are raced
+// independently. The first valid response wins. The round-trip time and
+// failures of each server, and its resolved address, are kept in NVS across
+// boots, so that the first request after boot goes to the fastest server
+// without waiting for DNS. The scores change with nearly every race, so they
+// are written at most every SAVE_SECONDS, while a changed address is written
+// at once. The mapped address is cached for CACHE_SECONDS, for reconnection
+// to the same network.
+//
+// A mapping only holds for the socket that asked, and only while the NAT
+// keeps its binding, so the socket that won the last IPv4 race is kept open
+// and registered with keepalive.c. Then the public address that was reported
+// stays a working path to the device, rather than one that expires when the
+// NAT times out an idle binding.
 
 // Standard port number for STUN;
 // static const uint16_t stun_port = 3478;
@@ -34,7 +55,7 @@ static const uint32_t stun_magic = 0x42a41221; // 0x2112a442 in network byte ord
 
 // stun_message_class bits are interleaved into the type field.
 // Where c is the message class and m is the method:
-// htons(((c & 0x1) << 4) | ((c & 0x2) << 8) | (m & 0xf))
+// htons(((c & 0x1) << 4) | ((c & 0x2) << 7) | (m & 0xf))
 enum stun_message_class {
   STUN_REQUEST = 0,
   STUN_INDICATION = 1,
@@ -112,22 +133,27 @@ struct stun_attribute {
   } value;
 };
 
+
+// Time between requests to successive servers.
+#define STAGGER_MS		100
+// After the first answer, listen this long for the other servers, to score them.
+#define GRACE_MS		500
+// Give up on a race after this long.
+#define RACE_MS			3000
+// How long a mapped address is trusted without asking again.
+#define CACHE_SECONDS		300
+// The round-trip time assumed for a server that has never answered.
+#define DEFAULT_RTT_MS		250
+// How often changed scores are written to NVS.
+#define SAVE_SECONDS		3600
+#define NVS_NAMESPACE		"stun"
+#define NVS_KEY			"health"
+
 struct stun_server {
   const char *	host;
   uint16_t	port;
 };
 
-typedef void (*gm_stun_after_t)(bool success, bool ipv6, struct sockaddr * address);
-
-struct stun_run {
-  struct sockaddr *	address;
-  unsigned int		tries;
-  bool			ipv6;
-  gm_stun_after_t	after;
-};
-
-static void stun_receive(int fd, void * data, bool readable, bool writable, bool exception, bool timeout);
-
 static const struct stun_server ipv4_servers[] = {
   { "stun.ooma.com", 3478 },
   // { "stun.3cx.com", 3478 },
@@ -139,7 +165,7 @@ static const struct stun_server ipv4_servers[] = {
   // STUN multiplexed on port 80!
   { "openrelay.metered.ca", 80 }
 };
-static const size_t	ipv4_table_count = sizeof(ipv4_servers) / sizeof(*ipv4_servers);
+#define IPV4_COUNT	(sizeof(ipv4_servers) / sizeof(*ipv4_servers))
 
 static const struct stun_server ipv6_servers[] = {
   { "stun.l.google.com", 19302 },
@@ -147,371 +173,723 @@ static const struct stun_server ipv6_servers[] = {
   { "stun3.l.google.com", 19302 },
   { "stun4.l.google.com", 19302 }
 };
-static const size_t	ipv6_table_count = sizeof(ipv6_servers) / sizeof(*ipv6_servers);
+#define IPV6_COUNT	(sizeof(ipv6_servers) / sizeof(*ipv6_servers))
+
+#define MAX_SERVERS	(IPV4_COUNT > IPV6_COUNT ? IPV4_COUNT : IPV6_COUNT)
+
+// What's known about a server. This is saved in NVS.
+typedef struct stun_health {
+  uint16_t	rtt_ms;		// Smoothed round-trip time, 0 if it never answered.
+  uint8_t	failures;	// Races it hasn't answered since it last did.
+  uint8_t	resolved;	// True if the address is valid.
+  uint8_t	address[16];	// IPv4 addresses use the first 4 bytes.
+} stun_health;
+
+typedef struct stun_saved {
+  uint32_t	tables_hash;	// Scores are discarded when the server tables change.
+  stun_health	ipv4[IPV4_COUNT];
+  stun_health	ipv6[IPV6_COUNT];
+} stun_saved;
+
+typedef struct stun_race {
+  gm_stun_after_t	after;
+  bool			ipv6;
+  int			sock;
+  int64_t		start;		// gm_clock_us() microseconds.
+  int64_t		answered;	// When the result was delivered, or 0.
+  size_t		number_of_servers;
+  size_t		next;		// The next of order[] to send to.
+  size_t		winner;		// The request that answered first.
+  uint8_t		order[MAX_SERVERS];
+  struct {
+    uint32_t	transaction_id[3];
+    int64_t	sent;		// 0 if not sent.
+    bool	answered;
+  } requests[MAX_SERVERS];
+} stun_race;
+
+typedef struct stun_cache {
+  int64_t			time;	// 0 if there is no cached address.
+  struct in6_addr		local;	// The local address and router it's valid for.
+  struct in6_addr		router;
+  struct sockaddr_storage	mapped;
+} stun_cache;
+
+static pthread_mutex_t	lock = PTHREAD_MUTEX_INITIALIZER;
+static stun_saved	saved = {};
+static bool		loaded = false;
+static bool		dirty = false;
+static bool		addresses_changed = false;
+static int64_t		save_time = 0;	// Of the last write since boot, or 0.
+static bool		refreshed[2] = {};
+// These are only used in the select task.
+static stun_race *	races[2] = {};
+static stun_cache	cache[2] = {};
+static gm_keepalive_t	mapped_flow = { .fd = -1 };
+
+static void race_event(int fd, void * data, bool readable, bool writable, bool exception, bool timeout);
+static void server_address(bool ipv6, unsigned int index, struct sockaddr_storage * to, socklen_t * to_size);
+
+static const struct stun_server *
+servers(bool ipv6, size_t * count)
+{
+  *count = ipv6 ? IPV6_COUNT : IPV4_COUNT;
+  return ipv6 ? ipv6_servers : ipv4_servers;
+}
+
+static stun_health *
+health(bool ipv6)
+{
+  return ipv6 ? saved.ipv6 : saved.ipv4;
+}
+
+// FNV-1a of the server tables.
+static uint32_t
+tables_hash(void)
+{
+  uint32_t h = 2166136261;
+
+  for ( int family = 0; family < 2; family++ ) {
+    size_t count;
+    const struct stun_server * const s = servers(family, &count);
+
+    for ( size_t i = 0; i < count; i++ ) {
+      for ( const char * c = s[i].host; *c; c++ )
+        h = (h ^ (uint8_t)*c) * 16777619;
+      h = (h ^ s[i].port) * 16777619;
+    }
+    h = (h ^ 0xff) * 16777619;
+  }
+  return h;
+}
 
-static int		stun_sock = -1;
+// Call with the lock held.
+static void
+load(void)
+{
+  nvs_handle_t	nvs;
+  size_t	size = sizeof(saved);
+
+  if ( loaded )
+    return;
+  loaded = true;
+
+  if ( nvs_open(NVS_NAMESPACE, NVS_READONLY, &nvs) == ESP_OK ) {
+    if ( nvs_get_blob(nvs, NVS_KEY, &saved, &size) != ESP_OK
+     || size != sizeof(saved)
+     || saved.tables_hash != tables_hash() )
+      memset(&saved, 0, sizeof(saved));
+    nvs_close(nvs);
+  }
+  saved.tables_hash = tables_hash();
+}
 
 static void
-decode_mapped_address(struct stun_attribute * a, struct sockaddr * address)
+save(void * data)
 {
-  if ( a->value.mapped_address.family == 1 ) {
-    struct sockaddr_in * in = (struct sockaddr_in *)address;
-    memset(in, '\0', sizeof(*in));
-    in->sin_family = AF_INET;
-    in->sin_port = a->value.mapped_address.port;
-    in->sin_addr.s_addr = a->value.mapped_address.ipv4;
+  nvs_handle_t	nvs;
+  stun_saved	copy;
+  esp_err_t	err;
+
+  pthread_mutex_lock(&lock);
+  const int64_t now = gm_clock_us();
+  if ( !dirty
+   || (!addresses_changed && save_time != 0 && now - save_time < SAVE_SECONDS * 1000000LL) ) {
+    pthread_mutex_unlock(&lock);
+    return;
   }
-  else {
-    struct sockaddr_in6 * in6 = (struct sockaddr_in6 *)address;
-    memset(in6, '\0', sizeof(*in6));
-    in6->sin6_family = AF_INET6;
-    in6->sin6_port = a->value.mapped_address.port;
-    memcpy(&in6->sin6_addr.s6_addr, a->value.mapped_address.ipv6.s6_addr, sizeof(in6->sin6_addr.s6_addr));
+  copy = saved;
+  dirty = false;
+  addresses_changed = false;
+  save_time = now;
+  pthread_mutex_unlock(&lock);
+
+  if ( (err = nvs_open(NVS_NAMESPACE, NVS_READWRITE, &nvs)) != ESP_OK ) {
+    gm_flash_failure(NVS_NAMESPACE, err);
+    return;
   }
+  if ( (err = nvs_set_blob(nvs, NVS_KEY, &copy, sizeof(copy))) == ESP_OK )
+    err = nvs_commit(nvs);
+  nvs_close(nvs);
+  if ( err != ESP_OK )
+    gm_flash_failure(NVS_NAMESPACE, err);
 }
 
+// Resolve the addresses of all of the servers of a family. This blocks, so
+// it's run with GM_SLOW.
 static void
-decode_error_code(struct stun_attribute * a)
+resolve(bool ipv6)
 {
-  GM_FAIL("Received error code.\n");
+  size_t count;
+  const struct stun_server * const s = servers(ipv6, &count);
+
+  for ( size_t i = 0; i < count; i++ ) {
+    struct addrinfo	hints = {};
+    struct addrinfo *	result = NULL;
+    char		port[6];
+
+    // Only return the address family that is requested in hints->ai_family.
+    hints.ai_flags = AI_ADDRCONFIG;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_protocol = IPPROTO_UDP;
+    hints.ai_family = ipv6 ? AF_INET6 : AF_INET;
+    snprintf(port, sizeof(port), "%d", s[i].port);
+
+    if ( getaddrinfo(s[i].host, port, &hints, &result) != 0 || result == NULL )
+      continue;
+
+    pthread_mutex_lock(&lock);
+    stun_health * const h = &health(ipv6)[i];
+    uint8_t address[16] = {};
+
+    if ( ipv6 )
+      memcpy(address, &((struct sockaddr_in6 *)result->ai_addr)->sin6_addr, 16);
+    else
+      memcpy(address, &((struct sockaddr_in *)result->ai_addr)->sin_addr, 4);
+    if ( !h->resolved || memcmp(h->address, address, sizeof(address)) != 0 ) {
+      memcpy(h->address, address, sizeof(address));
+      h->resolved = true;
+      dirty = true;
+      addresses_changed = true;
+    }
+    pthread_mutex_unlock(&lock);
+    freeaddrinfo(result);
+  }
+  refreshed[ipv6] = true;
+  gm_run(save, NULL, GM_SLOW);
 }
 
 static void
-decode_unknown_attributes(struct stun_attribute * a)
+refresh(void * data)
+{
+  resolve((bool)(intptr_t)data);
+}
+
+static uint32_t
+score(const stun_health * h)
 {
-  GM_FAIL("Unknown attribute.\n");
+  const unsigned int failures = h->failures > 6 ? 6 : h->failures;
+
+  return (h->rtt_ms ? h->rtt_ms : DEFAULT_RTT_MS) << failures;
 }
 
 static void
-decode_xor_mapped_address(struct stun_attribute * a, struct stun_message * message, struct sockaddr * address)
+local_and_router(bool ipv6, struct in6_addr * local, struct in6_addr * router)
 {
-  if ( a->value.mapped_address.family == 1 ) {
-    fflush(stderr);
-    sleep(1);
-    struct sockaddr_in * in = (struct sockaddr_in *)address;
-    memset(in, '\0', sizeof(*in));
-    in->sin_family = AF_INET;
-    in->sin_port = a->value.mapped_address.port ^ ((stun_magic >> 16) & 0xffff);
-    in->sin_addr.s_addr = a->value.mapped_address.ipv4 ^ stun_magic;
+  const gm_netif_t * const i = &GM.net_interfaces[GM_STA];
+
+  memset(local, 0, sizeof(*local));
+  memset(router, 0, sizeof(*router));
+  if ( ipv6 ) {
+    *local = i->ip6.global[0];
+    *router = i->ip6.router;
   }
   else {
-    struct sockaddr_in6 * in6 = (struct sockaddr_in6 *)address;
-    memset(in6, '\0', sizeof(*in6));
-    in6->sin6_family = AF_INET6;
-    uint32_t *	out = (uint32_t *)&in6->sin6_addr.s6_addr;
-    uint32_t *	in = (uint32_t *)&a->value.mapped_address.ipv6.s6_addr;
-    for ( int i = 0; i < 4; i++ ) {
-      out[i] = in[i] ^ stun_magic;
-    }
+    memcpy(local, &i->ip4.address, sizeof(i->ip4.address));
+    memcpy(router, &i->ip4.router, sizeof(i->ip4.router));
   }
 }
 
 static void
-decode_software(struct stun_attribute * a)
+deliver(stun_race * race, const struct sockaddr_storage * mapped)
 {
-  // gm_printf("Software: ");
-  // fwrite((char *)&a->value, 1, ntohs(a->length), stderr);
-  // gm_printf("\n");
+  GM_TRACE_INSTANT("stun answer", race->ipv6);
+  gm_reachability_report(race->ipv6, GM_REACHABILITY_STUN, mapped);
+
+  if ( race->after )
+    (race->after)(true, race->ipv6, (struct sockaddr *)mapped);
 }
 
 static void
-decode_alternate_server(struct stun_attribute * a)
+drop_flow(void)
 {
-  // gm_printf("Alternate Server: ");
-  // fwrite((char *)&a->value, 1, ntohs(a->length), stderr);
-  // gm_printf("\n");
+  if ( mapped_flow.fd < 0 )
+    return;
+  gm_keepalive_remove(&mapped_flow);
+  gm_fd_unregister(mapped_flow.fd);
+  close(mapped_flow.fd);
+  mapped_flow.fd = -1;
 }
 
+// Nothing is expected on the kept socket but late answers to the race.
 static void
-decode_fingerprint(struct stun_attribute * a)
+flow_event(int fd, void * data, bool readable, bool writable, bool exception, bool timeout)
 {
+  uint32_t buffer[144];
+
+  if ( exception ) {
+    drop_flow();
+    return;
+  }
+  while ( recv(fd, buffer, sizeof(buffer), MSG_DONTWAIT) > 0 )
+    ;
 }
 
-struct addrinfo *
-get_address(const char * host, uint16_t port, bool ipv6)
+// Keep the socket of an IPv4 race that was answered, and keep its binding
+// alive with binding indications to the server that answered.
+static void
+keep_flow(stun_race * race)
 {
-  struct addrinfo *		send_address = 0;
-  struct addrinfo		hints = {};
-  char				port_string[6];
+  socklen_t size;
+
+  drop_flow();
+  pthread_mutex_lock(&lock);
+  server_address(false, race->order[race->winner], &mapped_flow.peer, &size);
+  pthread_mutex_unlock(&lock);
+  mapped_flow.fd = race->sock;
+  mapped_flow.stun = true;
+  gm_fd_register(mapped_flow.fd, flow_event, NULL, true, false, true, 0);
+  gm_keepalive_add(&mapped_flow);
+}
 
-  // Only return the address family that is requested in hints->ai_family.
-  hints.ai_flags = AI_ADDRCONFIG;
+static void
+race_end(stun_race * race, bool notify)
+{
+  stun_health * const h = health(race->ipv6);
 
-  hints.ai_socktype = SOCK_DGRAM;
-  hints.ai_protocol = IPPROTO_UDP;
-  if ( ipv6 )
-    hints.ai_family = AF_INET6;
+  gm_fd_unregister(race->sock);
+  // A race that ends without notification is being stopped or replaced.
+  if ( notify && race->answered && !race->ipv6 )
+    keep_flow(race);
   else
-    hints.ai_family = AF_INET;
-
-  snprintf(port_string, sizeof(port_string), "%d", port);
-  int gai_result =  getaddrinfo(host, port_string, &hints, &send_address);
-
-  if ( gai_result != 0 )
-    return 0;
+    close(race->sock);
+  races[race->ipv6] = NULL;
+
+  // Servers that didn't answer in time lose standing.
+  pthread_mutex_lock(&lock);
+  for ( size_t i = 0; i < race->number_of_servers; i++ ) {
+    if ( race->requests[i].sent && !race->requests[i].answered ) {
+      stun_health * const s = &h[race->order[i]];
+
+      if ( s->failures < UINT8_MAX )
+        s->failures++;
+      dirty = true;
+    }
+  }
+  pthread_mutex_unlock(&lock);
+  gm_run(save, NULL, GM_SLOW);
 
-  return send_address;
+  if ( notify && !race->answered && race->after )
+    (race->after)(false, race->ipv6, NULL);
+  gm_free(race);
 }
 
-static int
-send_stun_request(bool ipv6)
+// Get the address of a server, with the lock held.
+static void
+server_address(bool ipv6, unsigned int index, struct sockaddr_storage * to, socklen_t * to_size)
 {
-  uint32_t send_buffer[128] = {};
-  struct stun_message *	const	send_packet = (struct stun_message *)send_buffer; 
-  struct addrinfo *		send_address;
-  ssize_t			send_result;
-  unsigned			int message_class = STUN_REQUEST;
-  unsigned			int method = STUN_BINDING;
-  const struct stun_server *	servers;
-  size_t			count;
-  const struct stun_server *	server;
+  size_t count;
+  const struct stun_server * const s = servers(ipv6, &count);
 
+  memset(to, 0, sizeof(*to));
   if ( ipv6 ) {
-    servers = ipv6_servers;
-    count = ipv6_table_count;
+    struct sockaddr_in6 * const in6 = (struct sockaddr_in6 *)to;
+    in6->sin6_family = AF_INET6;
+    in6->sin6_port = htons(s[index].port);
+    memcpy(&in6->sin6_addr, health(true)[index].address, 16);
+    *to_size = sizeof(*in6);
   }
   else {
-    servers = ipv4_servers;
-    count = ipv4_table_count;
+    struct sockaddr_in * const in = (struct sockaddr_in *)to;
+    in->sin_family = AF_INET;
+    in->sin_port = htons(s[index].port);
+    memcpy(&in->sin_addr, health(false)[index].address, 4);
+    *to_size = sizeof(*in);
   }
+}
 
-  server = &servers[gm_choose_one(count)];
+// Make a binding request, or a binding indication, which has no response and
+// is the smallest valid STUN message, for keepalives. The buffer must hold
+// GM_STUN_MESSAGE_SIZE bytes.
+size_t
+gm_stun_message(void * buffer, bool indication, uint32_t transaction_id[3])
+{
+  struct stun_message * const	m = buffer;
+  const unsigned int		message_class = indication ? STUN_INDICATION : STUN_REQUEST;
+  const unsigned int		method = STUN_BINDING;
+
+  m->magic_cookie = stun_magic;
+  m->type = htons(((message_class & 0x1) << 4) | ((message_class & 0x2) << 7) | (method & 0xf));
+  m->length = 0;
+  esp_fill_random(m->transaction_id, sizeof(m->transaction_id));
+  if ( transaction_id )
+    memcpy(transaction_id, m->transaction_id, sizeof(m->transaction_id));
+  return GM_STUN_MESSAGE_SIZE;
+}
 
-  if ( (send_address = get_address(server->host, server->port, ipv6)) == 0 )
-    return -1;
+// Get the address of the best-scored server of a family.
+bool
+gm_stun_server(bool ipv6, struct sockaddr_storage * address)
+{
+  size_t	count;
+  int		best = -1;
+  socklen_t	size;
+
+  servers(ipv6, &count);
+  pthread_mutex_lock(&lock);
+  load();
+  for ( size_t i = 0; i < count; i++ ) {
+    const stun_health * const h = &health(ipv6)[i];
+
+    if ( h->resolved && (best < 0 || score(h) < score(&health(ipv6)[best])) )
+      best = i;
+  }
+  if ( best >= 0 )
+    server_address(ipv6, best, address, &size);
+  pthread_mutex_unlock(&lock);
+  return best >= 0;
+}
+
+static bool
+send_request(stun_race * race, size_t n)
+{
+  uint32_t			send_buffer[GM_STUN_MESSAGE_SIZE / sizeof(uint32_t)];
+  struct sockaddr_storage	to;
+  socklen_t			to_size;
 
-  if ( stun_sock >= 0 )
-    close(stun_sock);
+  pthread_mutex_lock(&lock);
+  server_address(race->ipv6, race->order[n], &to, &to_size);
+  pthread_mutex_unlock(&lock);
+
+  gm_stun_message(send_buffer, false, race->requests[n].transaction_id);
+  race->requests[n].sent = gm_clock_us();
+  GM_TRACE_INSTANT("stun request", race->ipv6);
+
+  // A server that's unreachable, as with a stale address, just doesn't win.
+  return sendto(race->sock, send_buffer, GM_STUN_MESSAGE_SIZE, 0, (struct sockaddr *)&to, to_size) == GM_STUN_MESSAGE_SIZE;
+}
+
+static int
+compare_scores(const void * a, const void * b, bool ipv6)
+{
+  const uint32_t sa = score(&health(ipv6)[*(const uint8_t *)a]);
+  const uint32_t sb = score(&health(ipv6)[*(const uint8_t *)b]);
+
+  return sa < sb ? -1 : sa > sb;
+}
+
+static int compare_ipv4(const void * a, const void * b) { return compare_scores(a, b, false); }
+static int compare_ipv6(const void * a, const void * b) { return compare_scores(a, b, true); }
+
+// Start a race, in the select task.
+static void
+race_start(void * data)
+{
+  stun_race * const	race = data;
+  size_t		count;
 
-  stun_sock = socket(send_address->ai_family, SOCK_DGRAM, send_address->ai_protocol);
-  if ( stun_sock < 0 ) {
+  if ( races[race->ipv6] )
+    race_end(races[race->ipv6], false);
+
+  servers(race->ipv6, &count);
+  pthread_mutex_lock(&lock);
+  for ( size_t i = 0; i < count; i++ ) {
+    if ( health(race->ipv6)[i].resolved )
+      race->order[race->number_of_servers++] = i;
+  }
+  qsort(race->order, race->number_of_servers, sizeof(*race->order), race->ipv6 ? compare_ipv6 : compare_ipv4);
+  pthread_mutex_unlock(&lock);
+
+  if ( race->number_of_servers == 0 ) {
+    // This is normal while DNS isn't working yet.
+    gm_printf("STUN: no %s server addresses could be resolved.\n", race->ipv6 ? "IPv6" : "IPv4");
+    if ( race->after )
+      (race->after)(false, race->ipv6, NULL);
+    gm_free(race);
+    return;
+  }
+
+  race->sock = socket(race->ipv6 ? AF_INET6 : AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  if ( race->sock < 0 ) {
     GM_FAIL_WITH_OS_ERROR("Can't get socket");
-    return -1;
+    if ( race->after )
+      (race->after)(false, race->ipv6, NULL);
+    gm_free(race);
+    return;
   }
 
-  // Bind the request address to a local address. This probably only matters
-  // for IPV6, as the only IPV4 address is usually behind NAT.
-  if ( ipv6 ) {
-    struct in6_addr * address = &GM.net_interfaces[GM_STA].ip6.link_local;
-    if ( gm_all_zeroes(address, sizeof(struct sockaddr_in6)) )
-      address = &GM.net_interfaces[GM_STA].ip6.site_local;
-    if ( gm_all_zeroes(address, sizeof(struct sockaddr_in6)) )
-      address = &GM.net_interfaces[GM_STA].ip6.site_unique;
-    else
-      address = &GM.net_interfaces[GM_STA].ip6.global[0];
+  // Send from the station interface. The IPv6 source is the first global
+  // address, which is what the server sees if there is no NAT66.
+  if ( race->ipv6 ) {
+    struct sockaddr_in6 local = { .sin6_family = AF_INET6 };
 
-    (void) bind(stun_sock, (struct sockaddr *)address, sizeof(struct sockaddr_in6));
+    local.sin6_addr = GM.net_interfaces[GM_STA].ip6.global[0];
+    (void) bind(race->sock, (struct sockaddr *)&local, sizeof(local));
   }
-  else
-	  (void) bind(stun_sock, (struct sockaddr *)&GM.net_interfaces[GM_STA].ip4.address, sizeof(GM.net_interfaces[GM_STA].ip4.address));
-
-  send_packet->magic_cookie = stun_magic;
-  send_packet->type = htons(((message_class & 0x1) << 4) | ((message_class & 0x2) << 8) | (method & 0xf));
-  esp_fill_random(send_packet->transaction_id, sizeof(send_packet->transaction_id));
-
-  send_result = sendto(
-   stun_sock,
-   send_packet,
-   send_packet->length + 20,
-   0,
-   send_address->ai_addr,
-   send_address->ai_addrlen);
-
-  freeaddrinfo(send_address);
-
-  if ( send_result < (send_packet->length + 20) ) {
-    GM_FAIL_WITH_OS_ERROR("Send error: %d", send_result);
-    close(stun_sock);
-    stun_sock = -1;
-    return -1;
+  else {
+    struct sockaddr_in local = { .sin_family = AF_INET };
+
+    local.sin_addr = GM.net_interfaces[GM_STA].ip4.address;
+    (void) bind(race->sock, (struct sockaddr *)&local, sizeof(local));
   }
-  return stun_sock;
+
+  races[race->ipv6] = race;
+  race->start = gm_clock_us();
+  send_request(race, race->next++);
+  gm_fd_register_ms(race->sock, race_event, race, true, false, true, STAGGER_MS);
 }
 
-static int
-process_received_packet(struct stun_message * receive_packet, struct sockaddr * address, ssize_t receive_result)
+// Resolve the servers, then start the race. For the first race ever, or
+// after the server tables change.
+static void
+resolve_and_start(void * data)
+{
+  resolve(((stun_race *)data)->ipv6);
+  gm_run(race_start, data, GM_FAST);
+}
+
+static void
+decode_mapped_address(struct stun_attribute * a, struct sockaddr_storage * address)
+{
+  memset(address, '\0', sizeof(*address));
+  if ( a->value.mapped_address.family == 1 ) {
+    struct sockaddr_in * in = (struct sockaddr_in *)address;
+    in->sin_family = AF_INET;
+    in->sin_port = a->value.mapped_address.port;
+    in->sin_addr.s_addr = a->value.mapped_address.ipv4;
+  }
+  else {
+    struct sockaddr_in6 * in6 = (struct sockaddr_in6 *)address;
+    in6->sin6_family = AF_INET6;
+    in6->sin6_port = a->value.mapped_address.port;
+    memcpy(&in6->sin6_addr.s6_addr, a->value.mapped_address.ipv6.s6_addr, sizeof(in6->sin6_addr.s6_addr));
+  }
+}
+
+static void
+decode_xor_mapped_address(struct stun_attribute * a, struct stun_message * message, struct sockaddr_storage * address)
+{
+  // The port is XOR-ed with the most significant 16 bits of the magic cookie,
+  // which are the first two bytes of it in memory.
+  const uint16_t port = a->value.mapped_address.port ^ (uint16_t)(stun_magic & 0xffff);
+
+  memset(address, '\0', sizeof(*address));
+  if ( a->value.mapped_address.family == 1 ) {
+    struct sockaddr_in * in = (struct sockaddr_in *)address;
+    in->sin_family = AF_INET;
+    in->sin_port = port;
+    in->sin_addr.s_addr = a->value.mapped_address.ipv4 ^ stun_magic;
+  }
+  else {
+    // An IPv6 address is XOR-ed with the magic cookie and the transaction ID.
+    struct sockaddr_in6 * in6 = (struct sockaddr_in6 *)address;
+    const uint8_t * const in = a->value.mapped_address.ipv6.s6_addr;
+    const uint8_t * const key = (const uint8_t *)&message->magic_cookie;
+
+    in6->sin6_family = AF_INET6;
+    in6->sin6_port = port;
+    for ( int i = 0; i < 16; i++ )
+      in6->sin6_addr.s6_addr[i] = in[i] ^ key[i];
+  }
+}
+
+// Check a binding response, and get the mapped address from it. The caller
+// checks the transaction ID, which is at GM_STUN_TRANSACTION_ID_OFFSET.
+bool
+gm_stun_mapped_address(const void * packet, size_t receive_result, bool ipv6, struct sockaddr_storage * address)
 {
+  struct stun_message * const	receive_packet = (struct stun_message *)packet;
   bool				got_xor_mapped_address = false;
   bool				got_an_address = false;
-  struct stun_attribute * attribute = (struct stun_attribute *)receive_packet->attributes;
-  uint16_t attribute_size = ntohs(receive_packet->length);
-  if ( attribute_size < (receive_result - 20) ) {
-    GM_FAIL("packet was truncated.");
-    return -1;
-  }
-  
-  while ( attribute_size > 0 ) {
-    uint16_t type = ntohs(attribute->type);
-    uint16_t length = ntohs(attribute->length);
-    if ( length == 0 || length >= 768 ) {
-      GM_FAIL("attribute length %d is invalid.", length);
-    }
+  struct stun_attribute *	attribute = (struct stun_attribute *)receive_packet->attributes;
+  uint16_t			attribute_size = ntohs(receive_packet->length);
+  const unsigned int		message_class = STUN_RESPONSE;
+  const unsigned int		method = STUN_BINDING;
+
+  if ( receive_result < 20 || attribute_size + 20 > receive_result
+   || receive_packet->magic_cookie != stun_magic
+   || receive_packet->type != htons(((message_class & 0x1) << 4) | ((message_class & 0x2) << 7) | (method & 0xf)) )
+    return false;
+
+  while ( attribute_size >= 4 ) {
+    const uint16_t type = ntohs(attribute->type);
+    const uint16_t length = ntohs(attribute->length);
+    // Attributes are padded to 32-bit boundaries.
+    const unsigned int increment = 4 + ((length + 3) & ~3);
+
+    if ( increment > attribute_size )
+      return false;
+
     switch ( type ) {
     case MAPPED_ADDRESS:
-      if ( !got_xor_mapped_address ) {
+      if ( !got_xor_mapped_address && length >= 8 ) {
         got_an_address = true;
         decode_mapped_address(attribute, address);
-        // char buffer[INET6_ADDRSTRLEN + 1];
-        // gm_ntop(address, buffer, sizeof(buffer));
       }
       break;
-    case ERROR_CODE:
-      decode_error_code(attribute);
-      return -1;
-      break;
-    case UNKNOWN_ATTRIBUTES:
-      decode_unknown_attributes(attribute);
-      break;
     case XOR_MAPPED_ADDRESS:
-      got_an_address = true;
-      got_xor_mapped_address = true;
-      decode_xor_mapped_address(attribute, receive_packet, address);
-      break;
-    case SOFTWARE:
-      decode_software(attribute);
-      break;
-    case ALTERNATE_SERVER:
-      decode_alternate_server(attribute);
-      break;
-    case FINGERPRINT:
-      decode_fingerprint(attribute);
+      if ( length >= 8 ) {
+        got_an_address = true;
+        got_xor_mapped_address = true;
+        decode_xor_mapped_address(attribute, receive_packet, address);
+      }
       break;
     default:
       break;
     }
-    uint16_t odd = length & 3;
-    unsigned int increment = length + 4;
-
-    // Pad strings to 32-bit boundaries.
-    if ( odd )
-      increment += (4 - odd);
-
-    if ( increment > attribute_size ) {
-      GM_FAIL("Attribute size mismatch.");
-      return -1;
-    }
     attribute = (struct stun_attribute *)((uint8_t *)attribute + increment);
     attribute_size -= increment;
   }
-  if ( got_an_address )
-    return 0;
-  else {
-    GM_FAIL("message didn't include an address.");
-    return -1;
-  }
+
+  // The address family must be the one asked about, and an IPv6 address needs
+  // the whole attribute.
+  return got_an_address && address->ss_family == (ipv6 ? AF_INET6 : AF_INET);
 }
 
-// FIX: Make this receive multiple times until it has the entire buffer.
-int receive_stun_response(int sock, struct sockaddr * address)
+// Get the index in the race of the request a response answers, or -1.
+static int
+which_request(stun_race * race, const struct stun_message * packet)
 {
-  uint32_t receive_buffer[256] = {};
-  struct stun_message *	const	receive_packet = (struct stun_message *)receive_buffer; 
-  ssize_t			receive_result;
-  struct timeval		timeout = { 3, 0 };
-  int result;
-
-  setsockopt (sock, SOL_SOCKET, SO_RCVTIMEO, (char *) &timeout,
-	    sizeof (timeout));
-
-  receive_result = recvfrom(
-   sock,
-   receive_packet,
-   sizeof(receive_buffer),
-   0,
-   0,
-   0);
-
-  if ( receive_result < 22 ) {
-    GM_FAIL("STUN response too small.");
-    gm_fd_unregister(sock);
-    close(sock);
-    stun_sock = -1;
-    return -1;
+  for ( size_t n = 0; n < race->number_of_servers; n++ ) {
+    if ( race->requests[n].sent
+     && memcmp(race->requests[n].transaction_id, packet->transaction_id, sizeof(packet->transaction_id)) == 0 )
+      return n;
   }
+  return -1;
+}
 
-  result = process_received_packet(receive_packet, address, receive_result);
-  gm_fd_unregister(sock);
-  close(sock);
-  stun_sock = -1;
-  return result;
+static void
+receive_response(stun_race * race)
+{
+  uint32_t			receive_buffer[144];
+  struct stun_message * const	receive_packet = (struct stun_message *)receive_buffer;
+  struct sockaddr_storage	mapped;
+  ssize_t			size;
+
+  while ( (size = recvfrom(race->sock, receive_buffer, sizeof(receive_buffer), MSG_DONTWAIT, NULL, NULL)) > 0 ) {
+    if ( !gm_stun_mapped_address(receive_packet, size, race->ipv6, &mapped) )
+      continue;
+
+    const int n = which_request(race, receive_packet);
+    if ( n < 0 || race->requests[n].answered )
+      continue;
+
+    const int64_t now = gm_clock_us();
+    uint32_t rtt_ms = (now - race->requests[n].sent) / 1000;
+    if ( rtt_ms == 0 )
+      rtt_ms = 1;
+    else if ( rtt_ms > UINT16_MAX )
+      rtt_ms = UINT16_MAX;
+    race->requests[n].answered = true;
+
+    pthread_mutex_lock(&lock);
+    stun_health * const h = &health(race->ipv6)[race->order[n]];
+    h->rtt_ms = h->rtt_ms ? (h->rtt_ms * 7 + rtt_ms) / 8 : rtt_ms;
+    h->failures = 0;
+    dirty = true;
+    pthread_mutex_unlock(&lock);
+
+    if ( !race->answered ) {
+      stun_cache * const c = &cache[race->ipv6];
+
+      race->answered = now;
+      race->winner = n;
+      c->time = now;
+      c->mapped = mapped;
+      local_and_router(race->ipv6, &c->local, &c->router);
+      deliver(race, &mapped);
+    }
+  }
 }
 
 static void
-stun_send(void * data)
+race_event(int fd, void * data, bool readable, bool writable, bool exception, bool timeout)
 {
-  struct stun_run * run = (struct stun_run *)data;
-  int	sock;
+  stun_race * const	race = data;
+  const int64_t		now = gm_clock_us();
+  bool			all_answered = true;
 
-  // FIX: Handle address unreachable.
-  if ( (sock = send_stun_request(run->ipv6)) < 0 )
-    return;
+  if ( readable )
+    receive_response(race);
+
+  for ( size_t i = 0; i < race->next; i++ )
+    all_answered = all_answered && race->requests[i].answered;
 
-  gm_fd_register(sock, stun_receive, run, true, false, true, 5);
+  if ( race->answered ) {
+    if ( all_answered || now - race->answered >= GRACE_MS * 1000LL )
+      race_end(race, true);
+    return;
+  }
+  if ( exception || now - race->start >= RACE_MS * 1000LL ) {
+    race_end(race, true);
+    return;
+  }
+  // Nobody has answered yet, so bring in the next server.
+  if ( timeout && race->next < race->number_of_servers )
+    send_request(race, race->next++);
 }
 
+// Answer from the cache, or start a race, in the select task, which owns the
+// cache and the races.
 static void
-stun_receive(int fd, void * data, bool readable, bool writable, bool exception, bool timeout)
+begin(void * data)
 {
-  struct stun_run * run = (struct stun_run *)data;
-
-  if ( readable ) {
-    int status = receive_stun_response(fd, run->address);
-
-    if ( status == 0 ) {
-      gm_fd_unregister(fd);
-      close(fd);
-      stun_sock = -1;
-      if ( run->after )
-        (run->after)(true, run->ipv6, run->address);
-      free(run);
-      return;
-    }
-  }
-  if ( timeout || exception ) {
-    gm_fd_unregister(fd);
-    close(fd);
-    stun_sock = -1;
-  }
-  if ( run->tries >= 5 ) {
-    if ( run->after )
-      (run->after)(false, run->ipv6, run->address);
-    free(run);
+  stun_race * const	race = data;
+  stun_cache * const	c = &cache[race->ipv6];
+  struct in6_addr	local;
+  struct in6_addr	router;
+  bool			any_resolved = false;
+  size_t		count;
+
+  local_and_router(race->ipv6, &local, &router);
+  if ( c->time != 0
+   && gm_clock_us() - c->time < CACHE_SECONDS * 1000000LL
+   && memcmp(&local, &c->local, sizeof(local)) == 0
+   && memcmp(&router, &c->router, sizeof(router)) == 0 ) {
+    deliver(race, &c->mapped);
+    gm_free(race);
     return;
   }
 
-  run->tries++;
-
-  gm_run(stun_send, run, GM_FAST);
+  servers(race->ipv6, &count);
+  pthread_mutex_lock(&lock);
+  load();
+  for ( size_t i = 0; i < count; i++ )
+    any_resolved = any_resolved || health(race->ipv6)[i].resolved;
+  pthread_mutex_unlock(&lock);
+
+  if ( any_resolved ) {
+    // Race with the saved addresses, and refresh them for next time.
+    if ( !refreshed[race->ipv6] )
+      gm_run(refresh, (void *)(intptr_t)race->ipv6, GM_SLOW);
+    race_start(race);
+  }
+  else
+    gm_run(resolve_and_start, race, GM_SLOW);
 }
 
-int gm_stun(bool ipv6, struct sockaddr * address, gm_stun_after_t after)
+// Find the public address of the station interface for a family, and report
+// it to the reachability service. *after* is called with the result, in the
+// select task.
+int
+gm_stun(bool ipv6, gm_stun_after_t after)
 {
-  char buffer[INET6_ADDRSTRLEN + 1];
-
-  memset(buffer, 0, sizeof(buffer));
-  struct stun_run * run = malloc(sizeof(struct stun_run));
-
-  if ( run == 0 ) {
+  stun_race * const race = gm_calloc(GM_MEMORY_STUN, 1, sizeof(*race));
+  if ( race == NULL ) {
     GM_FAIL_WITH_OS_ERROR("malloc failed");
     return -1;
   }
-    
-  run->ipv6 = ipv6;
-  run->address = address;
-  run->tries = 0;
-  run->after = after;
-
-  gm_run(stun_send, run, GM_FAST);
+  race->ipv6 = ipv6;
+  race->after = after;
+  race->sock = -1;
 
+  gm_run(begin, race, GM_FAST);
   return 0;
 }
 
+static void
+stop(void * data)
+{
+  for ( int i = 0; i < 2; i++ ) {
+    if ( races[i] )
+      race_end(races[i], false);
+  }
+  drop_flow();
+}
+
 void
 gm_stun_stop()
 {
-  if ( stun_sock >= 0 ) {
-    gm_fd_unregister(stun_sock);
-    close(stun_sock);
-    stun_sock = -1;
-  }
+  // The races belong to the select task.
+  gm_run(stop, NULL, GM_FAST);
 }
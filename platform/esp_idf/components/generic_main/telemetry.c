@@ -0,0 +1,408 @@
+// Live telemetry
+//
+// Push radio state and log lines to web browsers as Server-Sent Events, so
+// that the web UI doesn't have to poll entire pages through the TLS server
+// to watch the radio.
+//
+// There is one producer side, the gm_telemetry_*() functions, which may be
+// called from any task, and a small fixed number of clients. Each client has
+// its own bounded queue:
+//
+// Samples (RSSI, transmit) are merged. A client only ever has the
+// latest value of each sample pending, so a client that lags skips stale
+// samples rather than falling further behind.
+//
+// Events (scanner hits, log lines) are queued. When the queue of a slow client
+// is full, the oldest event is dropped and counted, and the client is told
+// how many it missed.
+//
+// Everything pending for a client is sent as a single HTTP chunk, so that
+// a burst of changes costs one TLS record rather than one per change. Sending
+// is done in the HTTPS server task with httpd_queue_work(), and only one
+// flush is queued at a time, so the producers never block on the network.
+//
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <esp_http_server.h>
+#include "generic_main.h"
+
+#define NUMBER_OF_CLIENTS	4
+#define NUMBER_OF_EVENTS	8
+#define LOG_LINE_SIZE		96
+// Leave room for the fixed-width chunk-size line at the start of a frame.
+#define CHUNK_HEADER_SIZE	6
+
+typedef enum _event_type {
+  SCAN,
+  LOG
+} event_type_t;
+
+typedef struct _event {
+  event_type_t	type;
+  union {
+    struct {
+      float	frequency;
+      float	rssi;
+    } scan;
+    char	line[LOG_LINE_SIZE];
+  } data;
+} event_t;
+
+typedef struct _client {
+  bool		active;
+  int		fd;
+  uint8_t	samples_pending;	// One bit per gm_telemetry_sample_t.
+  uint8_t	first_event;
+  uint8_t	number_of_events;
+  uint32_t	dropped;
+  float		samples[GM_TELEMETRY_NUMBER_OF_SAMPLES];
+  event_t	events[NUMBER_OF_EVENTS];
+} client_t;
+
+static const char * const sample_names[GM_TELEMETRY_NUMBER_OF_SAMPLES] = {
+  "rssi",
+  "transmit"
+};
+
+static pthread_mutex_t	lock = PTHREAD_MUTEX_INITIALIZER;
+static client_t		clients[NUMBER_OF_CLIENTS];
+// Read without the lock by the producers, so that they do nothing at all
+// when nobody is watching.
+static volatile int	number_of_clients = 0;
+static httpd_handle_t	server = NULL;
+static bool		flush_queued = false;
+// The last value of each sample, sent to a client when it connects.
+static float		latest[GM_TELEMETRY_NUMBER_OF_SAMPLES];
+static uint8_t		latest_valid = 0;
+static bool		sink_added = false;
+
+// Only used in the HTTPS server task, one flush at a time.
+static client_t		snapshot;
+static char		frame[1536];
+
+static void flush(void * arg);
+static void log_sink(int64_t time, const char * text, size_t size, void * data);
+
+// Call with the lock held.
+static void
+schedule_flush(void)
+{
+  if ( flush_queued || server == NULL )
+    return;
+
+  if ( httpd_queue_work(server, flush, NULL) == ESP_OK )
+    flush_queued = true;
+}
+
+// Call with the lock held.
+static void
+remove_client(client_t * c)
+{
+  if ( c->active ) {
+    c->active = false;
+    number_of_clients--;
+  }
+}
+
+static event_t *
+add_event(client_t * c)
+{
+  event_t * e;
+
+  if ( c->number_of_events == NUMBER_OF_EVENTS ) {
+    c->first_event = (c->first_event + 1) % NUMBER_OF_EVENTS;
+    c->number_of_events--;
+    c->dropped++;
+  }
+  e = &c->events[(c->first_event + c->number_of_events) % NUMBER_OF_EVENTS];
+  c->number_of_events++;
+  return e;
+}
+
+// Append to the frame, returning the new length, which is unchanged if the
+// text doesn't fit.
+static size_t
+append(size_t length, const char * pattern, ...)
+{
+  va_list	args;
+  int		size;
+
+  if ( length >= sizeof(frame) - 2 )
+    return length;
+
+  va_start(args, pattern);
+  // Keep 2 bytes for the chunk trailer.
+  size = vsnprintf(&frame[length], sizeof(frame) - 2 - length, pattern, args);
+  va_end(args);
+
+  if ( size < 0 || (size_t)size >= sizeof(frame) - 2 - length )
+    return length;
+
+  return length + size;
+}
+
+// Format what is pending for a client. The samples that don't fit are
+// returned in *unsent_samples*, to be sent with the next frame, and the number
+// of events that don't fit, and of drops that couldn't be reported, in
+// *unsent_events*, to be reported as dropped.
+static size_t
+format_frame(const client_t * c, uint32_t * unsent_samples, uint32_t * unsent_events)
+{
+  size_t	length = CHUNK_HEADER_SIZE;
+  size_t	before;
+
+  *unsent_samples = 0;
+  *unsent_events = 0;
+
+  for ( int i = 0; i < GM_TELEMETRY_NUMBER_OF_SAMPLES; i++ ) {
+    if ( c->samples_pending & (1 << i) ) {
+      before = length;
+      length = append(length, "event: %s\ndata: %g\n\n", sample_names[i], (double)c->samples[i]);
+      if ( length == before )
+        *unsent_samples |= 1 << i;
+    }
+  }
+
+  if ( c->dropped ) {
+    before = length;
+    length = append(length, "event: dropped\ndata: %lu\n\n", (unsigned long)c->dropped);
+    if ( length == before )
+      *unsent_events += c->dropped;
+  }
+
+  for ( int i = 0; i < c->number_of_events; i++ ) {
+    const event_t * e = &c->events[(c->first_event + i) % NUMBER_OF_EVENTS];
+
+    before = length;
+    switch ( e->type ) {
+    case SCAN:
+      length = append(length, "event: scan\ndata: {\"frequency\":%.5f,\"rssi\":%g}\n\n", (double)e->data.scan.frequency, (double)e->data.scan.rssi);
+      break;
+    case LOG:
+      length = append(length, "event: log\ndata: %s\n\n", e->data.line);
+      break;
+    }
+    if ( length == before )
+      (*unsent_events)++;
+  }
+
+  if ( length == CHUNK_HEADER_SIZE )
+    return 0;
+
+  // The response was started with httpd_resp_send_chunk(), so it's using
+  // chunked transfer encoding, and everything written directly to the socket
+  // must be framed as a chunk. Leading zeroes in the chunk size are legal,
+  // which lets the header be written in front of data already formatted.
+  char header[CHUNK_HEADER_SIZE + 1];
+  snprintf(header, sizeof(header), "%04x\r\n", (unsigned int)(length - CHUNK_HEADER_SIZE));
+  memcpy(frame, header, CHUNK_HEADER_SIZE);
+  frame[length++] = '\r';
+  frame[length++] = '\n';
+  return length;
+}
+
+// Runs in the HTTPS server task.
+static void
+flush(void * arg)
+{
+  for ( int i = 0; i < NUMBER_OF_CLIENTS; i++ ) {
+    client_t *	c = &clients[i];
+    size_t	length;
+    int		fd;
+    uint32_t	unsent_samples;
+    uint32_t	unsent_events;
+
+    // Take what is pending and release the lock before formatting and
+    // sending, so that the producers are never held up by the network.
+    pthread_mutex_lock(&lock);
+    if ( i == 0 )
+      flush_queued = false;
+    if ( !c->active ) {
+      pthread_mutex_unlock(&lock);
+      continue;
+    }
+    snapshot = *c;
+    fd = c->fd;
+    c->samples_pending = 0;
+    c->first_event = 0;
+    c->number_of_events = 0;
+    c->dropped = 0;
+    pthread_mutex_unlock(&lock);
+
+    length = format_frame(&snapshot, &unsent_samples, &unsent_events);
+
+    // Samples that didn't fit go with the next frame, unless there is a newer
+    // value by then. Events that didn't fit are reported as dropped.
+    if ( unsent_samples || unsent_events ) {
+      pthread_mutex_lock(&lock);
+      if ( c->active && c->fd == fd ) {
+        for ( int s = 0; s < GM_TELEMETRY_NUMBER_OF_SAMPLES; s++ ) {
+          if ( (unsent_samples & (1 << s)) && !(c->samples_pending & (1 << s)) ) {
+            c->samples[s] = snapshot.samples[s];
+            c->samples_pending |= 1 << s;
+          }
+        }
+        c->dropped += unsent_events;
+        schedule_flush();
+      }
+      pthread_mutex_unlock(&lock);
+    }
+
+    if ( length == 0 )
+      continue;
+
+    if ( httpd_socket_send(server, fd, frame, length, 0) != (int)length ) {
+      pthread_mutex_lock(&lock);
+      if ( c->active && c->fd == fd )
+        remove_client(c);
+      pthread_mutex_unlock(&lock);
+      httpd_sess_trigger_close(server, fd);
+    }
+  }
+}
+
+// Called from the "events" GET handler. This starts the event stream, and then
+// returns while leaving the connection open. All further data on the
+// connection is sent by flush().
+int
+gm_telemetry_add_client(httpd_req_t * req)
+{
+  client_t *	c = NULL;
+  bool		add_sink;
+
+  pthread_mutex_lock(&lock);
+  for ( int i = 0; i < NUMBER_OF_CLIENTS; i++ ) {
+    if ( !clients[i].active ) {
+      c = &clients[i];
+      break;
+    }
+  }
+  if ( c == NULL ) {
+    pthread_mutex_unlock(&lock);
+    httpd_resp_set_status(req, "503 Service Unavailable");
+    httpd_resp_set_hdr(req, "Retry-After", "10");
+    httpd_resp_send(req, "Too many telemetry clients.\n", HTTPD_RESP_USE_STRLEN);
+    return 0;
+  }
+  memset(c, 0, sizeof(*c));
+  c->fd = httpd_req_to_sockfd(req);
+  // Start the new client with the current state, rather than a blank display.
+  memcpy(c->samples, latest, sizeof(c->samples));
+  c->samples_pending = latest_valid;
+  c->active = true;
+  number_of_clients++;
+  server = req->handle;
+  add_sink = !sink_added;
+  sink_added = true;
+  pthread_mutex_unlock(&lock);
+
+  // The sink stays, and does nothing while there are no clients.
+  if ( add_sink && !gm_log_sink_add(log_sink, NULL) ) {
+    // The clients get no log text, and the next one tries again.
+    pthread_mutex_lock(&lock);
+    sink_added = false;
+    pthread_mutex_unlock(&lock);
+  }
+
+  httpd_resp_set_type(req, "text/event-stream");
+  httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
+  // Tell the browser how soon to reconnect if the stream is lost.
+  httpd_resp_send_chunk(req, "retry: 2000\n\n", HTTPD_RESP_USE_STRLEN);
+
+  pthread_mutex_lock(&lock);
+  schedule_flush();
+  pthread_mutex_unlock(&lock);
+  return 0;
+}
+
+// Called by the web server when it closes a socket, which may be that of a
+// telemetry client.
+void
+gm_telemetry_socket_closed(int fd)
+{
+  pthread_mutex_lock(&lock);
+  for ( int i = 0; i < NUMBER_OF_CLIENTS; i++ ) {
+    if ( clients[i].active && clients[i].fd == fd )
+      remove_client(&clients[i]);
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+// A log sink, which copies each log message to the browsers.
+static void
+log_sink(int64_t time, const char * text, size_t size, void * data)
+{
+  char	line[LOG_LINE_SIZE];
+  char * s;
+
+  if ( number_of_clients == 0 )
+    return;
+
+  if ( size > sizeof(line) - 1 )
+    size = sizeof(line) - 1;
+  memcpy(line, text, size);
+  line[size] = '\0';
+
+  // An SSE data line can't contain a line break.
+  for ( s = line; *s != '\0'; s++ ) {
+    if ( *s == '\n' || *s == '\r' )
+      *s = ' ';
+  }
+  while ( s > line && s[-1] == ' ' )
+    *--s = '\0';
+  if ( s == line )
+    return;
+
+  pthread_mutex_lock(&lock);
+  for ( int i = 0; i < NUMBER_OF_CLIENTS; i++ ) {
+    if ( clients[i].active ) {
+      event_t * e = add_event(&clients[i]);
+      e->type = LOG;
+      strcpy(e->data.line, line);
+    }
+  }
+  schedule_flush();
+  pthread_mutex_unlock(&lock);
+}
+
+void
+gm_telemetry_sample(gm_telemetry_sample_t which, float value)
+{
+  if ( which >= GM_TELEMETRY_NUMBER_OF_SAMPLES )
+    return;
+
+  pthread_mutex_lock(&lock);
+  latest[which] = value;
+  latest_valid |= 1 << which;
+  if ( number_of_clients > 0 ) {
+    for ( int i = 0; i < NUMBER_OF_CLIENTS; i++ ) {
+      if ( clients[i].active ) {
+        clients[i].samples[which] = value;
+        clients[i].samples_pending |= 1 << which;
+      }
+    }
+    schedule_flush();
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+void
+gm_telemetry_scan(float frequency, float rssi)
+{
+  if ( number_of_clients == 0 )
+    return;
+
+  pthread_mutex_lock(&lock);
+  for ( int i = 0; i < NUMBER_OF_CLIENTS; i++ ) {
+    if ( clients[i].active ) {
+      event_t * e = add_event(&clients[i]);
+      e->type = SCAN;
+      e->data.scan.frequency = frequency;
+      e->data.scan.rssi = rssi;
+    }
+  }
+  schedule_flush();
+  pthread_mutex_unlock(&lock);
+}
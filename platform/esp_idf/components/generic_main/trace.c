@@ -0,0 +1,165 @@
+// The ring of trace events for gm_trace.h.
+//
+// Recording an event is an atomic increment of the event counter, which
+// chooses the slot, and a few stores, so trace points can be left in the hot
+// paths. The ring overwrites its oldest events, so it always holds the most
+// recent ones. Each slot has a sequence number that is zero while the slot
+// is being written and the number of the event plus one when it's complete.
+// The dump reads it before and after copying the slot, and skips the slot if
+// it changed, so that tracing doesn't have to stop for a dump.
+//
+// The dump is text, one event per line, so that it can go through the log
+// server or HTTP:
+//
+//   # gm_trace 1
+//   T <task> <task name>
+//   <time in microseconds> <type> <core> <task> <value> <name>
+//
+// host/trace_to_json.c converts it to the Chrome trace JSON format.
+
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#define INCLUDE_xTaskGetCurrentTaskHandle 1
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <esp_timer.h>
+#include "gm_trace.h"
+#include "generic_main.h"
+
+#define LINE_SIZE	128
+
+static void
+write_line(gm_trace_writer_t writer, void * context, const char * pattern, ...)
+{
+  char		line[LINE_SIZE];
+  va_list	args;
+  int		size;
+
+  va_start(args, pattern);
+  size = vsnprintf(line, sizeof(line), pattern, args);
+  va_end(args);
+  if ( size < 0 )
+    return;
+  if ( (size_t)size >= sizeof(line) )
+    size = sizeof(line) - 1;
+  (writer)(line, size, context);
+}
+
+#if GM_TRACE
+typedef struct _event {
+  _Atomic uint32_t	sequence;
+  uint8_t		type;
+  uint8_t		core;
+  int32_t		value;
+  const char *		name;
+  TaskHandle_t		task;
+  int64_t		time;
+} event_t;
+
+static event_t		events[GM_TRACE_EVENTS];
+static _Atomic uint32_t	next_event = 0;
+// The first event after gm_trace_clear().
+static _Atomic uint32_t	first_event = 0;
+
+void
+gm_trace_record(gm_trace_type_t type, const char * name, int32_t value)
+{
+  const uint32_t	index = atomic_fetch_add_explicit(&next_event, 1, memory_order_relaxed);
+  event_t * const	e = &events[index % GM_TRACE_EVENTS];
+
+  atomic_store_explicit(&e->sequence, 0, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  e->type = type;
+  e->core = xPortGetCoreID();
+  e->value = value;
+  e->name = name;
+  e->task = xTaskGetCurrentTaskHandle();
+  e->time = esp_timer_get_time();
+  atomic_store_explicit(&e->sequence, index + 1, memory_order_release);
+}
+
+void
+gm_trace_clear(void)
+{
+  atomic_store(&first_event, atomic_load(&next_event));
+}
+
+// Name the tasks that are running now. Events of tasks that have since been
+// deleted are converted with the address of the task as its name.
+static void
+dump_tasks(gm_trace_writer_t writer, void * context)
+{
+  const UBaseType_t	size = uxTaskGetNumberOfTasks() + 4;
+  TaskStatus_t * const	tasks = gm_malloc(GM_MEMORY_TRACE, size * sizeof(*tasks));
+  UBaseType_t		n;
+
+  if ( tasks == NULL )
+    return;
+  n = uxTaskGetSystemState(tasks, size, NULL);
+  for ( UBaseType_t i = 0; i < n; i++ )
+    write_line(writer, context, "T %p %s\n", (void *)tasks[i].xHandle, tasks[i].pcTaskName);
+  gm_free(tasks);
+}
+
+void
+gm_trace_dump(gm_trace_writer_t writer, void * context)
+{
+  const uint32_t	end = atomic_load(&next_event);
+  uint32_t		start = atomic_load(&first_event);
+  uint32_t		skipped = 0;
+
+  if ( end - start > GM_TRACE_EVENTS )
+    start = end - GM_TRACE_EVENTS;
+
+  write_line(writer, context, "# gm_trace 1\n");
+  dump_tasks(writer, context);
+
+  for ( uint32_t index = start; index != end; index++ ) {
+    const event_t * const	e = &events[index % GM_TRACE_EVENTS];
+    event_t			copy;
+
+    if ( atomic_load_explicit(&e->sequence, memory_order_acquire) != index + 1 ) {
+      skipped++;
+      continue;
+    }
+    copy.type = e->type;
+    copy.core = e->core;
+    copy.value = e->value;
+    copy.name = e->name;
+    copy.task = e->task;
+    copy.time = e->time;
+    atomic_thread_fence(memory_order_acquire);
+    // Overwritten while it was copied.
+    if ( atomic_load_explicit(&e->sequence, memory_order_relaxed) != index + 1 ) {
+      skipped++;
+      continue;
+    }
+    write_line(
+     writer,
+     context,
+     "%lld %c %d %p %ld %s\n",
+     (long long)copy.time,
+     copy.type,
+     copy.core,
+     (void *)copy.task,
+     (long)copy.value,
+     copy.name);
+  }
+  if ( skipped )
+    write_line(writer, context, "# %lu events were overwritten during the dump.\n", (unsigned long)skipped);
+}
+#else
+void
+gm_trace_clear(void)
+{
+}
+
+void
+gm_trace_dump(gm_trace_writer_t writer, void * context)
+{
+  write_line(writer, context, "# gm_trace 1\n# Tracing isn't compiled in. Build with -DGM_TRACE=1.\n");
+}
+#endif
@@ -31,11 +31,14 @@ gm_uri_decode(const char * uri, char * buffer, size_t size)
         *buffer = '\0';
         return -1;
       }
-      *b++ = (first * 10 + second) & 0xff;
+      *b++ = (first * 16 + second) & 0xff;
     }
 
-    if ( b > &buffer[size] )
+    // Leave room for the terminating null.
+    if ( b >= &buffer[size] ) {
+      *buffer = '\0';
       return -1;
+    }
   }
   *b = '\0';
   return 0;
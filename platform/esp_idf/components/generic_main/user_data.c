@@ -1,41 +1,465 @@
+// User directory
+//
+// The user records are loaded from the "user" NVS namespace once at boot into
+// a hash table in RAM, and all reads come from RAM. So privilege checks, like
+// the one on the transmit path, never touch FLASH.
+//
+// Changes are made in RAM and marked dirty. They are written to FLASH a little
+// later, all in one batch with one commit, so that a bulk import or several
+// quick edits cost one FLASH transaction rather than one per change.
+//
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <time.h>
+#include <esp_timer.h>
 #include "generic_main.h"
 
-const char nvs_name[] = "user";
+// A power of two, so that the hash can be masked.
+#define TABLE_SIZE		64
+#define WRITE_DELAY_SECONDS	2
+// The records copied out of the table at a time to be written.
+#define WRITE_BATCH		8
 
-esp_err_t
-gm_get_user_data(const char * name, gm_user_data_t * data)
+typedef enum _state {
+  EMPTY = 0,
+  USED,
+  DELETED
+} state_t;
+
+typedef struct _user {
+  char			name[NVS_KEY_NAME_MAX_SIZE];
+  gm_user_data_t	data;
+  uint16_t		version;	// Changed with every change of the record.
+  uint8_t		state:2;
+  uint8_t		dirty:1;
+} user_t;
+
+static const char	nvs_name[] = "user";
+static pthread_mutex_t	lock = PTHREAD_MUTEX_INITIALIZER;
+static user_t		users[TABLE_SIZE];
+static size_t		number_of_users = 0;
+static esp_timer_handle_t write_timer = NULL;
+static bool		loaded = false;
+
+// FNV-1a.
+static uint32_t
+hash(const char * s)
+{
+  uint32_t h = 2166136261U;
+
+  while ( *s != '\0' ) {
+    h ^= (uint8_t)*s++;
+    h *= 16777619U;
+  }
+  return h;
+}
+
+// Call with the lock held. Returns the user's slot, or NULL.
+static user_t *
+find(const char * name)
+{
+  const uint32_t h = hash(name);
+
+  for ( size_t i = 0; i < TABLE_SIZE; i++ ) {
+    user_t * const u = &users[(h + i) & (TABLE_SIZE - 1)];
+
+    if ( u->state == EMPTY )
+      return NULL;
+    if ( u->state == USED && strcmp(u->name, name) == 0 )
+      return u;
+  }
+  return NULL;
+}
+
+// Call with the lock held. Returns the user's slot, a new slot for the user, or
+// NULL if the table is full.
+static user_t *
+find_or_add(const char * name)
+{
+  const uint32_t h = hash(name);
+  user_t * free_slot = NULL;
+
+  for ( size_t i = 0; i < TABLE_SIZE; i++ ) {
+    user_t * const u = &users[(h + i) & (TABLE_SIZE - 1)];
+
+    if ( u->state == USED ) {
+      if ( strcmp(u->name, name) == 0 )
+        return u;
+    }
+    else if ( u->state == DELETED && strcmp(u->name, name) == 0 ) {
+      // The user was deleted and is being added again before the deletion was
+      // written. Use the same slot, so that only the new record is written.
+      free_slot = u;
+      break;
+    }
+    else {
+      // A deleted slot may still need to have its key erased from FLASH, so
+      // only reuse it if it's clean.
+      if ( free_slot == NULL && (u->state == EMPTY || !u->dirty) )
+        free_slot = u;
+      if ( u->state == EMPTY )
+        break;
+    }
+  }
+  if ( free_slot ) {
+    const bool dirty = free_slot->dirty;
+    const uint16_t version = free_slot->version;
+    memset(free_slot, 0, sizeof(*free_slot));
+    strcpy(free_slot->name, name);
+    free_slot->state = USED;
+    free_slot->dirty = dirty;
+    free_slot->version = version + 1;
+    number_of_users++;
+  }
+  return free_slot;
+}
+
+// Write the dirty records in batches. Each batch is copied with the lock held,
+// and written with it released, so that a login or the PTT check doesn't wait
+// for FLASH. A record stays dirty until it's written, and if it changed while
+// it was being written, its version no longer matches, and it stays dirty for
+// the next write.
+static void
+write_dirty(void * data)
 {
-  nvs_handle_t nvs = 0;
+  struct {
+    size_t		index;
+    uint16_t		version;
+    bool		erase;
+    char		name[NVS_KEY_NAME_MAX_SIZE];
+    gm_user_data_t	data;
+  }		batch[WRITE_BATCH];
+  nvs_handle_t	nvs = 0;
+  esp_err_t	err = ESP_OK;
+  size_t	next = 0;
+
+  const esp_err_t open_err = nvs_open(nvs_name, NVS_READWRITE, &nvs);
+  if ( open_err != ESP_OK ) {
+    gm_flash_failure(nvs_name, open_err);
+    return;
+  }
+
+  while ( next < TABLE_SIZE && err == ESP_OK ) {
+    size_t n = 0;
+
+    pthread_mutex_lock(&lock);
+    for ( ; next < TABLE_SIZE && n < WRITE_BATCH; next++ ) {
+      const user_t * const u = &users[next];
+
+      if ( !u->dirty )
+        continue;
+      batch[n].index = next;
+      batch[n].version = u->version;
+      batch[n].erase = u->state != USED;
+      strcpy(batch[n].name, u->name);
+      batch[n].data = u->data;
+      n++;
+    }
+    pthread_mutex_unlock(&lock);
+
+    size_t written;
+    for ( written = 0; written < n; written++ ) {
+      if ( batch[written].erase ) {
+        err = nvs_erase_key(nvs, batch[written].name);
+        if ( err == ESP_ERR_NVS_NOT_FOUND )
+          err = ESP_OK;
+      }
+      else
+        err = nvs_set_blob(nvs, batch[written].name, &batch[written].data, sizeof(batch[written].data));
+      if ( err != ESP_OK )
+        break;
+    }
+
+    pthread_mutex_lock(&lock);
+    for ( size_t i = 0; i < written; i++ ) {
+      user_t * const u = &users[batch[i].index];
+
+      if ( u->version == batch[i].version )
+        u->dirty = false;
+    }
+    pthread_mutex_unlock(&lock);
+  }
+
+  if ( err == ESP_OK )
+    err = nvs_commit(nvs);
+  (void) nvs_close(nvs);
+
+  if ( err != ESP_OK )
+    gm_flash_failure(nvs_name, err);
+}
+
+static void
+write_timer_expired(void * data)
+{
+  // Don't write FLASH in the timer task, it would delay other timers.
+  gm_run(write_dirty, NULL, GM_SLOW);
+}
+
+// Call with the lock held. Restarts the delay, so that a burst of changes is
+// written once.
+static void
+schedule_write(void)
+{
+  if ( write_timer == NULL )
+    return;
+  esp_timer_stop(write_timer);
+  esp_timer_start_once(write_timer, WRITE_DELAY_SECONDS * 1000000ULL);
+}
+
+// Load the user directory from FLASH. Call once, after NVS is initialized.
+void
+gm_user_directory_load(void)
+{
+  nvs_iterator_t	iterator = NULL;
+  nvs_handle_t		nvs = 0;
+
+  const esp_timer_create_args_t timer_args = {
+    .callback = write_timer_expired,
+    .name = "user directory"
+  };
+  ESP_ERROR_CHECK(esp_timer_create(&timer_args, &write_timer));
 
-  const esp_err_t open_err = nvs_open(nvs_name, NVS_READONLY, &nvs);
   // This will fail quietly if no user has been defined.
-  if ( open_err != ESP_OK ) { 
-    if ( open_err == ESP_ERR_NVS_NOT_INITIALIZED )
-      return open_err;
-    else
-      return gm_flash_failure(nvs_name, open_err);
+  if ( nvs_open(nvs_name, NVS_READONLY, &nvs) != ESP_OK ) {
+    loaded = true;
+    return;
   }
 
-  size_t size = sizeof(gm_user_data_t);
-  const esp_err_t err = nvs_get_blob(nvs, name, data, &size);
+  esp_err_t err = nvs_entry_find(NVS_DEFAULT_PART_NAME, nvs_name, NVS_TYPE_BLOB, &iterator);
+
+  pthread_mutex_lock(&lock);
+  while ( err == ESP_OK ) {
+    nvs_entry_info_t	info;
+    gm_user_data_t	data;
+    size_t		size = sizeof(data);
+
+    nvs_entry_info(iterator, &info);
+
+    const esp_err_t get_err = nvs_get_blob(nvs, info.key, &data, &size);
+    if ( get_err != ESP_OK )
+      gm_flash_failure(nvs_name, get_err);
+    else if ( size != sizeof(data) ) {
+      // Figure out what to do here if the size of the structure changes.
+      // For now, just skip the record.
+      gm_printf("User %s structure size incorrect.\n", info.key);
+    }
+    else {
+      user_t * const u = find_or_add(info.key);
+      if ( u )
+        u->data = data;
+      else
+        GM_WARN_ONCE("User directory is full, some users were not loaded.\n");
+    }
+    err = nvs_entry_next(&iterator);
+  }
+  loaded = true;
+  pthread_mutex_unlock(&lock);
+
+  nvs_release_iterator(iterator);
   (void) nvs_close(nvs);
+}
 
-  if ( err != ESP_OK ) {
-    if ( err != ESP_ERR_NVS_NOT_FOUND )
-      gm_flash_failure(nvs_name, err);
-    return err;
+esp_err_t
+gm_get_user_data(const char * name, gm_user_data_t * data)
+{
+  esp_err_t err = ESP_ERR_NVS_NOT_FOUND;
+
+  if ( !loaded )
+    return ESP_ERR_NVS_NOT_INITIALIZED;
+
+  pthread_mutex_lock(&lock);
+  const user_t * const u = find(name);
+  if ( u ) {
+    *data = u->data;
+    err = ESP_OK;
+  }
+  pthread_mutex_unlock(&lock);
+  return err;
+}
+
+esp_err_t
+gm_set_user_data(const char * name, const gm_user_data_t * data)
+{
+  esp_err_t err = ESP_OK;
+
+  if ( strlen(name) >= NVS_KEY_NAME_MAX_SIZE || *name == '\0' )
+    return ESP_ERR_NVS_KEY_TOO_LONG;
+
+  pthread_mutex_lock(&lock);
+  user_t * const u = find_or_add(name);
+  if ( u ) {
+    u->data = *data;
+    u->dirty = true;
+    u->version++;
+    schedule_write();
   }
+  else
+    err = ESP_ERR_NO_MEM;
+  pthread_mutex_unlock(&lock);
+
+  // Sessions of this user that are cached must see the change.
+  gm_session_cache_invalidate(name);
+  return err;
+}
+
+esp_err_t
+gm_delete_user(const char * name)
+{
+  esp_err_t err = ESP_ERR_NVS_NOT_FOUND;
+
+  pthread_mutex_lock(&lock);
+  user_t * const u = find(name);
+  if ( u ) {
+    // The slot stays marked deleted, so that probing continues past it.
+    memset(&u->data, 0, sizeof(u->data));
+    u->state = DELETED;
+    u->dirty = true;
+    u->version++;
+    number_of_users--;
+    schedule_write();
+    err = ESP_OK;
+  }
+  pthread_mutex_unlock(&lock);
+
+  gm_session_cache_invalidate(name);
+  return err;
+}
+
+// Call the coroutine for every user, in no particular order. The coroutine is
+// called with the directory locked, so it must not change the directory.
+size_t
+gm_user_list(gm_user_list_coroutine_t coroutine, void * context)
+{
+  size_t count;
+
+  pthread_mutex_lock(&lock);
+  for ( size_t i = 0; i < TABLE_SIZE; i++ ) {
+    if ( users[i].state == USED )
+      (*coroutine)(users[i].name, &users[i].data, context);
+  }
+  count = number_of_users;
+  pthread_mutex_unlock(&lock);
+  return count;
+}
+
+// Check the privilege to transmit. This is called on the PTT path, and reads
+// only RAM.
+bool
+gm_user_may_transmit(const char * name)
+{
+  bool result = false;
+
+  pthread_mutex_lock(&lock);
+  const user_t * const u = find(name);
+  if ( u )
+    result = u->data.transmit && !u->data.banned && u->data.license_class[0] != '\0';
+  pthread_mutex_unlock(&lock);
+  return result;
+}
 
-  if ( size != sizeof(gm_user_data_t) ) {
-    // Figure out what to do here if the size of the structure changes.
-    // For now, just quit.
-    gm_printf("User structure size incorrect.\n");
-    return ESP_FAIL;
+static void
+json_string(cJSON * o, const char * name, const char * s, size_t size)
+{
+  char	buffer[64];
+
+  // The longest fields may not have a 0 string terminator.
+  if ( size >= sizeof(buffer) )
+    size = sizeof(buffer) - 1;
+  memcpy(buffer, s, size);
+  buffer[size] = '\0';
+  cJSON_AddStringToObject(o, name, buffer);
+}
+
+static void
+export_user(const char * name, const gm_user_data_t * d, void * context)
+{
+  cJSON * const o = cJSON_CreateObject();
+
+  cJSON_AddStringToObject(o, "name", name);
+  json_string(o, "callsign", d->callsign, sizeof(d->callsign));
+  json_string(o, "country", d->country, sizeof(d->country));
+  json_string(o, "license_class", d->license_class, sizeof(d->license_class));
+  cJSON_AddBoolToObject(o, "admin", d->admin);
+  cJSON_AddBoolToObject(o, "transmit", d->transmit);
+  cJSON_AddBoolToObject(o, "banned", d->banned);
+  // The password is secret, and is not exported.
+  cJSON_AddItemToArray((cJSON *)context, o);
+}
+
+// Export the directory as a JSON array of user objects, for backup or to set up
+// another station. The caller must cJSON_Delete() the result.
+cJSON *
+gm_user_export(void)
+{
+  cJSON * const array = cJSON_CreateArray();
+
+  gm_user_list(export_user, array);
+  return array;
+}
+
+static void
+copy_string(char * to, size_t size, const cJSON * o, const char * name)
+{
+  const cJSON * const item = cJSON_GetObjectItemCaseSensitive(o, name);
+
+  if ( cJSON_IsString(item) && item->valuestring ) {
+    // The longest fields may not have a 0 string terminator.
+    memset(to, 0, size);
+    strncpy(to, item->valuestring, size);
   }
+}
+
+static void
+copy_bool(const cJSON * o, const char * name, bool * b)
+{
+  const cJSON * const item = cJSON_GetObjectItemCaseSensitive(o, name);
+
+  if ( cJSON_IsBool(item) )
+    *b = cJSON_IsTrue(item);
+}
+
+// Import a JSON array of user objects, as written by gm_user_export(), adding
+// users or changing existing ones. Fields that are absent are left unchanged.
+// Returns the number of users imported, or -1 if the JSON isn't an array.
+int
+gm_user_import(const cJSON * array)
+{
+  const cJSON *	o;
+  int		count = 0;
 
-  return ESP_OK;
+  if ( !cJSON_IsArray(array) )
+    return -1;
+
+  cJSON_ArrayForEach(o, array) {
+    const cJSON * const name = cJSON_GetObjectItemCaseSensitive(o, "name");
+    gm_user_data_t	d = {};
+    bool		admin, transmit, banned;
+
+    if ( !cJSON_IsString(name) || name->valuestring == NULL ) {
+      gm_printf("User import: an entry has no name.\n");
+      continue;
+    }
+
+    (void) gm_get_user_data(name->valuestring, &d);
+    admin = d.admin;
+    transmit = d.transmit;
+    banned = d.banned;
+    copy_string(d.callsign, sizeof(d.callsign), o, "callsign");
+    copy_string(d.password, sizeof(d.password), o, "password");
+    copy_string(d.country, sizeof(d.country), o, "country");
+    copy_string(d.license_class, sizeof(d.license_class), o, "license_class");
+    copy_bool(o, "admin", &admin);
+    copy_bool(o, "transmit", &transmit);
+    copy_bool(o, "banned", &banned);
+    d.admin = admin;
+    d.transmit = transmit;
+    d.banned = banned;
+
+    if ( gm_set_user_data(name->valuestring, &d) == ESP_OK )
+      count++;
+    else
+      gm_printf("User import: can't add %s.\n", name->valuestring);
+  }
+  return count;
 }
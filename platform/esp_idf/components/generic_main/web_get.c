@@ -3,7 +3,37 @@
 #include <esp_http_client.h>
 #include <esp_crt_bundle.h>
 #include <esp_tls.h>
+#include <esp_timer.h>
 #include "generic_main.h"
+#include "gm_trace.h"
+
+// HTTP GET with a small pool of kept-alive connections.
+//
+// A new esp_http_client costs a DNS lookup, a TCP connection, and a TLS
+// handshake with certificate-bundle verification, which is most of the CPU
+// time and latency of a small request. So clients are kept after a request,
+// keyed by the scheme, credentials, host and port of the URL, and the next
+// request to the same place reuses the open connection.
+//
+// An open connection holds a TLS context of tens of kilobytes, so there are
+// at most POOL_SIZE, and the connections idle for IDLE_S are closed. A server
+// may close a kept connection first, so a request that fails on a reused
+// connection is tried once more on a new one.
+//
+// With CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS, each client saves its TLS
+// session, and a new connection from the same client resumes it, which skips
+// the certificate verification and the key exchange. So a client whose
+// connection was closed is kept, with only its buffers and the session, until
+// it has been idle for SESSION_S.
+
+#define POOL_SIZE	2
+#define IDLE_S		30
+#if CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS
+#define SESSION_S	(60 * 60)
+#else
+#define SESSION_S	IDLE_S
+#endif
+#define KEY_SIZE	128
 
 struct user_data {
   char * data;
@@ -12,6 +42,21 @@ struct user_data {
   gm_web_get_coroutine_t coroutine;
 };
 
+typedef struct _pooled {
+  esp_http_client_handle_t	client;
+  // Where the event handler puts the data. Its address is given to the client
+  // when it's created, so it's set for each request rather than replaced.
+  struct user_data		user_data;
+  char				key[KEY_SIZE];
+  int64_t			last_used;
+  bool				busy;
+  bool				open;	// The connection may be open.
+} pooled_t;
+
+static pthread_mutex_t		lock = PTHREAD_MUTEX_INITIALIZER;
+static pooled_t			pool[POOL_SIZE];
+static esp_timer_handle_t	idle_timer = NULL;
+
 static esp_err_t event_handler(esp_http_client_event_t * event)
 {
   struct user_data * const user_data = (struct user_data *)event->user_data;
@@ -40,16 +85,203 @@ static esp_err_t event_handler(esp_http_client_event_t * event)
   return ESP_OK;
 }
 
-static int gm_web_get_internal(const char * url, struct user_data * user_data)
+// The part of a URL that says which connection it can use:
+// scheme://[user:password@]host[:port]
+static bool
+pool_key(const char * url, char * key, size_t size)
+{
+  const char * const	authority = strstr(url, "://");
+  size_t		length;
+
+  if ( authority == NULL )
+    return false;
+  length = authority + 3 - url + strcspn(authority + 3, "/?#");
+  if ( length >= size )
+    return false;
+  memcpy(key, url, length);
+  key[length] = '\0';
+  return true;
+}
+
+// Close the connections that have been idle too long, and discard the
+// clients whose sessions are too old to be worth keeping. In the GM_SLOW task
+// because closing a TLS connection sends to the server.
+static void
+close_idle(void * data)
+{
+  const int64_t			now = gm_clock_us();
+  esp_http_client_handle_t	discarding[POOL_SIZE];
+  pooled_t *			closing[POOL_SIZE];
+  size_t			d = 0;
+  size_t			c = 0;
+  int64_t			next = INT64_MAX;
+
+  pthread_mutex_lock(&lock);
+  for ( size_t i = 0; i < POOL_SIZE; i++ ) {
+    pooled_t * const p = &pool[i];
+    int64_t due;
+
+    if ( p->client == NULL || p->busy )
+      continue;
+    if ( now - p->last_used >= SESSION_S * 1000000LL ) {
+      discarding[d++] = p->client;
+      p->client = NULL;
+      continue;
+    }
+    if ( p->open && now - p->last_used >= IDLE_S * 1000000LL ) {
+      // Busy while it's closed, so that no other task gets it.
+      p->busy = true;
+      p->open = false;
+      closing[c++] = p;
+    }
+    due = p->last_used + (p->open ? IDLE_S : SESSION_S) * 1000000LL;
+    if ( due < next )
+      next = due;
+  }
+  esp_timer_stop(idle_timer);
+  if ( next != INT64_MAX )
+    esp_timer_start_once(idle_timer, next > now ? next - now : 0);
+  pthread_mutex_unlock(&lock);
+
+  for ( size_t i = 0; i < d; i++ )
+    esp_http_client_cleanup(discarding[i]);
+  for ( size_t i = 0; i < c; i++ ) {
+    esp_http_client_close(closing[i]->client);
+    pthread_mutex_lock(&lock);
+    closing[i]->busy = false;
+    pthread_mutex_unlock(&lock);
+  }
+}
+
+static void
+idle_timer_expired(void * data)
+{
+  gm_run(close_idle, NULL, GM_SLOW);
+}
+
+// Get a client for a URL, reusing a kept connection if there is one.
+static pooled_t *
+acquire(const char * url, const char * key, bool * reused)
+{
+  pooled_t *			p = NULL;
+  esp_http_client_handle_t	evicted = NULL;
+
+  pthread_mutex_lock(&lock);
+  if ( idle_timer == NULL ) {
+    const esp_timer_create_args_t timer_args = {
+      .callback = idle_timer_expired,
+      .name = "web_get idle"
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&timer_args, &idle_timer));
+  }
+
+  for ( size_t i = 0; i < POOL_SIZE; i++ ) {
+    if ( pool[i].client && !pool[i].busy && strcmp(pool[i].key, key) == 0 ) {
+      p = &pool[i];
+      break;
+    }
+  }
+  *reused = p != NULL;
+
+  if ( p == NULL ) {
+    // An empty slot, or else the idle one that was used least recently.
+    for ( size_t i = 0; i < POOL_SIZE; i++ ) {
+      if ( pool[i].busy )
+        continue;
+      if ( pool[i].client == NULL ) {
+        p = &pool[i];
+        break;
+      }
+      if ( p == NULL || pool[i].last_used < p->last_used )
+        p = &pool[i];
+    }
+    if ( p ) {
+      evicted = p->client;
+      p->client = NULL;
+    }
+  }
+  if ( p )
+    p->busy = true;
+  pthread_mutex_unlock(&lock);
+
+  if ( evicted )
+    esp_http_client_cleanup(evicted);
+
+  // Every slot is in use by another task.
+  if ( p == NULL )
+    return NULL;
+
+  if ( p->client == NULL ) {
+    esp_http_client_config_t config = {};
+
+    config.url = url;
+    config.event_handler = &event_handler;
+    config.crt_bundle_attach = esp_crt_bundle_attach;
+    config.user_data = &p->user_data;
+    // This doesn't seem to do anything if the basic authentication information isn't
+    // in the URL, so it can be left on all of the time. It's used by ddns().
+    config.auth_type = HTTP_AUTH_TYPE_BASIC;
+#if CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS
+    config.save_client_session = true;
+#endif
+
+    p->client = esp_http_client_init(&config);
+    if ( p->client == NULL ) {
+      pthread_mutex_lock(&lock);
+      p->busy = false;
+      pthread_mutex_unlock(&lock);
+      return NULL;
+    }
+    strlcpy(p->key, key, sizeof(p->key));
+  }
+  else if ( esp_http_client_set_url(p->client, url) != ESP_OK ) {
+    esp_http_client_cleanup(p->client);
+    p->client = NULL;
+    pthread_mutex_lock(&lock);
+    p->busy = false;
+    pthread_mutex_unlock(&lock);
+    return NULL;
+  }
+  return p;
+}
+
+// Return a client to the pool, or discard it if its connection is no good.
+static void
+release(pooled_t * p, bool keep)
+{
+  esp_http_client_handle_t discard = NULL;
+
+  pthread_mutex_lock(&lock);
+  if ( keep ) {
+    p->last_used = gm_clock_us();
+    p->open = true;
+    // The timer may be set for a closed client's session, which is later.
+    // close_idle() sets it again for whatever is due next.
+    esp_timer_stop(idle_timer);
+    esp_timer_start_once(idle_timer, IDLE_S * 1000000LL);
+  }
+  else {
+    discard = p->client;
+    p->client = NULL;
+  }
+  p->busy = false;
+  pthread_mutex_unlock(&lock);
+
+  if ( discard )
+    esp_http_client_cleanup(discard);
+}
+
+// A client for a one-off request, when the pool is full.
+static int
+unpooled(const char * url, struct user_data * user_data)
 {
   esp_http_client_config_t config = {};
+  int status = -1;
 
   config.url = url;
   config.event_handler = &event_handler;
   config.crt_bundle_attach = esp_crt_bundle_attach;
   config.user_data = user_data;
-  // This doesn't seem to do anything if the basic authentication information isn't
-  // in the URL, so it can be left on all of the time. It's used by ddns().
   config.auth_type = HTTP_AUTH_TYPE_BASIC;
 
   esp_http_client_handle_t client = esp_http_client_init(&config);
@@ -57,14 +289,44 @@ static int gm_web_get_internal(const char * url, struct user_data * user_data)
   if (client == NULL)
     return -1;
 
-  esp_err_t err = esp_http_client_perform(client);
+  if ( esp_http_client_perform(client) == ESP_OK )
+    status = esp_http_client_get_status_code(client);
+  esp_http_client_cleanup(client);
+  return status;
+}
 
-  if (err) {
+static int gm_web_get_internal(const char * url, struct user_data * user_data)
+{
+  char		key[KEY_SIZE];
+  bool		reused;
+  pooled_t *	p;
+  esp_err_t	err;
+
+  if ( !pool_key(url, key, sizeof(key)) || (p = acquire(url, key, &reused)) == NULL )
+    return unpooled(url, user_data);
+
+  p->user_data = *user_data;
+  // The value is 1 if the connection was reused, 0 if there was a handshake.
+  GM_TRACE_BEGIN_VALUE("web_get", reused);
+  err = esp_http_client_perform(p->client);
+  GM_TRACE_END("web_get");
+
+  if ( err != ESP_OK && reused ) {
+    // The server probably closed the kept connection. Try a new one.
+    esp_http_client_close(p->client);
+    p->user_data = *user_data;
+    GM_TRACE_BEGIN_VALUE("web_get", 0);
+    err = esp_http_client_perform(p->client);
+    GM_TRACE_END("web_get");
+  }
+
+  if ( err != ESP_OK ) {
+    release(p, false);
     return -1;
   }
 
-  int status = esp_http_client_get_status_code(client);
-  esp_http_client_cleanup(client);
+  const int status = esp_http_client_get_status_code(p->client);
+  release(p, true);
   return status;
 }
 
@@ -1,6 +1,7 @@
 #include <stdarg.h>
 #include <esp_http_server.h>
 #include "generic_main.h"
+#include "gm_trace.h"
 
 static void * gm_web_request;
 
@@ -10,9 +11,13 @@ static gm_web_handler_t * * last[3] = {&handlers[0], &handlers[1], &handlers[2]}
 static esp_err_t
 run_post_handlers(httpd_req_t * req)
 {
-  gm_session(req);
   gm_uri uri = {};
 
+  if ( gm_session(req) != ESP_OK ) {
+    httpd_resp_send_500(req);
+    return ESP_FAIL;
+  }
+
   if ( gm_uri_parse(req->uri, &uri) == 0 )
     return gm_web_handler_run(req, &uri, POST) ? ESP_FAIL : ESP_OK;
   else
@@ -22,9 +27,13 @@ run_post_handlers(httpd_req_t * req)
 static esp_err_t
 run_put_handlers(httpd_req_t * req)
 {
-  gm_session(req);
   gm_uri uri = {};
 
+  if ( gm_session(req) != ESP_OK ) {
+    httpd_resp_send_500(req);
+    return ESP_FAIL;
+  }
+
   gm_uri_parse(req->uri, &uri);
 
   if ( gm_uri_parse(req->uri, &uri) == 0 )
@@ -70,7 +79,10 @@ gm_web_handler_run(httpd_req_t * req, const gm_uri * uri, gm_web_method method)
 
   while ( h ) {
     if ( strcmp(h->name, path) == 0 ) {
-      return (*(h->handler))(req, uri);
+      GM_TRACE_BEGIN(h->name);
+      const int result = (*(h->handler))(req, uri);
+      GM_TRACE_END(h->name);
+      return result;
     }
     h = h->next;
   }
@@ -67,7 +67,7 @@ finish_current_tag()
     else {
       emit(">"); // There is no "/>" in HTML 5.
       tag_t * parent = current->parent;
-      free(current);
+      gm_free(current);
       current = parent;
     }
   }
@@ -83,7 +83,7 @@ flush()
 static void *
 mem(size_t size)
 {
-  void * const m = malloc(size);
+  void * const m = gm_malloc(GM_MEMORY_TEMPLATE, size);
   if ( m == 0 ) 
     fail("Out of memory.\n");
   memset(m, '\0', size);
@@ -145,7 +145,7 @@ html_end()
   if ( h->nesting ) {
     emit("</%s>", h->name); 
     tag_t * const parent = h->parent;
-    free(current);
+    gm_free(current);
     current = parent;
     if ( current == &root ) {
       flush();
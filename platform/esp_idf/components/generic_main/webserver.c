@@ -8,12 +8,27 @@
 #include <esp_log.h>
 #include <esp_timer.h>
 #include <inttypes.h>
+#include <unistd.h>
+#include <pthread.h>
 #include "generic_main.h"
 
 static const char TASK_NAME[] = "web_server";
 static httpd_handle_t ssl_server = NULL;
+// Initialization and the WiFi event handlers start and stop the server from
+// different tasks.
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static bool initialized = false;
 
-void start_webserver(void)
+static void
+close_socket(httpd_handle_t server, int fd)
+{
+  // The socket may be carrying a live telemetry stream.
+  gm_telemetry_socket_closed(fd);
+  close(fd);
+}
+
+static void
+start(void)
 {
   if (ssl_server)
     return;
@@ -27,12 +42,19 @@ void start_webserver(void)
   config.httpd.core_id = 0;
   config.httpd.uri_match_fn = httpd_uri_match_wildcard;
   config.httpd.lru_purge_enable = true;
+  config.httpd.close_fn = close_socket;
   gm_self_signed_ssl_certificates(&config);
+#ifdef CONFIG_ESP_TLS_SERVER_SESSION_TICKETS
+  // A browser resumes with a ticket, rather than a full handshake for every
+  // connection it opens.
+  config.session_tickets = true;
+#endif
 
   // Start the httpd server
   ESP_LOGI(TASK_NAME, "Starting server on port: %d", config.port_secure);
   if (httpd_ssl_start(&ssl_server, &config) == ESP_OK) {
     gm_web_handler_install(ssl_server);
+    gm_boot_milestone("web server listening");
   }
   else {
     ssl_server = NULL;
@@ -40,12 +62,36 @@ void start_webserver(void)
   }
 }
 
+// Called once during initialization, when the keys and the user directory are
+// loaded. The server listens on every address, so it starts before WiFi has
+// one, and the TLS setup isn't in the time to the first response.
+void
+gm_webserver_initialize(void)
+{
+  pthread_mutex_lock(&lock);
+  initialized = true;
+  start();
+  pthread_mutex_unlock(&lock);
+}
+
+// Called when WiFi gets an address, to restart the server after
+// stop_webserver(). Until gm_webserver_initialize() is called, it's too early.
+void start_webserver(void)
+{
+  pthread_mutex_lock(&lock);
+  if (initialized)
+    start();
+  pthread_mutex_unlock(&lock);
+}
+
 void stop_webserver()
 {
+  pthread_mutex_lock(&lock);
   if (ssl_server) {
     gm_stop_redirect_to_https();
     GM.time_last_synchronized = 0;
     httpd_ssl_stop(ssl_server);
     ssl_server = NULL;
   }
+  pthread_mutex_unlock(&lock);
 }
@@ -33,6 +33,10 @@
 #include <pthread.h>
 #include "generic_main.h"
 
+// The web server port, and the external port asked of the router for it.
+static const uint16_t https_port = 443;
+static const uint16_t external_https_port = 7300;
+
 enum EventBits {
   CONNECTED_BIT = 1 << 0,
   DISCONNECTED_BIT = 1 << 1,
@@ -83,10 +87,16 @@ gm_wifi_is_connected(void)
   return !!uxBits & CONNECTED_BIT;
 }
 
-static void after_stun(bool success, bool ipv6, struct sockaddr * address)
+// Called in the GM_SLOW task when a public address changes.
+static void public_address_changed(bool ipv6, const struct sockaddr_storage * address, gm_reachability_source_t source)
 {
-  if ( !success )
-    GM_FAIL("STUN for %s failed.\n", ipv6 ? "IPv6" : "IPv4");
+  char buffer[INET6_ADDRSTRLEN + 1];
+
+  gm_ntop(address, buffer, sizeof(buffer));
+  gm_printf("Public %s address %s, from %s.\n", ipv6 ? "IPv6" : "IPv4", buffer, gm_reachability_source_name(source));
+  // A new address may be a new NAT, measure it.
+  if ( !ipv6 )
+    gm_keepalive_start();
 }
 
 void
@@ -96,6 +106,9 @@ gm_wifi_start(void)
   gm_netif_t * const sta = &GM.net_interfaces[GM.next_free_net_interface++];
   sta->esp_netif = esp_netif_create_default_wifi_sta();
 
+  gm_reachability_subscribe(public_address_changed);
+  gm_ddns_start();
+
   // Register the event handler for WiFi station ready.
   ESP_ERROR_CHECK( esp_event_handler_register(WIFI_EVENT, WIFI_EVENT_STA_START, &wifi_event_sta_start, NULL) );
   ESP_ERROR_CHECK( esp_event_handler_register(WIFI_EVENT, WIFI_EVENT_STA_DISCONNECTED, &wifi_event_sta_disconnected, NULL) );
@@ -117,15 +130,10 @@ gm_wifi_start(void)
 //
 void wifi_event_sta_start(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data)
 {
-  char ssid[33] = { 0 };
-  char password[65] = { 0 };
-  size_t ssid_size = sizeof(ssid);
-  size_t password_size = sizeof(password);
+  const char * const ssid = gm_nonvolatile_string("ssid");
+  const char * const password = gm_nonvolatile_string("wifi_password");
   // wifi_scan_config_t config = {};
 
-  esp_err_t ssid_err = nvs_get_str(GM.nvs, "ssid", ssid, &ssid_size);
-  esp_err_t password_err = nvs_get_str(GM.nvs, "wifi_password", password, &password_size);
-
   // config.scan_type = WIFI_SCAN_TYPE_PASSIVE;
   // config.scan_type = WIFI_ALL_CHANNEL_SCAN;
   // config.scan_time.active.min = 120;
@@ -133,8 +141,7 @@ void wifi_event_sta_start(void* arg, esp_event_base_t event_base, int32_t event_
   // config.scan_time.passive = 120;
   // esp_wifi_scan_start(&config, 0);
 
-  // ssid_size includes the terminating null.
-  if (ssid_err == ESP_OK && password_err == ESP_OK && ssid_size > 1)
+  if (ssid && password && *ssid != '\0')
     wifi_connect_to_ap(ssid, password);
 
   xEventGroupSetBits(wifi_events, STATION_READY_BIT);
@@ -165,11 +172,12 @@ ipv6_router_advertisement_handler(struct sockaddr_in6 * address, uint16_t router
   if ( !pcp_ipv6_started ) {
     pcp_ipv6_started = true;
     gm_pcp_start_ipv6(&GM.net_interfaces[GM_STA]);
-    gm_pcp_request_mapping_ipv6(&GM.net_interfaces[GM_STA]);
+    gm_pcp_request_mapping_ipv6(&GM.net_interfaces[GM_STA], GM_PCP_TCP, https_port, external_https_port);
   }
 }
 
 static void wifi_event_sta_connected_to_ap(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data) {
+  gm_boot_milestone("wifi associated");
   // Start the ICMPv6 listener as early as possible, so that we get the router
   // advertisement that is solicited when the IPV6 interfaces are configured.
   gm_icmpv6_start_listener_ipv6(ipv6_router_advertisement_handler);
@@ -183,6 +191,8 @@ static void ip_event_sta_got_ip4(void* arg, esp_event_base_t event_base, int32_t
   ip_event_got_ip_t* event = (ip_event_got_ip_t*)event_data;
   char	buffer[INET6_ADDRSTRLEN + 1];
 
+  gm_boot_milestone("got ipv4");
+
   // Save the IP information for other facilities, like NAT-PCP, to use.
   GM.net_interfaces[GM_STA].esp_netif = event->esp_netif;
   GM.net_interfaces[GM_STA].ip4.address.s_addr = event->ip_info.ip.addr;
@@ -196,9 +206,9 @@ static void ip_event_sta_got_ip4(void* arg, esp_event_base_t event_base, int32_t
   inet_ntop(AF_INET, &event->ip_info.gw.addr, buffer, sizeof(buffer));
   gm_printf("router %s\n", buffer);
   gm_sntp_start();
-  gm_stun(false, (struct sockaddr *)&GM.net_interfaces[GM_STA].ip4.router_public_ip, after_stun);
+  gm_reachability_start(false);
   gm_pcp_start_ipv4(&GM.net_interfaces[GM_STA]);
-  gm_pcp_request_mapping_ipv4(&GM.net_interfaces[GM_STA]);
+  gm_pcp_request_mapping_ipv4(&GM.net_interfaces[GM_STA], GM_PCP_TCP, https_port, external_https_port);
   start_webserver();
   gm_log_server_start();
 }
@@ -244,6 +254,10 @@ static void ip_event_got_ip6(void* arg, esp_event_base_t event_base, int32_t eve
        // If one of the public address entries is all zeroes, copy the address into it.
        if (gm_all_zeroes(&interface->ip6.global[i].s6_addr, sizeof(&interface->ip6.global[0].s6_addr))) {
          memcpy(interface->ip6.global[i].s6_addr, event->ip6_info.ip.addr, sizeof(event->ip6_info.ip.addr));
+         // Find the public IPv6 address as soon as there is a global one,
+         // in parallel with IPv4.
+         if ( i == 0 && interface == &GM.net_interfaces[GM_STA] )
+           gm_reachability_start(true);
          break;
        }
     }
@@ -309,6 +323,8 @@ gm_wifi_stop()
   gm_log_server_stop();
   gm_icmpv6_stop_listener_ipv6();
   gm_pcp_stop(&GM.net_interfaces[GM_STA]);
+  gm_reachability_stop();
+  gm_keepalive_stop();
   gm_stun_stop();
   gm_sntp_stop();
   if ( gm_wifi_is_connected() ) {
@@ -321,18 +337,33 @@ gm_wifi_stop()
 void
 gm_wifi_restart(void)
 {
-  char ssid[33] = { 0 };
-  char password[65] = { 0 };
-  size_t ssid_size = sizeof(ssid);
-  size_t password_size = sizeof(password);
+  const char * const ssid = gm_nonvolatile_string("ssid");
+  const char * const password = gm_nonvolatile_string("wifi_password");
 
   gm_wifi_stop();
 
-  esp_err_t ssid_err = nvs_get_str(GM.nvs, "ssid", ssid, &ssid_size);
-  esp_err_t password_err = nvs_get_str(GM.nvs, "wifi_password", password, &password_size);
-
-  // ssid_size includes the terminating null.
-  if (ssid_err == ESP_OK && password_err == ESP_OK && ssid_size > 1 && password_size > 1) {
+  if (ssid && password && *ssid != '\0' && *password != '\0') {
     wifi_connect_to_ap(ssid, password);
   }
 }
+
+static void
+credentials_changed(const char * name, void * context)
+{
+  gm_wifi_restart();
+}
+
+CONSTRUCTOR install(void)
+{
+  static gm_nonvolatile_subscription_t ssid = {
+    .name = "ssid",
+    .changed = credentials_changed
+  };
+  static gm_nonvolatile_subscription_t password = {
+    .name = "wifi_password",
+    .changed = credentials_changed
+  };
+
+  gm_nonvolatile_subscribe(&ssid);
+  gm_nonvolatile_subscribe(&password);
+}
@@ -0,0 +1,114 @@
+#include <string.h>
+#include <esp_http_server.h>
+#include "generic_main.h"
+#include "web_template.h"
+
+// Replace the web assets with a compressed_fs image, uploaded as the "assets"
+// file of a multipart form, and made with:
+//
+//   make -f platform/Makefile.native assets
+//
+// The image is streamed to the assets partition as it arrives, so it can be
+// as large as the partition without being held in memory.
+
+typedef struct _upload {
+  gm_assets_writer_t *	writer;
+  bool			done;
+  esp_err_t		result;
+} upload_t;
+
+static int
+file_start(const char * name, const char * file_name, void * context)
+{
+  upload_t * const up = context;
+
+  // One image per form.
+  if ( strcmp(name, "assets") != 0 || up->done )
+    return -1;
+  if ( (up->writer = gm_assets_write_begin()) == NULL ) {
+    up->result = ESP_ERR_INVALID_STATE;
+    return -1;
+  }
+  return 0;
+}
+
+static int
+file_data(const char * bytes, size_t size, void * context)
+{
+  upload_t * const up = context;
+
+  return gm_assets_write(up->writer, bytes, size) == ESP_OK ? 0 : -1;
+}
+
+static int
+file_end(void * context)
+{
+  upload_t * const up = context;
+
+  up->result = gm_assets_write_end(up->writer, true);
+  up->writer = NULL;
+  up->done = true;
+  return up->result == ESP_OK ? 0 : -1;
+}
+
+static int
+assets_post(httpd_req_t * req, const gm_uri * uri)
+{
+  const gm_session_context_t * const session = req->sess_ctx;
+  upload_t	upload = { .result = ESP_FAIL };
+  gm_form_handlers_t handlers = {
+    .file_start = file_start,
+    .file_data = file_data,
+    .file_end = file_end,
+    .context = &upload
+  };
+
+  // This replaces the web interface, so it takes an administrator.
+  if ( session == NULL || session->user_name == NULL || !session->user_data.admin ) {
+    httpd_resp_send_err(req, HTTPD_403_FORBIDDEN, "Only an administrator may replace the web assets.");
+    return 0;
+  }
+
+  (void) gm_form_receive(req, &handlers);
+
+  // The form ended in the middle of the file.
+  if ( upload.writer ) {
+    upload.result = gm_assets_write_end(upload.writer, false);
+    upload.done = true;
+  }
+  if ( !upload.done )
+    return -1;
+
+  boilerplate("Web Assets")
+
+  p
+    if ( upload.result == ESP_OK ) {
+      text("The web assets were replaced.");
+    }
+    else {
+      text("The web assets were not replaced: %s. Until a valid image is uploaded, the built-in pages are used.", esp_err_to_name(upload.result));
+    }
+  end
+
+  ul
+    li
+      a _("href", "/");
+        text("Front page.");
+      end
+    end
+  end
+
+  end_boilerplate
+
+  return 0;
+}
+
+CONSTRUCTOR install(void)
+{
+  static gm_web_handler_t handler = {
+    .name = "assets",
+    .handler = assets_post
+  };
+
+  gm_web_handler_register(&handler, POST);
+}
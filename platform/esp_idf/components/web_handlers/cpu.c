@@ -0,0 +1,101 @@
+#include <stdlib.h>
+#include <string.h>
+#include <esp_http_server.h>
+#include <esp_timer.h>
+#include "generic_main.h"
+
+// Samples are written into chunks, as there are hundreds of them, rather than
+// made into one cJSON tree.
+typedef struct _chunk {
+  httpd_req_t *	req;
+  size_t	size;
+  bool		first;
+  uint32_t	newest;
+  char		data[1024];
+} chunk_t;
+
+static void
+add(chunk_t * c, const char * text, size_t size)
+{
+  if ( c->size + size > sizeof(c->data) ) {
+    httpd_resp_send_chunk(c->req, c->data, c->size);
+    c->size = 0;
+  }
+  memcpy(&c->data[c->size], text, size);
+  c->size += size;
+}
+
+static void
+add_sample(const gm_cpu_sample_t * s, void * context)
+{
+  chunk_t * const	c = (chunk_t *)context;
+  char			text[160];
+  int			n;
+
+  n = snprintf(text, sizeof(text), "%s{\"t\":%lu,\"busy\":[", c->first ? "" : ",", (unsigned long)s->time_ms);
+  for ( int core = 0; core < GM_CPU_MAXIMUM_CORES; core++ )
+    n += snprintf(&text[n], sizeof(text) - n, "%s%u", core ? "," : "", s->busy[core]);
+  n += snprintf(&text[n], sizeof(text) - n, "],\"top\":[");
+  for ( int i = 0; i < GM_CPU_TOP && s->top[i].task != GM_CPU_NO_TASK; i++ )
+    n += snprintf(&text[n], sizeof(text) - n, "%s[%u,%u]", i ? "," : "", s->top[i].task, s->top[i].share);
+  n += snprintf(&text[n], sizeof(text) - n, "]}");
+  c->first = false;
+  c->newest = s->time_ms;
+  add(c, text, n);
+}
+
+// The CPU history, as JSON, for the web UI to graph:
+//
+//   GET /cpu?since=<milliseconds since boot>
+//
+// {"tasks":["name",...],"samples":[{"t":<ms>,"busy":[<core 0>,<core 1>],
+// "top":[[<index in tasks>,<share>],...]},...],"now":<ms>}
+//
+// Shares are per mille of a core. "now" of one response is the "since" of the
+// next, to get only the new samples. It's just after the newest sample sent,
+// rather than the time of the request, so that a sample stamped before the
+// request but stored after it isn't skipped.
+static int
+cpu(httpd_req_t * req, const gm_uri * uri)
+{
+  const char * const	since = gm_param(uri->params, COUNTOF(uri->params), "since");
+  // Without "since", all of the history. The ring holds 300 one-second
+  // samples, so an hour back covers it.
+  const uint32_t	since_ms = since ? strtoul(since, NULL, 10) : esp_timer_get_time() / 1000 - 3600 * 1000;
+  chunk_t * const	c = gm_malloc(GM_MEMORY_CPU, sizeof(*c));
+  const char *		name;
+  char			text[64];
+
+  if ( c == NULL ) {
+    httpd_resp_send_500(req);
+    return 0;
+  }
+  c->req = req;
+  c->size = 0;
+  c->first = true;
+  httpd_resp_set_type(req, "application/json");
+
+  add(c, "{\"tasks\":[", 10);
+  // The tasks in the order of their indexes, which the samples use.
+  for ( unsigned int i = 0; (name = gm_cpu_task_name(i)) != NULL; i++ )
+    add(c, text, snprintf(text, sizeof(text), "%s\"%s\"", i ? "," : "", name));
+  add(c, "],\"samples\":[", 13);
+  gm_cpu_history(since_ms, add_sample, c);
+  // Without new samples, the next request starts from the same place.
+  add(c, text, snprintf(text, sizeof(text), "],\"now\":%lu}", (unsigned long)(c->first ? since_ms : c->newest + 1)));
+
+  httpd_resp_send_chunk(req, c->data, c->size);
+  httpd_resp_send_chunk(req, NULL, 0);
+  gm_free(c);
+  return 0;
+}
+
+CONSTRUCTOR install(void)
+{
+  static gm_web_handler_t handler = {
+    .name = "cpu",
+    .handler = cpu
+  };
+
+  gm_web_handler_register(&handler, GET);
+}
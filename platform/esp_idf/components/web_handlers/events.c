@@ -0,0 +1,19 @@
+#include <esp_http_server.h>
+#include "generic_main.h"
+
+// Stream live telemetry to the browser as Server-Sent Events.
+static int
+events(httpd_req_t * req, const gm_uri * uri)
+{
+  return gm_telemetry_add_client(req);
+}
+
+CONSTRUCTOR install(void)
+{
+  static gm_web_handler_t handler = {
+    .name = "events",
+    .handler = events
+  };
+
+  gm_web_handler_register(&handler, GET);
+}
@@ -0,0 +1,99 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <esp_http_server.h>
+#include "generic_main.h"
+#include "gm_log_store.h"
+
+// Lines are gathered into chunks, rather than a TLS record for each one.
+typedef struct _chunk {
+  httpd_req_t *	req;
+  size_t	size;
+  bool		line_start;
+  char		data[1024];
+} chunk_t;
+
+static void
+add(chunk_t * c, const char * text, size_t size)
+{
+  while ( size > 0 ) {
+    const size_t n = size < sizeof(c->data) - c->size ? size : sizeof(c->data) - c->size;
+
+    memcpy(&c->data[c->size], text, n);
+    c->size += n;
+    text += n;
+    size -= n;
+    if ( c->size == sizeof(c->data) ) {
+      httpd_resp_send_chunk(c->req, c->data, c->size);
+      c->size = 0;
+    }
+  }
+}
+
+// Each line starts with the time of the message. A message may be part of a
+// line, or more than one.
+static int
+reader(int64_t time, const char * text, size_t size, void * context)
+{
+  chunk_t * const	c = (chunk_t *)context;
+  const time_t		seconds = time / 1000000;
+  struct tm		t;
+  char			stamp[32];
+  size_t		stamp_size;
+
+  localtime_r(&seconds, &t);
+  stamp_size = strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &t);
+  stamp_size += snprintf(&stamp[stamp_size], sizeof(stamp) - stamp_size, ".%03d ", (int)(time / 1000 % 1000));
+
+  while ( size > 0 ) {
+    const char * const	newline = memchr(text, '\n', size);
+    const size_t	n = newline ? (size_t)(newline - text) + 1 : size;
+
+    if ( c->line_start )
+      add(c, stamp, stamp_size);
+    add(c, text, n);
+    c->line_start = newline != NULL;
+    text += n;
+    size -= n;
+  }
+  return 0;
+}
+
+// Send the persistent log, or the part of it from and to times in seconds
+// since the epoch: GET /log?from=1700000000&to=1700003600
+static int
+log_get(httpd_req_t * req, const gm_uri * uri)
+{
+  const char * const	from = gm_param(uri->params, COUNTOF(uri->params), "from");
+  const char * const	to = gm_param(uri->params, COUNTOF(uri->params), "to");
+  chunk_t * const	c = gm_malloc(GM_MEMORY_LOG, sizeof(*c));
+
+  if ( c == NULL ) {
+    httpd_resp_send_500(req);
+    return 0;
+  }
+  c->req = req;
+  c->size = 0;
+  c->line_start = true;
+  httpd_resp_set_type(req, "text/plain");
+  gm_log_store_read(
+   from ? strtoll(from, NULL, 10) * 1000000 : INT64_MIN,
+   to ? strtoll(to, NULL, 10) * 1000000 + 999999 : INT64_MAX,
+   reader,
+   c);
+  if ( c->size > 0 )
+    httpd_resp_send_chunk(req, c->data, c->size);
+  httpd_resp_send_chunk(req, NULL, 0);
+  gm_free(c);
+  return 0;
+}
+
+CONSTRUCTOR install(void)
+{
+  static gm_web_handler_t handler = {
+    .name = "log",
+    .handler = log_get
+  };
+
+  gm_web_handler_register(&handler, GET);
+}
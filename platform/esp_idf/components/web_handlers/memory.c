@@ -0,0 +1,81 @@
+#include <stdlib.h>
+#include <string.h>
+#include <esp_http_server.h>
+#include <esp_timer.h>
+#include "generic_main.h"
+
+static void
+add_site(gm_memory_tag_t tag, const char * file, int line, uint32_t allocations, size_t bytes, void * context)
+{
+  cJSON * const		sites = (cJSON *)context;
+  cJSON * const		site = cJSON_CreateObject();
+  const char * const	slash = strrchr(file, '/');
+
+  cJSON_AddStringToObject(site, "tag", gm_memory_tag_name(tag));
+  cJSON_AddStringToObject(site, "file", slash ? slash + 1 : file);
+  cJSON_AddNumberToObject(site, "line", line);
+  cJSON_AddNumberToObject(site, "allocations", allocations);
+  cJSON_AddNumberToObject(site, "bytes", bytes);
+  cJSON_AddItemToArray(sites, site);
+}
+
+// Heap use by subsystem, as JSON. The "mark" is the allocation sequence number
+// now; GET /memory?since=<mark> later adds the allocations made since then
+// that are still live, by where they were made, to find leaks. Rates are the
+// difference of "allocations" between two requests over that of "uptime_us".
+static int
+memory(httpd_req_t * req, const gm_uri * uri)
+{
+  const char * const	since = gm_param(uri->params, COUNTOF(uri->params), "since");
+  cJSON * const		json = cJSON_CreateObject();
+  cJSON * const		heap_json = cJSON_AddObjectToObject(json, "heap");
+  cJSON * const		tags = cJSON_AddObjectToObject(json, "tags");
+  gm_memory_heap_t	heap;
+  char *		text;
+
+  cJSON_AddNumberToObject(json, "uptime_us", (double)esp_timer_get_time());
+  cJSON_AddNumberToObject(json, "mark", gm_memory_mark());
+
+  gm_memory_heap(&heap);
+  cJSON_AddNumberToObject(heap_json, "free", heap.free_bytes);
+  cJSON_AddNumberToObject(heap_json, "minimum_free", heap.minimum_free_bytes);
+  cJSON_AddNumberToObject(heap_json, "largest_free_block", heap.largest_free_block);
+
+  for ( int tag = 0; tag < GM_MEMORY_TAGS; tag++ ) {
+    cJSON * const	t = cJSON_AddObjectToObject(tags, gm_memory_tag_name(tag));
+    gm_memory_stats_t	s;
+
+    gm_memory_stats(tag, &s);
+    cJSON_AddNumberToObject(t, "live_bytes", s.live_bytes);
+    cJSON_AddNumberToObject(t, "peak_bytes", s.peak_bytes);
+    cJSON_AddNumberToObject(t, "live_allocations", s.live_allocations);
+    cJSON_AddNumberToObject(t, "allocations", s.allocations);
+    cJSON_AddNumberToObject(t, "frees", s.frees);
+    cJSON_AddNumberToObject(t, "failures", s.failures);
+    cJSON_AddNumberToObject(t, "largest_free_at_peak", s.largest_free_at_peak);
+  }
+
+  if ( since )
+    gm_memory_since(strtoul(since, NULL, 10), add_site, cJSON_AddArrayToObject(json, "since"));
+
+  text = cJSON_PrintUnformatted(json);
+  cJSON_Delete(json);
+  if ( text == NULL ) {
+    httpd_resp_send_500(req);
+    return 0;
+  }
+  httpd_resp_set_type(req, "application/json");
+  httpd_resp_send(req, text, strlen(text));
+  free(text);
+  return 0;
+}
+
+CONSTRUCTOR install(void)
+{
+  static gm_web_handler_t handler = {
+    .name = "memory",
+    .handler = memory
+  };
+
+  gm_web_handler_register(&handler, GET);
+}
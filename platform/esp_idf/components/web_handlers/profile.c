@@ -0,0 +1,56 @@
+#include <stdlib.h>
+#include <string.h>
+#include <esp_http_server.h>
+#include "generic_main.h"
+#include "gm_profile.h"
+
+// Lines are gathered into chunks, rather than a TLS record for each one.
+typedef struct _chunk {
+  httpd_req_t *	req;
+  size_t	size;
+  char		data[1024];
+} chunk_t;
+
+static void
+writer(const char * text, size_t size, void * context)
+{
+  chunk_t * const c = (chunk_t *)context;
+
+  if ( c->size + size > sizeof(c->data) ) {
+    httpd_resp_send_chunk(c->req, c->data, c->size);
+    c->size = 0;
+  }
+  memcpy(&c->data[c->size], text, size);
+  c->size += size;
+}
+
+// Dump the profiler's samples as text, for symbolization with profile_fold.
+static int
+profile(httpd_req_t * req, const gm_uri * uri)
+{
+  chunk_t * const c = gm_malloc(GM_MEMORY_PROFILE, sizeof(*c));
+
+  if ( c == NULL ) {
+    httpd_resp_send_500(req);
+    return 0;
+  }
+  c->req = req;
+  c->size = 0;
+  httpd_resp_set_type(req, "text/plain");
+  gm_profile_dump(writer, c);
+  if ( c->size > 0 )
+    httpd_resp_send_chunk(req, c->data, c->size);
+  httpd_resp_send_chunk(req, NULL, 0);
+  gm_free(c);
+  return 0;
+}
+
+CONSTRUCTOR install(void)
+{
+  static gm_web_handler_t handler = {
+    .name = "profile",
+    .handler = profile
+  };
+
+  gm_web_handler_register(&handler, GET);
+}
@@ -1,45 +1,95 @@
+#include <string.h>
 #include <esp_http_server.h>
 #include "generic_main.h"
 #include "web_template.h"
 
+typedef struct _setting {
+  char	name[GM_FORM_NAME_SIZE];
+  char	value[GM_FORM_VALUE_SIZE];
+  bool	has_name;
+  bool	has_value;
+  int	others_set;
+  int	others_failed;
+} setting_t;
+
+static void
+field(const char * name, const char * value, void * context)
+{
+  setting_t * const s = context;
+
+  if ( strcmp(name, "name") == 0 ) {
+    strlcpy(s->name, value, sizeof(s->name));
+    s->has_name = true;
+  }
+  else if ( strcmp(name, "value") == 0 ) {
+    strlcpy(s->value, value, sizeof(s->value));
+    s->has_value = true;
+  }
+  else {
+    // Any other field is a parameter to set, so that one form can change
+    // several parameters in one transaction.
+    if ( gm_nonvolatile_set(name, value) == GM_NORMAL )
+      s->others_set++;
+    else
+      s->others_failed++;
+  }
+}
+
 static int
 setting_post(httpd_req_t * req, const gm_uri * uri)
 {
-  char		buffer[1024];
-  gm_param_t	params[2] = {};
-  gm_nonvolatile_result_t result;
+  setting_t	s = {};
+  gm_form_handlers_t handlers = {
+    .field = field,
+    .context = &s
+  };
+  gm_nonvolatile_result_t result = GM_NORMAL;
 
-  int size = httpd_req_recv(req, buffer, sizeof(buffer) - 1);
+  // Write all of the changes in the form to FLASH together.
+  gm_config_begin();
 
-  if ( size >= 0 )
-    buffer[size] = '\0';
+  if ( gm_form_receive(req, &handlers) != 0
+   || s.has_name != s.has_value
+   || (!s.has_name && s.others_set + s.others_failed == 0) ) {
+    gm_nonvolatile_abort();
+    return -1;
+  }
 
-  gm_param_parse(buffer, params, COUNTOF(params));
+  const char * const name = s.has_name ? s.name : "parameters";
+  const char * const value = s.value;
 
-  const char * name = gm_param(params, COUNTOF(params), "name");
-  const char * value = gm_param(params, COUNTOF(params), "value");
-  
-  if ( !name || !value )
-    return -1;
+  if ( s.has_name )
+    result = gm_nonvolatile_set(name, value);
+
+  gm_config_commit();
 
   boilerplate("Setting %s", name)
 
-  result = gm_nonvolatile_set(name, value);
-
-  switch ( result ) {
-  case GM_NOT_SET:
-  case GM_ERROR:
-    text("Non-volatile memory error, not set.");
-    break;
-  case GM_NOT_IN_PARAMETER_TABLE:
-    text("%s is not in the non-volatile parameter table.", name);
-    break;
-  case GM_NORMAL:
-    text("The value was set: %s=%s\n", name, value);
-    break;
-  case GM_SECRET:
-    text("The value was set.");
-    break;
+  if ( s.others_set + s.others_failed > 0 ) {
+    p
+      text("%d values were set, %d were not.", s.others_set, s.others_failed);
+    end
+  }
+
+  if ( s.has_name ) {
+    switch ( result ) {
+    case GM_NOT_SET:
+    case GM_ERROR:
+      text("Non-volatile memory error, not set.");
+      break;
+    case GM_NOT_IN_PARAMETER_TABLE:
+      text("%s is not in the non-volatile parameter table.", name);
+      break;
+    case GM_INVALID:
+      text("That is not a valid value for %s, not set.", name);
+      break;
+    case GM_NORMAL:
+      text("The value was set: %s=%s\n", name, value);
+      break;
+    case GM_SECRET:
+      text("The value was set.");
+      break;
+    }
   }
 
   ul
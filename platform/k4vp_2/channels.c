@@ -0,0 +1,317 @@
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <esp_console.h>
+#include <argtable3/argtable3.h>
+#include "generic_main.h"
+#include "channel_db.h"
+#include "maidenhead.h"
+#include "repeater_index.h"
+
+// The channel and repeater database, on the littlefs partition. It's opened on
+// first use. Only the console uses it, so access is serialized.
+#define CHANNEL_DB_PATH GM_DATA_PATH "/channels.db"
+
+// The index of repeater locations, rebuilt when the database has changed.
+#define REPEATER_INDEX_PATH GM_DATA_PATH "/repeaters.idx"
+
+#define NEAREST_LIMIT	10
+
+static struct {
+    struct arg_str * add;
+    struct arg_dbl * receive;
+    struct arg_dbl * transmit;
+    struct arg_dbl * tone;
+    struct arg_str * tag;
+    struct arg_str * location;
+    struct arg_dbl * low;
+    struct arg_dbl * high;
+    struct arg_str * name;
+    struct arg_int * delete;
+    struct arg_lit * compact;
+    struct arg_str * near;
+    struct arg_dbl * radius;
+    struct arg_int * count;
+    struct arg_str * country;
+    struct arg_str * license_class;
+    struct arg_end * end;
+} args;
+
+static channel_db * db = NULL;
+static repeater_index * repeaters = NULL;
+
+static bool
+print_entry(const channel_db_entry * e, void * context)
+{
+  const radio_channel_data * const c = &e->channel;
+  char tags[64] = "";
+
+  for ( int bit = 0; bit < CHANNEL_DB_TAGS; bit++ ) {
+    const char * const name = channel_db_tag_name(db, bit);
+
+    if ( name && (e->tags & (1UL << bit)) ) {
+      strlcat(tags, name, sizeof(tags));
+      strlcat(tags, " ", sizeof(tags));
+    }
+  }
+
+  gm_printf(
+   "%5u %-12s %9.4f %9.4f %5.1f %s\n",
+   (unsigned int)e->id,
+   e->name,
+   c->receive_frequency,
+   c->transmit_frequency,
+   c->transmit_subaudible_tone,
+   tags);
+  return true;
+}
+
+// A grid locator, or latitude,longitude in degrees.
+static bool
+location(const char * s, float * latitude, float * longitude)
+{
+  if ( maidenhead_to_location(s, latitude, longitude)
+   || (sscanf(s, "%f,%f", latitude, longitude) == 2
+    && *latitude >= -90.0f && *latitude <= 90.0f
+    && *longitude >= -180.0f && *longitude <= 180.0f) )
+    return true;
+
+  gm_printf("%s is not a grid locator or latitude,longitude.\n", s);
+  return false;
+}
+
+static int
+add(void)
+{
+  channel_db_entry e = {};
+
+  if ( args.location->count > 0 && !location(args.location->sval[0], &e.latitude, &e.longitude) )
+    return 1;
+
+  strlcpy(e.name, args.add->sval[0], sizeof(e.name));
+  e.channel.bandwidth = 12.5;
+  e.channel.volume = 1.0;
+  e.channel.receive_frequency = args.receive->dval[0];
+  e.channel.transmit_frequency = args.transmit->count > 0 ? args.transmit->dval[0] : args.receive->dval[0];
+  if ( args.tone->count > 0 ) {
+    e.channel.transmit_subaudible_tone = args.tone->dval[0];
+    e.channel.receive_subaudible_tone = args.tone->dval[0];
+  }
+  for ( int i = 0; i < args.tag->count; i++ ) {
+    const int bit = channel_db_tag(db, args.tag->sval[i]);
+
+    if ( bit < 0 ) {
+      gm_printf("%s: %s\n", args.tag->sval[i], channel_db_error(db));
+      return 1;
+    }
+    e.tags |= 1UL << bit;
+  }
+
+  if ( !channel_db_put(db, &e) ) {
+    gm_printf("%s\n", channel_db_error(db));
+    return 1;
+  }
+  gm_printf("Added channel %u.\n", (unsigned int)e.id);
+  return 0;
+}
+
+static int
+tag_bits(uint32_t * tags)
+{
+  *tags = 0;
+  for ( int i = 0; i < args.tag->count; i++ ) {
+    int bit;
+
+    for ( bit = 0; bit < CHANNEL_DB_TAGS; bit++ ) {
+      const char * const name = channel_db_tag_name(db, bit);
+
+      if ( name && strcasecmp(name, args.tag->sval[i]) == 0 )
+        break;
+    }
+    if ( bit == CHANNEL_DB_TAGS ) {
+      gm_printf("No such tag: %s\n", args.tag->sval[i]);
+      return -1;
+    }
+    *tags |= 1UL << bit;
+  }
+  return 0;
+}
+
+static int
+near(void)
+{
+  repeater_result	results[NEAREST_LIMIT];
+  repeater_query	q = {};
+  char			locator[9];
+  int			count;
+
+  if ( !location(args.near->sval[0], &q.latitude, &q.longitude) )
+    return 1;
+  q.radius = args.radius->count > 0 ? args.radius->dval[0] : 100.0;
+  q.limit = args.count->count > 0 ? args.count->ival[0] : 5;
+  if ( q.limit < 1 || q.limit > NEAREST_LIMIT ) {
+    gm_printf("The count must be 1 to %d.\n", NEAREST_LIMIT);
+    return 1;
+  }
+  if ( args.license_class->count > 0 ) {
+    q.number_of_privileges = repeater_privileges(
+     args.country->count > 0 ? args.country->sval[0] : "US",
+     args.license_class->sval[0],
+     &q.privileges);
+    if ( q.number_of_privileges == 0 ) {
+      gm_printf("Unknown country or license class.\n");
+      return 1;
+    }
+  }
+
+  if ( repeaters && !repeater_index_current(repeaters, db, 0) ) {
+    repeater_index_close(repeaters);
+    repeaters = NULL;
+  }
+  if ( repeaters == NULL ) {
+    repeaters = repeater_index_open(REPEATER_INDEX_PATH);
+    if ( repeaters && !repeater_index_current(repeaters, db, 0) ) {
+      repeater_index_close(repeaters);
+      repeaters = NULL;
+    }
+    if ( repeaters == NULL ) {
+      if ( !repeater_index_build(db, REPEATER_INDEX_PATH, 0)
+       || (repeaters = repeater_index_open(REPEATER_INDEX_PATH)) == NULL ) {
+        gm_printf("Can't build %s: %s\n", REPEATER_INDEX_PATH, strerror(errno));
+        return 1;
+      }
+    }
+  }
+
+  if ( (count = repeater_index_nearest(repeaters, &q, results)) < 0 ) {
+    gm_printf("Can't read %s: %s\n", REPEATER_INDEX_PATH, strerror(errno));
+    return 1;
+  }
+  maidenhead_from_location(q.latitude, q.longitude, locator, 6);
+  gm_printf("Nearest to %s:\n", locator);
+  for ( int i = 0; i < count; i++ ) {
+    const channel_db_entry * const e = channel_db_get(db, results[i].id);
+
+    gm_printf("%7.1f km %s", results[i].distance, results[i].permitted ? "" : "(no privileges) ");
+    if ( e )
+      print_entry(e, NULL);
+  }
+  gm_printf("%d repeaters.\n", count);
+  return 0;
+}
+
+static int run(int argc, char * * argv)
+{
+  channel_db_stats	s;
+  uint32_t		tags;
+  size_t		count;
+
+  int nerrors = arg_parse(argc, argv, (void **) &args);
+  if (nerrors) {
+    arg_print_errors(stderr, args.end, argv[0]);
+      return 1;
+  }
+
+  if ( db == NULL ) {
+    if ( !GM.data_filesystem_mounted ) {
+      gm_printf("The data filesystem is not mounted.\n");
+      return 1;
+    }
+    if ( (db = channel_db_open(CHANNEL_DB_PATH)) == NULL ) {
+      gm_printf("Can't open %s: %s\n", CHANNEL_DB_PATH, strerror(errno));
+      return 1;
+    }
+  }
+
+  if ( args.add->count > 0 ) {
+    if ( args.receive->count == 0 ) {
+      gm_printf("A receive frequency is required.\n");
+      return 1;
+    }
+    return add();
+  }
+
+  if ( args.delete->count > 0 ) {
+    if ( !channel_db_delete(db, args.delete->ival[0]) ) {
+      gm_printf("%s\n", channel_db_error(db));
+      return 1;
+    }
+    return 0;
+  }
+
+  if ( args.near->count > 0 )
+    return near();
+
+  if ( args.compact->count > 0 ) {
+    if ( !channel_db_compact(db) ) {
+      gm_printf("%s\n", channel_db_error(db));
+      return 1;
+    }
+  }
+  else if ( args.low->count > 0 || args.high->count > 0 ) {
+    if ( tag_bits(&tags) != 0 )
+      return 1;
+    count = channel_db_frequency_range(
+     db,
+     args.low->count > 0 ? args.low->dval[0] : 0.0,
+     args.high->count > 0 ? args.high->dval[0] : 1e6,
+     tags,
+     print_entry,
+     NULL);
+    gm_printf("%d channels.\n", (int)count);
+    return 0;
+  }
+  else if ( args.name->count > 0 ) {
+    count = channel_db_name_prefix(db, args.name->sval[0], print_entry, NULL);
+    gm_printf("%d channels.\n", (int)count);
+    return 0;
+  }
+  else if ( args.tag->count > 0 ) {
+    if ( tag_bits(&tags) != 0 )
+      return 1;
+    count = channel_db_frequency_range(db, 0.0, 1e6, tags, print_entry, NULL);
+    gm_printf("%d channels.\n", (int)count);
+    return 0;
+  }
+
+  channel_db_stats_get(db, &s);
+  gm_printf(
+   "%d channels, %d dead records, file %ld bytes, %u compactions.\n",
+   (int)s.entries,
+   (int)s.dead_records,
+   s.file_size,
+   s.compactions);
+  return 0;
+}
+
+CONSTRUCTOR install(void)
+{
+  args.add = arg_str0("a", "add", "name", "Add a channel.");
+  args.receive = arg_dbl0("r", "receive", "MHz", "Receive frequency of the added channel.");
+  args.transmit = arg_dbl0("t", "transmit", "MHz", "Transmit frequency, if it's not the same.");
+  args.tone = arg_dbl0(NULL, "tone", "Hz", "Subaudible tone.");
+  args.tag = arg_strn(NULL, "tag", "tag", 0, 4, "Tag of the added channel, or to query.");
+  args.location = arg_str0("l", "location", "grid|lat,lon", "Location of the added repeater.");
+  args.low = arg_dbl0(NULL, "low", "MHz", "List channels at or above this frequency.");
+  args.high = arg_dbl0(NULL, "high", "MHz", "List channels at or below this frequency.");
+  args.name = arg_str0("n", "name", "prefix", "List channels with names that start with this.");
+  args.delete = arg_int0("d", "delete", "id", "Delete a channel.");
+  args.compact = arg_lit0(NULL, "compact", "Compact the database file.");
+  args.near = arg_str0(NULL, "near", "grid|lat,lon", "List the repeaters nearest to a location.");
+  args.radius = arg_dbl0(NULL, "radius", "km", "Farthest repeater to list, default 100.");
+  args.count = arg_int0(NULL, "count", "n", "Number of repeaters to list, default 5.");
+  args.country = arg_str0(NULL, "country", "code", "Country of the license, default US.");
+  args.license_class = arg_str0(NULL, "class", "class", "License class, to rank repeaters you can use first.");
+  args.end = arg_end(10);
+  static const esp_console_cmd_t command = {
+    .command = "channels",
+    .help = "Query or edit the channel and repeater database.",
+    .hint = NULL,
+    .func = &run,
+    .argtable = &args
+  };
+
+  gm_command_register(&command);
+}
@@ -0,0 +1,899 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include "channel_db.h"
+#include "gm_memory.h"
+
+// File format
+//
+// The file starts with an 8-byte header: the magic string "CHDB", a version
+// byte, and 3 reserved bytes. It is followed by records, each of which has an
+// 8-byte header:
+//
+//   type		1 byte
+//   reserved		1 byte, 0
+//   length		2 bytes, of the payload
+//   crc		4 bytes, CRC-32 of the type, length, and payload
+//
+// and then the payload. Numbers are little-endian, floats are IEEE-754 single
+// precision. Records are written in the order of the changes, and the last one
+// for an identifier wins when the file is loaded.
+//
+// Every change counts one generation. Compaction writes a generation record
+// after the live records, so that the count survives it.
+
+#define MAGIC			"CHDB"
+#define VERSION			1
+#define FILE_HEADER_SIZE	8
+#define RECORD_HEADER_SIZE	8
+#define MAX_PAYLOAD		128
+
+// Compact when there are at least this many dead records, and more dead
+// records than live entries.
+#define COMPACT_MINIMUM		64
+
+enum record_type {
+  RECORD_PUT = 1,
+  RECORD_DELETE = 2,
+  RECORD_TAG = 3,
+  RECORD_GENERATION = 4
+};
+
+typedef struct frequency_key {
+  float		frequency;
+  uint32_t	index;
+} frequency_key;
+
+typedef struct name_key {
+  const char *	name;
+  uint32_t	index;
+} name_key;
+
+struct channel_db {
+  char *		path;
+  FILE *		file;
+  const char *		error_message;
+
+  // Sorted by identifier, so that lookups are a binary search. New entries
+  // always have the highest identifier, so they are appended.
+  channel_db_entry *	entries;
+  size_t		number_of_entries;
+  size_t		capacity;
+  uint32_t		next_id;
+
+  char			tags[CHANNEL_DB_TAGS][CHANNEL_DB_TAG_SIZE];
+
+  // The indexes hold positions in *entries*, so they are rebuilt after any
+  // change, when they are next used. That makes a bulk load one sort rather
+  // than an insertion for each entry.
+  bool			indexes_valid;
+  frequency_key *	by_frequency;
+  name_key *		by_name;
+  uint32_t		tag_offsets[CHANNEL_DB_TAGS + 1];
+  uint32_t *		tag_postings;
+  size_t		tag_postings_capacity;
+
+  size_t		dead_records;
+  long			file_size;
+  unsigned int		compactions;
+  uint32_t		generation;
+};
+
+static uint32_t
+crc32_update(uint32_t crc, const uint8_t * data, size_t size)
+{
+  static uint32_t	table[256];
+  static bool		table_valid = false;
+
+  if ( !table_valid ) {
+    for ( uint32_t i = 0; i < 256; i++ ) {
+      uint32_t c = i;
+      for ( int j = 0; j < 8; j++ )
+        c = (c & 1) ? (0xEDB88320 ^ (c >> 1)) : (c >> 1);
+      table[i] = c;
+    }
+    table_valid = true;
+  }
+
+  crc = ~crc;
+  while ( size-- > 0 )
+    crc = table[(crc ^ *data++) & 0xff] ^ (crc >> 8);
+  return ~crc;
+}
+
+static uint8_t *
+put_u16(uint8_t * p, uint16_t v)
+{
+  *p++ = v & 0xff;
+  *p++ = v >> 8;
+  return p;
+}
+
+static uint8_t *
+put_u32(uint8_t * p, uint32_t v)
+{
+  for ( int i = 0; i < 4; i++ ) {
+    *p++ = v & 0xff;
+    v >>= 8;
+  }
+  return p;
+}
+
+static uint8_t *
+put_float(uint8_t * p, float f)
+{
+  uint32_t v;
+
+  memcpy(&v, &f, sizeof(v));
+  return put_u32(p, v);
+}
+
+static uint16_t
+get_u16(const uint8_t * * p)
+{
+  const uint16_t v = (*p)[0] | ((*p)[1] << 8);
+  *p += 2;
+  return v;
+}
+
+static uint32_t
+get_u32(const uint8_t * * p)
+{
+  uint32_t v = 0;
+
+  for ( int i = 3; i >= 0; i-- )
+    v = (v << 8) | (*p)[i];
+  *p += 4;
+  return v;
+}
+
+static float
+get_float(const uint8_t * * p)
+{
+  const uint32_t v = get_u32(p);
+  float f;
+
+  memcpy(&f, &v, sizeof(f));
+  return f;
+}
+
+static size_t
+encode_entry(uint8_t * buffer, const channel_db_entry * e)
+{
+  const radio_channel_data * const c = &e->channel;
+  const size_t name_length = strnlen(e->name, CHANNEL_DB_NAME_SIZE - 1);
+  uint8_t * p = buffer;
+
+  p = put_u32(p, e->id);
+  p = put_float(p, c->bandwidth);
+  p = put_float(p, c->transmit_power);
+  p = put_float(p, c->transmit_frequency);
+  p = put_float(p, c->receive_frequency);
+  p = put_float(p, c->transmit_subaudible_tone);
+  p = put_float(p, c->receive_subaudible_tone);
+  p = put_float(p, c->squelch_level);
+  p = put_float(p, c->volume);
+  p = put_u16(p, c->transmit_digital_code);
+  p = put_u16(p, c->receive_digital_code);
+  *p++ = (c->preemphasis_deemphasis ? 1 : 0)
+   | (c->low_pass_filter ? 2 : 0)
+   | (c->high_pass_filter ? 4 : 0)
+   | (c->tail_tone ? 8 : 0);
+  p = put_u32(p, e->tags);
+  p = put_float(p, e->latitude);
+  p = put_float(p, e->longitude);
+  *p++ = (uint8_t)name_length;
+  memcpy(p, e->name, name_length);
+  p += name_length;
+  return p - buffer;
+}
+
+static bool
+decode_entry(const uint8_t * buffer, size_t size, channel_db_entry * e)
+{
+  const uint8_t * p = buffer;
+  radio_channel_data * const c = &e->channel;
+
+  // The fixed part, and the name length.
+  if ( size < 54 )
+    return false;
+
+  memset(e, 0, sizeof(*e));
+  e->id = get_u32(&p);
+  c->bandwidth = get_float(&p);
+  c->transmit_power = get_float(&p);
+  c->transmit_frequency = get_float(&p);
+  c->receive_frequency = get_float(&p);
+  c->transmit_subaudible_tone = get_float(&p);
+  c->receive_subaudible_tone = get_float(&p);
+  c->squelch_level = get_float(&p);
+  c->volume = get_float(&p);
+  c->transmit_digital_code = get_u16(&p);
+  c->receive_digital_code = get_u16(&p);
+  const uint8_t flags = *p++;
+  c->preemphasis_deemphasis = (flags & 1) != 0;
+  c->low_pass_filter = (flags & 2) != 0;
+  c->high_pass_filter = (flags & 4) != 0;
+  c->tail_tone = (flags & 8) != 0;
+  e->tags = get_u32(&p);
+  e->latitude = get_float(&p);
+  e->longitude = get_float(&p);
+  const size_t name_length = *p++;
+  if ( name_length >= CHANNEL_DB_NAME_SIZE || (size_t)(p - buffer) + name_length != size )
+    return false;
+  memcpy(e->name, p, name_length);
+  return true;
+}
+
+static bool
+write_record(channel_db * db, FILE * f, enum record_type type, const uint8_t * payload, size_t length)
+{
+  uint8_t header[RECORD_HEADER_SIZE];
+  uint8_t * p = header;
+
+  *p++ = type;
+  *p++ = 0;
+  p = put_u16(p, (uint16_t)length);
+  uint32_t crc = crc32_update(0, header, 4);
+  crc = crc32_update(crc, payload, length);
+  (void)put_u32(p, crc);
+
+  if ( fwrite(header, sizeof(header), 1, f) != 1
+   || (length > 0 && fwrite(payload, length, 1, f) != 1) ) {
+    db->error_message = "Write failed.";
+    return false;
+  }
+  return true;
+}
+
+// Write a record to the database file, and make it durable.
+static bool
+append(channel_db * db, enum record_type type, const uint8_t * payload, size_t length)
+{
+  if ( !write_record(db, db->file, type, payload, length)
+   || fflush(db->file) != 0
+   || fsync(fileno(db->file)) != 0 ) {
+    // Part of the record may have been written. Rewrite the file from RAM, so
+    // that later records aren't appended after a damaged one.
+    (void)channel_db_compact(db);
+    db->error_message = "Write failed.";
+    return false;
+  }
+  db->file_size += RECORD_HEADER_SIZE + length;
+  db->generation++;
+  return true;
+}
+
+static long
+find_position(const channel_db * db, uint32_t id)
+{
+  size_t low = 0;
+  size_t high = db->number_of_entries;
+
+  while ( low < high ) {
+    const size_t middle = low + (high - low) / 2;
+    const uint32_t m = db->entries[middle].id;
+
+    if ( m == id )
+      return (long)middle;
+    else if ( m < id )
+      low = middle + 1;
+    else
+      high = middle;
+  }
+  return -1;
+}
+
+// Store an entry in RAM.
+static bool
+store(channel_db * db, const channel_db_entry * e)
+{
+  const long position = find_position(db, e->id);
+
+  db->indexes_valid = false;
+
+  if ( position >= 0 ) {
+    db->entries[position] = *e;
+    db->dead_records++;
+    return true;
+  }
+
+  if ( db->number_of_entries == db->capacity ) {
+    const size_t capacity = db->capacity ? db->capacity * 2 : 64;
+    channel_db_entry * const entries = gm_realloc(GM_MEMORY_CHANNELS, db->entries, capacity * sizeof(*entries));
+
+    if ( entries == NULL ) {
+      db->error_message = "Out of memory.";
+      return false;
+    }
+    db->entries = entries;
+    db->capacity = capacity;
+  }
+
+  // Identifiers almost always arrive in ascending order, but an entry that was
+  // deleted and re-created in an older file may not.
+  size_t i = db->number_of_entries;
+  while ( i > 0 && db->entries[i - 1].id > e->id ) {
+    db->entries[i] = db->entries[i - 1];
+    i--;
+  }
+  db->entries[i] = *e;
+  db->number_of_entries++;
+
+  if ( e->id >= db->next_id )
+    db->next_id = e->id + 1;
+  return true;
+}
+
+static void
+forget(channel_db * db, uint32_t id)
+{
+  const long position = find_position(db, id);
+
+  if ( position < 0 )
+    return;
+
+  memmove(
+   &db->entries[position],
+   &db->entries[position + 1],
+   (db->number_of_entries - position - 1) * sizeof(*db->entries));
+  db->number_of_entries--;
+  db->indexes_valid = false;
+  // The deletion record, and the record it deletes.
+  db->dead_records += 2;
+}
+
+static bool
+apply(channel_db * db, enum record_type type, const uint8_t * payload, size_t length)
+{
+  channel_db_entry	e;
+  const uint8_t *	p = payload;
+
+  switch ( type ) {
+  case RECORD_PUT:
+    if ( !decode_entry(payload, length, &e) || !store(db, &e) )
+      return false;
+    db->generation++;
+    return true;
+  case RECORD_DELETE:
+    if ( length != 4 )
+      return false;
+    forget(db, get_u32(&p));
+    db->generation++;
+    return true;
+  case RECORD_TAG:
+    if ( length < 2 || payload[0] >= CHANNEL_DB_TAGS || payload[1] >= CHANNEL_DB_TAG_SIZE
+     || (size_t)payload[1] + 2 != length )
+      return false;
+    memset(db->tags[payload[0]], 0, CHANNEL_DB_TAG_SIZE);
+    memcpy(db->tags[payload[0]], &payload[2], payload[1]);
+    db->generation++;
+    return true;
+  case RECORD_GENERATION:
+    if ( length != 4 )
+      return false;
+    db->generation = get_u32(&p);
+    return true;
+  default:
+    // A record type from a later version. Skip it.
+    return true;
+  }
+}
+
+typedef enum load_result {
+  LOAD_OK,
+  LOAD_DAMAGED,		// The good records before the damage were loaded.
+  LOAD_NOT_A_DATABASE
+} load_result;
+
+// Read the file into RAM.
+static load_result
+load(channel_db * db, FILE * f)
+{
+  uint8_t header[RECORD_HEADER_SIZE];
+  uint8_t payload[MAX_PAYLOAD];
+  const size_t got = fread(header, 1, FILE_HEADER_SIZE, f);
+
+  db->file_size = FILE_HEADER_SIZE;
+
+  // An empty file is left if power failed while it was being created.
+  if ( got == 0 )
+    return LOAD_DAMAGED;
+  if ( got != FILE_HEADER_SIZE || memcmp(header, MAGIC, 4) != 0 || header[4] != VERSION )
+    return LOAD_NOT_A_DATABASE;
+
+  for ( ; ; ) {
+    const size_t got = fread(header, 1, sizeof(header), f);
+    const uint8_t * p = &header[2];
+
+    if ( got == 0 )
+      return LOAD_OK;
+    if ( got != sizeof(header) )
+      return LOAD_DAMAGED;
+
+    const size_t length = get_u16(&p);
+    const uint32_t crc = get_u32(&p);
+
+    if ( length > sizeof(payload)
+     || (length > 0 && fread(payload, length, 1, f) != 1) )
+      return LOAD_DAMAGED;
+
+    if ( crc32_update(crc32_update(0, header, 4), payload, length) != crc )
+      return LOAD_DAMAGED;
+
+    if ( !apply(db, header[0], payload, length) )
+      return LOAD_DAMAGED;
+
+    db->file_size += RECORD_HEADER_SIZE + length;
+  }
+}
+
+static bool
+write_header(FILE * f)
+{
+  const uint8_t header[FILE_HEADER_SIZE] = { 'C', 'H', 'D', 'B', VERSION, 0, 0, 0 };
+
+  return fwrite(header, sizeof(header), 1, f) == 1;
+}
+
+static bool
+encode_tag(const channel_db * db, int bit, uint8_t * payload, size_t * length)
+{
+  const size_t name_length = strlen(db->tags[bit]);
+
+  payload[0] = (uint8_t)bit;
+  payload[1] = (uint8_t)name_length;
+  memcpy(&payload[2], db->tags[bit], name_length);
+  *length = name_length + 2;
+  return true;
+}
+
+static void
+maybe_compact(channel_db * db)
+{
+  if ( db->dead_records >= COMPACT_MINIMUM && db->dead_records > db->number_of_entries )
+    (void)channel_db_compact(db);
+}
+
+static int
+compare_frequency(const void * a, const void * b)
+{
+  const frequency_key * const x = a;
+  const frequency_key * const y = b;
+
+  if ( x->frequency < y->frequency )
+    return -1;
+  else if ( x->frequency > y->frequency )
+    return 1;
+  else
+    return (x->index > y->index) - (x->index < y->index);
+}
+
+static int
+compare_name(const void * a, const void * b)
+{
+  const name_key * const x = a;
+  const name_key * const y = b;
+  const int result = strcasecmp(x->name, y->name);
+
+  if ( result != 0 )
+    return result;
+  return (x->index > y->index) - (x->index < y->index);
+}
+
+static bool
+build_indexes(channel_db * db)
+{
+  const size_t n = db->number_of_entries;
+  size_t postings = 0;
+
+  if ( db->indexes_valid )
+    return true;
+
+  gm_free(db->by_frequency);
+  gm_free(db->by_name);
+  db->by_frequency = gm_malloc(GM_MEMORY_CHANNELS, (n ? n : 1) * sizeof(*db->by_frequency));
+  db->by_name = gm_malloc(GM_MEMORY_CHANNELS, (n ? n : 1) * sizeof(*db->by_name));
+  if ( db->by_frequency == NULL || db->by_name == NULL ) {
+    db->error_message = "Out of memory.";
+    return false;
+  }
+
+  memset(db->tag_offsets, 0, sizeof(db->tag_offsets));
+  for ( size_t i = 0; i < n; i++ ) {
+    const channel_db_entry * const e = &db->entries[i];
+
+    db->by_frequency[i].frequency = e->channel.receive_frequency;
+    db->by_frequency[i].index = i;
+    db->by_name[i].name = e->name;
+    db->by_name[i].index = i;
+    for ( int bit = 0; bit < CHANNEL_DB_TAGS; bit++ ) {
+      if ( e->tags & (1UL << bit) ) {
+        db->tag_offsets[bit + 1]++;
+        postings++;
+      }
+    }
+  }
+  qsort(db->by_frequency, n, sizeof(*db->by_frequency), compare_frequency);
+  qsort(db->by_name, n, sizeof(*db->by_name), compare_name);
+
+  // The tag index is a list of entry positions for each tag, all in one array.
+  if ( postings > db->tag_postings_capacity ) {
+    uint32_t * const p = gm_realloc(GM_MEMORY_CHANNELS, db->tag_postings, postings * sizeof(*p));
+
+    if ( p == NULL ) {
+      db->error_message = "Out of memory.";
+      return false;
+    }
+    db->tag_postings = p;
+    db->tag_postings_capacity = postings;
+  }
+  for ( int bit = 0; bit < CHANNEL_DB_TAGS; bit++ )
+    db->tag_offsets[bit + 1] += db->tag_offsets[bit];
+
+  uint32_t fill[CHANNEL_DB_TAGS];
+  memcpy(fill, db->tag_offsets, sizeof(fill));
+  for ( size_t i = 0; i < n; i++ ) {
+    for ( int bit = 0; bit < CHANNEL_DB_TAGS; bit++ ) {
+      if ( db->entries[i].tags & (1UL << bit) )
+        db->tag_postings[fill[bit]++] = i;
+    }
+  }
+
+  db->indexes_valid = true;
+  return true;
+}
+
+channel_db *
+channel_db_open(const char * path)
+{
+  channel_db * const db = gm_calloc(GM_MEMORY_CHANNELS, 1, sizeof(*db));
+  load_result result = LOAD_OK;
+
+  if ( db == NULL )
+    return NULL;
+
+  db->next_id = 1;
+  db->path = gm_strdup(GM_MEMORY_CHANNELS, path);
+  if ( db->path == NULL ) {
+    gm_free(db);
+    return NULL;
+  }
+
+  FILE * const f = fopen(path, "rb");
+  if ( f ) {
+    result = load(db, f);
+    fclose(f);
+    if ( result == LOAD_NOT_A_DATABASE ) {
+      channel_db_close(db);
+      errno = EINVAL;
+      return NULL;
+    }
+  }
+  else if ( errno == ENOENT ) {
+    FILE * const n = fopen(path, "wb");
+
+    if ( n == NULL || !write_header(n) || fclose(n) != 0 ) {
+      channel_db_close(db);
+      return NULL;
+    }
+    db->file_size = FILE_HEADER_SIZE;
+  }
+  else {
+    const int error = errno;
+
+    channel_db_close(db);
+    errno = error;
+    return NULL;
+  }
+
+  db->file = fopen(path, "ab");
+  if ( db->file == NULL ) {
+    const int error = errno;
+
+    channel_db_close(db);
+    errno = error;
+    return NULL;
+  }
+
+  // Rewrite the file without the damaged part, so that new records aren't
+  // appended after it.
+  if ( result == LOAD_DAMAGED && !channel_db_compact(db) ) {
+    channel_db_close(db);
+    errno = EIO;
+    return NULL;
+  }
+  return db;
+}
+
+void
+channel_db_close(channel_db * db)
+{
+  if ( db->file ) {
+    fflush(db->file);
+    fsync(fileno(db->file));
+    fclose(db->file);
+  }
+  gm_free(db->entries);
+  gm_free(db->by_frequency);
+  gm_free(db->by_name);
+  gm_free(db->tag_postings);
+  gm_free(db->path);
+  gm_free(db);
+}
+
+bool
+channel_db_compact(channel_db * db)
+{
+  const size_t	path_length = strlen(db->path);
+  char *	temporary = gm_malloc(GM_MEMORY_CHANNELS, path_length + 5);
+  uint8_t	payload[MAX_PAYLOAD];
+  size_t	length;
+  bool		ok;
+
+  if ( temporary == NULL ) {
+    db->error_message = "Out of memory.";
+    return false;
+  }
+  memcpy(temporary, db->path, path_length);
+  memcpy(&temporary[path_length], ".tmp", 5);
+
+  FILE * const f = fopen(temporary, "wb");
+  if ( f == NULL ) {
+    db->error_message = "Can't create the compacted file.";
+    gm_free(temporary);
+    return false;
+  }
+
+  ok = write_header(f);
+  for ( int bit = 0; ok && bit < CHANNEL_DB_TAGS; bit++ ) {
+    if ( db->tags[bit][0] != '\0' && encode_tag(db, bit, payload, &length) )
+      ok = write_record(db, f, RECORD_TAG, payload, length);
+  }
+  for ( size_t i = 0; ok && i < db->number_of_entries; i++ ) {
+    length = encode_entry(payload, &db->entries[i]);
+    ok = write_record(db, f, RECORD_PUT, payload, length);
+  }
+  if ( ok ) {
+    (void)put_u32(payload, db->generation);
+    ok = write_record(db, f, RECORD_GENERATION, payload, 4);
+  }
+  ok = ok && fflush(f) == 0 && fsync(fileno(f)) == 0;
+  const long size = ftell(f);
+  ok = (fclose(f) == 0) && ok;
+
+  if ( !ok ) {
+    remove(temporary);
+    gm_free(temporary);
+    db->error_message = "Write failed during compaction.";
+    return false;
+  }
+
+  // rename() replaces the old file atomically, so a power failure leaves
+  // either the old file or the new one.
+  fclose(db->file);
+  db->file = NULL;
+  ok = rename(temporary, db->path) == 0;
+  gm_free(temporary);
+
+  db->file = fopen(db->path, "ab");
+  if ( !ok || db->file == NULL ) {
+    db->error_message = "Can't replace the database file.";
+    return false;
+  }
+
+  db->file_size = size;
+  db->dead_records = 0;
+  db->compactions++;
+  return true;
+}
+
+bool
+channel_db_delete(channel_db * db, uint32_t id)
+{
+  uint8_t payload[4];
+
+  if ( find_position(db, id) < 0 ) {
+    db->error_message = "No such entry.";
+    return false;
+  }
+
+  (void)put_u32(payload, id);
+  if ( !append(db, RECORD_DELETE, payload, sizeof(payload)) )
+    return false;
+
+  forget(db, id);
+  maybe_compact(db);
+  return true;
+}
+
+const char *
+channel_db_error(const channel_db * db)
+{
+  return db->error_message ? db->error_message : "No error.";
+}
+
+size_t
+channel_db_frequency_range(
+ channel_db *		db,
+ float			low,
+ float			high,
+ uint32_t		tags,
+ channel_db_coroutine	coroutine,
+ void *			context)
+{
+  size_t count = 0;
+
+  if ( !build_indexes(db) )
+    return 0;
+
+  // Find the first entry at or above the low frequency.
+  size_t first = 0;
+  size_t last = db->number_of_entries;
+  while ( first < last ) {
+    const size_t middle = first + (last - first) / 2;
+
+    if ( db->by_frequency[middle].frequency < low )
+      first = middle + 1;
+    else
+      last = middle;
+  }
+
+  for ( size_t i = first; i < db->number_of_entries; i++ ) {
+    const frequency_key * const k = &db->by_frequency[i];
+    const channel_db_entry * const e = &db->entries[k->index];
+
+    if ( k->frequency > high )
+      break;
+    if ( (e->tags & tags) != tags )
+      continue;
+    count++;
+    if ( !(*coroutine)(e, context) )
+      break;
+  }
+  return count;
+}
+
+const channel_db_entry *
+channel_db_get(channel_db * db, uint32_t id)
+{
+  const long position = find_position(db, id);
+
+  return position >= 0 ? &db->entries[position] : NULL;
+}
+
+size_t
+channel_db_name_prefix(
+ channel_db *		db,
+ const char *		prefix,
+ channel_db_coroutine	coroutine,
+ void *			context)
+{
+  const size_t	prefix_length = strlen(prefix);
+  size_t	count = 0;
+
+  if ( !build_indexes(db) )
+    return 0;
+
+  size_t first = 0;
+  size_t last = db->number_of_entries;
+  while ( first < last ) {
+    const size_t middle = first + (last - first) / 2;
+
+    if ( strcasecmp(db->by_name[middle].name, prefix) < 0 )
+      first = middle + 1;
+    else
+      last = middle;
+  }
+
+  for ( size_t i = first; i < db->number_of_entries; i++ ) {
+    const name_key * const k = &db->by_name[i];
+
+    if ( strncasecmp(k->name, prefix, prefix_length) != 0 )
+      break;
+    count++;
+    if ( !(*coroutine)(&db->entries[k->index], context) )
+      break;
+  }
+  return count;
+}
+
+bool
+channel_db_put(channel_db * db, channel_db_entry * entry)
+{
+  uint8_t	payload[MAX_PAYLOAD];
+  bool		is_new = false;
+
+  if ( entry->id == 0 ) {
+    entry->id = db->next_id;
+    is_new = true;
+  }
+  else if ( find_position(db, entry->id) < 0 ) {
+    db->error_message = "No such entry.";
+    return false;
+  }
+  entry->name[CHANNEL_DB_NAME_SIZE - 1] = '\0';
+
+  const size_t length = encode_entry(payload, entry);
+  if ( !append(db, RECORD_PUT, payload, length) || !store(db, entry) ) {
+    if ( is_new )
+      entry->id = 0;
+    return false;
+  }
+  maybe_compact(db);
+  return true;
+}
+
+void
+channel_db_stats_get(const channel_db * db, channel_db_stats * stats)
+{
+  stats->entries = db->number_of_entries;
+  stats->dead_records = db->dead_records;
+  stats->file_size = db->file_size;
+  stats->compactions = db->compactions;
+  stats->generation = db->generation;
+}
+
+int
+channel_db_tag(channel_db * db, const char * name)
+{
+  uint8_t	payload[CHANNEL_DB_TAG_SIZE + 2];
+  size_t	length;
+  int		free_bit = -1;
+
+  if ( *name == '\0' || strlen(name) >= CHANNEL_DB_TAG_SIZE ) {
+    db->error_message = "Invalid tag name.";
+    return -1;
+  }
+
+  for ( int bit = 0; bit < CHANNEL_DB_TAGS; bit++ ) {
+    if ( strcasecmp(db->tags[bit], name) == 0 )
+      return bit;
+    if ( free_bit < 0 && db->tags[bit][0] == '\0' )
+      free_bit = bit;
+  }
+
+  if ( free_bit < 0 ) {
+    db->error_message = "Too many tags.";
+    return -1;
+  }
+
+  strcpy(db->tags[free_bit], name);
+  (void)encode_tag(db, free_bit, payload, &length);
+  if ( !append(db, RECORD_TAG, payload, length) ) {
+    db->tags[free_bit][0] = '\0';
+    return -1;
+  }
+  return free_bit;
+}
+
+const char *
+channel_db_tag_name(const channel_db * db, int bit)
+{
+  if ( bit < 0 || bit >= CHANNEL_DB_TAGS || db->tags[bit][0] == '\0' )
+    return NULL;
+  return db->tags[bit];
+}
+
+size_t
+channel_db_tagged(
+ channel_db *		db,
+ int			bit,
+ channel_db_coroutine	coroutine,
+ void *			context)
+{
+  size_t count = 0;
+
+  if ( bit < 0 || bit >= CHANNEL_DB_TAGS || !build_indexes(db) )
+    return 0;
+
+  for ( uint32_t i = db->tag_offsets[bit]; i < db->tag_offsets[bit + 1]; i++ ) {
+    count++;
+    if ( !(*coroutine)(&db->entries[db->tag_postings[i]], context) )
+      break;
+  }
+  return count;
+}
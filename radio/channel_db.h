@@ -0,0 +1,181 @@
+#ifndef _CHANNEL_DB_DOT_H_
+#define _CHANNEL_DB_DOT_H_
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "radio.h"
+
+/// Channel database: a persistent directory of channel memories and repeaters.
+///
+/// The database is a file of records that is only appended to. Changing a
+/// channel appends a new copy of it, and deleting one appends a deletion
+/// record. When enough of the file is superseded records, it's compacted by
+/// writing the live records to a new file and renaming it over the old one.
+/// This suits FLASH filesystems like littlefs, which wear less with appends
+/// than with rewrites in place.
+///
+/// All of the entries are kept in RAM, with indexes by frequency, name, and
+/// tag, so that queries don't read the file.
+///
+/// This is portable C using stdio, it runs on the host as well as the device.
+/// It is not thread-safe, the caller must serialize access to a database.
+
+/// The maximum length of a channel name, including the terminating null.
+#define CHANNEL_DB_NAME_SIZE	24
+
+/// The maximum length of a tag name, including the terminating null.
+#define CHANNEL_DB_TAG_SIZE	16
+
+/// The number of distinct tags in a database.
+#define CHANNEL_DB_TAGS		32
+
+/// Opaque context for an open database.
+struct channel_db;
+typedef struct channel_db channel_db;
+
+/// A channel in the database.
+typedef struct channel_db_entry {
+  /// The database assigns the identifier when an entry is first stored.
+  /// It is 0 for a new entry.
+  uint32_t		id;
+
+  /// The transceiver settings for the channel.
+  radio_channel_data	channel;
+
+  /// The channel name, like a repeater callsign.
+  char			name[CHANNEL_DB_NAME_SIZE];
+
+  /// A bit for each tag, see channel_db_tag().
+  uint32_t		tags;
+
+  /// The location of a repeater, in degrees. 0, 0 for none.
+  float			latitude;
+  float			longitude;
+} channel_db_entry;
+
+/// Statistics about a database.
+typedef struct channel_db_stats {
+  /// The number of live entries.
+  size_t	entries;
+
+  /// Records in the file that are superseded by later ones.
+  size_t	dead_records;
+
+  /// The size of the file in bytes.
+  long		file_size;
+
+  /// The number of compactions since the database was opened.
+  unsigned int	compactions;
+
+  /// The number of changes since the database was created. Compaction
+  /// doesn't change it, so it identifies the contents of the database.
+  uint32_t	generation;
+} channel_db_stats;
+
+/// Type for the pointer to a coroutine that receives query results.
+/// Return false to stop the query.
+///
+typedef bool (*channel_db_coroutine)(const channel_db_entry * entry, void * context);
+
+/// Open a database, creating the file if it doesn't exist, and load it into
+/// RAM. A damaged record at the end of the file, as from a power failure
+/// during a write, is discarded.
+///
+/// \return The database context, or NULL with *errno* set.
+///
+extern channel_db /*@null@*/ *
+channel_db_open(const char * path);
+
+/// Close the database and release all resources.
+///
+extern void
+channel_db_close(channel_db /*@only@*/ * db);
+
+/// Compact the file, so that it contains only the live entries. This is done
+/// automatically, when enough of the file is dead records.
+///
+extern bool
+channel_db_compact(channel_db * db);
+
+/// Delete an entry.
+///
+extern bool
+channel_db_delete(channel_db * db, uint32_t id);
+
+/// Get the message for the last error.
+///
+extern const char *
+channel_db_error(const channel_db * db);
+
+/// Query the entries with a receive frequency in a range, inclusive,
+/// in order of frequency. If *tags* is not 0, only the entries that have all
+/// of those tags are returned.
+///
+/// \return The number of entries passed to the coroutine.
+///
+extern size_t
+channel_db_frequency_range(
+ channel_db *		db,
+ float			low,
+ float			high,
+ uint32_t		tags,
+ channel_db_coroutine	coroutine,
+ void *			context);
+
+/// Get an entry by its identifier.
+///
+/// \return The entry, which is valid until the next change to the database,
+/// or NULL if there is no such entry.
+///
+extern const channel_db_entry /*@null@*/ *
+channel_db_get(channel_db * db, uint32_t id);
+
+/// Query the entries with a name that starts with *prefix*, ignoring case,
+/// in order of name.
+///
+/// \return The number of entries passed to the coroutine.
+///
+extern size_t
+channel_db_name_prefix(
+ channel_db *		db,
+ const char *		prefix,
+ channel_db_coroutine	coroutine,
+ void *			context);
+
+/// Store an entry. If *entry->id* is 0, a new entry is created and its
+/// identifier is set in *entry*. Otherwise the existing entry is replaced.
+///
+extern bool
+channel_db_put(channel_db * db, channel_db_entry * entry);
+
+/// Get statistics about the database.
+///
+extern void
+channel_db_stats_get(const channel_db * db, channel_db_stats * stats);
+
+/// Get the bit for a tag name, creating the tag if it doesn't yet exist.
+///
+/// \return The bit number, or -1 if the name is too long or there are already
+/// CHANNEL_DB_TAGS tags.
+///
+extern int
+channel_db_tag(channel_db * db, const char * name);
+
+/// Get the name of a tag bit, or NULL if it's not in use.
+///
+extern const char /*@null@*/ *
+channel_db_tag_name(const channel_db * db, int bit);
+
+/// Query the entries that have a tag, in order of identifier.
+///
+/// \return The number of entries passed to the coroutine.
+///
+extern size_t
+channel_db_tagged(
+ channel_db *		db,
+ int			bit,
+ channel_db_coroutine	coroutine,
+ void *			context);
+
+#endif
@@ -0,0 +1,115 @@
+#include <math.h>
+#include <ctype.h>
+#include "maidenhead.h"
+
+#define EARTH_RADIUS_KM	6371.0
+#define RADIANS(d)	((d) * (M_PI / 180.0))
+
+float
+maidenhead_distance(float latitude1, float longitude1, float latitude2, float longitude2)
+{
+  // Haversine.
+  const double d_latitude = RADIANS(latitude2 - latitude1);
+  const double d_longitude = RADIANS(longitude2 - longitude1);
+  const double a = sin(d_latitude / 2) * sin(d_latitude / 2)
+   + cos(RADIANS(latitude1)) * cos(RADIANS(latitude2))
+   * sin(d_longitude / 2) * sin(d_longitude / 2);
+
+  return (float)(2 * EARTH_RADIUS_KM * atan2(sqrt(a), sqrt(1 - a)));
+}
+
+bool
+maidenhead_to_location(const char * locator, float * latitude, float * longitude)
+{
+  // The size of each pair in degrees of longitude. Latitude is half of that.
+  static const double sizes[] = { 20.0, 2.0, 2.0 / 24.0, 2.0 / 240.0 };
+  // The letter or digit range of each pair.
+  static const int ranges[] = { 18, 10, 24, 10 };
+  double lon = -180.0;
+  double lat = -90.0;
+  int pairs = 0;
+
+  while ( pairs < 4 && locator[pairs * 2] != '\0' ) {
+    const char a = locator[pairs * 2];
+    const char b = locator[pairs * 2 + 1];
+    int x, y;
+
+    if ( b == '\0' )
+      return false;
+
+    if ( ranges[pairs] == 10 ) {
+      if ( !isdigit((unsigned char)a) || !isdigit((unsigned char)b) )
+        return false;
+      x = a - '0';
+      y = b - '0';
+    }
+    else {
+      x = toupper((unsigned char)a) - 'A';
+      y = toupper((unsigned char)b) - 'A';
+      if ( x < 0 || x >= ranges[pairs] || y < 0 || y >= ranges[pairs] )
+        return false;
+    }
+    lon += x * sizes[pairs];
+    lat += y * sizes[pairs] / 2;
+    pairs++;
+  }
+
+  if ( pairs == 0 || locator[pairs * 2] != '\0' )
+    return false;
+
+  // The center of the smallest area.
+  *longitude = (float)(lon + sizes[pairs - 1] / 2);
+  *latitude = (float)(lat + sizes[pairs - 1] / 4);
+  return true;
+}
+
+bool
+maidenhead_from_location(float latitude, float longitude, char * locator, size_t characters)
+{
+  static const double sizes[] = { 20.0, 2.0, 2.0 / 24.0, 2.0 / 240.0 };
+  static const char bases[] = { 'A', '0', 'a', '0' };
+  static const int ranges[] = { 18, 10, 24, 10 };
+
+  if ( characters < 2 || characters > 8 || (characters & 1) != 0
+   || latitude < -90.0f || latitude > 90.0f || longitude < -180.0f || longitude > 180.0f )
+    return false;
+
+  double lon = longitude + 180.0;
+  double lat = latitude + 90.0;
+
+  for ( size_t pair = 0; pair < characters / 2; pair++ ) {
+    int x = (int)(lon / sizes[pair]);
+    int y = (int)(lat / (sizes[pair] / 2));
+
+    // The east and north edges belong to the last area.
+    if ( x >= ranges[pair] )
+      x = ranges[pair] - 1;
+    if ( y >= ranges[pair] )
+      y = ranges[pair] - 1;
+
+    locator[pair * 2] = bases[pair] + x;
+    locator[pair * 2 + 1] = bases[pair] + y;
+    lon -= x * sizes[pair];
+    lat -= y * sizes[pair] / 2;
+  }
+  locator[characters] = '\0';
+  return true;
+}
+
+uint16_t
+maidenhead_square(float latitude, float longitude)
+{
+  int x = (int)floorf((longitude + 180.0f) / 2.0f);
+  int y = (int)floorf(latitude + 90.0f);
+
+  if ( x < 0 )
+    x = 0;
+  else if ( x >= MAIDENHEAD_SQUARES_LONGITUDE )
+    x = MAIDENHEAD_SQUARES_LONGITUDE - 1;
+  if ( y < 0 )
+    y = 0;
+  else if ( y >= MAIDENHEAD_SQUARES_LATITUDE )
+    y = MAIDENHEAD_SQUARES_LATITUDE - 1;
+
+  return (uint16_t)(x * MAIDENHEAD_SQUARES_LATITUDE + y);
+}
@@ -0,0 +1,45 @@
+#ifndef _MAIDENHEAD_DOT_H_
+#define _MAIDENHEAD_DOT_H_
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/// Maidenhead grid locators, like "CM87wj", and distances on the earth.
+///
+/// A field (two letters) is 20 degrees of longitude by 10 of latitude, a
+/// square (two digits) is 2 degrees by 1, and a subsquare (two letters) is
+/// 5 minutes by 2.5 minutes.
+
+/// The number of 2-by-1 degree grid squares across the globe, in each axis.
+#define MAIDENHEAD_SQUARES_LONGITUDE	180
+#define MAIDENHEAD_SQUARES_LATITUDE	180
+
+/// Get the distance in kilometers between two locations, in degrees.
+///
+extern float
+maidenhead_distance(float latitude1, float longitude1, float latitude2, float longitude2);
+
+/// Convert a locator of 2, 4, 6, or 8 characters to the location of the center
+/// of the area it describes.
+///
+/// \return False if the locator is not valid.
+///
+extern bool
+maidenhead_to_location(const char * locator, float * latitude, float * longitude);
+
+/// Convert a location to a locator of *characters* length: 2, 4, 6, or 8.
+/// *locator* must have room for *characters* + 1.
+///
+/// \return False if the location or the length is not valid.
+///
+extern bool
+maidenhead_from_location(float latitude, float longitude, char * locator, size_t characters);
+
+/// Get the number of the 2-by-1 degree grid square containing a location.
+/// The number is longitude_index * MAIDENHEAD_SQUARES_LATITUDE + latitude_index.
+///
+extern uint16_t
+maidenhead_square(float latitude, float longitude);
+
+#endif
@@ -1,6 +1,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include "radio.h"
+#include "gm_telemetry.h"
 
 bool
 radio_channel(radio_module * const c, const unsigned int channel)
@@ -14,10 +15,16 @@ radio_end(radio_module /*@owned@*/ * const c)
   return (*(c->end))(c);
 }
 
+// A scanner hit is any frequency that is occupied, and goes to the live
+// telemetry. The drivers all come through here, so none of them report it.
 bool
 radio_frequency_rssi(radio_module * const c, const float frequency, float * const rssi)
 {
-  return (*(c->frequency_rssi))(c, frequency, rssi);
+  if ( !(*(c->frequency_rssi))(c, frequency, rssi) )
+    return false;
+  if ( *rssi > 0.0f )
+    gm_telemetry_scan(frequency, *rssi);
+  return true;
 }
 
 bool
@@ -35,13 +42,19 @@ radio_heartbeat(radio_module * const c)
 bool
 radio_receive(radio_module * const c)
 {
-  return (*(c->receive))(c);
+  if ( !(*(c->receive))(c) )
+    return false;
+  gm_telemetry_sample(GM_TELEMETRY_TRANSMIT, 0.0f);
+  return true;
 }
 
 bool
 radio_rssi(radio_module * const c, float * const rssi)
 {
-  return (*(c->rssi))(c, rssi);
+  if ( !(*(c->rssi))(c, rssi) )
+    return false;
+  gm_telemetry_sample(GM_TELEMETRY_RSSI, *rssi);
+  return true;
 }
 
 // Set parameters in a channel of the module.
@@ -59,5 +72,8 @@ radio_set(
 bool
 radio_transmit(radio_module * const c)
 {
-  return (*(c->transmit))(c);
+  if ( !(*(c->transmit))(c) )
+    return false;
+  gm_telemetry_sample(GM_TELEMETRY_TRANSMIT, 1.0f);
+  return true;
 }
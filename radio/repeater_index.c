@@ -0,0 +1,517 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <math.h>
+#include <unistd.h>
+#include "maidenhead.h"
+#include "repeater_index.h"
+#include "gm_memory.h"
+
+// File format
+//
+// A header, then a directory of the grid squares that have repeaters, in order
+// of square number, then the repeater records, grouped by square in the same
+// order. The structures are written as they are in memory, so this assumes a
+// little-endian processor with IEEE-754 floats, as are the ESP32 family and
+// the usual hosts. The index is built on the device that uses it, so it's
+// never moved between them.
+//
+// The header records the generation of the channel database the index was
+// built from, so that a stale index can be detected and rebuilt.
+
+#define MAGIC		"RPTI"
+#define VERSION		2
+
+#define EARTH_RADIUS_KM	6371.0
+#define KM_PER_DEGREE	(EARTH_RADIUS_KM * M_PI / 180.0)
+
+// Records read from the file at once.
+#define READ_RECORDS	16
+
+typedef struct file_header {
+  char		magic[4];
+  uint32_t	version;
+  uint32_t	number_of_squares;
+  uint32_t	number_of_records;
+  uint32_t	tags;
+  uint32_t	source_generation;
+} file_header;
+
+typedef struct square {
+  uint16_t	square;
+  uint16_t	count;
+  uint32_t	first;
+} square;
+
+typedef struct record {
+  uint32_t	id;
+  float		latitude;
+  float		longitude;
+  float		receive_frequency;
+  float		transmit_frequency;
+} record;
+
+struct repeater_index {
+  FILE *	file;
+  file_header	header;
+  long		records_offset;
+  square *	squares;
+};
+
+typedef struct build_state {
+  uint32_t	tags;
+  record *	records;
+  size_t	count;
+  size_t	capacity;
+} build_state;
+
+typedef struct search_state {
+  const repeater_query *	query;
+  repeater_result *		results;
+  size_t			count;
+} search_state;
+
+// VHF and UHF privileges of US amateur license classes, FCC Part 97.301.
+static const radio_band_limits us_all[] = {
+  { 50.0f, 54.0f },
+  { 144.0f, 148.0f },
+  { 222.0f, 225.0f },
+  { 420.0f, 450.0f },
+  { 902.0f, 928.0f },
+  { 1240.0f, 1300.0f }
+};
+
+static const radio_band_limits us_novice[] = {
+  { 222.0f, 225.0f },
+  { 1270.0f, 1295.0f }
+};
+
+static const struct {
+  const char *			country;
+  const char *			license_class;
+  const radio_band_limits *	bands;
+  size_t			number_of_bands;
+} privileges[] = {
+  { "US", "novice", us_novice, sizeof(us_novice) / sizeof(*us_novice) },
+  { "US", "technician", us_all, sizeof(us_all) / sizeof(*us_all) },
+  { "US", "general", us_all, sizeof(us_all) / sizeof(*us_all) },
+  { "US", "advanced", us_all, sizeof(us_all) / sizeof(*us_all) },
+  { "US", "extra", us_all, sizeof(us_all) / sizeof(*us_all) },
+  { "US", "amateur extra", us_all, sizeof(us_all) / sizeof(*us_all) },
+  { }
+};
+
+static bool
+in_bands(const radio_band_limits * bands, size_t number_of_bands, float frequency)
+{
+  for ( size_t i = 0; i < number_of_bands; i++ ) {
+    if ( frequency >= bands[i].low && frequency <= bands[i].high )
+      return true;
+  }
+  return false;
+}
+
+static bool
+collect(const channel_db_entry * e, void * context)
+{
+  build_state * const s = context;
+
+  if ( (e->tags & s->tags) != s->tags || (e->latitude == 0.0f && e->longitude == 0.0f) )
+    return true;
+
+  if ( s->count == s->capacity ) {
+    const size_t capacity = s->capacity ? s->capacity * 2 : 256;
+    record * const records = gm_realloc(GM_MEMORY_CHANNELS, s->records, capacity * sizeof(*records));
+
+    if ( records == NULL )
+      return false;
+    s->records = records;
+    s->capacity = capacity;
+  }
+
+  record * const r = &s->records[s->count++];
+  r->id = e->id;
+  r->latitude = e->latitude;
+  r->longitude = e->longitude;
+  r->receive_frequency = e->channel.receive_frequency;
+  r->transmit_frequency = e->channel.transmit_frequency;
+  return true;
+}
+
+static int
+compare_records(const void * a, const void * b)
+{
+  const record * const ra = a;
+  const record * const rb = b;
+  const uint16_t sa = maidenhead_square(ra->latitude, ra->longitude);
+  const uint16_t sb = maidenhead_square(rb->latitude, rb->longitude);
+
+  if ( sa != sb )
+    return sa < sb ? -1 : 1;
+  return ra->id < rb->id ? -1 : ra->id > rb->id;
+}
+
+bool
+repeater_index_build(channel_db * db, const char * path, uint32_t tags)
+{
+  build_state		s = { .tags = tags };
+  channel_db_stats	stats;
+  file_header		h = {};
+  square *		squares = NULL;
+  size_t		number_of_squares = 0;
+  const size_t		path_length = strlen(path);
+  char *		temporary = gm_malloc(GM_MEMORY_CHANNELS, path_length + 5);
+  bool			ok;
+
+  if ( temporary == NULL ) {
+    errno = ENOMEM;
+    return false;
+  }
+  memcpy(temporary, path, path_length);
+  memcpy(&temporary[path_length], ".tmp", 5);
+
+  // Collect every entry, in order of frequency, and group them by square.
+  const size_t total = channel_db_frequency_range(db, 0.0f, 1e6f, 0, collect, &s);
+  channel_db_stats_get(db, &stats);
+  if ( total < stats.entries ) {
+    gm_free(s.records);
+    gm_free(temporary);
+    errno = ENOMEM;
+    return false;
+  }
+  qsort(s.records, s.count, sizeof(*s.records), compare_records);
+
+  if ( s.count > 0 && (squares = gm_malloc(GM_MEMORY_CHANNELS, s.count * sizeof(*squares))) == NULL ) {
+    gm_free(s.records);
+    gm_free(temporary);
+    errno = ENOMEM;
+    return false;
+  }
+  for ( size_t i = 0; i < s.count; i++ ) {
+    const uint16_t n = maidenhead_square(s.records[i].latitude, s.records[i].longitude);
+
+    if ( number_of_squares == 0 || squares[number_of_squares - 1].square != n
+     || squares[number_of_squares - 1].count == UINT16_MAX ) {
+      squares[number_of_squares].square = n;
+      squares[number_of_squares].count = 0;
+      squares[number_of_squares].first = i;
+      number_of_squares++;
+    }
+    squares[number_of_squares - 1].count++;
+  }
+
+  memcpy(h.magic, MAGIC, sizeof(h.magic));
+  h.version = VERSION;
+  h.number_of_squares = number_of_squares;
+  h.number_of_records = s.count;
+  h.tags = tags;
+  h.source_generation = stats.generation;
+
+  FILE * const f = fopen(temporary, "wb");
+  ok = f != NULL;
+  ok = ok && fwrite(&h, sizeof(h), 1, f) == 1;
+  ok = ok && (number_of_squares == 0
+   || fwrite(squares, sizeof(*squares), number_of_squares, f) == number_of_squares);
+  ok = ok && (s.count == 0 || fwrite(s.records, sizeof(*s.records), s.count, f) == s.count);
+  ok = ok && fflush(f) == 0 && fsync(fileno(f)) == 0;
+  if ( f != NULL )
+    ok = (fclose(f) == 0) && ok;
+
+  // rename() replaces the old index atomically.
+  ok = ok && rename(temporary, path) == 0;
+  if ( !ok ) {
+    const int error = errno;
+    remove(temporary);
+    errno = error;
+  }
+
+  gm_free(squares);
+  gm_free(s.records);
+  gm_free(temporary);
+  return ok;
+}
+
+void
+repeater_index_close(repeater_index * index)
+{
+  if ( index->file )
+    fclose(index->file);
+  gm_free(index->squares);
+  gm_free(index);
+}
+
+bool
+repeater_index_current(const repeater_index * index, channel_db * db, uint32_t tags)
+{
+  channel_db_stats s;
+
+  channel_db_stats_get(db, &s);
+  return index->header.tags == tags
+   && index->header.source_generation == s.generation;
+}
+
+repeater_index *
+repeater_index_open(const char * path)
+{
+  repeater_index * const index = gm_calloc(GM_MEMORY_CHANNELS, 1, sizeof(*index));
+  long size;
+
+  if ( index == NULL ) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  if ( (index->file = fopen(path, "rb")) == NULL ) {
+    const int error = errno;
+    gm_free(index);
+    errno = error;
+    return NULL;
+  }
+
+  const file_header * const h = &index->header;
+
+  if ( fread(&index->header, sizeof(index->header), 1, index->file) != 1
+   || memcmp(h->magic, MAGIC, sizeof(h->magic)) != 0
+   || h->version != VERSION
+   || fseek(index->file, 0, SEEK_END) != 0
+   || (size = ftell(index->file)) < 0
+   || h->number_of_squares > h->number_of_records
+   || (unsigned long)size != sizeof(*h)
+    + (unsigned long)h->number_of_squares * sizeof(square)
+    + (unsigned long)h->number_of_records * sizeof(record) ) {
+    repeater_index_close(index);
+    errno = EINVAL;
+    return NULL;
+  }
+  index->records_offset = sizeof(*h) + h->number_of_squares * sizeof(square);
+
+  if ( h->number_of_squares > 0 ) {
+    index->squares = gm_malloc(GM_MEMORY_CHANNELS, h->number_of_squares * sizeof(*index->squares));
+    if ( index->squares == NULL ) {
+      repeater_index_close(index);
+      errno = ENOMEM;
+      return NULL;
+    }
+    if ( fseek(index->file, sizeof(*h), SEEK_SET) != 0
+     || fread(index->squares, sizeof(*index->squares), h->number_of_squares, index->file)
+      != h->number_of_squares ) {
+      repeater_index_close(index);
+      errno = EIO;
+      return NULL;
+    }
+  }
+
+  for ( uint32_t i = 0; i < h->number_of_squares; i++ ) {
+    const square * const s = &index->squares[i];
+
+    if ( s->first > h->number_of_records || s->count > h->number_of_records - s->first
+     || (i > 0 && s->square < index->squares[i - 1].square) ) {
+      repeater_index_close(index);
+      errno = EINVAL;
+      return NULL;
+    }
+  }
+  return index;
+}
+
+// True if *a* is a better result than *b*.
+static bool
+better(const repeater_result * a, const repeater_result * b)
+{
+  if ( a->permitted != b->permitted )
+    return a->permitted;
+  return a->distance < b->distance;
+}
+
+static void
+consider(search_state * s, const record * r)
+{
+  const repeater_query * const q = s->query;
+  repeater_result result;
+
+  if ( q->tunable
+   && (!in_bands(q->tunable, q->number_of_tunable, r->receive_frequency)
+    || !in_bands(q->tunable, q->number_of_tunable, r->transmit_frequency)) )
+    return;
+
+  result.distance = maidenhead_distance(q->latitude, q->longitude, r->latitude, r->longitude);
+  if ( result.distance > q->radius )
+    return;
+
+  result.id = r->id;
+  result.permitted = q->privileges == NULL
+   || in_bands(q->privileges, q->number_of_privileges, r->transmit_frequency);
+  result.receive_frequency = r->receive_frequency;
+  result.transmit_frequency = r->transmit_frequency;
+
+  // Insert in order, dropping the worst result if the array is full.
+  size_t i = s->count;
+
+  if ( i == q->limit ) {
+    if ( !better(&result, &s->results[i - 1]) )
+      return;
+    i--;
+  }
+  else
+    s->count++;
+
+  while ( i > 0 && better(&result, &s->results[i - 1]) ) {
+    s->results[i] = s->results[i - 1];
+    i--;
+  }
+  s->results[i] = result;
+}
+
+static int
+read_square(repeater_index * index, search_state * s, uint16_t number)
+{
+  size_t low = 0;
+  size_t high = index->header.number_of_squares;
+  record records[READ_RECORDS];
+
+  // The directory is in order of square, with large squares split in runs.
+  while ( low < high ) {
+    const size_t middle = low + (high - low) / 2;
+
+    if ( index->squares[middle].square < number )
+      low = middle + 1;
+    else
+      high = middle;
+  }
+
+  for ( ; low < index->header.number_of_squares && index->squares[low].square == number; low++ ) {
+    const square * const sq = &index->squares[low];
+
+    if ( fseek(index->file, index->records_offset + (long)sq->first * sizeof(record), SEEK_SET) != 0 )
+      return -1;
+
+    for ( size_t done = 0; done < sq->count; ) {
+      size_t n = sq->count - done;
+
+      if ( n > READ_RECORDS )
+        n = READ_RECORDS;
+      if ( fread(records, sizeof(*records), n, index->file) != n ) {
+        errno = EIO;
+        return -1;
+      }
+      for ( size_t i = 0; i < n; i++ )
+        consider(s, &records[i]);
+      done += n;
+    }
+  }
+  return 0;
+}
+
+// The least distance from the query location to any square in ring *r* or
+// beyond. A square in the ring is *r* squares away in latitude, or in
+// longitude, and the location can be anywhere in its own square.
+static double
+ring_distance(const repeater_query * q, int r)
+{
+  if ( r <= 1 )
+    return 0.0;
+
+  // At least r - 1 degrees of latitude away.
+  const double by_latitude = (r - 1) * KM_PER_DEGREE;
+
+  // At least 2 * (r - 1) degrees of longitude away. The nearest such point
+  // is on the meridian at that difference, its distance from the location is
+  // across the plane of that great circle.
+  double longitude = (r - 1) * 2.0;
+  if ( longitude > 90.0 )
+    longitude = 90.0;
+  const double s = cos(q->latitude * M_PI / 180.0) * sin(longitude * M_PI / 180.0);
+  const double by_longitude = EARTH_RADIUS_KM * asin(s > 1.0 ? 1.0 : s);
+
+  return by_latitude < by_longitude ? by_latitude : by_longitude;
+}
+
+int
+repeater_index_nearest(
+ repeater_index *		index,
+ const repeater_query *		query,
+ repeater_result *		results)
+{
+  search_state s = { .query = query, .results = results };
+
+  if ( query->limit == 0 || index->header.number_of_squares == 0 )
+    return 0;
+
+  const uint16_t center = maidenhead_square(query->latitude, query->longitude);
+  const int x0 = center / MAIDENHEAD_SQUARES_LATITUDE;
+  const int y0 = center % MAIDENHEAD_SQUARES_LATITUDE;
+
+  for ( int r = 0; r < MAIDENHEAD_SQUARES_LATITUDE; r++ ) {
+    const double bound = ring_distance(query, r);
+
+    if ( bound > query->radius )
+      break;
+
+    // A permitted result is only displaced by a nearer one, so stop when the
+    // results are full of permitted ones nearer than the rest of the squares.
+    if ( s.count == query->limit && results[s.count - 1].permitted
+     && bound >= results[s.count - 1].distance )
+      break;
+
+    // Longitude wraps around, so don't visit a column twice.
+    const int dx_low = r < MAIDENHEAD_SQUARES_LONGITUDE / 2 ? -r : 1 - MAIDENHEAD_SQUARES_LONGITUDE / 2;
+    const int dx_high = r < MAIDENHEAD_SQUARES_LONGITUDE / 2 ? r : MAIDENHEAD_SQUARES_LONGITUDE / 2;
+
+    for ( int dy = -r; dy <= r; dy++ ) {
+      const int y = y0 + dy;
+
+      if ( y < 0 || y >= MAIDENHEAD_SQUARES_LATITUDE )
+        continue;
+
+      // The top and bottom rows of the ring are whole, the others only have
+      // their ends.
+      const bool whole = dy == -r || dy == r;
+      const int step = whole ? 1 : 2 * r;
+
+      for ( int dx = whole ? dx_low : -r; dx <= dx_high; dx += step ) {
+        if ( dx < dx_low )
+          continue;
+
+        const int x = (x0 + dx + MAIDENHEAD_SQUARES_LONGITUDE) % MAIDENHEAD_SQUARES_LONGITUDE;
+
+        if ( read_square(index, &s, x * MAIDENHEAD_SQUARES_LATITUDE + y) != 0 )
+          return -1;
+      }
+    }
+  }
+  return s.count;
+}
+
+size_t
+repeater_privileges(
+ const char *			country,
+ const char *			license_class,
+ const radio_band_limits * *	bands)
+{
+  for ( int i = 0; privileges[i].country; i++ ) {
+    if ( strcasecmp(country, privileges[i].country) == 0
+     && strcasecmp(license_class, privileges[i].license_class) == 0 ) {
+      *bands = privileges[i].bands;
+      return privileges[i].number_of_bands;
+    }
+  }
+  *bands = NULL;
+  return 0;
+}
+
+bool
+repeater_tune(
+ radio_module *			radio,
+ channel_db *			db,
+ const repeater_result *	result,
+ unsigned int			channel)
+{
+  const channel_db_entry * const e = channel_db_get(db, result->id);
+
+  if ( e == NULL ) {
+    radio->error_message = "The repeater is no longer in the channel database.";
+    return false;
+  }
+  return radio_set(radio, &e->channel, channel);
+}
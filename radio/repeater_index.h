@@ -0,0 +1,140 @@
+#ifndef _REPEATER_INDEX_DOT_H_
+#define _REPEATER_INDEX_DOT_H_
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "radio.h"
+#include "channel_db.h"
+
+/// Repeater index: find the repeaters nearest to a location.
+///
+/// The index is a file built from the repeaters in a channel database. Its
+/// records are grouped by the Maidenhead grid square, 2 degrees of longitude
+/// by 1 of latitude, that contains each repeater. Only the small directory of
+/// squares is kept in RAM. A query reads the squares around the location in
+/// expanding rings, and stops when no square that's left can hold a better
+/// result, so it reads a few hundred bytes of a regional directory rather than
+/// the whole thing.
+///
+/// Results are ranked first by whether the operator may transmit on the
+/// repeater's input, and then by distance.
+///
+/// This is portable C using stdio, it runs on the host as well as the device.
+/// It is not thread-safe, the caller must serialize access to an index.
+
+/// Opaque context for an open index.
+struct repeater_index;
+typedef struct repeater_index repeater_index;
+
+/// A query of the index.
+typedef struct repeater_query {
+  /// The location of the operator, in degrees.
+  float				latitude;
+  float				longitude;
+
+  /// The greatest distance of a result, in kilometers.
+  float				radius;
+
+  /// The most results to return, the size of the results array.
+  size_t			limit;
+
+  /// The bands in which the operator may transmit, from
+  /// repeater_privileges(). Repeaters with inputs outside of these are
+  /// ranked after all of those within. NULL ranks only by distance.
+  const radio_band_limits *	privileges;
+  size_t			number_of_privileges;
+
+  /// The bands the transceiver can tune, usually *band_limits* of the
+  /// radio_module. Repeaters with an input or output outside of these are not
+  /// returned. NULL for no limit.
+  const radio_band_limits *	tunable;
+  size_t			number_of_tunable;
+} repeater_query;
+
+/// A query result.
+typedef struct repeater_result {
+  /// The identifier of the repeater in the channel database.
+  uint32_t	id;
+
+  /// The distance from the query location, in kilometers.
+  float		distance;
+
+  /// True if the repeater input is within the operator's privileges.
+  bool		permitted;
+
+  /// The repeater output and input frequencies.
+  float		receive_frequency;
+  float		transmit_frequency;
+} repeater_result;
+
+/// Build an index file of the entries of a channel database that have a
+/// location and all of the tags in *tags*, replacing any existing index.
+/// The file is written under a temporary name and renamed, so that a
+/// power failure leaves the old index rather than a partial one.
+///
+/// \return False with *errno* set on failure.
+///
+extern bool
+repeater_index_build(channel_db * db, const char * path, uint32_t tags);
+
+/// Close the index and release all resources.
+///
+extern void
+repeater_index_close(repeater_index /*@only@*/ * index);
+
+/// Check if an index was built from the current contents of a database,
+/// and with the same tags.
+///
+extern bool
+repeater_index_current(const repeater_index * index, channel_db * db, uint32_t tags);
+
+/// Find the best repeaters for a query.
+///
+/// \param results An array of *query->limit* results, which is filled with
+/// the best repeaters, best first.
+///
+/// \return The number of results, or -1 with *errno* set if the index file
+/// can't be read.
+///
+extern int
+repeater_index_nearest(
+ repeater_index *		index,
+ const repeater_query *		query,
+ repeater_result *		results);
+
+/// Open an index file, and read its directory of grid squares.
+///
+/// \return The index context, or NULL with *errno* set.
+///
+extern repeater_index /*@null@*/ *
+repeater_index_open(const char * path);
+
+/// Get the bands in which an operator may transmit through repeaters.
+///
+/// \param country The ITU country code, like "US".
+///
+/// \param license_class The license class, like "technician".
+///
+/// \return The number of bands, with *bands* set to a constant table.
+/// 0 if the country or class is not known, with *bands* set to NULL.
+///
+extern size_t
+repeater_privileges(
+ const char *			country,
+ const char *			license_class,
+ const radio_band_limits * *	bands);
+
+/// Set a channel of the transceiver to a repeater from a query result.
+///
+/// \return False if the repeater is no longer in the database, or if
+/// radio_set() fails, in which case *radio->error_message* is set.
+///
+extern bool
+repeater_tune(
+ radio_module *			radio,
+ channel_db *			db,
+ const repeater_result *	result,
+ unsigned int			channel);
+
+#endif
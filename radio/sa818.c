@@ -21,6 +21,7 @@
 #include "platform.h"
 #include "gpio_bits.h"
 #include "os_driver.h"
+#include "gm_memory.h"
 
 /// \private
 /// splint complains about these not being defined, it's not parsing their headers
@@ -29,7 +30,6 @@ extern float roundf(float);
 
 /// \private
 /// same as above.
-extern char *strdup(const char *s);
 
 /// \private
 /// Internal structure for the sa818
@@ -183,14 +183,14 @@ sa818_end(radio_module /*@owned@*/ * const c)
 
   // Put the radio into standby.
   (void) (*(s->platform->gpio))(s->platform, 0);
-  free(s->channels);
-  free(s->buffer);
+  gm_free(s->channels);
+  gm_free(s->buffer);
   memset(s, 0, sizeof(*s));
-  free(s);
-  free(c->device_name);
-  free(c->band_limits);
+  gm_free(s);
+  gm_free(c->device_name);
+  gm_free(c->band_limits);
   memset(c, 0, sizeof(*c));
-  free(c);
+  gm_free(c);
 
   return true;
 }
@@ -349,13 +349,13 @@ radio_module /*@null@*/ *
 sa818(platform_context * const platform)
 {
   // Set up the device-dependent context.
-  /*@partial@*/ radio_module * const c = malloc(sizeof(*c));
+  /*@partial@*/ radio_module * const c = gm_malloc(GM_MEMORY_RADIO, sizeof(*c));
   if ( c == 0 )
     return 0;
   memset(c, 0, sizeof(*c));
-  /*@partial@*/ sa818_module * const s = c->device.sa818 = malloc(sizeof(*s));
+  /*@partial@*/ sa818_module * const s = c->device.sa818 = gm_malloc(GM_MEMORY_RADIO, sizeof(*s));
   if ( s == 0 ) {
-    free(c);
+    gm_free(c);
     return 0;
   }
   memset(c->device.sa818, 0, sizeof(*c->device.sa818));
@@ -377,20 +377,20 @@ sa818(platform_context * const platform)
   c->subaudible_tones = tones;
   c->number_of_digital_codes = (unsigned int)(sizeof(digital_codes) / sizeof(*digital_codes));
   c->digital_codes = digital_codes;
-  radio_band_limits * const band_limits = c->band_limits = malloc(sizeof(radio_band_limits) * c->number_of_bands);
+  radio_band_limits * const band_limits = c->band_limits = gm_malloc(GM_MEMORY_RADIO, sizeof(radio_band_limits) * c->number_of_bands);
   if ( band_limits == 0 ) {
-    free(c->device.sa818);
-    free(c->band_limits);
-    free(c);
+    gm_free(c->device.sa818);
+    gm_free(c->band_limits);
+    gm_free(c);
     return 0;
   }
   memset(c->band_limits, 0, sizeof(*c->band_limits));
   c->number_of_channels = 1;
 
   if ( !(*(s->platform->gpio))(s->platform, SA818_ENABLE_BIT|SA818_PTT_BIT|SA818_HIGH_POWER_BIT) ) {
-    free(c->device.sa818);
-    free(c->band_limits);
-    free(c);
+    gm_free(c->device.sa818);
+    gm_free(c->band_limits);
+    gm_free(c);
     return 0;
   }
 
@@ -402,7 +402,7 @@ sa818(platform_context * const platform)
 
     if ( sa818_command(c, version_command, version_response, &result)
      && !!result ) {
-      c->device_name = strdup(result);
+      c->device_name = gm_strdup(GM_MEMORY_RADIO, result);
       if ( strcmp(c->device_name, sa868_name) == 0 ) {
         // The SA-868 has 16 channels.
         c->number_of_channels = 16;
@@ -413,25 +413,25 @@ sa818(platform_context * const platform)
       s->version[0] = '\0';
       // Because I duplicate the string if the device actually returns it, I
       // also do it here.
-      c->device_name = strdup(sa808_name);
+      c->device_name = gm_strdup(GM_MEMORY_RADIO, sa808_name);
     }
 
-    s->channels = malloc(sizeof(radio_channel_data) * c->number_of_channels);
+    s->channels = gm_malloc(GM_MEMORY_RADIO, sizeof(radio_channel_data) * c->number_of_channels);
     if ( s->channels == 0 ) {
-      free(c->device.sa818);
-      free(c->band_limits);
-      free(c);
+      gm_free(c->device.sa818);
+      gm_free(c->band_limits);
+      gm_free(c);
       return 0;
     }
     // Buffer size must be larger than the largest command or response, on SA-868
     // we set 16 channels at once.
     s->buffer_size = 100 + (20 * (ssize_t)c->number_of_channels);
-    s->buffer = malloc((size_t)s->buffer_size);
+    s->buffer = gm_malloc(GM_MEMORY_RADIO, (size_t)s->buffer_size);
     if ( s->buffer == 0 ) {
-      free(s->channels);
-      free(c->device.sa818);
-      free(c->band_limits);
-      free(c);
+      gm_free(s->channels);
+      gm_free(c->device.sa818);
+      gm_free(c->band_limits);
+      gm_free(c);
       return 0;
     }
     memset(s->buffer, 0, (size_t)s->buffer_size);
@@ -456,9 +456,9 @@ sa818(platform_context * const platform)
     // radio commands.
     return c;
   }
-  free(s);
-  free(c->band_limits);
-  free(c);
+  gm_free(s);
+  gm_free(c->band_limits);
+  gm_free(c);
   // This is an invalid return. No commands to the device are possible.
   return 0;
 }